@@ -0,0 +1,500 @@
+/*
+ * area.c - assemble areas (polygons) from closed ways and multipolygon
+ *          and boundary relations
+ *
+ * The node locations come from w->locs (see locations.c) or from a
+ * location index. A closed way with at least 4 nodes is an area unless it
+ * has area=no. For a relation with type=multipolygon or type=boundary the
+ * member ways are stitched to rings: the end nodes of the ways which are
+ * not closed go into a small hash table, then starting with any unused
+ * way the way sharing the current end node is appended until the ring is
+ * closed. Rings which do not close are dropped. A ring contained in an odd
+ * number of other rings is an inner ring, the roles are not used. Outer
+ * rings are counter clockwise, inner ones clockwise, and each outer ring
+ * is followed by its inner rings.
+ *
+ * The candidates are handed out in small chunks to the threads, so large
+ * relations do not hold up the others. The result keeps the order of the
+ * input, ways first.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "osm.h"
+
+#define AREA_CHUNK 64   /* candidates per hand out */
+
+struct area_job {
+    OSM_Way_List      *ways;
+    OSM_Relation_List *rels;
+    OSM_Loc_Index     *index;
+    OSM_Id_Map        *way_map;
+    uint32_t           num;     /* candidates: closed ways, then relations */
+    uint32_t          *cand;    /* index into ways or rels (+ ways->num) */
+    struct osm_area   *res;     /* per candidate, coords NULL: failed */
+    uint32_t           next;
+};
+
+/* a member way of a relation */
+struct area_seg {
+    uint64_t     *nodes;
+    OSM_Location *locs;
+    uint32_t      num;
+    int           used;
+};
+
+/* points of a thread, reused for all candidates */
+struct area_buf {
+    double   *pt;       /* lon, lat */
+    uint64_t  num;
+    uint64_t  size;
+    uint32_t *ring;     /* first point of ring i, ring num_rings: end */
+    uint32_t  num_rings;
+    uint64_t  size_rings;
+    struct area_seg *seg;
+    uint64_t  size_seg;
+    uint32_t *hash;     /* segment + 1, 0: empty */
+    uint64_t  alloc_hash;
+    uint32_t  size_hash;    /* used part, a power of 2 */
+};
+
+static char *area_tag(OSM_Tag_List *t, const char *key) {
+    uint32_t i;
+    if (t == NULL)
+        return NULL;
+    for (i=0; i<t->num; i++)
+        if (strcmp(t->data[i].key, key) == 0)
+            return t->data[i].val;
+    return NULL;
+}
+
+static int area_is_relation(OSM_Relation *r) {
+    char *type = area_tag(r->tags, "type");
+    return type != NULL && (strcmp(type, "multipolygon") == 0 || strcmp(type, "boundary") == 0);
+}
+
+static int area_is_way(OSM_Way *w) {
+    char *area;
+    uint32_t num = 0;
+    while (w->nodes[num])
+        num += 1;
+    if (num < 4 || w->nodes[0] != w->nodes[num - 1])
+        return 0;
+    area = area_tag(w->tags, "area");
+    return area == NULL || strcmp(area, "no") != 0;
+}
+
+static int area_grow(void **p, uint64_t *size, uint64_t need, size_t elem) {
+    uint64_t s = *size ? *size : 1024;
+    void *tmp;
+    if (need <= *size)
+        return 0;
+    while (s < need)
+        s *= 2;
+    tmp = realloc(*p, elem * s);
+    if (tmp == NULL) {
+        fprintf(stderr, "failed to realloc area buffer: %s\n", strerror(errno));
+        return -1;
+    }
+    *p = tmp;
+    *size = s;
+    return 0;
+}
+
+/* location of node i of a segment, -1 if unknown */
+static int area_loc(struct area_job *job, struct area_seg *s, uint32_t i, OSM_Location *loc) {
+    if (s->locs != NULL && !isnan(s->locs[i].lat)) {
+        *loc = s->locs[i];
+        return 0;
+    }
+    if (job->index == NULL)
+        return -1;
+    return osm_loc_index_get(job->index, s->nodes[i], loc);
+}
+
+/* append the nodes of s, from the second one (or all if first), reversed */
+static int area_append(struct area_job *job, struct area_buf *b, struct area_seg *s,
+                        int reverse, int first)
+{
+    uint32_t i;
+    uint64_t need = b->num + s->num;
+    if (area_grow((void **)&b->pt, &b->size, need, sizeof(double) * 2) != 0)
+        return -1;
+    for (i=first ? 0 : 1; i<s->num; i++) {
+        OSM_Location loc;
+        if (area_loc(job, s, reverse ? s->num - 1 - i : i, &loc) != 0) {
+            osm_trace(OSM_TRACE_DETAIL, "area: node %lu without location",
+                        s->nodes[reverse ? s->num - 1 - i : i]);
+            return -1;
+        }
+        b->pt[b->num * 2]     = loc.lon;
+        b->pt[b->num * 2 + 1] = loc.lat;
+        b->num += 1;
+    }
+    return 0;
+}
+
+static int area_close_ring(struct area_buf *b) {
+    if (area_grow((void **)&b->ring, &b->size_rings, b->num_rings + 2, sizeof(uint32_t)) != 0)
+        return -1;
+    b->num_rings += 1;
+    b->ring[b->num_rings] = b->num;
+    return 0;
+}
+
+/* twice the signed area, > 0: counter clockwise */
+static double area_signed(const double *pt, uint32_t num) {
+    double a = 0;
+    uint32_t i;
+    for (i=0; i+1<num; i++)
+        a += pt[i*2] * pt[i*2+3] - pt[i*2+2] * pt[i*2+1];
+    return a;
+}
+
+static int area_contains(const double *pt, uint32_t num, double x, double y) {
+    uint32_t i;
+    int in = 0;
+    for (i=0; i+1<num; i++) {
+        double x1 = pt[i*2], y1 = pt[i*2+1], x2 = pt[i*2+2], y2 = pt[i*2+3];
+        if ((y1 > y) != (y2 > y) && x < (x2 - x1) * (y - y1) / (y2 - y1) + x1)
+            in = !in;
+    }
+    return in;
+}
+
+static uint32_t area_hash_slot(struct area_buf *b, uint64_t id) {
+    id ^= id >> 33;
+    id *= 0xFF51AFD7ED558CCDULL;
+    id ^= id >> 33;
+    return id & (b->size_hash - 1);
+}
+
+static void area_hash_add(struct area_buf *b, uint64_t id, uint32_t seg) {
+    uint32_t h = area_hash_slot(b, id);
+    while (b->hash[h])
+        h = (h + 1) & (b->size_hash - 1);
+    b->hash[h] = seg + 1;
+}
+
+/* an unused segment starting or ending at id, -1 if there is none */
+static int64_t area_hash_find(struct area_buf *b, uint64_t id) {
+    uint32_t h = area_hash_slot(b, id);
+    while (b->hash[h]) {
+        struct area_seg *s = &b->seg[ b->hash[h] - 1 ];
+        if (!s->used && (s->nodes[0] == id || s->nodes[s->num - 1] == id))
+            return b->hash[h] - 1;
+        h = (h + 1) & (b->size_hash - 1);
+    }
+    return -1;
+}
+
+/* stitch the member ways of r to rings in b, returns the number of rings */
+static int area_rings(struct area_job *job, struct area_buf *b, OSM_Relation *r) {
+    uint32_t i, num = 0, open = 0;
+
+    if (r->member == NULL)
+        return 0;
+    if (area_grow((void **)&b->seg, &b->size_seg, r->member->num, sizeof(struct area_seg)) != 0)
+        return -1;
+    for (i=0; i<r->member->num; i++) {
+        OSM_Way *w;
+        if (r->member->data[i].type != OSM_REL_MEMBER_TYPE_WAY)
+            continue;
+        w = osm_idmap_get(job->way_map, r->member->data[i].ref);
+        if (w == NULL) {
+            osm_trace(OSM_TRACE_OBJECT, "relation %lu: way %lu missing", r->id,
+                        r->member->data[i].ref);
+            return -1;
+        }
+        b->seg[num].nodes = w->nodes;
+        b->seg[num].locs  = w->locs;
+        b->seg[num].num   = 0;
+        b->seg[num].used  = 0;
+        while (w->nodes[b->seg[num].num])
+            b->seg[num].num += 1;
+        if (b->seg[num].num < 2)
+            continue;
+        if (w->nodes[0] != w->nodes[b->seg[num].num - 1])
+            open += 1;
+        num += 1;
+    }
+
+    if (area_grow((void **)&b->hash, &b->alloc_hash, open * 4 + 4, sizeof(uint32_t)) != 0)
+        return -1;
+    b->size_hash = 1;
+    while (b->size_hash < open * 4 + 4)
+        b->size_hash *= 2;
+    memset(b->hash, 0, sizeof(uint32_t) * b->size_hash);
+    for (i=0; i<num; i++) {
+        struct area_seg *s = &b->seg[i];
+        if (s->nodes[0] == s->nodes[s->num - 1])
+            continue;
+        area_hash_add(b, s->nodes[0], i);
+        area_hash_add(b, s->nodes[s->num - 1], i);
+    }
+
+    for (i=0; i<num; i++) {
+        struct area_seg *s = &b->seg[i];
+        uint64_t start, end;
+        uint32_t ring_start = b->num;
+        int ok = 1;
+
+        if (s->used)
+            continue;
+        s->used = 1;
+        if (area_append(job, b, s, 0, 1) != 0)
+            return -1;
+        start = s->nodes[0];
+        end   = s->nodes[s->num - 1];
+        while (end != start) {
+            int64_t k = area_hash_find(b, end);
+            if (k < 0) {
+                osm_trace(OSM_TRACE_OBJECT, "relation %lu: ring open at node %lu", r->id, end);
+                ok = 0;
+                break;
+            }
+            s = &b->seg[k];
+            s->used = 1;
+            if (area_append(job, b, s, s->nodes[0] != end, 0) != 0)
+                return -1;
+            end = s->nodes[0] == end ? s->nodes[s->num - 1] : s->nodes[0];
+        }
+        if (!ok || b->num - ring_start < 4) {
+            b->num = ring_start;
+            continue;
+        }
+        if (area_close_ring(b) != 0)
+            return -1;
+    }
+    return b->num_rings;
+}
+
+static void area_reverse(double *pt, uint32_t num) {
+    uint32_t i;
+    for (i=0; i<num/2; i++) {
+        double x = pt[i*2], y = pt[i*2+1];
+        pt[i*2]   = pt[(num-1-i)*2];
+        pt[i*2+1] = pt[(num-1-i)*2+1];
+        pt[(num-1-i)*2]   = x;
+        pt[(num-1-i)*2+1] = y;
+    }
+}
+
+/* append ring k of b to a, counter clockwise if outer, else clockwise */
+static void area_copy_ring(struct area_buf *b, struct osm_area *a, uint32_t k,
+                            int outer, double size)
+{
+    uint32_t len = b->ring[k+1] - b->ring[k], out = a->ring[a->num_rings];
+    double *dst = a->coords + out * 2;
+
+    memcpy(dst, b->pt + b->ring[k] * 2, sizeof(double) * 2 * len);
+    if (outer != (size > 0))
+        area_reverse(dst, len);
+    a->outer[a->num_rings] = outer;
+    a->num_rings += 1;
+    a->ring[a->num_rings] = out + len;
+}
+
+/*
+ * classify and orient the rings in b and copy them to a, outer rings
+ * each followed by their inner rings
+ */
+static int area_finish(struct area_buf *b, struct osm_area *a) {
+    uint32_t n = b->num_rings, i, k;
+    uint32_t *depth, *parent;
+    double *size;
+    char *mem;
+    size_t coords = sizeof(double) * 2 * b->num;
+
+    mem = malloc(coords + sizeof(uint32_t) * (n + 1) + n);
+    depth  = malloc(sizeof(uint32_t) * n * 2);
+    size   = malloc(sizeof(double) * n);
+    if (mem == NULL || depth == NULL || size == NULL) {
+        fprintf(stderr, "failed to malloc area with %u rings: %s\n", n, strerror(errno));
+        free(mem);
+        free(depth);
+        free(size);
+        return -1;
+    }
+    parent = depth + n;
+    for (i=0; i<n; i++)
+        size[i] = area_signed(b->pt + b->ring[i] * 2, b->ring[i+1] - b->ring[i]);
+    for (i=0; i<n; i++) {
+        /* the middle of the first segment, vertices are often shared */
+        const double *p = b->pt + b->ring[i] * 2;
+        double x = (p[0] + p[2]) / 2, y = (p[1] + p[3]) / 2;
+        depth[i]  = 0;
+        parent[i] = n;
+        for (k=0; k<n; k++) {
+            if (k == i || fabs(size[k]) <= fabs(size[i]))
+                continue;
+            if (!area_contains(b->pt + b->ring[k] * 2, b->ring[k+1] - b->ring[k], x, y))
+                continue;
+            depth[i] += 1;
+            if (parent[i] == n || fabs(size[k]) < fabs(size[parent[i]]))
+                parent[i] = k;
+        }
+    }
+
+    a->coords    = (double *)mem;
+    a->ring      = (uint32_t *)(mem + coords);
+    a->outer     = (uint8_t *)(a->ring + n + 1);
+    a->num_rings = 0;
+    a->ring[0]   = 0;
+    for (i=0; i<n; i++) {
+        if (depth[i] % 2)
+            continue;
+        area_copy_ring(b, a, i, 1, size[i]);
+        for (k=0; k<n; k++) {
+            if (depth[k] % 2 && parent[k] == i)
+                area_copy_ring(b, a, k, 0, size[k]);
+        }
+    }
+    free(depth);
+    free(size);
+    return 0;
+}
+
+static void area_build(struct area_job *job, struct area_buf *b, uint32_t c) {
+    struct osm_area *a = &job->res[c];
+    uint32_t idx = job->cand[c];
+    int ret;
+
+    b->num = 0;
+    b->num_rings = 0;
+    if (area_grow((void **)&b->ring, &b->size_rings, 1, sizeof(uint32_t)) != 0)
+        return;
+    b->ring[0] = 0;
+
+    a->coords = NULL;
+    if (idx < job->ways->num) {
+        OSM_Way *w = job->ways->data[idx];
+        struct area_seg s = { w->nodes, w->locs, 0, 0 };
+        while (w->nodes[s.num])
+            s.num += 1;
+        a->id   = w->id;
+        a->type = OSM_REL_MEMBER_TYPE_WAY;
+        a->tags = w->tags;
+        if (area_append(job, b, &s, 0, 1) != 0 || area_close_ring(b) != 0)
+            return;
+    }
+    else {
+        OSM_Relation *r = job->rels->data[idx - job->ways->num];
+        a->id   = r->id;
+        a->type = OSM_REL_MEMBER_TYPE_RELATION;
+        a->tags = r->tags;
+        ret = area_rings(job, b, r);
+        if (ret <= 0)
+            return;
+    }
+    area_finish(b, a);
+}
+
+static void area_worker(int id, int num, void *arg) {
+    struct area_job *job = arg;
+    struct area_buf b;
+    uint32_t c, end;
+
+    memset(&b, 0, sizeof(b));
+    while (1) {
+        c = __atomic_fetch_add(&job->next, AREA_CHUNK, __ATOMIC_RELAXED);
+        if (c >= job->num)
+            break;
+        end = c + AREA_CHUNK < job->num ? c + AREA_CHUNK : job->num;
+        for (; c<end; c++)
+            area_build(job, &b, c);
+    }
+    free(b.pt);
+    free(b.ring);
+    free(b.seg);
+    free(b.hash);
+}
+
+/*
+ * the areas of the closed ways and multipolygon / boundary relations.
+ * Relations need their member ways in ways. index may be NULL if the ways
+ * have locations. threads <= 0 uses all CPUs.
+ */
+struct osm_areas *osm_areas_build(OSM_Way_List *ways, OSM_Relation_List *rels,
+                                    OSM_Loc_Index *index, int threads)
+{
+    OSM_Way_List no_ways = { 0, 0, NULL };
+    OSM_Relation_List no_rels = { 0, 0, NULL };
+    struct area_job job;
+    struct osm_areas *A;
+    uint32_t i, k;
+
+    memset(&job, 0, sizeof(job));
+    job.ways  = ways != NULL ? ways : &no_ways;
+    job.rels  = rels != NULL ? rels : &no_rels;
+    job.index = index;
+    A = calloc(1, sizeof(struct osm_areas));
+    job.cand = malloc(sizeof(uint32_t) * (job.ways->num + job.rels->num + 1));
+    job.way_map = osm_idmap_new(job.rels->num ? job.ways->num : 0);
+    if (A == NULL || job.cand == NULL || job.way_map == NULL) {
+        fprintf(stderr, "failed to malloc areas: %s\n", strerror(errno));
+        goto fail;
+    }
+    if (index != NULL)
+        osm_loc_index_sort(index, threads);
+
+    for (i=0; i<job.ways->num; i++) {
+        if (job.rels->num && osm_idmap_put(job.way_map, job.ways->data[i]->id,
+                                            job.ways->data[i]) != 0)
+            goto fail;
+        if (area_is_way(job.ways->data[i]))
+            job.cand[job.num++] = i;
+    }
+    for (i=0; i<job.rels->num; i++) {
+        if (area_is_relation(job.rels->data[i]))
+            job.cand[job.num++] = job.ways->num + i;
+    }
+    job.res = calloc(job.num + 1, sizeof(struct osm_area));
+    if (job.res == NULL) {
+        fprintf(stderr, "failed to malloc %u areas: %s\n", job.num, strerror(errno));
+        goto fail;
+    }
+
+    threads = job.num < AREA_CHUNK * 2 ? 1 : osm_threads_num(threads);
+    osm_threads_run(threads, area_worker, &job);
+
+    for (i=0, k=0; i<job.num; i++) {
+        if (job.res[i].coords == NULL) {
+            A->failed += 1;
+            continue;
+        }
+        job.res[k++] = job.res[i];
+    }
+    A->num  = k;
+    A->data = job.res;
+    osm_trace(OSM_TRACE_PASS, "areas: %u candidates, %u built", job.num, k);
+    free(job.cand);
+    osm_idmap_free(job.way_map);
+    return A;
+
+  fail:
+    free(A);
+    free(job.cand);
+    osm_idmap_free(job.way_map);
+    return (struct osm_areas *)NULL;
+}
+
+void osm_free_areas(struct osm_areas *A) {
+    uint32_t i;
+    if (A == NULL)
+        return;
+    for (i=0; i<A->num; i++)
+        free(A->data[i].coords);
+    free(A->data);
+    free(A);
+}
+
+/* END */
@@ -0,0 +1,381 @@
+/*
+ * backref.c - reverse member indexes: node -> ways, way -> relations,
+ *             relation -> parent relations, mmap()ed
+ *
+ * osm_backrefs_build() collects (member, parent) pairs in one scan, sorts
+ * them with the threaded radix sort and writes one file with a CSR index
+ * per member type:
+ *
+ *   header      struct backref_header, one page
+ *   start       uint64 per member id 0 .. max + 1: the parents of id are
+ *               parents[start[id]] .. parents[start[id + 1] - 1]
+ *   parents     uint64 per (member, parent) pair, parents of one member
+ *               in the order of the input, each once
+ *
+ * for node -> ways, way -> relations and relation -> relations, each
+ * section page aligned. Values are in host byte order. A lookup is two
+ * loads from start plus the parents, like the store (see store.c) the
+ * start array has one entry per id up to the largest one. The start
+ * arrays and parents are filled by several threads, each one a range of
+ * ids / pairs. The file is written as FILE.tmp and renamed when complete.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "osm.h"
+
+#define BACKREF_MAGIC      "OSMBREFS"
+#define BACKREF_VERSION    1
+#define BACKREF_BYTE_ORDER 0x01020304
+#define BACKREF_PAGE       4096
+#define BACKREF_MAX_ID     ((uint64_t)1 << 40)  /* 8 TB (sparse) of start */
+
+/* index by member type: nodes, ways, relations */
+#define BACKREF_INDEXES    3
+#define BACKREF_INDEX(type) ((type) - OSM_REL_MEMBER_TYPE_NODE)
+
+struct backref_section {
+    uint64_t max_id;        /* largest member id, 0: empty */
+    uint64_t num;           /* pairs */
+    uint64_t start;         /* offsets of the arrays */
+    uint64_t parents;
+};
+
+struct backref_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t size;          /* of the complete file */
+    struct backref_section index[BACKREF_INDEXES];
+};
+
+struct _osm_backrefs {
+    int       fd;
+    size_t    map_size;
+    const uint8_t *map;
+    const struct backref_header *hdr;
+    const uint64_t *start[BACKREF_INDEXES];
+    const uint64_t *parents[BACKREF_INDEXES];
+};
+
+struct backref_build {
+    struct osm_sort_pair *pairs[BACKREF_INDEXES];   /* member -> parent */
+    uint64_t num[BACKREF_INDEXES];
+    uint64_t size[BACKREF_INDEXES];
+    int      failed;
+};
+
+/* one section for the fill threads */
+struct backref_fill {
+    const struct osm_sort_pair *pairs;
+    uint64_t  num;
+    uint64_t  max_id;
+    uint64_t *start;
+    uint64_t *parents;
+};
+
+static uint64_t backref_align(uint64_t off) {
+    return (off + BACKREF_PAGE - 1) & ~(uint64_t)(BACKREF_PAGE - 1);
+}
+
+/*
+ * member ids are indexes into start, negative ones (e.g. from JOSM files)
+ * are huge as uint64_t and can not be indexed
+ */
+static int backref_check_id(struct backref_build *b, int type, uint64_t id) {
+    if (id < BACKREF_MAX_ID)
+        return 0;
+    fprintf(stderr, "%s %ld: id out of range for the back references (max %lu)\n",
+                    type == OSM_REL_MEMBER_TYPE_NODE ? "node"
+                    : type == OSM_REL_MEMBER_TYPE_WAY ? "way" : "relation",
+                    (int64_t)id, BACKREF_MAX_ID - 1);
+    b->failed = 1;
+    return -1;
+}
+
+static void backref_add(struct backref_build *b, int type, uint64_t member, uint64_t parent) {
+    int i = BACKREF_INDEX(type);
+    if (b->failed || backref_check_id(b, type, member) != 0)
+        return;
+    if (b->num[i] == b->size[i]) {
+        uint64_t size = b->size[i] ? b->size[i] * 2 : 65536;
+        struct osm_sort_pair *tmp = realloc(b->pairs[i], sizeof(struct osm_sort_pair) * size);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to realloc back references: %s\n", strerror(errno));
+            b->failed = 1;
+            return;
+        }
+        osm_stats_alloc(OSM_MEM_MEMBERS, sizeof(struct osm_sort_pair) * (size - b->size[i]));
+        b->pairs[i] = tmp;
+        b->size[i]  = size;
+    }
+    b->pairs[i][ b->num[i] ].key = member;
+    b->pairs[i][ b->num[i] ].val = parent;
+    b->num[i] += 1;
+}
+
+static int backref_block(OSM_Data *d, void *ctx) {
+    struct backref_build *b = ctx;
+    uint32_t i, k;
+
+    for (i=0; i<d->ways->num; i++) {
+        OSM_Way *w = d->ways->data[i];
+        for (k=0; w->nodes[k]; k++)
+            backref_add(b, OSM_REL_MEMBER_TYPE_NODE, w->nodes[k], w->id);
+    }
+    for (i=0; i<d->relations->num; i++) {
+        OSM_Relation *r = d->relations->data[i];
+        for (k=0; r->member != NULL && k<r->member->num; k++) {
+            OSM_Rel_Member *m = &r->member->data[k];
+            if (m->type == OSM_REL_MEMBER_TYPE_WAY || m->type == OSM_REL_MEMBER_TYPE_RELATION)
+                backref_add(b, m->type, m->ref, r->id);
+        }
+    }
+    return b->failed ? -1 : 0;
+}
+
+/*
+ * sort by member and drop repeated pairs (a node used twice by a way):
+ * the sort is stable, so they are next to each other
+ */
+static void backref_sort(struct backref_build *b, int i, int threads) {
+    struct osm_sort_pair *p = b->pairs[i];
+    uint64_t k, n = 0;
+
+    osm_sort_pairs(p, b->num[i], threads);
+    for (k=0; k<b->num[i]; k++) {
+        if (n && p[n-1].key == p[k].key && p[n-1].val == p[k].val)
+            continue;
+        p[n++] = p[k];
+    }
+    b->num[i] = n;
+}
+
+static void backref_fill_worker(int id, int num, void *arg) {
+    struct backref_fill *f = arg;
+    uint64_t ids = f->max_id + 2, lo, hi, pos, lower, upper, k;
+
+    /* start: ids lo .. hi - 1 */
+    lo = ids / num * id;
+    hi = id == num - 1 ? ids : ids / num * (id + 1);
+    lower = 0;
+    upper = f->num;
+    while (lower < upper) {
+        pos = (lower + upper) / 2;
+        if (f->pairs[pos].key < lo)
+            lower = pos + 1;
+        else
+            upper = pos;
+    }
+    pos = lower;
+    for (k=lo; k<hi; k++) {
+        while (pos < f->num && f->pairs[pos].key < k)
+            ++pos;
+        f->start[k] = pos;
+    }
+
+    /* parents: pairs lo .. hi - 1 */
+    lo = f->num / num * id;
+    hi = id == num - 1 ? f->num : f->num / num * (id + 1);
+    for (k=lo; k<hi; k++)
+        f->parents[k] = f->pairs[k].val;
+}
+
+/*
+ * build the reverse indexes of F in file, written to file.tmp and renamed
+ * when complete. threads <= 0 uses all CPUs. Returns 0 on success.
+ */
+int osm_backrefs_build(OSM_File *F, const char *file, int threads) {
+    struct backref_build b;
+    struct backref_header *hdr;
+    uint8_t *map = NULL;
+    uint64_t off;
+    char *tmp;
+    int fd = -1, i, ret = -1;
+
+    memset(&b, 0, sizeof(b));
+    threads = osm_threads_num(threads);
+    tmp = malloc(strlen(file) + 5);
+    if (tmp == NULL)
+        return -1;
+    sprintf(tmp, "%s.tmp", file);
+
+    if (osm_scan(F, OSMDATA_WAY|OSMDATA_REL, backref_block, &b) != 0 || b.failed)
+        goto done;
+
+    /* all member ids are below BACKREF_MAX_ID, the sizes can not overflow */
+    off = BACKREF_PAGE;
+    for (i=0; i<BACKREF_INDEXES; i++) {
+        backref_sort(&b, i, threads);
+        off = backref_align(off + sizeof(uint64_t) * ((b.num[i] ? b.pairs[i][b.num[i]-1].key : 0) + 2));
+        off = backref_align(off + sizeof(uint64_t) * b.num[i]);
+    }
+
+    fd = open(tmp, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "failed to open %s: %s\n", tmp, strerror(errno));
+        goto done;
+    }
+    if (ftruncate(fd, off) != 0) {
+        fprintf(stderr, "failed to resize %s: %s\n", tmp, strerror(errno));
+        goto done;
+    }
+    map = mmap(NULL, off, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "failed to mmap %s: %s\n", tmp, strerror(errno));
+        map = NULL;
+        goto done;
+    }
+    hdr = (struct backref_header *)map;
+    hdr->size = off;
+
+    off = BACKREF_PAGE;
+    for (i=0; i<BACKREF_INDEXES; i++) {
+        struct backref_section *s = &hdr->index[i];
+        struct backref_fill f;
+
+        s->max_id  = b.num[i] ? b.pairs[i][b.num[i]-1].key : 0;
+        s->num     = b.num[i];
+        s->start   = off;
+        s->parents = off = backref_align(off + sizeof(uint64_t) * (s->max_id + 2));
+        off = backref_align(off + sizeof(uint64_t) * s->num);
+
+        f.pairs   = b.pairs[i];
+        f.num     = b.num[i];
+        f.max_id  = s->max_id;
+        f.start   = (uint64_t *)(map + s->start);
+        f.parents = (uint64_t *)(map + s->parents);
+        osm_threads_run(threads, backref_fill_worker, &f);
+
+        osm_stats_alloc(OSM_MEM_MEMBERS, -(int64_t)(sizeof(struct osm_sort_pair) * b.size[i]));
+        free(b.pairs[i]);
+        b.pairs[i] = NULL;
+        b.size[i]  = 0;
+        osm_trace(OSM_TRACE_PASS, "backref: index %d: max id %lu, %lu references",
+                    i, s->max_id, s->num);
+    }
+
+    /* header last: an incomplete file has no magic */
+    hdr->version    = BACKREF_VERSION;
+    hdr->byte_order = BACKREF_BYTE_ORDER;
+    memcpy(hdr->magic, BACKREF_MAGIC, 8);
+    if (msync(map, hdr->size, MS_SYNC) != 0 || fsync(fd) != 0) {
+        fprintf(stderr, "failed to sync %s: %s\n", tmp, strerror(errno));
+        goto done;
+    }
+    if (rename(tmp, file) != 0) {
+        fprintf(stderr, "failed to rename %s to %s: %s\n", tmp, file, strerror(errno));
+        goto done;
+    }
+    ret = 0;
+
+  done:
+    if (map != NULL)
+        munmap(map, ((struct backref_header *)map)->size);
+    if (fd != -1)
+        close(fd);
+    if (ret != 0)
+        unlink(tmp);
+    for (i=0; i<BACKREF_INDEXES; i++) {
+        if (b.pairs[i] != NULL)
+            osm_stats_alloc(OSM_MEM_MEMBERS, -(int64_t)(sizeof(struct osm_sort_pair) * b.size[i]));
+        free(b.pairs[i]);
+    }
+    free(tmp);
+    return ret;
+}
+
+OSM_Backrefs *osm_backrefs_open(const char *file) {
+    OSM_Backrefs *B = calloc(1, sizeof(OSM_Backrefs));
+    const struct backref_header *h;
+    struct stat st;
+    int i;
+
+    if (B == NULL) {
+        fprintf(stderr, "failed to malloc back references: %s\n", strerror(errno));
+        return (OSM_Backrefs *)NULL;
+    }
+    B->fd = open(file, O_RDONLY);
+    if (B->fd == -1 || fstat(B->fd, &st) != 0) {
+        fprintf(stderr, "failed to open %s: %s\n", file, strerror(errno));
+        goto fail;
+    }
+    if (st.st_size < BACKREF_PAGE) {
+        fprintf(stderr, "%s: not a back reference index\n", file);
+        goto fail;
+    }
+    B->map_size = st.st_size;
+    B->map = mmap(NULL, B->map_size, PROT_READ, MAP_SHARED, B->fd, 0);
+    if (B->map == MAP_FAILED) {
+        fprintf(stderr, "failed to mmap %s: %s\n", file, strerror(errno));
+        B->map = NULL;
+        goto fail;
+    }
+    h = B->hdr = (const struct backref_header *)B->map;
+    if (memcmp(h->magic, BACKREF_MAGIC, 8) != 0 || h->byte_order != BACKREF_BYTE_ORDER) {
+        fprintf(stderr, "%s: not a back reference index\n", file);
+        goto fail;
+    }
+    if (h->version != BACKREF_VERSION) {
+        fprintf(stderr, "%s: unsupported back reference version %u\n", file, h->version);
+        goto fail;
+    }
+    if (h->size > (uint64_t)st.st_size) {
+        fprintf(stderr, "%s: truncated back reference index\n", file);
+        goto fail;
+    }
+    for (i=0; i<BACKREF_INDEXES; i++) {
+        if (h->index[i].max_id >= BACKREF_MAX_ID) {
+            fprintf(stderr, "%s: not a back reference index\n", file);
+            goto fail;
+        }
+    }
+    for (i=0; i<BACKREF_INDEXES; i++) {
+        B->start[i]   = (const uint64_t *)(B->map + h->index[i].start);
+        B->parents[i] = (const uint64_t *)(B->map + h->index[i].parents);
+    }
+    return B;
+
+  fail:
+    osm_backrefs_close(B);
+    return (OSM_Backrefs *)NULL;
+}
+
+void osm_backrefs_close(OSM_Backrefs *B) {
+    if (B == NULL)
+        return;
+    if (B->map != NULL)
+        munmap((void *)B->map, B->map_size);
+    if (B->fd != -1)
+        close(B->fd);
+    free(B);
+}
+
+/*
+ * the parents of member id of type (OSM_REL_MEMBER_TYPE_*): the ways of a
+ * node, the relations of a way or of a relation. NULL and num 0 if none
+ */
+const uint64_t *osm_backrefs_get(OSM_Backrefs *B, int type, uint64_t id, uint64_t *num) {
+    int i = BACKREF_INDEX(type);
+    const uint64_t *start;
+
+    *num = 0;
+    if (i < 0 || i >= BACKREF_INDEXES || id > B->hdr->index[i].max_id)
+        return NULL;
+    start = B->start[i];
+    *num = start[id + 1] - start[id];
+    return *num ? B->parents[i] + start[id] : NULL;
+}
+
+/* END */
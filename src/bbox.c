@@ -39,4 +39,46 @@ OSM_BBox *osm_bbox_from_nodes(OSM_Node_List *n) {
     return box;
 }
 
+/* parse "left_lon,bottom_lat,right_lon,top_lat", returns NULL on error */
+OSM_BBox *osm_bbox_parse(const char *str) {
+    OSM_BBox *box;
+    const char *orig = str;
+    double v[4];
+    char *end;
+    int i;
+
+    for (i=0; i<4; i++) {
+        v[i] = strtod(str, &end);
+        if (end == str || (i < 3 && *end != ',') || (i == 3 && *end)) {
+            fprintf(stderr, "invalid bbox, need left,bottom,right,top: %s\n", orig);
+            return (OSM_BBox *)NULL;
+        }
+        str = end + 1;
+    }
+    box = malloc(sizeof(OSM_BBox));
+    if (box == NULL) {
+        fprintf(stderr, "failed to malloc bbox: %s\n", strerror(errno));
+        return (OSM_BBox *)NULL;
+    }
+    box->left_lon   = v[0];
+    box->bottom_lat = v[1];
+    box->right_lon  = v[2];
+    box->top_lat    = v[3];
+    return box;
+}
+
+int osm_bbox_contains(OSM_BBox *box, double lat, double lon) {
+    return lon    >= box->left_lon
+        && lon    <= box->right_lon
+        && lat    >= box->bottom_lat
+        && lat    <= box->top_lat;
+}
+
+int osm_bbox_intersects(OSM_BBox *a, OSM_BBox *b) {
+    return a->left_lon   <= b->right_lon
+        && a->right_lon  >= b->left_lon
+        && a->bottom_lat <= b->top_lat
+        && a->top_lat    >= b->bottom_lat;
+}
+
 /* END */
@@ -0,0 +1,368 @@
+/*
+ * changeset.c - changesets from .osm.pbf ChangeSet groups and an index
+ *               for them
+ *
+ * The changesets are kept column wise (OSM_CSet_List in osm-data.h), a
+ * few bytes per changeset and no pointers. osm_cset_index() sorts the
+ * columns by id, so objects are joined to their changeset by a binary
+ * search for their changeset id (osm_cset_find()), and builds two lists
+ * of positions sorted by (uid, created_at) and by created_at for
+ * osm_cset_query().
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "osm.h"
+
+#define CSET_DEGREE 10000000.0
+
+struct cset_key {
+    uint64_t a;
+    uint64_t b;
+    uint32_t pos;
+};
+
+static int cset_cmp_key(const void *x, const void *y) {
+    const struct cset_key *k = x, *l = y;
+    if (k->a != l->a)
+        return k->a < l->a ? -1 : 1;
+    if (k->b != l->b)
+        return k->b < l->b ? -1 : 1;
+    return k->pos < l->pos ? -1 : k->pos > l->pos;
+}
+
+static int cset_grow(OSM_CSet_List *cs, uint32_t size) {
+    uint64_t *id, *created_at, *closed_at;
+    uint32_t *uid;
+    uint8_t  *flags;
+    int32_t  *bbox;
+
+    if ((id = realloc(cs->id, sizeof(uint64_t) * size)) != NULL)
+        cs->id = id;
+    if ((created_at = realloc(cs->created_at, sizeof(uint64_t) * size)) != NULL)
+        cs->created_at = created_at;
+    if ((closed_at = realloc(cs->closed_at, sizeof(uint64_t) * size)) != NULL)
+        cs->closed_at = closed_at;
+    if ((uid = realloc(cs->uid, sizeof(uint32_t) * size)) != NULL)
+        cs->uid = uid;
+    if ((flags = realloc(cs->flags, size)) != NULL)
+        cs->flags = flags;
+    if ((bbox = realloc(cs->bbox, sizeof(int32_t) * 4 * size)) != NULL)
+        cs->bbox = bbox;
+
+    if (id == NULL || created_at == NULL || closed_at == NULL
+        || uid == NULL || flags == NULL || bbox == NULL)
+    {
+        fprintf(stderr, "failed to realloc changesets: %s\n", strerror(errno));
+        return -1;
+    }
+    cs->size = size;
+    return 0;
+}
+
+static void cset_drop_index(OSM_CSet_List *cs) {
+    free(cs->by_uid);
+    free(cs->by_time);
+    cs->by_uid  = NULL;
+    cs->by_time = NULL;
+    cs->indexed = 0;
+}
+
+OSM_CSet_List *osm_cset_new(uint32_t size) {
+    OSM_CSet_List *cs = calloc(1, sizeof(OSM_CSet_List));
+    if (cs == NULL) {
+        fprintf(stderr, "failed to malloc changesets: %s\n", strerror(errno));
+        return (OSM_CSet_List *)NULL;
+    }
+    if (cset_grow(cs, size < 16 ? 16 : size) != 0) {
+        osm_cset_free(cs);
+        return (OSM_CSet_List *)NULL;
+    }
+    return cs;
+}
+
+void osm_cset_free(OSM_CSet_List *cs) {
+    if (cs == NULL)
+        return;
+    free(cs->id);
+    free(cs->created_at);
+    free(cs->closed_at);
+    free(cs->uid);
+    free(cs->flags);
+    free(cs->bbox);
+    free(cs->by_uid);
+    free(cs->by_time);
+    free(cs);
+}
+
+/* closed_at 0: unknown, bbox NULL: none */
+int osm_cset_add(OSM_CSet_List *cs, uint64_t id, uint64_t created_at,
+                    uint64_t closed_at, uint32_t uid, int open, OSM_BBox *bbox)
+{
+    uint32_t n = cs->num;
+    if (n == cs->size && cset_grow(cs, cs->size * 2) != 0)
+        return -1;
+    if (cs->indexed)
+        cset_drop_index(cs);
+
+    cs->id[n]         = id;
+    cs->created_at[n] = created_at;
+    cs->closed_at[n]  = closed_at;
+    cs->uid[n]        = uid;
+    cs->flags[n]      = open ? OSM_CSET_OPEN : 0;
+    if (bbox != NULL) {
+        cs->flags[n]      |= OSM_CSET_BBOX;
+        cs->bbox[4*n]     = (int32_t)(bbox->left_lon   * CSET_DEGREE);
+        cs->bbox[4*n + 1] = (int32_t)(bbox->bottom_lat * CSET_DEGREE);
+        cs->bbox[4*n + 2] = (int32_t)(bbox->right_lon  * CSET_DEGREE);
+        cs->bbox[4*n + 3] = (int32_t)(bbox->top_lat    * CSET_DEGREE);
+    }
+    else
+        memset(&cs->bbox[4*n], 0, sizeof(int32_t) * 4);
+    cs->num += 1;
+    return 0;
+}
+
+int osm_cset_append(OSM_CSet_List *dst, OSM_CSet_List *src) {
+    uint32_t size = dst->size;
+    if (src == NULL || src->num == 0)
+        return 0;
+    while (size < dst->num + src->num)
+        size *= 2;
+    if (size != dst->size && cset_grow(dst, size) != 0)
+        return -1;
+    if (dst->indexed)
+        cset_drop_index(dst);
+
+    memcpy(dst->id + dst->num,         src->id,         sizeof(uint64_t) * src->num);
+    memcpy(dst->created_at + dst->num, src->created_at, sizeof(uint64_t) * src->num);
+    memcpy(dst->closed_at + dst->num,  src->closed_at,  sizeof(uint64_t) * src->num);
+    memcpy(dst->uid + dst->num,        src->uid,        sizeof(uint32_t) * src->num);
+    memcpy(dst->flags + dst->num,      src->flags,      src->num);
+    memcpy(dst->bbox + 4 * dst->num,   src->bbox,       sizeof(int32_t) * 4 * src->num);
+    dst->num += src->num;
+    return 0;
+}
+
+/* positions of all changesets, sorted by the keys in k */
+static uint32_t *cset_order(struct cset_key *k, uint32_t num) {
+    uint32_t i, *pos = malloc(sizeof(uint32_t) * (num + 1));
+    if (pos == NULL)
+        return NULL;
+    qsort(k, num, sizeof(struct cset_key), cset_cmp_key);
+    for (i=0; i<num; i++)
+        pos[i] = k[i].pos;
+    return pos;
+}
+
+/*
+ * cs->col in the order of order[] into tmp (allocated before, so this
+ * cannot fail half way), which replaces the column
+ */
+#define CSET_PERMUTE(col, tmp, width) { \
+        for (i=0; i<cs->num; i++) \
+            memcpy(&(tmp)[(width) * i], &cs->col[(width) * order[i]], sizeof(*(tmp)) * (width)); \
+        free(cs->col); \
+        cs->col = (tmp); \
+        (tmp) = NULL; \
+    }
+
+int osm_cset_index(OSM_CSet_List *cs) {
+    struct cset_key *k;
+    uint32_t i, *order = NULL;
+    uint64_t *id = NULL, *created_at = NULL, *closed_at = NULL;
+    uint32_t *uid = NULL;
+    uint8_t *flags = NULL;
+    int32_t *bbox = NULL;
+
+    if (cs->indexed)
+        return 0;
+    k = malloc(sizeof(struct cset_key) * (cs->num + 1));
+    if (k == NULL)
+        goto fail;
+
+    /* columns by id */
+    for (i=0; i<cs->num; i++) {
+        k[i].a   = cs->id[i];
+        k[i].b   = 0;
+        k[i].pos = i;
+    }
+    order = cset_order(k, cs->num);
+    if (order == NULL)
+        goto fail;
+    id         = malloc(sizeof(uint64_t) * cs->size);
+    created_at = malloc(sizeof(uint64_t) * cs->size);
+    closed_at  = malloc(sizeof(uint64_t) * cs->size);
+    uid        = malloc(sizeof(uint32_t) * cs->size);
+    flags      = malloc(sizeof(uint8_t) * cs->size);
+    bbox       = malloc(sizeof(int32_t) * 4 * cs->size);
+    if (id == NULL || created_at == NULL || closed_at == NULL
+        || uid == NULL || flags == NULL || bbox == NULL)
+        goto fail;
+    CSET_PERMUTE(id, id, 1);
+    CSET_PERMUTE(created_at, created_at, 1);
+    CSET_PERMUTE(closed_at, closed_at, 1);
+    CSET_PERMUTE(uid, uid, 1);
+    CSET_PERMUTE(flags, flags, 1);
+    CSET_PERMUTE(bbox, bbox, 4);
+    free(order);
+    order = NULL;
+
+    for (i=0; i<cs->num; i++) {
+        k[i].a   = cs->uid[i];
+        k[i].b   = cs->created_at[i];
+        k[i].pos = i;
+    }
+    free(cs->by_uid);
+    cs->by_uid = cset_order(k, cs->num);
+
+    for (i=0; i<cs->num; i++) {
+        k[i].a   = cs->created_at[i];
+        k[i].b   = 0;
+        k[i].pos = i;
+    }
+    free(cs->by_time);
+    cs->by_time = cset_order(k, cs->num);
+
+    if (cs->by_uid == NULL || cs->by_time == NULL)
+        goto fail;
+    free(k);
+    cs->indexed = 1;
+    return 0;
+
+  fail:
+    fprintf(stderr, "failed to index changesets: %s\n", strerror(errno));
+    free(k);
+    free(order);
+    free(id);
+    free(created_at);
+    free(closed_at);
+    free(uid);
+    free(flags);
+    free(bbox);
+    cset_drop_index(cs);
+    return -1;
+}
+
+/* position of changeset id, -1 if not found. Needs osm_cset_index() */
+int64_t osm_cset_find(OSM_CSet_List *cs, uint64_t id) {
+    uint32_t lo = 0, hi = cs->num;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (cs->id[mid] < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < cs->num && cs->id[lo] == id)
+        return lo;
+    return -1;
+}
+
+/*
+ * first entry in pos[lo..hi) with a key (uid, created_at) (or created_at
+ * only) >= (uid, t), or > (uid, t) for upper
+ */
+static uint32_t cset_bound(OSM_CSet_List *cs, uint32_t *pos, uint32_t lo, uint32_t hi,
+                            int by_uid, uint32_t uid, uint64_t t, int upper)
+{
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2, p = pos[mid];
+        int before;
+        if (by_uid && cs->uid[p] != uid)
+            before = cs->uid[p] < uid;
+        else if (upper)
+            before = cs->created_at[p] <= t;
+        else
+            before = cs->created_at[p] < t;
+        if (before)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int cset_in_bbox(OSM_CSet_List *cs, uint32_t p, OSM_BBox *bbox) {
+    int32_t *b = &cs->bbox[4 * p];
+    if (!(cs->flags[p] & OSM_CSET_BBOX))
+        return 0;
+    return b[0] / CSET_DEGREE <= bbox->right_lon
+        && b[2] / CSET_DEGREE >= bbox->left_lon
+        && b[1] / CSET_DEGREE <= bbox->top_lat
+        && b[3] / CSET_DEGREE >= bbox->bottom_lat;
+}
+
+/*
+ * positions of the changesets of user uid (0: any user) created in
+ * [from, to] (to 0: no limit) whose bbox intersects bbox (NULL: any) in
+ * *res, sorted by created_at. Returns the number of matches, -1 on error.
+ * Needs osm_cset_index().
+ */
+int64_t osm_cset_query(OSM_CSet_List *cs, uint32_t uid, uint64_t from, uint64_t to,
+                        OSM_BBox *bbox, uint32_t **res)
+{
+    uint32_t *pos, lo, hi, i, num = 0;
+
+    if (!cs->indexed) {
+        fprintf(stderr, "changesets are not indexed\n");
+        return -1;
+    }
+    if (to == 0)
+        to = UINT64_MAX;
+
+    if (uid) {
+        pos = cs->by_uid;
+        lo  = cset_bound(cs, pos, 0, cs->num, 1, uid, from, 0);
+        hi  = cset_bound(cs, pos, lo, cs->num, 1, uid, to, 1);
+    }
+    else {
+        pos = cs->by_time;
+        lo  = cset_bound(cs, pos, 0, cs->num, 0, 0, from, 0);
+        hi  = cset_bound(cs, pos, lo, cs->num, 0, 0, to, 1);
+    }
+
+    *res = malloc(sizeof(uint32_t) * (hi - lo + 1));
+    if (*res == NULL) {
+        fprintf(stderr, "failed to malloc changeset query: %s\n", strerror(errno));
+        return -1;
+    }
+    for (i=lo; i<hi; i++) {
+        if (bbox != NULL && !cset_in_bbox(cs, pos[i], bbox))
+            continue;
+        (*res)[num++] = pos[i];
+    }
+    return num;
+}
+
+static int cset_scan_block(OSM_Data *d, void *ctx) {
+    if (d->changesets != NULL && osm_cset_append(ctx, d->changesets) != 0)
+        return 1;
+    return 0;
+}
+
+/* all changesets of the file, indexed */
+OSM_CSet_List *osm_cset_read(OSM_File *F) {
+    OSM_CSet_List *cs = osm_cset_new(1024);
+    if (cs == NULL)
+        return (OSM_CSet_List *)NULL;
+    if (osm_scan(F, OSMDATA_CSET, cset_scan_block, cs) != 0
+        || osm_cset_index(cs) != 0)
+    {
+        osm_cset_free(cs);
+        return (OSM_CSet_List *)NULL;
+    }
+    if (debug)
+        fprintf(stderr, "%s:%d:%s(): %u changesets\n",
+                        __FILE__, __LINE__, __FUNCTION__, cs->num);
+    return cs;
+}
+
+/* END */
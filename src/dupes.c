@@ -0,0 +1,358 @@
+/*
+ * dupes.c - find ways sharing segments (duplicate ways)
+ *
+ * Every segment (consecutive node pair) of every way is normalized to
+ * (min(a,b), max(a,b)) and partitioned into shards by its hash. Each shard
+ * is then loaded into its own hash table by one thread, a segment which is
+ * already present for another way directly yields a duplicate pair. The
+ * pairs of all shards are merged, so each pair of ways is reported once
+ * with the number and length of the segments they share.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "osm.h"
+
+#define DUPES_SHARDS 256
+
+struct dupes_seg {
+    uint64_t a;
+    uint64_t b;
+    uint32_t way;
+};
+
+struct dupes_pair {
+    uint32_t i; /* way index, i < k */
+    uint32_t k;
+    uint64_t a; /* shared segment */
+    uint64_t b;
+};
+
+struct dupes_pair_list {
+    uint32_t num;
+    uint32_t size;
+    struct dupes_pair *data;
+};
+
+struct dupes_job {
+    OSM_Way_List *ways;
+    int threads;
+    size_t (*count)[DUPES_SHARDS];   /* per thread segments in shard */
+    size_t start[DUPES_SHARDS + 1];  /* first segment of shard */
+    struct dupes_seg *segs;
+    struct dupes_pair_list pairs[DUPES_SHARDS];
+    int failed;
+};
+
+static inline uint64_t dupes_hash(uint64_t a, uint64_t b) {
+    uint64_t h = a * 0x9E3779B97F4A7C15ULL;
+    h ^= b + 0xC2B2AE3D27D4EB4FULL + (h << 6) + (h >> 2);
+    h ^= h >> 31;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 29;
+    return h;
+}
+
+static void dupes_range(int id, int num, uint32_t total, uint32_t *lo, uint32_t *hi) {
+    *lo = (uint32_t)(((uint64_t)total * id) / num);
+    *hi = (uint32_t)(((uint64_t)total * (id + 1)) / num);
+}
+
+/* pass 1: count the segments of each shard in our range of ways */
+static void dupes_count(int id, int num, void *arg) {
+    struct dupes_job *job = arg;
+    uint32_t lo, hi, w;
+    size_t *count = job->count[id];
+
+    memset(count, 0, sizeof(size_t) * DUPES_SHARDS);
+    dupes_range(id, num, job->ways->num, &lo, &hi);
+    for (w=lo; w<hi; w++) {
+        uint64_t *n = job->ways->data[w]->nodes;
+        int l;
+        if (n[0] == 0)
+            continue;
+        for (l=1; n[l]; l++) {
+            uint64_t a = n[l-1], b = n[l];
+            if (a == b)
+                continue;
+            if (a > b) { uint64_t t = a; a = b; b = t; }
+            count[dupes_hash(a, b) % DUPES_SHARDS] += 1;
+        }
+    }
+}
+
+/* pass 2: scatter the segments into their shards */
+static void dupes_scatter(int id, int num, void *arg) {
+    struct dupes_job *job = arg;
+    size_t pos[DUPES_SHARDS];
+    uint32_t lo, hi, w;
+    int s, t;
+
+    for (s=0; s<DUPES_SHARDS; s++) {
+        pos[s] = job->start[s];
+        for (t=0; t<id; t++)
+            pos[s] += job->count[t][s];
+    }
+
+    dupes_range(id, num, job->ways->num, &lo, &hi);
+    for (w=lo; w<hi; w++) {
+        uint64_t *n = job->ways->data[w]->nodes;
+        int l;
+        if (n[0] == 0)
+            continue;
+        for (l=1; n[l]; l++) {
+            uint64_t a = n[l-1], b = n[l];
+            if (a == b)
+                continue;
+            if (a > b) { uint64_t t = a; a = b; b = t; }
+            s = dupes_hash(a, b) % DUPES_SHARDS;
+            job->segs[pos[s]].a   = a;
+            job->segs[pos[s]].b   = b;
+            job->segs[pos[s]].way = w;
+            pos[s] += 1;
+        }
+    }
+}
+
+static int dupes_add_pair(struct dupes_pair_list *p, uint32_t i, uint32_t k, uint64_t a, uint64_t b) {
+    if (p->num == p->size) {
+        uint32_t size = p->size ? p->size * 2 : 256;
+        struct dupes_pair *tmp = realloc(p->data, sizeof(struct dupes_pair) * size);
+        if (tmp == NULL)
+            return -1;
+        p->data = tmp;
+        p->size = size;
+    }
+    if (i > k) { uint32_t t = i; i = k; k = t; }
+    p->data[p->num].i = i;
+    p->data[p->num].k = k;
+    p->data[p->num].a = a;
+    p->data[p->num].b = b;
+    p->num += 1;
+    return 0;
+}
+
+/* pass 3: one hash table per shard, collisions are the duplicates */
+static void dupes_collide(int id, int num, void *arg) {
+    struct dupes_job *job = arg;
+    int s;
+
+    for (s=id; s<DUPES_SHARDS; s+=num) {
+        struct dupes_seg *seg = job->segs + job->start[s];
+        size_t n = job->start[s+1] - job->start[s];
+        size_t mask, size = 16, j;
+        int64_t *head, *next;
+
+        if (n < 2)
+            continue;
+        while (size < n * 2)
+            size *= 2;
+        mask = size - 1;
+
+        head = malloc(sizeof(int64_t) * size);
+        next = malloc(sizeof(int64_t) * n);
+        if (head == NULL || next == NULL) {
+            fprintf(stderr, "failed to malloc hash table for %lu segments\n", n);
+            free(head);
+            free(next);
+            job->failed = 1;
+            return;
+        }
+        memset(head, 0xff, sizeof(int64_t) * size);
+
+        for (j=0; j<n; j++) {
+            size_t h = (dupes_hash(seg[j].a, seg[j].b) >> 8) & mask;
+            while (head[h] != -1) {
+                struct dupes_seg *first = &seg[head[h]];
+                if (first->a == seg[j].a && first->b == seg[j].b)
+                    break;
+                h = (h + 1) & mask;
+            }
+            if (head[h] != -1) {
+                int64_t m;
+                for (m = head[h]; m != -1; m = next[m]) {
+                    if (seg[m].way == seg[j].way)
+                        continue;
+                    if (dupes_add_pair(&job->pairs[s], seg[m].way, seg[j].way,
+                                        seg[j].a, seg[j].b) != 0)
+                    {
+                        fprintf(stderr, "failed to realloc duplicate list\n");
+                        job->failed = 1;
+                        break;
+                    }
+                }
+            }
+            next[j] = head[h];
+            head[h] = j;
+        }
+        free(head);
+        free(next);
+    }
+}
+
+static int dupes_cmp_pair(const void *x, const void *y) {
+    const struct dupes_pair *p = x, *q = y;
+    if (p->i != q->i) return p->i > q->i ? 1 : -1;
+    if (p->k != q->k) return p->k > q->k ? 1 : -1;
+    if (p->a != q->a) return p->a > q->a ? 1 : -1;
+    if (p->b != q->b) return p->b > q->b ? 1 : -1;
+    return 0;
+}
+
+static double dupes_seg_length(OSM_Node_List *nodes, uint64_t a, uint64_t b) {
+    int pa, pb;
+    if (nodes == NULL || nodes->num == 0)
+        return 0.0;
+    pa = osm_node_pos(nodes, a);
+    pb = osm_node_pos(nodes, b);
+    if (pa == -1 || pb == -1)
+        return 0.0;
+    return osm_distance(nodes->data[pa]->lat, nodes->data[pa]->lon,
+                        nodes->data[pb]->lat, nodes->data[pb]->lon);
+}
+
+/*
+ * find all pairs of ways sharing at least one segment. If nodes is not
+ * NULL it must be sorted (osm_node_list_sort()) and is used to compute
+ * the length of the shared segments. threads <= 0 uses all CPUs.
+ */
+struct osm_dupes *osm_find_dupes(OSM_Way_List *ways, OSM_Node_List *nodes, int threads) {
+    struct dupes_job *job;
+    struct osm_dupes *res;
+    struct dupes_pair *all = NULL;
+    size_t total = 0, num_pairs = 0, j;
+    int s, t;
+
+    res = malloc(sizeof(struct osm_dupes));
+    job = calloc(1, sizeof(struct dupes_job));
+    if (res == NULL || job == NULL) {
+        fprintf(stderr, "failed to malloc duplicate search: %s\n", strerror(errno));
+        free(res);
+        free(job);
+        return (struct osm_dupes *)NULL;
+    }
+    res->num  = 0;
+    res->size = 0;
+    res->data = NULL;
+    if (ways == NULL || ways->num == 0) {
+        free(job);
+        return res;
+    }
+
+    job->ways    = ways;
+    job->threads = osm_threads_num(threads);
+    job->count   = calloc(job->threads, sizeof(size_t) * DUPES_SHARDS);
+    if (job->count == NULL) {
+        fprintf(stderr, "failed to malloc shard counts: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    osm_threads_run(job->threads, dupes_count, job);
+    for (s=0; s<DUPES_SHARDS; s++) {
+        job->start[s] = total;
+        for (t=0; t<job->threads; t++)
+            total += job->count[t][s];
+    }
+    job->start[DUPES_SHARDS] = total;
+    if (debug)
+        fprintf(stderr, "%s:%d:%s(): %lu segments in %u ways\n",
+                        __FILE__, __LINE__, __FUNCTION__, total, ways->num);
+
+    job->segs = malloc(sizeof(struct dupes_seg) * (total ? total : 1));
+    if (job->segs == NULL) {
+        fprintf(stderr, "failed to malloc %lu segments: %s\n", total, strerror(errno));
+        goto fail;
+    }
+    osm_threads_run(job->threads, dupes_scatter, job);
+    osm_threads_run(job->threads, dupes_collide, job);
+    free(job->segs);
+    job->segs = NULL;
+    if (job->failed)
+        goto fail;
+
+    for (s=0; s<DUPES_SHARDS; s++)
+        num_pairs += job->pairs[s].num;
+    if (num_pairs) {
+        all = malloc(sizeof(struct dupes_pair) * num_pairs);
+        if (all == NULL) {
+            fprintf(stderr, "failed to malloc %lu pairs: %s\n", num_pairs, strerror(errno));
+            goto fail;
+        }
+        num_pairs = 0;
+        for (s=0; s<DUPES_SHARDS; s++) {
+            memcpy(all + num_pairs, job->pairs[s].data,
+                    sizeof(struct dupes_pair) * job->pairs[s].num);
+            num_pairs += job->pairs[s].num;
+            free(job->pairs[s].data);
+            job->pairs[s].data = NULL;
+        }
+        qsort(all, num_pairs, sizeof(struct dupes_pair), dupes_cmp_pair);
+    }
+
+    for (j=0; j<num_pairs; j++) {
+        struct osm_dupe *d;
+        if (j > 0 && all[j].i == all[j-1].i && all[j].k == all[j-1].k) {
+            /* the same way may use a segment twice, count it once */
+            if (all[j].a == all[j-1].a && all[j].b == all[j-1].b)
+                continue;
+            d = &res->data[res->num - 1];
+        }
+        else {
+            if (res->num == res->size) {
+                uint32_t size = res->size ? res->size * 2 : 1024;
+                struct osm_dupe *tmp = realloc(res->data, sizeof(struct osm_dupe) * size);
+                if (tmp == NULL) {
+                    fprintf(stderr, "failed to realloc duplicate list\n");
+                    goto fail;
+                }
+                res->data = tmp;
+                res->size = size;
+            }
+            d = &res->data[res->num];
+            res->num += 1;
+            d->way_a = ways->data[all[j].i]->id;
+            d->way_b = ways->data[all[j].k]->id;
+            if (d->way_a > d->way_b) {
+                uint64_t tmp = d->way_a;
+                d->way_a = d->way_b;
+                d->way_b = tmp;
+            }
+            d->segments = 0;
+            d->length   = 0.0;
+        }
+        d->segments += 1;
+        d->length   += dupes_seg_length(nodes, all[j].a, all[j].b);
+    }
+
+    free(all);
+    free(job->count);
+    free(job);
+    return res;
+
+  fail:
+    for (s=0; s<DUPES_SHARDS; s++)
+        free(job->pairs[s].data);
+    free(all);
+    free(job->segs);
+    free(job->count);
+    free(job);
+    osm_free_dupes(res);
+    return (struct osm_dupes *)NULL;
+}
+
+void osm_free_dupes(struct osm_dupes *d) {
+    if (d == NULL)
+        return;
+    free(d->data);
+    free(d);
+}
+
+/* END */
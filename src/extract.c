@@ -0,0 +1,546 @@
+/*
+ * extract.c - cut many extracts (bbox and / or filter) in one set of passes
+ *
+ * Every output keeps its own id sets of the nodes in its area and of the
+ * nodes, ways and relations it needs. The passes over the input are
+ *   1. nodes in the bboxes / polygons (only if any output has one)
+ *   2. relations: filter and node member in area, mark members. Outputs
+ *      without area add the relations of relations (at any depth) from
+ *      the relation graph of this pass, see extract_closure()
+ *   3. ways: member of a relation or filter and node in area, mark nodes
+ *   4. write: nodes (needed or filter and in area), ways and relations
+ * i.e. the same selection as osm_parse() with OSMDATA_BBOX (or OSMDATA_REL
+ * for outputs without bbox), independent of the number of outputs. The
+ * outputs of each block are handled by several threads, each output is
+ * written by one thread at a time through its own stdio buffer.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "osm.h"
+
+#define EXTRACT_BUFFER_SIZE (1 << 18)
+
+enum {
+    pass_area,
+    pass_relations,
+    pass_closure,
+    pass_ways,
+    pass_write
+};
+
+struct extract_out {
+    OSM_Extract *ex;
+    FILE *out;
+    char *buf;
+    OSM_Id_Set *area;   /* nodes in the bbox */
+    OSM_Id_Set *nodes;  /* needed as members */
+    OSM_Id_Set *ways;
+    OSM_Id_Set *rels;
+    uint64_t *kept;     /* relations kept in the relation pass, no area only */
+    uint32_t num_kept;
+    uint32_t size_kept;
+};
+
+struct extract_job {
+    struct extract_out *out;
+    int num;
+    int threads;
+    int pass;
+    OSM_Data *block;
+    OSM_Rel_Graph *graph;
+    int failed;
+};
+
+static void extract_add(struct extract_job *job, OSM_Id_Set *s, uint64_t id) {
+    if (osm_idset_add(s, id) == -1)
+        job->failed = 1;
+}
+
+static int extract_has_area(OSM_Extract *ex) {
+    return ex->bbox != NULL || ex->poly != NULL;
+}
+
+static void extract_keep(struct extract_job *job, struct extract_out *o, uint64_t id) {
+    if (o->num_kept == o->size_kept) {
+        uint32_t size = o->size_kept ? o->size_kept * 2 : 1024;
+        uint64_t *kept = realloc(o->kept, sizeof(uint64_t) * size);
+        if (kept == NULL) {
+            fprintf(stderr, "failed to realloc relation ids: %s\n", strerror(errno));
+            job->failed = 1;
+            return;
+        }
+        o->kept = kept;
+        o->size_kept = size;
+    }
+    o->kept[o->num_kept++] = id;
+}
+
+static void extract_area_nodes(struct extract_job *job, struct extract_out *o) {
+    OSM_Node_List *nl = job->block->nodes;
+    OSM_Extract *ex = o->ex;
+    uint32_t i;
+    for (i=0; i<nl->num; i++) {
+        double lat = nl->data[i]->lat, lon = nl->data[i]->lon;
+        if (ex->bbox != NULL && !osm_bbox_contains(ex->bbox, lat, lon))
+            continue;
+        if (ex->poly != NULL && !osm_poly_contains(ex->poly, lat, lon))
+            continue;
+        extract_add(job, o->area, nl->data[i]->id);
+    }
+}
+
+static void extract_relations(struct extract_job *job, struct extract_out *o) {
+    OSM_Relation_List *rl = job->block->relations;
+    uint32_t i, m, filtered = 0;
+
+    for (i=0; i<rl->num; i++) {
+        OSM_Relation *r = rl->data[i];
+        int in_area = !extract_has_area(o->ex);
+
+        if (o->ex->filter != NULL && !osm_filter_relation(o->ex->filter, r)) {
+            ++filtered;
+            continue;
+        }
+        for (m=0; !in_area && r->member != NULL && m<r->member->num; m++) {
+            if (r->member->data[m].type == OSM_REL_MEMBER_TYPE_NODE
+                && osm_idset_has(o->area, r->member->data[m].ref))
+                in_area = 1;
+        }
+        if (!in_area)
+            continue;
+
+        extract_add(job, o->rels, r->id);
+        if (job->graph != NULL && !extract_has_area(o->ex))
+            extract_keep(job, o, r->id);
+        for (m=0; r->member != NULL && m<r->member->num; m++) {
+            switch (r->member->data[m].type) {
+                case OSM_REL_MEMBER_TYPE_NODE:
+                    extract_add(job, o->nodes, r->member->data[m].ref);
+                    break;
+                case OSM_REL_MEMBER_TYPE_WAY:
+                    extract_add(job, o->ways, r->member->data[m].ref);
+                    break;
+                /* relations in relations: see extract_closure() */
+            }
+        }
+    }
+    osm_stats_add(OSM_STAT_RELATIONS_FILTERED, filtered);
+}
+
+/*
+ * like pbf_relation_closure(): the relations which are members of the
+ * kept ones at any depth, with their node and way members. Only for
+ * outputs without area, as osm_parse() does it only for OSMDATA_REL.
+ */
+static void extract_closure(struct extract_job *job, struct extract_out *o) {
+    struct osm_members wanted, added;
+    uint32_t i, k, num;
+
+    if (extract_has_area(o->ex) || o->num_kept == 0)
+        return;
+    osm_sort_ids(o->kept, o->num_kept, 1);
+    wanted.num  = o->num_kept;
+    wanted.size = o->size_kept;
+    wanted.data = o->kept;
+    added.num   = 0;
+    added.size  = 1024;
+    added.data  = malloc(sizeof(uint64_t) * added.size);
+    if (added.data == NULL) {
+        fprintf(stderr, "failed to malloc relation ids: %s\n", strerror(errno));
+        job->failed = 1;
+        return;
+    }
+    osm_stats_alloc(OSM_MEM_MEMBERS, sizeof(uint64_t) * added.size);
+    if (osm_relgraph_closure(job->graph, &wanted, &added) < 0)
+        job->failed = 1;
+
+    for (i=0; i<added.num; i++) {
+        const uint64_t *m = osm_relgraph_get(job->graph, added.data[i], &num);
+        extract_add(job, o->rels, added.data[i]);
+        for (k=0; k<num; k++) {
+            if (OSM_RELGRAPH_TYPE(m[k]) == OSM_REL_MEMBER_TYPE_NODE)
+                extract_add(job, o->nodes, OSM_RELGRAPH_REF(m[k]));
+            else if (OSM_RELGRAPH_TYPE(m[k]) == OSM_REL_MEMBER_TYPE_WAY)
+                extract_add(job, o->ways, OSM_RELGRAPH_REF(m[k]));
+        }
+    }
+    osm_stats_alloc(OSM_MEM_MEMBERS, -(int64_t)(sizeof(uint64_t) * added.size));
+    free(added.data);
+}
+
+static void extract_ways(struct extract_job *job, struct extract_out *o) {
+    OSM_Way_List *wl = job->block->ways;
+    uint32_t i, filtered = 0;
+    int l;
+
+    for (i=0; i<wl->num; i++) {
+        OSM_Way *w = wl->data[i];
+
+        if (!osm_idset_has(o->ways, w->id)) {
+            int in_area = !extract_has_area(o->ex);
+            if (o->ex->filter != NULL && !osm_filter_way(o->ex->filter, w)) {
+                ++filtered;
+                continue;
+            }
+            for (l=0; !in_area && w->nodes[l]; l++) {
+                if (osm_idset_has(o->area, w->nodes[l]))
+                    in_area = 1;
+            }
+            if (!in_area)
+                continue;
+            extract_add(job, o->ways, w->id);
+        }
+        for (l=0; w->nodes[l]; l++)
+            extract_add(job, o->nodes, w->nodes[l]);
+    }
+    osm_stats_add(OSM_STAT_WAYS_FILTERED, filtered);
+}
+
+static void extract_write_block(struct extract_job *job, struct extract_out *o) {
+    OSM_Data *d = job->block;
+    uint32_t i, filtered = 0, nodes = 0, ways = 0, rels = 0;
+
+    for (i=0; i<d->nodes->num; i++) {
+        OSM_Node *n = d->nodes->data[i];
+        if (!osm_idset_has(o->nodes, n->id)) {
+            if (extract_has_area(o->ex) && !osm_idset_has(o->area, n->id))
+                continue;
+            if (o->ex->filter != NULL && !osm_filter_node(o->ex->filter, n)) {
+                ++filtered;
+                continue;
+            }
+        }
+        osm_xml_write_node(n, o->out);
+        ++nodes;
+    }
+    for (i=0; i<d->ways->num; i++) {
+        if (osm_idset_has(o->ways, d->ways->data[i]->id)) {
+            osm_xml_write_way(d->ways->data[i], o->out);
+            ++ways;
+        }
+    }
+    for (i=0; i<d->relations->num; i++) {
+        if (osm_idset_has(o->rels, d->relations->data[i]->id)) {
+            osm_xml_write_relation(d->relations->data[i], o->out);
+            ++rels;
+        }
+    }
+    osm_stats_add(OSM_STAT_NODES_FILTERED, filtered);
+    osm_stats_add(OSM_STAT_NODES_KEPT, nodes);
+    osm_stats_add(OSM_STAT_WAYS_KEPT, ways);
+    osm_stats_add(OSM_STAT_RELATIONS_KEPT, rels);
+}
+
+static void extract_worker(int id, int num, void *arg) {
+    struct extract_job *job = arg;
+    int i;
+
+    for (i=id; i<job->num; i+=num) {
+        struct extract_out *o = &job->out[i];
+        switch (job->pass) {
+            case pass_area:
+                if (extract_has_area(o->ex))
+                    extract_area_nodes(job, o);
+                break;
+            case pass_relations:
+                extract_relations(job, o);
+                break;
+            case pass_closure:
+                extract_closure(job, o);
+                break;
+            case pass_ways:
+                extract_ways(job, o);
+                break;
+            case pass_write:
+                extract_write_block(job, o);
+                break;
+        }
+    }
+}
+
+/* all relations with their members, for the closure of the kept ones */
+static void extract_graph(struct extract_job *job, OSM_Relation_List *rl) {
+    uint32_t i, m;
+    for (i=0; i<rl->num; i++) {
+        OSM_Relation *r = rl->data[i];
+        if (osm_relgraph_add(job->graph, r->id) != 0) {
+            job->failed = 1;
+            return;
+        }
+        for (m=0; r->member != NULL && m<r->member->num; m++) {
+            if (osm_relgraph_member(job->graph, r->member->data[m].type,
+                                    r->member->data[m].ref) != 0) {
+                job->failed = 1;
+                return;
+            }
+        }
+    }
+}
+
+static int extract_block(OSM_Data *d, void *ctx) {
+    struct extract_job *job = ctx;
+    if (job->pass == pass_relations && job->graph != NULL)
+        extract_graph(job, d->relations);
+    job->block = d;
+    osm_threads_run(job->threads, extract_worker, job);
+    job->block = NULL;
+    return job->failed;
+}
+
+/*
+ * write num extracts from F, each one to ex[i].file as .osm XML. threads
+ * <= 0 uses all CPUs. Returns 0 on success.
+ */
+int osm_extract(OSM_File *F, OSM_Extract *ex, int num, int threads, char *creator) {
+    struct extract_job job;
+    int i, ret = 0, any_area = 0, any_rel = 0;
+
+    if (num <= 0)
+        return 0;
+    memset(&job, 0, sizeof(job));
+    job.num     = num;
+    job.threads = osm_threads_num(threads);
+    if (job.threads > num)
+        job.threads = num;
+    job.out = calloc(num, sizeof(struct extract_out));
+    if (job.out == NULL) {
+        fprintf(stderr, "failed to malloc %d extracts: %s\n", num, strerror(errno));
+        return -1;
+    }
+
+    for (i=0; i<num; i++) {
+        struct extract_out *o = &job.out[i];
+        o->ex    = &ex[i];
+        o->area  = osm_idset_new();
+        o->nodes = osm_idset_new();
+        o->ways  = osm_idset_new();
+        o->rels  = osm_idset_new();
+        o->out   = fopen(ex[i].file, "w");
+        if (o->out == NULL) {
+            fprintf(stderr, "failed to open %s: %s\n", ex[i].file, strerror(errno));
+            ret = -1;
+            goto done;
+        }
+        o->buf = malloc(EXTRACT_BUFFER_SIZE);
+        if (o->buf != NULL)
+            setvbuf(o->out, o->buf, _IOFBF, EXTRACT_BUFFER_SIZE);
+        if (o->area == NULL || o->nodes == NULL || o->ways == NULL || o->rels == NULL) {
+            ret = -1;
+            goto done;
+        }
+        if (extract_has_area(&ex[i]))
+            any_area = 1;
+        else
+            any_rel = 1;
+    }
+
+    if (any_area) {
+        job.pass = pass_area;
+        if (osm_scan(F, OSMDATA_NODE|OSMDATA_BARE, extract_block, &job) != 0) {
+            ret = -1;
+            goto done;
+        }
+        if (debug)
+            fprintf(stderr, "%s:%d:%s(): area pass done\n", __FILE__, __LINE__, __FUNCTION__);
+    }
+
+    if (any_rel) {
+        job.graph = osm_relgraph_new();
+        if (job.graph == NULL) {
+            ret = -1;
+            goto done;
+        }
+    }
+    job.pass = pass_relations;
+    if (osm_scan(F, OSMDATA_REL, extract_block, &job) != 0) {
+        ret = -1;
+        goto done;
+    }
+    if (job.graph != NULL) {
+        /* sorted once here, the closures only read the graph */
+        if (osm_relgraph_index(job.graph, job.threads) != 0) {
+            ret = -1;
+            goto done;
+        }
+        job.pass = pass_closure;
+        osm_threads_run(job.threads, extract_worker, &job);
+        if (job.failed) {
+            ret = -1;
+            goto done;
+        }
+        if (debug)
+            fprintf(stderr, "%s:%d:%s(): %u relations in the relation graph\n",
+                            __FILE__, __LINE__, __FUNCTION__, osm_relgraph_count(job.graph));
+        osm_relgraph_free(job.graph);
+        job.graph = NULL;
+    }
+    job.pass = pass_ways;
+    if (osm_scan(F, OSMDATA_WAY, extract_block, &job) != 0) {
+        ret = -1;
+        goto done;
+    }
+    if (debug) {
+        for (i=0; i<num; i++)
+            fprintf(stderr, "%s:%d:%s(): %s: %lu nodes, %lu ways, %lu relations\n",
+                            __FILE__, __LINE__, __FUNCTION__, ex[i].file,
+                            osm_idset_count(job.out[i].nodes),
+                            osm_idset_count(job.out[i].ways),
+                            osm_idset_count(job.out[i].rels));
+    }
+
+    for (i=0; i<num; i++)
+        osm_xml_write_header(creator, job.out[i].out);
+    job.pass = pass_write;
+    if (osm_scan(F, OSMDATA_NODE|OSMDATA_WAY|OSMDATA_REL, extract_block, &job) != 0)
+        ret = -1;
+    for (i=0; i<num; i++)
+        osm_xml_write_footer(job.out[i].out);
+
+  done:
+    for (i=0; i<num; i++) {
+        struct extract_out *o = &job.out[i];
+        if (o->out != NULL && fclose(o->out) != 0) {
+            fprintf(stderr, "failed to write %s: %s\n", ex[i].file, strerror(errno));
+            ret = -1;
+        }
+        free(o->buf);
+        osm_idset_free(o->area);
+        osm_idset_free(o->nodes);
+        osm_idset_free(o->ways);
+        osm_idset_free(o->rels);
+        free(o->kept);
+    }
+    osm_relgraph_free(job.graph);
+    free(job.out);
+    return ret;
+}
+
+/*
+ * read the extract config: one output per line
+ *   FILE [bbox LEFT,BOTTOM,RIGHT,TOP] [poly FILE.poly] [filter EXPR ...]
+ * the filter expression is the rest of the line. Empty lines and lines
+ * starting with # are ignored.
+ */
+OSM_Extract *osm_extract_read_config(const char *file, int *num) {
+    FILE *fh;
+    OSM_Extract *ex = NULL;
+    char line[LINE_SIZE];
+    int size = 0, lineno = 0;
+
+    *num = 0;
+    fh = fopen(file, "r");
+    if (fh == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", file, strerror(errno));
+        return (OSM_Extract *)NULL;
+    }
+
+    while (fgets(line, LINE_SIZE, fh) != NULL) {
+        char *ptr = line, *word;
+        OSM_Extract *e;
+
+        ++lineno;
+        ptr[strcspn(ptr, "\r\n")] = '\0';
+        trim_left(ptr);
+        if (!*ptr || *ptr == '#')
+            continue;
+
+        if (*num == size) {
+            OSM_Extract *tmp;
+            size = size ? size * 2 : 16;
+            tmp = realloc(ex, sizeof(OSM_Extract) * size);
+            if (tmp == NULL) {
+                fprintf(stderr, "failed to realloc extract list: %s\n", strerror(errno));
+                goto fail;
+            }
+            ex = tmp;
+        }
+        e = &ex[*num];
+        *num += 1;
+        e->bbox   = NULL;
+        e->poly   = NULL;
+        e->filter = NULL;
+
+        word = ptr;
+        ptr += strcspn(ptr, " \t");
+        if (*ptr)
+            *ptr++ = '\0';
+        e->file = strdup(word);
+
+        while (1) {
+            trim_left(ptr);
+            if (!*ptr)
+                break;
+            if (strncmp(ptr, "bbox", 4) == 0 && (ptr[4] == ' ' || ptr[4] == '\t')) {
+                ptr += 4;
+                trim_left(ptr);
+                word = ptr;
+                ptr += strcspn(ptr, " \t");
+                if (*ptr)
+                    *ptr++ = '\0';
+                free(e->bbox);
+                e->bbox = osm_bbox_parse(word);
+                if (e->bbox == NULL) {
+                    fprintf(stderr, "%s:%d: invalid bbox\n", file, lineno);
+                    goto fail;
+                }
+            }
+            else if (strncmp(ptr, "poly", 4) == 0 && (ptr[4] == ' ' || ptr[4] == '\t')) {
+                ptr += 4;
+                trim_left(ptr);
+                word = ptr;
+                ptr += strcspn(ptr, " \t");
+                if (*ptr)
+                    *ptr++ = '\0';
+                osm_poly_free(e->poly);
+                e->poly = osm_poly_read(word);
+                if (e->poly == NULL) {
+                    fprintf(stderr, "%s:%d: invalid polygon\n", file, lineno);
+                    goto fail;
+                }
+            }
+            else if (strncmp(ptr, "filter", 6) == 0 && (ptr[6] == ' ' || ptr[6] == '\t')) {
+                e->filter = osm_filter_compile(ptr + 6);
+                if (e->filter == NULL) {
+                    fprintf(stderr, "%s:%d: invalid filter\n", file, lineno);
+                    goto fail;
+                }
+                ptr += strlen(ptr);
+            }
+            else {
+                fprintf(stderr, "%s:%d: expected bbox, poly or filter: %s\n", file, lineno, ptr);
+                goto fail;
+            }
+        }
+    }
+    fclose(fh);
+    return ex;
+
+  fail:
+    fclose(fh);
+    osm_extract_free(ex, *num);
+    *num = 0;
+    return (OSM_Extract *)NULL;
+}
+
+void osm_extract_free(OSM_Extract *ex, int num) {
+    int i;
+    if (ex == NULL)
+        return;
+    for (i=0; i<num; i++) {
+        free(ex[i].file);
+        free(ex[i].bbox);
+        osm_poly_free(ex[i].poly);
+        osm_filter_free(ex[i].filter);
+    }
+    free(ex);
+}
+
+/* END */
@@ -0,0 +1,766 @@
+/*
+ * extsort.c - sort files by type and id in limited memory
+ *
+ * The parsers expect nodes before ways before relations (the passes of
+ * osm_pbf_parse(), find_starts() in xml.c) and osm_merge() also each
+ * type by id. Unsorted files, e.g. merged diffs or exports of other
+ * tools, give wrong extracts without an error. osm_sort_file() writes
+ * such a file sorted, as an external merge sort:
+ *   1. the objects are packed into compact records (varints, the way
+ *      nodes and relation members delta coded) in one buffer of mem
+ *      bytes, allocated once: the records from the front, their (id,
+ *      offset) pairs from the back,
+ *   2. a full buffer is sorted with osm_sort_pairs_tmp() on all threads,
+ *      the free space in the middle (as large as the pairs) is the
+ *      second buffer of the radix sort, and written to a temporary file
+ *      as one run,
+ *   3. while there are more than SORT_FANIN runs, groups of SORT_FANIN
+ *      runs are merged into one, the groups in parallel,
+ *   4. the last runs are merged into the .osm.pbf output, which is
+ *      marked Sort.Type_then_ID.
+ * The sort is stable: objects with the same type and id are all kept,
+ * in the order of the input. Ids are compared as uint64_t, i.e. negative
+ * ids (JOSM files) go after the positive ones of their type. Locations
+ * on ways are not kept.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "osm.h"
+
+#define SORT_FANIN 16
+#define SORT_IOBUF (256 * 1024)     /* stdio buffer per run */
+#define SORT_HDR   13               /* id, length and type of the record */
+
+/*
+ * the pairs are sorted by id only, the type is kept in the top bits of
+ * the value (the offset of the record) and the runs are written by type
+ */
+#define SORT_VAL(type, off) (((uint64_t)(type) << 62) | (off))
+#define SORT_VAL_TYPE(v)    ((int)((v) >> 62))
+#define SORT_VAL_OFF(v)     ((v) & (((uint64_t)1 << 62) - 1))
+
+struct sort_buf {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+};
+
+struct sort_run {
+    FILE *f;
+    uint64_t num;
+};
+
+struct sort_state {
+    size_t mem;                 /* size of buf, a multiple of 16 */
+    int threads;
+    const char *tmp_dir;
+    unsigned char *buf;         /* records from the front, pairs from the back */
+    size_t len;                 /* bytes of records */
+    size_t num;                 /* pairs */
+    struct sort_buf rec;        /* the record being packed */
+    struct sort_run *runs;
+    int num_runs, size_runs;
+};
+
+/* a run being read */
+struct sort_reader {
+    FILE *f;
+    int type;
+    uint64_t id;
+    uint32_t len;
+    unsigned char *rec;
+    uint32_t size;
+};
+
+/* scratch space for unpacking a record into an object */
+struct sort_object {
+    int type;
+    OSM_Node n;
+    OSM_Way w;
+    OSM_Relation r;
+    OSM_Tag_List tags;
+    uint32_t size_tags;
+    uint64_t *nodes;
+    uint32_t size_nodes;
+    OSM_Rel_Member_List members;
+};
+
+static int sort_grow(struct sort_buf *b, size_t len) {
+    if (b->len + len > b->size) {
+        size_t size = b->size ? b->size : 4096;
+        unsigned char *tmp;
+        while (b->len + len > size)
+            size *= 2;
+        tmp = realloc(b->data, size);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to malloc sort buffer: %s\n", strerror(errno));
+            return -1;
+        }
+        osm_stats_alloc(OSM_MEM_SORT, (int64_t)(size - b->size));
+        b->data = tmp;
+        b->size = size;
+    }
+    return 0;
+}
+
+static void sort_free_buf(struct sort_buf *b) {
+    osm_stats_alloc(OSM_MEM_SORT, -(int64_t)b->size);
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+/* the rec buffer is grown to the largest size in sort_pack() first */
+static void sort_put_varint(struct sort_buf *b, uint64_t v) {
+    while (v >= 0x80) {
+        b->data[b->len++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    b->data[b->len++] = v;
+}
+
+static void sort_put_sint(struct sort_buf *b, int64_t v) {
+    sort_put_varint(b, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static void sort_put_str(struct sort_buf *b, const char *s) {
+    size_t len = s != NULL ? strlen(s) : 0;
+    memcpy(b->data + b->len, s != NULL ? s : "", len + 1);
+    b->len += len + 1;
+}
+
+static size_t sort_str_size(const char *s) {
+    return s != NULL ? strlen(s) + 1 : 1;
+}
+
+static size_t sort_tags_size(OSM_Tag_List *t) {
+    size_t len = 10;
+    uint32_t i;
+    for (i=0; t != NULL && i<t->num; i++)
+        len += sort_str_size(t->data[i].key) + sort_str_size(t->data[i].val);
+    return len;
+}
+
+static void sort_put_tags(struct sort_buf *b, OSM_Tag_List *t) {
+    uint32_t i, num = t != NULL ? t->num : 0;
+    sort_put_varint(b, num);
+    for (i=0; i<num; i++) {
+        sort_put_str(b, t->data[i].key);
+        sort_put_str(b, t->data[i].val);
+    }
+}
+
+/* version, timestamp, changeset, uid, user */
+static void sort_put_meta(struct sort_buf *b, uint32_t version, uint64_t timestamp,
+                            uint64_t changeset, uint32_t uid, const char *user)
+{
+    sort_put_varint(b, version);
+    sort_put_varint(b, timestamp);
+    sort_put_varint(b, changeset);
+    sort_put_varint(b, uid);
+    sort_put_str(b, user);
+}
+
+/* pack the object into st->rec, id, length and type first */
+static int sort_pack(struct sort_state *st, int type, void *obj) {
+    struct sort_buf *b = &st->rec;
+    uint64_t id;
+    uint32_t len;
+    size_t max = SORT_HDR + 5 * 10;
+    uint32_t i;
+
+    b->len = 0;
+    if (type == OSM_REL_MEMBER_TYPE_NODE) {
+        OSM_Node *n = obj;
+        if (sort_grow(b, max + 20 + sort_str_size(n->user) + sort_tags_size(n->tags)) != 0)
+            return -1;
+        id = n->id;
+        b->len = SORT_HDR;
+        sort_put_meta(b, n->version, n->timestamp, n->changeset, n->uid, n->user);
+        sort_put_sint(b, llround(n->lat / NANO_DEGREE / 100));
+        sort_put_sint(b, llround(n->lon / NANO_DEGREE / 100));
+        sort_put_tags(b, n->tags);
+    }
+    else if (type == OSM_REL_MEMBER_TYPE_WAY) {
+        OSM_Way *w = obj;
+        uint32_t num = 0;
+        int64_t last = 0;
+        while (w->nodes != NULL && w->nodes[num])
+            num++;
+        if (sort_grow(b, max + 10 + num * 10 + sort_str_size(w->user)
+                            + sort_tags_size(w->tags)) != 0)
+            return -1;
+        id = w->id;
+        b->len = SORT_HDR;
+        sort_put_meta(b, w->version, w->timestamp, w->changeset, w->uid, w->user);
+        sort_put_varint(b, num);
+        for (i=0; i<num; i++) {
+            sort_put_sint(b, (int64_t)w->nodes[i] - last);
+            last = w->nodes[i];
+        }
+        sort_put_tags(b, w->tags);
+    }
+    else {
+        OSM_Relation *r = obj;
+        uint32_t num = r->member != NULL ? r->member->num : 0;
+        size_t roles = 0;
+        int64_t last = 0;
+        for (i=0; i<num; i++)
+            roles += sort_str_size(r->member->data[i].role);
+        if (sort_grow(b, max + 10 + num * 11 + roles + sort_str_size(r->user)
+                            + sort_tags_size(r->tags)) != 0)
+            return -1;
+        id = r->id;
+        b->len = SORT_HDR;
+        sort_put_meta(b, r->version, r->timestamp, r->changeset, r->uid, r->user);
+        sort_put_varint(b, num);
+        for (i=0; i<num; i++) {
+            OSM_Rel_Member *m = &r->member->data[i];
+            b->data[b->len++] = m->type;
+            sort_put_sint(b, (int64_t)m->ref - last);
+            last = m->ref;
+            sort_put_str(b, m->role);
+        }
+        sort_put_tags(b, r->tags);
+    }
+    len = b->len - SORT_HDR;
+    memcpy(b->data, &id, 8);
+    memcpy(b->data + 8, &len, 4);
+    b->data[12] = type;
+    return 0;
+}
+
+static uint64_t sort_get_varint(const unsigned char **p) {
+    uint64_t v = 0;
+    int shift = 0;
+    while (**p & 0x80) {
+        v |= (uint64_t)(**p & 0x7f) << shift;
+        shift += 7;
+        (*p)++;
+    }
+    v |= (uint64_t)**p << shift;
+    (*p)++;
+    return v;
+}
+
+static int64_t sort_get_sint(const unsigned char **p) {
+    uint64_t v = sort_get_varint(p);
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static char *sort_get_str(const unsigned char **p) {
+    char *s = (char *)*p;
+    *p += strlen(s) + 1;
+    return s;
+}
+
+static int sort_get_tags(const unsigned char **p, struct sort_object *o, OSM_Tag_List **tags) {
+    uint32_t i, num = sort_get_varint(p);
+    if (num == 0) {
+        *tags = NULL;
+        return 0;
+    }
+    if (num > o->size_tags) {
+        OSM_Tag *tmp = realloc(o->tags.data, sizeof(OSM_Tag) * num);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to malloc tags: %s\n", strerror(errno));
+            return -1;
+        }
+        o->tags.data = tmp;
+        o->size_tags = num;
+    }
+    for (i=0; i<num; i++) {
+        o->tags.data[i].key = sort_get_str(p);
+        o->tags.data[i].val = sort_get_str(p);
+    }
+    o->tags.num  = num;
+    o->tags.size = o->size_tags;
+    *tags = &o->tags;
+    return 0;
+}
+
+/*
+ * unpack a record into o->n, o->w or o->r. The strings point into the
+ * record, the lists into o, all valid until the next record
+ */
+static int sort_unpack(int type, uint64_t id, const unsigned char *p, struct sort_object *o) {
+    uint32_t version, uid, num, i;
+    uint64_t timestamp, changeset;
+    int64_t last = 0;
+    char *user;
+
+    o->type   = type;
+    version   = sort_get_varint(&p);
+    timestamp = sort_get_varint(&p);
+    changeset = sort_get_varint(&p);
+    uid       = sort_get_varint(&p);
+    user      = sort_get_str(&p);
+
+    if (o->type == OSM_REL_MEMBER_TYPE_NODE) {
+        OSM_Node *n = &o->n;
+        n->id = id; n->version = version; n->timestamp = timestamp;
+        n->changeset = changeset; n->uid = uid; n->user = user;
+        n->lat = sort_get_sint(&p) * NANO_DEGREE * 100;
+        n->lon = sort_get_sint(&p) * NANO_DEGREE * 100;
+        return sort_get_tags(&p, o, &n->tags);
+    }
+    num = sort_get_varint(&p);
+    if (o->type == OSM_REL_MEMBER_TYPE_WAY) {
+        OSM_Way *w = &o->w;
+        if (num + 1 > o->size_nodes) {
+            uint64_t *tmp = realloc(o->nodes, sizeof(uint64_t) * (num + 1));
+            if (tmp == NULL) {
+                fprintf(stderr, "failed to malloc way nodes: %s\n", strerror(errno));
+                return -1;
+            }
+            o->nodes      = tmp;
+            o->size_nodes = num + 1;
+        }
+        for (i=0; i<num; i++) {
+            last += sort_get_sint(&p);
+            o->nodes[i] = last;
+        }
+        o->nodes[num] = 0;
+        w->id = id; w->version = version; w->timestamp = timestamp;
+        w->changeset = changeset; w->uid = uid; w->user = user;
+        w->nodes = o->nodes;
+        w->locs  = NULL;
+        return sort_get_tags(&p, o, &w->tags);
+    }
+    if (num > o->members.size) {
+        OSM_Rel_Member *tmp = realloc(o->members.data, sizeof(OSM_Rel_Member) * num);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to malloc members: %s\n", strerror(errno));
+            return -1;
+        }
+        o->members.data = tmp;
+        o->members.size = num;
+    }
+    for (i=0; i<num; i++) {
+        OSM_Rel_Member *m = &o->members.data[i];
+        m->type = *p++;
+        last   += sort_get_sint(&p);
+        m->ref  = last;
+        m->role = sort_get_str(&p);
+    }
+    o->members.num = num;
+    o->r.id = id; o->r.version = version; o->r.timestamp = timestamp;
+    o->r.changeset = changeset; o->r.uid = uid; o->r.user = user;
+    o->r.member = &o->members;
+    return sort_get_tags(&p, o, &o->r.tags);
+}
+
+/* an unlinked temporary file in tmp_dir */
+static FILE *sort_tmpfile(const char *tmp_dir) {
+    char path[4096];
+    FILE *f;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/osm-sort-XXXXXX", tmp_dir);
+    fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "failed to create temporary file in %s: %s\n",
+                        tmp_dir, strerror(errno));
+        return NULL;
+    }
+    unlink(path);
+    f = fdopen(fd, "w+");
+    if (f == NULL) {
+        fprintf(stderr, "failed to open temporary file: %s\n", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    setvbuf(f, NULL, _IOFBF, SORT_IOBUF);
+    return f;
+}
+
+static int sort_add_run(struct sort_state *st, struct sort_run *run) {
+    if (st->num_runs == st->size_runs) {
+        int size = st->size_runs ? st->size_runs * 2 : 64;
+        struct sort_run *tmp = realloc(st->runs, sizeof(struct sort_run) * size);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to malloc runs: %s\n", strerror(errno));
+            return -1;
+        }
+        st->runs      = tmp;
+        st->size_runs = size;
+    }
+    st->runs[ st->num_runs++ ] = *run;
+    return 0;
+}
+
+/* the pairs at the end of buf, the last one added first */
+static struct osm_sort_pair *sort_pairs(struct sort_state *st) {
+    return (struct osm_sort_pair *)(st->buf + st->mem) - st->num;
+}
+
+/* sort the buffer and write it as a run */
+static int sort_spill(struct sort_state *st) {
+    struct osm_sort_pair *pairs = sort_pairs(st), t;
+    struct sort_run run;
+    size_t i;
+    int type;
+
+    if (st->num == 0)
+        return 0;
+    /* in the order of the input again, the sort is stable */
+    for (i=0; i<st->num/2; i++) {
+        t = pairs[i];
+        pairs[i] = pairs[st->num - 1 - i];
+        pairs[st->num - 1 - i] = t;
+    }
+    osm_sort_pairs_tmp(pairs, st->num, st->buf + ((st->len + 15) & ~(size_t)15),
+                        st->threads);
+    run.num = st->num;
+    run.f   = sort_tmpfile(st->tmp_dir);
+    if (run.f == NULL)
+        return -1;
+    /* stable: by id within each type */
+    for (type=OSM_REL_MEMBER_TYPE_NODE; type<=OSM_REL_MEMBER_TYPE_RELATION; type++) {
+        for (i=0; i<st->num; i++) {
+            const unsigned char *r;
+            uint32_t len;
+            if (SORT_VAL_TYPE(pairs[i].val) != type)
+                continue;
+            r = st->buf + SORT_VAL_OFF(pairs[i].val);
+            memcpy(&len, r + 8, 4);
+            fwrite(r, 1, SORT_HDR + len, run.f);
+        }
+    }
+    if (fflush(run.f) != 0 || ferror(run.f)) {
+        fprintf(stderr, "failed to write sort run: %s\n", strerror(errno));
+        fclose(run.f);
+        return -1;
+    }
+    osm_trace(OSM_TRACE_PASS, "sort: run %d, %lu objects, %lu bytes",
+                st->num_runs, st->num, st->len);
+    st->len = 0;
+    st->num = 0;
+    return sort_add_run(st, &run);
+}
+
+/* room for the record, its pair and the second buffer of the sort */
+static int sort_fits(struct sort_state *st, size_t len) {
+    return st->len + len + 2 * (st->num + 1) * sizeof(struct osm_sort_pair) + 16 <= st->mem;
+}
+
+static int sort_add(struct sort_state *st, int type, void *obj) {
+    struct osm_sort_pair *p;
+    size_t len;
+
+    if (sort_pack(st, type, obj) != 0)
+        return -1;
+    len = st->rec.len;
+    if (!sort_fits(st, len) && sort_spill(st) != 0)
+        return -1;
+    if (!sort_fits(st, len)) {
+        fprintf(stderr, "object of %lu bytes does not fit in %lu bytes of sort memory\n",
+                        len, st->mem);
+        return -1;
+    }
+    memcpy(st->buf + st->len, st->rec.data, len);
+    st->num++;
+    p = sort_pairs(st);
+    memcpy(&p->key, st->rec.data, 8);
+    p->val = SORT_VAL(type, st->len);
+    st->len += len;
+    return 0;
+}
+
+static int sort_block(OSM_Data *d, void *ctx) {
+    struct sort_state *st = ctx;
+    uint32_t i;
+
+    for (i=0; i<d->nodes->num; i++)
+        if (sort_add(st, OSM_REL_MEMBER_TYPE_NODE, d->nodes->data[i]) != 0)
+            return -1;
+    for (i=0; i<d->ways->num; i++)
+        if (sort_add(st, OSM_REL_MEMBER_TYPE_WAY, d->ways->data[i]) != 0)
+            return -1;
+    for (i=0; i<d->relations->num; i++)
+        if (sort_add(st, OSM_REL_MEMBER_TYPE_RELATION, d->relations->data[i]) != 0)
+            return -1;
+    return 0;
+}
+
+/* the next record of the run, 1 if there is one, 0 at the end, -1 on errors */
+static int sort_read(struct sort_reader *R) {
+    unsigned char hdr[SORT_HDR];
+    size_t got = fread(hdr, 1, SORT_HDR, R->f);
+
+    if (got == 0 && feof(R->f))
+        return 0;
+    if (got != SORT_HDR)
+        goto fail;
+    memcpy(&R->id, hdr, 8);
+    memcpy(&R->len, hdr + 8, 4);
+    R->type = hdr[12];
+    if (R->len > R->size) {
+        unsigned char *tmp = realloc(R->rec, R->len);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to malloc sort record: %s\n", strerror(errno));
+            return -1;
+        }
+        R->rec  = tmp;
+        R->size = R->len;
+    }
+    if (fread(R->rec, 1, R->len, R->f) != R->len)
+        goto fail;
+    return 1;
+
+  fail:
+    fprintf(stderr, "failed to read sort run: %s\n",
+                    ferror(R->f) ? strerror(errno) : "short read");
+    return -1;
+}
+
+/* heap order: type, id, then run, which keeps the input order */
+static int sort_less(struct sort_reader *R, int a, int b) {
+    if (R[a].type != R[b].type)
+        return R[a].type < R[b].type;
+    if (R[a].id != R[b].id)
+        return R[a].id < R[b].id;
+    return a < b;
+}
+
+static void sort_sift_down(struct sort_reader *R, int *heap, int num, int i) {
+    while (1) {
+        int l = 2 * i + 1, r = l + 1, min = i, t;
+        if (l < num && sort_less(R, heap[l], heap[min]))
+            min = l;
+        if (r < num && sort_less(R, heap[r], heap[min]))
+            min = r;
+        if (min == i)
+            return;
+        t = heap[i];
+        heap[i] = heap[min];
+        heap[min] = t;
+        i = min;
+    }
+}
+
+/*
+ * merge the num runs, in order, into out (another run) or W. The runs
+ * are closed
+ */
+static int sort_merge(struct sort_run *runs, int num, FILE *out, OSM_PBF_Writer *W) {
+    struct sort_reader R[SORT_FANIN];
+    struct sort_object o;
+    int heap[SORT_FANIN], heap_num = 0, ret = 0, i, r;
+
+    memset(R, 0, sizeof(R));
+    memset(&o, 0, sizeof(o));
+    for (i=0; i<num; i++) {
+        R[i].f = runs[i].f;
+        if (fseek(R[i].f, 0, SEEK_SET) != 0) {
+            fprintf(stderr, "failed to rewind sort run: %s\n", strerror(errno));
+            ret = -1;
+            goto done;
+        }
+        r = sort_read(&R[i]);
+        if (r < 0) {
+            ret = -1;
+            goto done;
+        }
+        if (r > 0)
+            heap[heap_num++] = i;
+    }
+    for (i=heap_num/2 - 1; i>=0; i--)
+        sort_sift_down(R, heap, heap_num, i);
+
+    while (heap_num) {
+        struct sort_reader *S = &R[ heap[0] ];
+        if (out != NULL) {
+            unsigned char hdr[SORT_HDR];
+            memcpy(hdr, &S->id, 8);
+            memcpy(hdr + 8, &S->len, 4);
+            hdr[12] = S->type;
+            fwrite(hdr, 1, SORT_HDR, out);
+            fwrite(S->rec, 1, S->len, out);
+        }
+        else {
+            if (sort_unpack(S->type, S->id, S->rec, &o) != 0) {
+                ret = -1;
+                break;
+            }
+            osm_stats_add(OSM_STAT_KEPT(o.type), 1);
+            if (o.type == OSM_REL_MEMBER_TYPE_NODE)
+                r = osm_pbf_write_node(&o.n, W);
+            else if (o.type == OSM_REL_MEMBER_TYPE_WAY)
+                r = osm_pbf_write_way(&o.w, W);
+            else
+                r = osm_pbf_write_relation(&o.r, W);
+            if (r != 0) {
+                ret = -1;
+                break;
+            }
+        }
+        r = sort_read(S);
+        if (r < 0) {
+            ret = -1;
+            break;
+        }
+        if (r == 0)
+            heap[0] = heap[--heap_num];
+        sort_sift_down(R, heap, heap_num, 0);
+    }
+    if (out != NULL && (fflush(out) != 0 || ferror(out))) {
+        fprintf(stderr, "failed to write sort run: %s\n", strerror(errno));
+        ret = -1;
+    }
+
+  done:
+    for (i=0; i<num; i++) {
+        free(R[i].rec);
+        fclose(runs[i].f);
+        runs[i].f = NULL;
+    }
+    free(o.tags.data);
+    free(o.nodes);
+    free(o.members.data);
+    return ret;
+}
+
+struct sort_pass {
+    struct sort_run *runs;      /* in */
+    int num_runs;
+    struct sort_run *out;       /* one per group */
+    int num_groups;
+    int next;
+    int failed;
+    const char *tmp_dir;
+};
+
+static void sort_pass_worker(int id, int num, void *arg) {
+    struct sort_pass *p = arg;
+    int g;
+
+    while ((g = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) < p->num_groups) {
+        int first = g * SORT_FANIN, n = p->num_runs - first, i;
+        if (n > SORT_FANIN)
+            n = SORT_FANIN;
+        p->out[g].num = 0;
+        for (i=0; i<n; i++)
+            p->out[g].num += p->runs[first + i].num;
+        p->out[g].f = __atomic_load_n(&p->failed, __ATOMIC_RELAXED)
+                        ? NULL : sort_tmpfile(p->tmp_dir);
+        if (p->out[g].f == NULL
+            || sort_merge(p->runs + first, n, p->out[g].f, NULL) != 0)
+        {
+            __atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+            /* sort_merge() closes its runs, not so without a temporary file */
+            for (i=0; i<n; i++) {
+                if (p->runs[first + i].f != NULL)
+                    fclose(p->runs[first + i].f);
+                p->runs[first + i].f = NULL;
+            }
+        }
+    }
+}
+
+/* merge groups of SORT_FANIN runs on all threads until SORT_FANIN are left */
+static int sort_passes(struct sort_state *st) {
+    while (st->num_runs > SORT_FANIN) {
+        struct sort_pass p;
+        int i;
+
+        memset(&p, 0, sizeof(p));
+        p.runs       = st->runs;
+        p.num_runs   = st->num_runs;
+        p.num_groups = (st->num_runs + SORT_FANIN - 1) / SORT_FANIN;
+        p.tmp_dir    = st->tmp_dir;
+        p.out        = calloc(p.num_groups, sizeof(struct sort_run));
+        if (p.out == NULL) {
+            fprintf(stderr, "failed to malloc runs: %s\n", strerror(errno));
+            return -1;
+        }
+        osm_trace(OSM_TRACE_PASS, "sort: merging %d runs into %d", p.num_runs, p.num_groups);
+        osm_threads_run(p.num_groups < st->threads ? p.num_groups : st->threads,
+                        sort_pass_worker, &p);
+        free(st->runs);
+        st->runs      = p.out;
+        st->num_runs  = p.num_groups;
+        st->size_runs = p.num_groups;
+        if (p.failed) {
+            for (i=0; i<st->num_runs; i++) {
+                if (st->runs[i].f != NULL)
+                    fclose(st->runs[i].f);
+            }
+            st->num_runs = 0;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * write F sorted by type, then id to out as .osm.pbf, using about mem
+ * bytes (0: OSM_SORT_MEM) for the runs, threads for sorting and merging
+ * them (0: all CPUs), temporary files in tmp_dir (NULL: $TMPDIR or
+ * /tmp). block_size and level as for osm_pbf_write_header(), who for the
+ * header. Returns 0 on success, -1 on errors
+ */
+int osm_sort_file(OSM_File *F, FILE *out, size_t mem, int threads, const char *tmp_dir,
+                    uint32_t block_size, int level, char *who)
+{
+    struct sort_state st;
+    OSM_PBF_Writer *W;
+    uint64_t total = 0;
+    int ret = 0, i;
+
+    memset(&st, 0, sizeof(st));
+    st.mem     = (mem ? mem : OSM_SORT_MEM) & ~(size_t)15;
+    st.threads = osm_threads_num(threads);
+    st.tmp_dir = tmp_dir;
+    if (st.tmp_dir == NULL)
+        st.tmp_dir = getenv("TMPDIR");
+    if (st.tmp_dir == NULL || !*st.tmp_dir)
+        st.tmp_dir = "/tmp";
+
+    st.buf     = malloc(st.mem);
+    if (st.buf == NULL) {
+        fprintf(stderr, "failed to malloc %lu bytes of sort memory: %s\n",
+                        st.mem, strerror(errno));
+        return -1;
+    }
+    osm_stats_alloc(OSM_MEM_SORT, st.mem);
+
+    if (osm_scan(F, OSMDATA_NODE|OSMDATA_WAY|OSMDATA_REL, sort_block, &st) != 0
+        || sort_spill(&st) != 0)
+        ret = -1;
+    osm_stats_alloc(OSM_MEM_SORT, -(int64_t)st.mem);
+    free(st.buf);
+    sort_free_buf(&st.rec);
+    for (i=0; i<st.num_runs; i++)
+        total += st.runs[i].num;
+    osm_trace(OSM_TRACE_PASS, "sort: %lu objects in %d runs", total, st.num_runs);
+
+    if (ret == 0)
+        ret = sort_passes(&st);
+    if (ret == 0) {
+        W = osm_pbf_write_header_opt(who, out, NULL, block_size, level, OSM_PBF_SORTED);
+        if (W == NULL)
+            ret = -1;
+        else {
+            ret = sort_merge(st.runs, st.num_runs, NULL, W);
+            st.num_runs = 0;
+            if (osm_pbf_write_footer(W) != 0)
+                ret = -1;
+        }
+    }
+    for (i=0; i<st.num_runs; i++)
+        fclose(st.runs[i].f);
+    free(st.runs);
+    return ret;
+}
+
+/* END */
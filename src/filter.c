@@ -0,0 +1,656 @@
+/*
+ * filter.c - compiled tag / user / id filter expressions
+ *
+ * Syntax:
+ *   expr  := and { '|' and }
+ *   and   := unary { '&' unary }
+ *   unary := '!' unary | '(' expr ')' | term
+ *   term  := key                     object has a tag "key"
+ *          | key '=' val { '|' val } tag "key" has one of the values
+ *          | key '!=' val { '|' val } same as !(key=val|...)
+ *   key "@type" matches node|way|relation, "@id", "@user" and "@uid"
+ *   match the object's meta data, a value "*" matches any value.
+ *   Keys and values may be quoted with " or ', \ escapes the next char.
+ *
+ * A '|' after a value starts another value unless the word following it
+ * is a key (i.e. followed by '=' or '!='), so
+ *   highway=primary|secondary & !access=private
+ * is (highway=primary or highway=secondary) and not access=private. To
+ * OR a value list with a plain key, put the key in parentheses.
+ *
+ * The expression is compiled to a small postfix program. For .osm.pbf
+ * files the literals of the program are bound to the string table ids of
+ * each block (osm_filter_bind()), so objects can be checked before their
+ * strings are copied (osm_filter_pbf()).
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "osm.h"
+
+enum {
+    FOP_TAG,
+    FOP_TYPE,
+    FOP_ID,
+    FOP_USER,
+    FOP_UID,
+    FOP_NOT,
+    FOP_AND,
+    FOP_OR
+};
+
+struct filter_op {
+    int      op;
+    int      key;   /* FOP_TAG: literal index of the key */
+    int      first; /* first argument in args[] */
+    int      num;   /* number of arguments, FOP_TAG: 0 == any value */
+    uint32_t mask;  /* FOP_TYPE: 1 << OSM_REL_MEMBER_TYPE_* */
+};
+
+struct filter_lit {
+    char   *s;
+    size_t  len;
+    int64_t sid;    /* string table id in the bound block, -1 == none */
+};
+
+struct _osm_filter {
+    int num_ops;
+    int size_ops;
+    struct filter_op *ops;
+    int num_lits;
+    int size_lits;
+    struct filter_lit *lits;
+    int num_args;
+    int size_args;
+    int64_t *args;  /* literal indexes (FOP_TAG, FOP_USER) or numbers */
+    char *stack;    /* num_ops entries for filter_eval(), so one filter
+                       must not be evaluated by two threads at once */
+};
+
+/* the object to check, either materialized or raw from a PrimitiveBlock */
+struct filter_obj {
+    int type;
+    uint64_t id;
+    uint32_t uid;
+    OSM_Tag_List *tags;
+    const char *user;
+    const uint32_t *keys;
+    const uint32_t *vals;
+    size_t num;
+    int stride;
+    int64_t user_sid;
+};
+
+enum {
+    TOK_END,
+    TOK_WORD,
+    TOK_EQ,
+    TOK_NE,
+    TOK_AND,
+    TOK_OR,
+    TOK_NOT,
+    TOK_OPEN,
+    TOK_CLOSE
+};
+
+struct filter_tok {
+    int   type;
+    char *word;
+};
+
+struct filter_parser {
+    const char *expr;
+    struct filter_tok *tok;
+    int num_tok;
+    int pos;
+    OSM_Filter *f;
+    int error;
+};
+
+static void filter_error(struct filter_parser *p, const char *msg) {
+    if (!p->error)
+        fprintf(stderr, "filter expression '%s': %s\n", p->expr, msg);
+    p->error = 1;
+}
+
+static int filter_tokenize(struct filter_parser *p) {
+    const char *s = p->expr;
+    int size = 16;
+
+    p->tok = malloc(sizeof(struct filter_tok) * size);
+    if (p->tok == NULL)
+        return -1;
+    p->num_tok = 0;
+    while (1) {
+        struct filter_tok t;
+        while (*s == ' ' || *s == '\t' || *s == '\n')
+            ++s;
+        t.word = NULL;
+        if (!*s)
+            t.type = TOK_END;
+        else if (*s == '&') { t.type = TOK_AND;   ++s; }
+        else if (*s == '|') { t.type = TOK_OR;    ++s; }
+        else if (*s == '(') { t.type = TOK_OPEN;  ++s; }
+        else if (*s == ')') { t.type = TOK_CLOSE; ++s; }
+        else if (*s == '=') { t.type = TOK_EQ;    ++s; }
+        else if (*s == '!' && *(s+1) == '=') { t.type = TOK_NE; s += 2; }
+        else if (*s == '!') { t.type = TOK_NOT;   ++s; }
+        else {
+            char *w = malloc(strlen(s) + 1), *d = w;
+            if (w == NULL)
+                return -1;
+            if (*s == '"' || *s == '\'') {
+                char q = *s++;
+                while (*s && *s != q) {
+                    if (*s == '\\' && *(s+1))
+                        ++s;
+                    *d++ = *s++;
+                }
+                if (*s != q) {
+                    free(w);
+                    filter_error(p, "unterminated quote");
+                    return -1;
+                }
+                ++s;
+            }
+            else {
+                while (*s && strchr(" \t\n&|()=!", *s) == NULL) {
+                    if (*s == '\\' && *(s+1))
+                        ++s;
+                    *d++ = *s++;
+                }
+            }
+            *d = '\0';
+            t.type = TOK_WORD;
+            t.word = w;
+        }
+        if (p->num_tok == size) {
+            struct filter_tok *tmp;
+            size *= 2;
+            tmp = realloc(p->tok, sizeof(struct filter_tok) * size);
+            if (tmp == NULL) {
+                free(t.word);
+                return -1;
+            }
+            p->tok = tmp;
+        }
+        p->tok[p->num_tok++] = t;
+        if (t.type == TOK_END)
+            return 0;
+    }
+}
+
+static int filter_add_op(struct filter_parser *p, int op) {
+    OSM_Filter *f = p->f;
+    if (f->num_ops == f->size_ops) {
+        struct filter_op *tmp;
+        f->size_ops = f->size_ops ? f->size_ops * 2 : 16;
+        tmp = realloc(f->ops, sizeof(struct filter_op) * f->size_ops);
+        if (tmp == NULL) {
+            filter_error(p, "out of memory");
+            return -1;
+        }
+        f->ops = tmp;
+    }
+    f->ops[f->num_ops].op    = op;
+    f->ops[f->num_ops].key   = -1;
+    f->ops[f->num_ops].first = f->num_args;
+    f->ops[f->num_ops].num   = 0;
+    f->ops[f->num_ops].mask  = 0;
+    f->num_ops += 1;
+    return f->num_ops - 1;
+}
+
+static int filter_add_lit(struct filter_parser *p, const char *s) {
+    OSM_Filter *f = p->f;
+    int i;
+    for (i=0; i<f->num_lits; i++) {
+        if (strcmp(f->lits[i].s, s) == 0)
+            return i;
+    }
+    if (f->num_lits == f->size_lits) {
+        struct filter_lit *tmp;
+        f->size_lits = f->size_lits ? f->size_lits * 2 : 16;
+        tmp = realloc(f->lits, sizeof(struct filter_lit) * f->size_lits);
+        if (tmp == NULL) {
+            filter_error(p, "out of memory");
+            return -1;
+        }
+        f->lits = tmp;
+    }
+    f->lits[f->num_lits].s   = strdup(s);
+    if (f->lits[f->num_lits].s == NULL) {
+        filter_error(p, "out of memory");
+        return -1;
+    }
+    f->lits[f->num_lits].len = strlen(s);
+    f->lits[f->num_lits].sid = -1;
+    f->num_lits += 1;
+    return f->num_lits - 1;
+}
+
+static int filter_add_arg(struct filter_parser *p, int64_t arg) {
+    OSM_Filter *f = p->f;
+    if (f->num_args == f->size_args) {
+        int64_t *tmp;
+        f->size_args = f->size_args ? f->size_args * 2 : 16;
+        tmp = realloc(f->args, sizeof(int64_t) * f->size_args);
+        if (tmp == NULL) {
+            filter_error(p, "out of memory");
+            return -1;
+        }
+        f->args = tmp;
+    }
+    f->args[f->num_args++] = arg;
+    return 0;
+}
+
+static struct filter_tok *filter_peek(struct filter_parser *p, int ahead) {
+    int pos = p->pos + ahead;
+    if (pos >= p->num_tok)
+        pos = p->num_tok - 1;
+    return &p->tok[pos];
+}
+
+static void filter_parse_or(struct filter_parser *p);
+
+/* one value of a key=value term */
+static void filter_parse_value(struct filter_parser *p, int op) {
+    struct filter_tok *t = filter_peek(p, 0);
+    OSM_Filter *f = p->f;
+    struct filter_op *o = &f->ops[op];
+    char *end;
+
+    if (t->type != TOK_WORD) {
+        filter_error(p, "value expected");
+        return;
+    }
+    p->pos += 1;
+
+    switch (o->op) {
+        case FOP_TAG:
+            if (strcmp(t->word, "*") == 0)
+                o->mask = 1; /* any value, see filter_parse_term() */
+            else {
+                int lit = filter_add_lit(p, t->word);
+                if (lit < 0 || filter_add_arg(p, lit) != 0)
+                    return;
+                f->ops[op].num += 1;
+            }
+            break;
+        case FOP_TYPE:
+            if (strcmp(t->word, "node") == 0)
+                o->mask |= 1 << OSM_REL_MEMBER_TYPE_NODE;
+            else if (strcmp(t->word, "way") == 0)
+                o->mask |= 1 << OSM_REL_MEMBER_TYPE_WAY;
+            else if (strcmp(t->word, "relation") == 0 || strcmp(t->word, "rel") == 0)
+                o->mask |= 1 << OSM_REL_MEMBER_TYPE_RELATION;
+            else
+                filter_error(p, "@type must be node, way or relation");
+            break;
+        case FOP_ID:
+        case FOP_UID:
+            errno = 0;
+            int64_t num = strtoll(t->word, &end, 10);
+            if (errno || *end) {
+                filter_error(p, "number expected");
+                return;
+            }
+            if (filter_add_arg(p, num) != 0)
+                return;
+            f->ops[op].num += 1;
+            break;
+        case FOP_USER: {
+            int lit = filter_add_lit(p, t->word);
+            if (lit < 0 || filter_add_arg(p, lit) != 0)
+                return;
+            f->ops[op].num += 1;
+            break;
+        }
+    }
+}
+
+static void filter_parse_term(struct filter_parser *p) {
+    struct filter_tok *t = filter_peek(p, 0);
+    int op, negate = 0, kind = FOP_TAG;
+    char *key;
+
+    if (t->type != TOK_WORD) {
+        filter_error(p, "key expected");
+        return;
+    }
+    key = t->word;
+    p->pos += 1;
+
+    if (*key == '@') {
+        if (strcmp(key, "@type") == 0)      kind = FOP_TYPE;
+        else if (strcmp(key, "@id") == 0)   kind = FOP_ID;
+        else if (strcmp(key, "@user") == 0) kind = FOP_USER;
+        else if (strcmp(key, "@uid") == 0)  kind = FOP_UID;
+        else {
+            filter_error(p, "unknown @ key");
+            return;
+        }
+    }
+
+    t = filter_peek(p, 0);
+    if (t->type != TOK_EQ && t->type != TOK_NE) {
+        if (kind != FOP_TAG) {
+            filter_error(p, "@ keys need a value");
+            return;
+        }
+        op = filter_add_op(p, FOP_TAG);
+        if (op < 0)
+            return;
+        p->f->ops[op].key = filter_add_lit(p, key);
+        return;
+    }
+    negate = t->type == TOK_NE;
+    p->pos += 1;
+
+    op = filter_add_op(p, kind);
+    if (op < 0)
+        return;
+    if (kind == FOP_TAG) {
+        p->f->ops[op].key = filter_add_lit(p, key);
+        if (p->f->ops[op].key < 0)
+            return;
+    }
+
+    filter_parse_value(p, op);
+    while (!p->error) {
+        struct filter_tok *next, *after;
+        t = filter_peek(p, 0);
+        if (t->type != TOK_OR)
+            break;
+        next  = filter_peek(p, 1);
+        after = filter_peek(p, 2);
+        if (next->type != TOK_WORD
+            || after->type == TOK_EQ || after->type == TOK_NE)
+            break;
+        p->pos += 1;
+        filter_parse_value(p, op);
+    }
+    /* "key=*" matches any value */
+    if (kind == FOP_TAG && p->f->ops[op].mask) {
+        p->f->ops[op].num  = 0;
+        p->f->ops[op].mask = 0;
+    }
+    if (negate)
+        filter_add_op(p, FOP_NOT);
+}
+
+static void filter_parse_unary(struct filter_parser *p) {
+    struct filter_tok *t = filter_peek(p, 0);
+    if (p->error)
+        return;
+    if (t->type == TOK_NOT) {
+        p->pos += 1;
+        filter_parse_unary(p);
+        filter_add_op(p, FOP_NOT);
+    }
+    else if (t->type == TOK_OPEN) {
+        p->pos += 1;
+        filter_parse_or(p);
+        if (filter_peek(p, 0)->type != TOK_CLOSE) {
+            filter_error(p, "missing ')'");
+            return;
+        }
+        p->pos += 1;
+    }
+    else
+        filter_parse_term(p);
+}
+
+static void filter_parse_and(struct filter_parser *p) {
+    filter_parse_unary(p);
+    while (!p->error && filter_peek(p, 0)->type == TOK_AND) {
+        p->pos += 1;
+        filter_parse_unary(p);
+        filter_add_op(p, FOP_AND);
+    }
+}
+
+static void filter_parse_or(struct filter_parser *p) {
+    filter_parse_and(p);
+    while (!p->error && filter_peek(p, 0)->type == TOK_OR) {
+        p->pos += 1;
+        filter_parse_and(p);
+        filter_add_op(p, FOP_OR);
+    }
+}
+
+OSM_Filter *osm_filter_compile(const char *expr) {
+    struct filter_parser p;
+    int i;
+
+    memset(&p, 0, sizeof(p));
+    p.expr = expr;
+    p.f = calloc(1, sizeof(OSM_Filter));
+    if (p.f == NULL) {
+        fprintf(stderr, "failed to malloc filter: %s\n", strerror(errno));
+        return (OSM_Filter *)NULL;
+    }
+
+    if (filter_tokenize(&p) != 0)
+        filter_error(&p, "failed to tokenize");
+    else {
+        filter_parse_or(&p);
+        if (!p.error && filter_peek(&p, 0)->type != TOK_END)
+            filter_error(&p, "garbage at end of expression");
+        if (!p.error && p.f->num_ops == 0)
+            filter_error(&p, "empty expression");
+    }
+
+    for (i=0; i<p.num_tok; i++)
+        free(p.tok[i].word);
+    free(p.tok);
+
+    if (!p.error) {
+        p.f->stack = malloc(p.f->num_ops);
+        if (p.f->stack == NULL) {
+            fprintf(stderr, "failed to malloc filter stack: %s\n", strerror(errno));
+            p.error = 1;
+        }
+    }
+    if (p.error) {
+        osm_filter_free(p.f);
+        return (OSM_Filter *)NULL;
+    }
+    return p.f;
+}
+
+void osm_filter_free(OSM_Filter *f) {
+    int i;
+    if (f == NULL)
+        return;
+    for (i=0; i<f->num_lits; i++)
+        free(f->lits[i].s);
+    free(f->lits);
+    free(f->ops);
+    free(f->args);
+    free(f->stack);
+    free(f);
+}
+
+/*
+ * look up the literals of the program in the string table of a block,
+ * must be called for each PrimitiveBlock before osm_filter_pbf()
+ */
+void osm_filter_bind(OSM_Filter *f, StringTable *st) {
+    int i;
+    size_t k;
+    for (i=0; i<f->num_lits; i++)
+        f->lits[i].sid = -1;
+    /* index 0 is always empty and used as delimiter */
+    for (k=1; k<st->n_s; k++) {
+        for (i=0; i<f->num_lits; i++) {
+            if (f->lits[i].sid == -1
+                && f->lits[i].len == st->s[k].len
+                && memcmp(f->lits[i].s, st->s[k].data, st->s[k].len) == 0)
+            {
+                f->lits[i].sid = k;
+            }
+        }
+    }
+}
+
+static int filter_tag(OSM_Filter *f, struct filter_op *o, struct filter_obj *obj) {
+    size_t i;
+    int k;
+    if (obj->tags != NULL || obj->keys == NULL) {
+        struct filter_lit *key = &f->lits[o->key];
+        if (obj->tags == NULL)
+            return 0;
+        for (i=0; i<obj->tags->num; i++) {
+            if (strcmp(obj->tags->data[i].key, key->s) != 0)
+                continue;
+            if (o->num == 0)
+                return 1;
+            for (k=0; k<o->num; k++) {
+                if (strcmp(obj->tags->data[i].val, f->lits[f->args[o->first + k]].s) == 0)
+                    return 1;
+            }
+        }
+        return 0;
+    }
+
+    int64_t key = f->lits[o->key].sid;
+    if (key == -1)
+        return 0;
+    for (i=0; i<obj->num; i++) {
+        if (obj->keys[i * obj->stride] != key)
+            continue;
+        if (o->num == 0)
+            return 1;
+        for (k=0; k<o->num; k++) {
+            if (obj->vals[i * obj->stride] == f->lits[f->args[o->first + k]].sid)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+static int filter_user(OSM_Filter *f, struct filter_op *o, struct filter_obj *obj) {
+    int k;
+    for (k=0; k<o->num; k++) {
+        struct filter_lit *l = &f->lits[f->args[o->first + k]];
+        if (obj->user != NULL) {
+            if (strcmp(obj->user, l->s) == 0)
+                return 1;
+        }
+        else if (obj->user_sid > 0 && obj->user_sid == l->sid)
+            return 1;
+    }
+    return 0;
+}
+
+static int filter_eval(OSM_Filter *f, struct filter_obj *obj) {
+    char *stack = f->stack;
+    int sp = 0, i, k, res;
+
+    for (i=0; i<f->num_ops; i++) {
+        struct filter_op *o = &f->ops[i];
+        switch (o->op) {
+            case FOP_TAG:
+                stack[sp++] = filter_tag(f, o, obj);
+                break;
+            case FOP_TYPE:
+                stack[sp++] = (o->mask >> obj->type) & 1;
+                break;
+            case FOP_ID:
+            case FOP_UID:
+                res = 0;
+                for (k=0; k<o->num; k++) {
+                    if ((o->op == FOP_ID && (int64_t)obj->id == f->args[o->first + k])
+                        || (o->op == FOP_UID && obj->uid == f->args[o->first + k]))
+                    {
+                        res = 1;
+                        break;
+                    }
+                }
+                stack[sp++] = res;
+                break;
+            case FOP_USER:
+                stack[sp++] = filter_user(f, o, obj);
+                break;
+            case FOP_NOT:
+                stack[sp-1] = !stack[sp-1];
+                break;
+            case FOP_AND:
+                sp -= 1;
+                stack[sp-1] = stack[sp-1] && stack[sp];
+                break;
+            case FOP_OR:
+                sp -= 1;
+                stack[sp-1] = stack[sp-1] || stack[sp];
+                break;
+        }
+    }
+    return sp > 0 ? stack[sp-1] : 0;
+}
+
+int osm_filter_node(OSM_Filter *f, OSM_Node *n) {
+    struct filter_obj o;
+    memset(&o, 0, sizeof(o));
+    o.type = OSM_REL_MEMBER_TYPE_NODE;
+    o.id   = n->id;
+    o.uid  = n->uid;
+    o.user = n->user;
+    o.tags = n->tags;
+    return filter_eval(f, &o);
+}
+
+int osm_filter_way(OSM_Filter *f, OSM_Way *w) {
+    struct filter_obj o;
+    memset(&o, 0, sizeof(o));
+    o.type = OSM_REL_MEMBER_TYPE_WAY;
+    o.id   = w->id;
+    o.uid  = w->uid;
+    o.user = w->user;
+    o.tags = w->tags;
+    return filter_eval(f, &o);
+}
+
+int osm_filter_relation(OSM_Filter *f, OSM_Relation *r) {
+    struct filter_obj o;
+    memset(&o, 0, sizeof(o));
+    o.type = OSM_REL_MEMBER_TYPE_RELATION;
+    o.id   = r->id;
+    o.uid  = r->uid;
+    o.user = r->user;
+    o.tags = r->tags;
+    return filter_eval(f, &o);
+}
+
+/*
+ * check a not yet converted object of the bound block: keys[i * stride]
+ * and vals[i * stride] are the string ids of the i-th tag, user_sid is -1
+ * if the object has no user.
+ */
+int osm_filter_pbf(OSM_Filter *f, int type, uint64_t id,
+                    const uint32_t *keys, const uint32_t *vals, size_t num, int stride,
+                    uint32_t uid, int64_t user_sid)
+{
+    static const uint32_t none = 0;
+    struct filter_obj o;
+    memset(&o, 0, sizeof(o));
+    o.type     = type;
+    o.id       = id;
+    o.uid      = uid;
+    o.keys     = keys != NULL ? keys : &none;
+    o.vals     = vals != NULL ? vals : &none;
+    o.num      = num;
+    o.stride   = stride;
+    o.user_sid = user_sid;
+    return filter_eval(f, &o);
+}
+
+/* END */
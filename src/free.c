@@ -41,6 +41,7 @@ void osm_free_way(OSM_Way *w) {
     if (*w->user)
         free(w->user);
     free(w->nodes);
+    free(w->locs);
     free(w);
 }
 
@@ -69,4 +70,31 @@ void osm_free_relation(OSM_Relation *r) {
     free(r);
 }
 
+/* free an OSM_Data and all objects in it */
+void osm_free_data(OSM_Data *d) {
+    int i;
+    if (d == NULL)
+        return;
+    if (d->nodes != NULL) {
+        for (i=0; i<d->nodes->num; i++)
+            osm_free_node(d->nodes->data[i]);
+        free(d->nodes->data);
+        free(d->nodes);
+    }
+    if (d->ways != NULL) {
+        for (i=0; i<d->ways->num; i++)
+            osm_free_way(d->ways->data[i]);
+        free(d->ways->data);
+        free(d->ways);
+    }
+    if (d->relations != NULL) {
+        for (i=0; i<d->relations->num; i++)
+            osm_free_relation(d->relations->data[i]);
+        free(d->relations->data);
+        free(d->relations);
+    }
+    osm_cset_free(d->changesets);
+    free(d);
+}
+
 /* END */
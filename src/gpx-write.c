@@ -1,95 +1,42 @@
 /*
  * gpx-write.c - write GPX file from OSM_Data
+ *
+ * The writer is fed with blocks by the parse callbacks, it keeps the ids,
+ * locations and GPX tags (name, ele, ...) of the nodes used by ways only,
+ * not the objects:
+ *
+ *   G = osm_gpx_writer_new(out, "me");
+ *   osm_scan(F, OSMDATA_WAY, osm_gpx_way_nodes, G);
+ *   osm_scan(F, OSMDATA_NODE, osm_gpx_write_block, G);
+ *   osm_scan(F, OSMDATA_WAY, osm_gpx_write_block, G);
+ *   osm_gpx_writer_close(G);
+ *
+ * which is what osm_gpx_write() does.
  *        
  * This file is licenced licenced under the General Public License 3. 
  *
  * Hanno Hecker <vetinari+osm at ankh-morp dot org>
  */
 
+#define _GNU_SOURCE /* open_memstream */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <math.h>
 
 #include "osm.h"
 
-static int in_node_list(uint64_t *list, int num, uint64_t id) {
-    if (num == 0)
-        return -1;
-    int32_t upper = num - 1,
-            lower = 0,
-            pos   = -1;
-    while (upper >= lower) {
-        pos = floor((upper+lower)/2);
-        if (list[pos] < id)
-            lower = pos + 1;
-        else if (list[pos] > id)
-            upper = pos - 1;
-        else 
-            return pos;
-    }
-    return -1;
-}
-
-static int find_node(OSM_Node_List *list, uint64_t id) {
-    int upper = list->num - 1,
-        lower = 0,
-        pos   = -1;
-    if (debug) 
-        fprintf(stderr, "%s:%d:%s(): upper=%d, id=%lu\n",
-                        __FILE__, __LINE__, __FUNCTION__, upper, id);
-    while (upper >= lower) {
-        pos = floor((upper+lower)/2);
-        if (list->data[pos]->id < id)
-            lower = pos + 1;
-        else if (list->data[pos]->id > id)
-            upper = pos - 1;
-        else 
-            return pos;
-    }
-    return -1;
-}
-
-static int gpx_sort_nodes(const void *a, const void *b) {
-    OSM_Node *n = *(OSM_Node * const *)a;
-    OSM_Node *m = *(OSM_Node * const *)b;
-    if      (n->id > m->id) return  1;
-    else if (n->id < m->id) return -1;
-    else                    return  0;
-}
-
-
-uint64_t *osm_gpx_write_init(OSM_Data *data, uint32_t *num) {
-    int i, k;
-    uint32_t num_nodes = 0;
-    uint64_t *way_nodes = malloc(sizeof(uint64_t) * data->nodes->num);
-    qsort(data->nodes->data, data->nodes->num, sizeof(OSM_Node *), gpx_sort_nodes);
-    if (debug) {
-        int x;
-        for (x=0; x<data->nodes->num; x++) {
-            fprintf(stderr, "%s:%d:%s(): node num=% 5d id=%lu\n", 
-                __FILE__, __LINE__, __FUNCTION__, x, data->nodes->data[x]->id);
-        }
-    }
-
-    for (i=0; i<data->ways->num; i++) {
-        if (debug) 
-            fprintf(stderr, "%s:%d:%s(): way num=% 5d id=%lu\n", 
-                __FILE__, __LINE__, __FUNCTION__, i, data->ways->data[i]->id);
-        OSM_Way *w = data->ways->data[i]; 
-        k = 0;
-        while (w->nodes[k]) {
-            if (in_node_list(way_nodes, num_nodes, w->nodes[k]) == -1) {
-                way_nodes[num_nodes] = w->nodes[k];
-                ++num_nodes;
-                qsort(way_nodes, num_nodes, sizeof(uint64_t), osm_cmp_member);
-            }
-            k++;
-        }
-    }
-    *num = num_nodes;
-    return way_nodes;
-}
+struct _osm_gpx_writer {
+    FILE *out;
+    OSM_Id_Set *used;           /* nodes of ways: track points, not <wpt> */
+    OSM_Loc_Index *locs;        /* their locations */
+    OSM_Id_Map *tags;           /* their GPX tags: offset + 1 into text */
+    FILE *text_out;
+    char *text;
+    size_t text_len;
+    int in_trk;
+};
 
 void osm_gpx_write_header(char *who, FILE *outfh) {
     fprintf(outfh, "<?xml version='1.0' encoding='UTF-8'?>\n");
@@ -152,55 +99,141 @@ void osm_gpx_write_node(OSM_Node *n, FILE *outfh, int is_trk) {
     }
 }
 
-void osm_gpx_write(OSM_Data *data, FILE *outfh, char *creator) {
-    uint32_t num_nodes = 0;
-    uint64_t *nodes = osm_gpx_write_init(data, &num_nodes);
-    int i, k;
-    if (debug)
-        fprintf(stderr, "%s:%d:%s(): num_nodes=%u\n", 
-                    __FILE__, __LINE__, __FUNCTION__, num_nodes);
-
+/* write the header, returns NULL if the sets could not be allocated */
+OSM_GPX_Writer *osm_gpx_writer_new(FILE *outfh, char *creator) {
+    OSM_GPX_Writer *G = calloc(1, sizeof(OSM_GPX_Writer));
+    if (G == NULL) {
+        fprintf(stderr, "failed to malloc GPX writer: %s\n", strerror(errno));
+        return (OSM_GPX_Writer *)NULL;
+    }
+    G->out  = outfh;
+    G->used = osm_idset_new();
+    G->locs = osm_loc_index_new();
+    G->tags = osm_idmap_new(0);
+    G->text_out = open_memstream(&G->text, &G->text_len);
+    if (G->used == NULL || G->locs == NULL || G->tags == NULL || G->text_out == NULL) {
+        if (G->text_out == NULL)
+            fprintf(stderr, "failed to open GPX tag buffer: %s\n", strerror(errno));
+        else
+            fclose(G->text_out);
+        free(G->text);
+        osm_idset_free(G->used);
+        osm_loc_index_free(G->locs);
+        osm_idmap_free(G->tags);
+        free(G);
+        return (OSM_GPX_Writer *)NULL;
+    }
     osm_gpx_write_header(creator, outfh);
-    for (i=0; i<data->nodes->num; i++) {
-        OSM_Node *n = data->nodes->data[i];
-        if (in_node_list(nodes, num_nodes, n->id) == -1) {
-            osm_gpx_write_node(n, outfh, 0);
-            if (debug)
-                fprintf(stderr, "%s:%d:%s(): nodes=%lu not used by way\n", 
-                        __FILE__, __LINE__, __FUNCTION__, n->id);
-        }
-        else {
-            if (debug)
-                fprintf(stderr, "%s:%d:%s(): nodes=%lu used by way\n", 
-                        __FILE__, __LINE__, __FUNCTION__, n->id);
+    return G;
+}
+
+/* the GPX tags of a track point, if it has any */
+static int gpx_keep_tags(OSM_GPX_Writer *G, OSM_Node *n) {
+    long off;
+    if (n->tags == NULL || n->tags->num == 0)
+        return 0;
+    off = ftell(G->text_out);
+    osm_gpx_write_tags(n->tags, G->text_out);
+    if (ftell(G->text_out) == off)
+        return 0;
+    fputc('\0', G->text_out);
+    return osm_idmap_put(G->tags, n->id, (void *)(uintptr_t)(off + 1));
+}
+
+static void gpx_write_trkpt(OSM_GPX_Writer *G, uint64_t id, OSM_Location *loc) {
+    uintptr_t off = (uintptr_t)osm_idmap_get(G->tags, id);
+    fprintf(G->out, "   <!-- node id=\"%lu\" -->\n", id);
+    fprintf(G->out, "   <trkpt lat=\"%.7f\" lon=\"%.7f\"", loc->lat, loc->lon);
+    if (off) {
+        fflush(G->text_out);
+        fprintf(G->out, ">\n%s   </trkpt>\n", G->text + off - 1);
+    }
+    else
+        fprintf(G->out, "/>\n");
+}
+
+/* block callback: remember the nodes of the ways in d, before any node is written */
+int osm_gpx_way_nodes(OSM_Data *d, void *ctx) {
+    OSM_GPX_Writer *G = ctx;
+    uint32_t i, k;
+    for (i=0; i<d->ways->num; i++) {
+        OSM_Way *w = d->ways->data[i];
+        for (k=0; w->nodes[k]; k++) {
+            if (osm_idset_add(G->used, w->nodes[k]) == -1)
+                return -1;
         }
     }
-    if (data->ways->num) {
-        fprintf(outfh, " <trk>\n");
-        for (i=0; i<data->ways->num; i++) {
-            OSM_Way *w = data->ways->data[i];
-            if (debug)
-                fprintf(stderr, "%s:%d:%s(): way=%lu\n",
-                        __FILE__, __LINE__, __FUNCTION__, w->id);
-
-            fprintf(outfh, "  <!-- way id=\"%lu\" -->\n", w->id);
-            fprintf(outfh, "  <trkseg>\n");
-            int pos;
-            k=0;
-            while (w->nodes[k]) {
-                pos = find_node(data->nodes, w->nodes[k]);
-                if (debug)
-                    fprintf(stderr, "%s:%d:%s(): way=%lu, ref=%lu, pos=%d\n",
-                            __FILE__, __LINE__, __FUNCTION__, w->id, w->nodes[k], pos);
-                if (pos >= 0)
-                    osm_gpx_write_node(data->nodes->data[pos], outfh, 1);
-                k++;
-            }
-            fprintf(outfh, "  </trkseg>\n");
+    return 0;
+}
+
+/*
+ * block callback: nodes used by any way are kept as track points of that
+ * way's <trkseg>, all others are written as <wpt>, so all nodes must come
+ * before the first way. Ways with locations (w->locs) need no nodes.
+ */
+int osm_gpx_write_block(OSM_Data *d, void *ctx) {
+    OSM_GPX_Writer *G = ctx;
+    uint32_t i, k;
+
+    for (i=0; i<d->nodes->num; i++) {
+        OSM_Node *n = d->nodes->data[i];
+        if (!osm_idset_has(G->used, n->id))
+            osm_gpx_write_node(n, G->out, 0);
+        else if (osm_loc_index_add(G->locs, n->id, n->lat, n->lon) != 0
+                 || gpx_keep_tags(G, n) != 0)
+            return -1;
+    }
+    for (i=0; i<d->ways->num; i++) {
+        OSM_Way *w = d->ways->data[i];
+        if (w->locs == NULL && osm_way_locations(G->locs, w) < 0)
+            return -1;
+        if (!G->in_trk) {
+            fprintf(G->out, " <trk>\n");
+            G->in_trk = 1;
+        }
+        fprintf(G->out, "  <!-- way id=\"%lu\" -->\n", w->id);
+        fprintf(G->out, "  <trkseg>\n");
+        for (k=0; w->nodes[k]; k++) {
+            if (w->locs != NULL && !isnan(w->locs[k].lat))
+                gpx_write_trkpt(G, w->nodes[k], &w->locs[k]);
+            else
+                osm_trace(OSM_TRACE_DETAIL, "way %lu: node %lu missing", w->id, w->nodes[k]);
         }
-        fprintf(outfh, " </trk>\n");
+        fprintf(G->out, "  </trkseg>\n");
     }
-    osm_gpx_write_footer(outfh);
+    return 0;
+}
+
+/* write the footer and free G */
+void osm_gpx_writer_close(OSM_GPX_Writer *G) {
+    if (G->in_trk)
+        fprintf(G->out, " </trk>\n");
+    osm_gpx_write_footer(G->out);
+    osm_trace(OSM_TRACE_PASS, "gpx: %lu track points", osm_loc_index_count(G->locs));
+    fclose(G->text_out);
+    free(G->text);
+    osm_idset_free(G->used);
+    osm_loc_index_free(G->locs);
+    osm_idmap_free(G->tags);
+    free(G);
+}
+
+/*
+ * write F as GPX with three passes: the nodes of the ways, the nodes and
+ * the ways. Returns 0 on success, -1 on error.
+ */
+int osm_gpx_write(OSM_File *F, FILE *outfh, char *creator) {
+    OSM_GPX_Writer *G = osm_gpx_writer_new(outfh, creator);
+    int ret = 0;
+
+    if (G == NULL)
+        return -1;
+    if (osm_scan(F, OSMDATA_WAY, osm_gpx_way_nodes, G) != 0
+        || osm_scan(F, OSMDATA_NODE, osm_gpx_write_block, G) != 0
+        || osm_scan(F, OSMDATA_WAY, osm_gpx_write_block, G) != 0)
+        ret = -1;
+    osm_gpx_writer_close(G);
+    return ret;
 }
 
 /* END */
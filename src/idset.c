@@ -0,0 +1,243 @@
+/*
+ * idset.c - sets of object ids (paged bitmap) and id -> pointer maps
+ *
+ * Ids from IDSET_MAX_ID up (and negative ones, e.g. new objects in JOSM
+ * files, which are huge as uint64_t) would need a page table of up to
+ * 2^48 pointers, they are kept in an id map instead.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "osm.h"
+
+#define IDSET_PAGE_BITS 16
+#define IDSET_PAGE_SIZE (1 << IDSET_PAGE_BITS)   /* ids per page */
+#define IDSET_MAX_ID (1ULL << 40)   /* page table of 128 MB at most */
+
+struct _osm_id_set {
+    uint64_t   num;         /* number of ids in the set */
+    uint64_t   num_pages;
+    uint64_t **pages;       /* NULL for pages without any id */
+    OSM_Id_Map *big;        /* ids >= IDSET_MAX_ID, NULL until needed */
+};
+
+struct _osm_id_map {
+    uint64_t  num;
+    uint64_t  size;         /* always a power of 2 */
+    uint64_t *keys;         /* 0 == empty slot */
+    void    **vals;
+};
+
+OSM_Id_Set *osm_idset_new() {
+    OSM_Id_Set *s = malloc(sizeof(OSM_Id_Set));
+    if (s == NULL) {
+        fprintf(stderr, "failed to malloc id set: %s\n", strerror(errno));
+        return (OSM_Id_Set *)NULL;
+    }
+    s->num       = 0;
+    s->num_pages = 0;
+    s->pages     = NULL;
+    s->big       = NULL;
+    return s;
+}
+
+/* returns 1 if id was added, 0 if it was already in the set, -1 on error */
+int osm_idset_add(OSM_Id_Set *s, uint64_t id) {
+    uint64_t page = id >> IDSET_PAGE_BITS;
+    uint64_t bit  = id & (IDSET_PAGE_SIZE - 1);
+    uint64_t *p;
+
+    if (id >= IDSET_MAX_ID) {
+        if (s->big == NULL) {
+            s->big = osm_idmap_new(0);
+            if (s->big == NULL)
+                return -1;
+        }
+        if (osm_idmap_get(s->big, id) != NULL)
+            return 0;
+        if (osm_idmap_put(s->big, id, s) != 0)
+            return -1;
+        s->num += 1;
+        return 1;
+    }
+    if (page >= s->num_pages) {
+        uint64_t num = s->num_pages ? s->num_pages : 64;
+        uint64_t **tmp;
+        while (num <= page)
+            num *= 2;
+        tmp = realloc(s->pages, sizeof(uint64_t *) * num);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to realloc id set: %s\n", strerror(errno));
+            return -1;
+        }
+        memset(tmp + s->num_pages, 0, sizeof(uint64_t *) * (num - s->num_pages));
+        s->pages     = tmp;
+        s->num_pages = num;
+    }
+    p = s->pages[page];
+    if (p == NULL) {
+        p = calloc(IDSET_PAGE_SIZE / 64, sizeof(uint64_t));
+        if (p == NULL) {
+            fprintf(stderr, "failed to malloc id set page: %s\n", strerror(errno));
+            return -1;
+        }
+        s->pages[page] = p;
+    }
+    if (p[bit >> 6] & (1ULL << (bit & 63)))
+        return 0;
+    p[bit >> 6] |= 1ULL << (bit & 63);
+    s->num += 1;
+    return 1;
+}
+
+int osm_idset_has(OSM_Id_Set *s, uint64_t id) {
+    uint64_t page = id >> IDSET_PAGE_BITS;
+    uint64_t bit  = id & (IDSET_PAGE_SIZE - 1);
+    if (id >= IDSET_MAX_ID)
+        return s->big != NULL && osm_idmap_get(s->big, id) != NULL;
+    if (page >= s->num_pages || s->pages[page] == NULL)
+        return 0;
+    return (s->pages[page][bit >> 6] >> (bit & 63)) & 1;
+}
+
+void osm_idset_del(OSM_Id_Set *s, uint64_t id) {
+    uint64_t page = id >> IDSET_PAGE_BITS;
+    uint64_t bit  = id & (IDSET_PAGE_SIZE - 1);
+    if (id >= IDSET_MAX_ID) {
+        /* the map has no delete, NULL marks a removed id */
+        if (s->big != NULL && osm_idmap_get(s->big, id) != NULL) {
+            osm_idmap_put(s->big, id, NULL);
+            s->num -= 1;
+        }
+        return;
+    }
+    if (page >= s->num_pages || s->pages[page] == NULL)
+        return;
+    if (s->pages[page][bit >> 6] & (1ULL << (bit & 63))) {
+        s->pages[page][bit >> 6] &= ~(1ULL << (bit & 63));
+        s->num -= 1;
+    }
+}
+
+uint64_t osm_idset_count(OSM_Id_Set *s) {
+    return s->num;
+}
+
+void osm_idset_free(OSM_Id_Set *s) {
+    uint64_t i;
+    if (s == NULL)
+        return;
+    for (i=0; i<s->num_pages; i++)
+        free(s->pages[i]);
+    free(s->pages);
+    osm_idmap_free(s->big);
+    free(s);
+}
+
+static inline uint64_t idmap_hash(uint64_t id) {
+    id ^= id >> 33;
+    id *= 0xFF51AFD7ED558CCDULL;
+    id ^= id >> 33;
+    id *= 0xC4CEB9FE1A85EC53ULL;
+    id ^= id >> 33;
+    return id;
+}
+
+OSM_Id_Map *osm_idmap_new(uint64_t expected) {
+    OSM_Id_Map *m = malloc(sizeof(OSM_Id_Map));
+    if (m == NULL) {
+        fprintf(stderr, "failed to malloc id map: %s\n", strerror(errno));
+        return (OSM_Id_Map *)NULL;
+    }
+    m->num  = 0;
+    m->size = 64;
+    while (m->size < expected * 2)
+        m->size *= 2;
+    m->keys = calloc(m->size, sizeof(uint64_t));
+    m->vals = malloc(sizeof(void *) * m->size);
+    if (m->keys == NULL || m->vals == NULL) {
+        fprintf(stderr, "failed to malloc id map: %s\n", strerror(errno));
+        free(m->keys);
+        free(m->vals);
+        free(m);
+        return (OSM_Id_Map *)NULL;
+    }
+    return m;
+}
+
+static int idmap_grow(OSM_Id_Map *m) {
+    uint64_t size = m->size * 2, mask = size - 1, i;
+    uint64_t *keys = calloc(size, sizeof(uint64_t));
+    void **vals = malloc(sizeof(void *) * size);
+    if (keys == NULL || vals == NULL) {
+        fprintf(stderr, "failed to grow id map: %s\n", strerror(errno));
+        free(keys);
+        free(vals);
+        return -1;
+    }
+    for (i=0; i<m->size; i++) {
+        uint64_t h;
+        if (m->keys[i] == 0)
+            continue;
+        h = idmap_hash(m->keys[i]) & mask;
+        while (keys[h] != 0)
+            h = (h + 1) & mask;
+        keys[h] = m->keys[i];
+        vals[h] = m->vals[i];
+    }
+    free(m->keys);
+    free(m->vals);
+    m->keys = keys;
+    m->vals = vals;
+    m->size = size;
+    return 0;
+}
+
+/* id must not be 0, an existing entry is replaced */
+int osm_idmap_put(OSM_Id_Map *m, uint64_t id, void *val) {
+    uint64_t mask, h;
+    if ((m->num + 1) * 2 > m->size && idmap_grow(m) != 0)
+        return -1;
+    mask = m->size - 1;
+    h = idmap_hash(id) & mask;
+    while (m->keys[h] != 0 && m->keys[h] != id)
+        h = (h + 1) & mask;
+    if (m->keys[h] == 0) {
+        m->keys[h] = id;
+        m->num += 1;
+    }
+    m->vals[h] = val;
+    return 0;
+}
+
+void *osm_idmap_get(OSM_Id_Map *m, uint64_t id) {
+    uint64_t mask = m->size - 1;
+    uint64_t h = idmap_hash(id) & mask;
+    while (m->keys[h] != 0) {
+        if (m->keys[h] == id)
+            return m->vals[h];
+        h = (h + 1) & mask;
+    }
+    return NULL;
+}
+
+uint64_t osm_idmap_count(OSM_Id_Map *m) {
+    return m->num;
+}
+
+void osm_idmap_free(OSM_Id_Map *m) {
+    if (m == NULL)
+        return;
+    free(m->keys);
+    free(m->vals);
+    free(m);
+}
+
+/* END */
@@ -0,0 +1,242 @@
+/*
+ * locations.c - node location index, locations on ways
+ *
+ * The index maps node ids to their locations, stored as sorted pairs of
+ * (id, lat and lon in 100 nano degrees packed in 64 bits), i.e. 16 bytes
+ * per node, looked up with a binary search. osm_loc_index_read() fills it
+ * with one pass over the nodes of a file (they are usually sorted by id
+ * already, then no sort is needed).
+ *
+ * osm_way_locations() copies the locations of the nodes of a way to
+ * w->locs, which the XML and PBF writers emit as <nd ref lon lat/> and
+ * the Way lat / lon fields of "LocationsOnWays" files. Readers of such
+ * files get w->locs filled and do not need the nodes at all.
+ *
+ *   I = osm_loc_index_read(F, 0);
+ *   osm_scan_locations(F, OSMDATA_WAY, I, block, ctx);
+ *   osm_loc_index_free(I);
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "osm.h"
+
+#define LOC_SCALE 10000000.0    /* 100 nano degrees */
+
+struct _osm_loc_index {
+    struct osm_sort_pair *data;
+    uint64_t num;
+    uint64_t size;
+    int      sorted;
+};
+
+static uint64_t loc_pack(double lat, double lon) {
+    uint32_t la = (uint32_t)(int32_t)llround(lat * LOC_SCALE);
+    uint32_t lo = (uint32_t)(int32_t)llround(lon * LOC_SCALE);
+    return ((uint64_t)la << 32) | lo;
+}
+
+static void loc_unpack(uint64_t v, OSM_Location *loc) {
+    loc->lat = (int32_t)(uint32_t)(v >> 32) / LOC_SCALE;
+    loc->lon = (int32_t)(uint32_t)(v & 0xffffffff) / LOC_SCALE;
+}
+
+OSM_Loc_Index *osm_loc_index_new() {
+    OSM_Loc_Index *I = calloc(1, sizeof(OSM_Loc_Index));
+    if (I == NULL) {
+        fprintf(stderr, "failed to malloc location index: %s\n", strerror(errno));
+        return (OSM_Loc_Index *)NULL;
+    }
+    I->sorted = 1;
+    return I;
+}
+
+int osm_loc_index_add(OSM_Loc_Index *I, uint64_t id, double lat, double lon) {
+    if (I->num == I->size) {
+        uint64_t size = I->size ? I->size * 2 : 65536;
+        struct osm_sort_pair *tmp = realloc(I->data, sizeof(struct osm_sort_pair) * size);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to realloc location index to %lu nodes: %s\n",
+                            size, strerror(errno));
+            return -1;
+        }
+        osm_stats_alloc(OSM_MEM_LOCATIONS, sizeof(struct osm_sort_pair) * (size - I->size));
+        I->data = tmp;
+        I->size = size;
+    }
+    if (I->num && I->data[I->num - 1].key >= id)
+        I->sorted = 0;
+    I->data[I->num].key = id;
+    I->data[I->num].val = loc_pack(lat, lon);
+    I->num += 1;
+    return 0;
+}
+
+/*
+ * sort the index, if needed, and drop duplicate ids (the one added last
+ * wins). Called by osm_loc_index_get() when something was added.
+ */
+void osm_loc_index_sort(OSM_Loc_Index *I, int threads) {
+    uint64_t i, k = 0;
+    if (I->sorted)
+        return;
+    osm_sort_pairs(I->data, I->num, threads);
+    for (i=0; i<I->num; i++) {
+        if (k && I->data[k-1].key == I->data[i].key)
+            --k;
+        I->data[k++] = I->data[i];
+    }
+    I->num = k;
+    I->sorted = 1;
+}
+
+static int loc_index_block(OSM_Data *d, void *ctx) {
+    OSM_Loc_Index *I = ctx;
+    uint32_t i;
+    for (i=0; i<d->nodes->num; i++) {
+        OSM_Node *n = d->nodes->data[i];
+        if (osm_loc_index_add(I, n->id, n->lat, n->lon) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* the locations of all nodes in F */
+OSM_Loc_Index *osm_loc_index_read(OSM_File *F, int threads) {
+    OSM_Loc_Index *I = osm_loc_index_new();
+    if (I == NULL)
+        return (OSM_Loc_Index *)NULL;
+    if (osm_scan(F, OSMDATA_NODE|OSMDATA_BARE, loc_index_block, I) != 0) {
+        osm_loc_index_free(I);
+        return (OSM_Loc_Index *)NULL;
+    }
+    osm_loc_index_sort(I, threads);
+    osm_trace(OSM_TRACE_PASS, "location index: %lu nodes", I->num);
+    return I;
+}
+
+/* 0 and the location in loc if id is known, -1 if not */
+int osm_loc_index_get(OSM_Loc_Index *I, uint64_t id, OSM_Location *loc) {
+    uint64_t lower = 0, upper = I->num;
+    if (!I->sorted)
+        osm_loc_index_sort(I, 0);
+    while (lower < upper) {
+        uint64_t pos = (lower + upper) / 2;
+        if (I->data[pos].key < id)
+            lower = pos + 1;
+        else if (I->data[pos].key > id)
+            upper = pos;
+        else {
+            loc_unpack(I->data[pos].val, loc);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+uint64_t osm_loc_index_count(OSM_Loc_Index *I) {
+    return I->num;
+}
+
+void osm_loc_index_free(OSM_Loc_Index *I) {
+    if (I == NULL)
+        return;
+    osm_stats_alloc(OSM_MEM_LOCATIONS, -(int64_t)(sizeof(struct osm_sort_pair) * I->size));
+    free(I->data);
+    free(I);
+}
+
+/*
+ * set w->locs from the index, returns the number of nodes not in the
+ * index (their locations are NAN) or -1 if malloc() failed
+ */
+int osm_way_locations(OSM_Loc_Index *I, OSM_Way *w) {
+    uint32_t num = 0, i;
+    int missing = 0;
+
+    while (w->nodes[num])
+        num += 1;
+    free(w->locs);
+    w->locs = NULL;
+    if (num == 0)
+        return 0;
+    w->locs = malloc(sizeof(OSM_Location) * num);
+    if (w->locs == NULL) {
+        fprintf(stderr, "failed to malloc %u way locations: %s\n", num, strerror(errno));
+        return -1;
+    }
+    for (i=0; i<num; i++) {
+        if (osm_loc_index_get(I, w->nodes[i], &w->locs[i]) != 0) {
+            w->locs[i].lat = w->locs[i].lon = NAN;
+            osm_trace(OSM_TRACE_DETAIL, "way %lu: node %lu not found", w->id, w->nodes[i]);
+            ++missing;
+        }
+    }
+    return missing;
+}
+
+/*
+ * add the locations to all ways in d, from I or, if I is NULL, from the
+ * nodes in d. Returns the number of missing nodes or -1.
+ */
+int osm_data_locations(OSM_Data *d, OSM_Loc_Index *I) {
+    OSM_Loc_Index *tmp = NULL;
+    uint32_t i;
+    int missing = 0, ret;
+
+    if (I == NULL) {
+        tmp = I = osm_loc_index_new();
+        if (I == NULL || loc_index_block(d, I) != 0) {
+            osm_loc_index_free(tmp);
+            return -1;
+        }
+        osm_loc_index_sort(I, 0);
+    }
+    for (i=0; i<d->ways->num; i++) {
+        ret = osm_way_locations(I, d->ways->data[i]);
+        if (ret < 0) {
+            missing = -1;
+            break;
+        }
+        missing += ret;
+    }
+    osm_loc_index_free(tmp);
+    return missing;
+}
+
+struct loc_scan {
+    OSM_Loc_Index *index;
+    int (*block)(OSM_Data *d, void *ctx);
+    void *ctx;
+};
+
+static int loc_scan_block(OSM_Data *d, void *ctx) {
+    struct loc_scan *s = ctx;
+    if (d->ways->num && osm_data_locations(d, s->index) < 0)
+        return -1;
+    return s->block(d, s->ctx);
+}
+
+/*
+ * osm_scan() with the locations from I added to the ways before block()
+ * sees them
+ */
+int osm_scan_locations(OSM_File *F, uint32_t types, OSM_Loc_Index *I,
+                int (*block)(OSM_Data *d, void *ctx), void *ctx)
+{
+    struct loc_scan s;
+    s.index = I;
+    s.block = block;
+    s.ctx   = ctx;
+    return osm_scan(F, types, loc_scan_block, &s);
+}
+
+/* END */
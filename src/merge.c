@@ -0,0 +1,392 @@
+/*
+ * merge.c - merge files sorted by type and id into one .osm.pbf
+ *
+ * Every input is scanned (osm_scan()) by its own thread, which hands
+ * the blocks to the merge through a queue of MERGE_QUEUE blocks, so a
+ * fast input waits for the others instead of filling the memory. The
+ * merge takes the objects from the front of the inputs with a min-heap
+ * on (type, id, input), nodes before ways before relations as in the
+ * inputs. Of the same object in several inputs (or several times in one)
+ * only the one with the highest version is written, with equal versions
+ * the one from the first input.
+ *
+ * The inputs must be sorted (osm_pbf_parse() and the XML parser need that
+ * anyway), the merge stops with an error at the first object out of
+ * order.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "osm.h"
+
+#define MERGE_QUEUE 2   /* blocks per input waiting for the merge */
+
+/* type in the top bits, so the order is nodes, ways, relations, by id */
+#define MERGE_KEY(type, id) (((uint64_t)(type) << 60) | (id))
+#define MERGE_ID(key)       ((key) & (((uint64_t)1 << 60) - 1))
+#define MERGE_MAX_ID        ((uint64_t)1 << 60)
+
+struct merge_object {
+    int type;           /* OSM_REL_MEMBER_TYPE_*, 0: none */
+    void *obj;
+    uint64_t key;
+    uint32_t version;
+};
+
+struct merge_input {
+    OSM_File *F;
+    int n;
+    struct osm_merge *M;
+    pthread_t thread;
+    /* filled by the scan thread */
+    OSM_Data *queue[MERGE_QUEUE];
+    uint32_t q_head, q_num;
+    int done;
+    int ret;
+    /* the merge side */
+    OSM_Data *cur;
+    uint32_t node, way, rel;
+    struct merge_object head;
+    uint64_t last;
+};
+
+struct osm_merge {
+    struct merge_input *in;
+    int num;
+    int stop;           /* the merge failed, scans end */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* the scan thread's block(): queue d, it is replaced by an empty one */
+static int merge_block(OSM_Data *d, void *ctx) {
+    struct merge_input *I = ctx;
+    struct osm_merge *M = I->M;
+    OSM_Data *own = osm_new_data(16), tmp;
+
+    if (own == NULL)
+        return -1;
+    tmp  = *own;
+    *own = *d;
+    *d   = tmp;
+
+    pthread_mutex_lock(&M->lock);
+    while (I->q_num == MERGE_QUEUE && !M->stop)
+        pthread_cond_wait(&M->cond, &M->lock);
+    if (M->stop) {
+        pthread_mutex_unlock(&M->lock);
+        osm_free_data(own);
+        return -1;
+    }
+    I->queue[ (I->q_head + I->q_num) % MERGE_QUEUE ] = own;
+    I->q_num++;
+    pthread_cond_broadcast(&M->cond);
+    pthread_mutex_unlock(&M->lock);
+    return 0;
+}
+
+static void *merge_scan(void *arg) {
+    struct merge_input *I = arg;
+    int ret = osm_scan(I->F, OSMDATA_NODE|OSMDATA_WAY|OSMDATA_REL, merge_block, I);
+
+    pthread_mutex_lock(&I->M->lock);
+    I->done = 1;
+    I->ret  = ret;
+    pthread_cond_broadcast(&I->M->cond);
+    pthread_mutex_unlock(&I->M->lock);
+    return NULL;
+}
+
+/* the next block of the input, NULL at the end or on errors */
+static OSM_Data *merge_next_block(struct merge_input *I) {
+    struct osm_merge *M = I->M;
+    OSM_Data *d = NULL;
+
+    pthread_mutex_lock(&M->lock);
+    while (I->q_num == 0 && !I->done)
+        pthread_cond_wait(&M->cond, &M->lock);
+    if (I->q_num) {
+        d = I->queue[I->q_head];
+        I->q_head = (I->q_head + 1) % MERGE_QUEUE;
+        I->q_num--;
+        pthread_cond_broadcast(&M->cond);
+    }
+    pthread_mutex_unlock(&M->lock);
+    return d;
+}
+
+/* the objects were taken out one by one, only the lists are left */
+static void merge_free_block(OSM_Data *d) {
+    d->nodes->num     = 0;
+    d->ways->num      = 0;
+    d->relations->num = 0;
+    osm_free_data(d);
+}
+
+static void merge_free_object(struct merge_object *o) {
+    if (o->type == OSM_REL_MEMBER_TYPE_NODE)
+        osm_free_node(o->obj);
+    else if (o->type == OSM_REL_MEMBER_TYPE_WAY)
+        osm_free_way(o->obj);
+    else if (o->type == OSM_REL_MEMBER_TYPE_RELATION)
+        osm_free_relation(o->obj);
+    o->type = 0;
+}
+
+static const char *merge_type_name[] = { "", "node", "way", "relation" };
+
+/*
+ * take the next object of the input into I->head, 0 if there is one, 1 at
+ * the end of the input, -1 if the id does not fit next to the type in the
+ * key (negative ones, e.g. from JOSM files, are huge as uint64_t)
+ */
+static int merge_advance(struct merge_input *I) {
+    struct merge_object *o = &I->head;
+    uint64_t id;
+
+    o->type = 0;
+    while (1) {
+        if (I->cur == NULL && (I->cur = merge_next_block(I)) == NULL)
+            return 1;
+        if (I->node < I->cur->nodes->num) {
+            OSM_Node *N = I->cur->nodes->data[ I->node++ ];
+            o->type    = OSM_REL_MEMBER_TYPE_NODE;
+            o->obj     = N;
+            o->version = N->version;
+            id         = N->id;
+            break;
+        }
+        if (I->way < I->cur->ways->num) {
+            OSM_Way *W = I->cur->ways->data[ I->way++ ];
+            o->type    = OSM_REL_MEMBER_TYPE_WAY;
+            o->obj     = W;
+            o->version = W->version;
+            id         = W->id;
+            break;
+        }
+        if (I->rel < I->cur->relations->num) {
+            OSM_Relation *R = I->cur->relations->data[ I->rel++ ];
+            o->type    = OSM_REL_MEMBER_TYPE_RELATION;
+            o->obj     = R;
+            o->version = R->version;
+            id         = R->id;
+            break;
+        }
+        merge_free_block(I->cur);
+        I->cur  = NULL;
+        I->node = I->way = I->rel = 0;
+    }
+    if (id >= MERGE_MAX_ID) {
+        fprintf(stderr, "input %d: %s %ld: id out of range for the merge (max %lu)\n",
+                        I->n + 1, merge_type_name[o->type], (int64_t)id, MERGE_MAX_ID - 1);
+        return -1;
+    }
+    o->key = MERGE_KEY(o->type, id);
+    return 0;
+}
+
+/* heap order: key, then input */
+static int merge_less(struct osm_merge *M, int a, int b) {
+    struct merge_input *A = &M->in[a], *B = &M->in[b];
+    if (A->head.key != B->head.key)
+        return A->head.key < B->head.key;
+    return a < b;
+}
+
+static void merge_sift_down(struct osm_merge *M, int *heap, int num, int i) {
+    while (1) {
+        int l = 2 * i + 1, r = l + 1, min = i, t;
+        if (l < num && merge_less(M, heap[l], heap[min]))
+            min = l;
+        if (r < num && merge_less(M, heap[r], heap[min]))
+            min = r;
+        if (min == i)
+            return;
+        t = heap[i];
+        heap[i] = heap[min];
+        heap[min] = t;
+        i = min;
+    }
+}
+
+static int merge_write(struct merge_object *o, OSM_PBF_Writer *W) {
+    osm_stats_add(OSM_STAT_KEPT(o->type), 1);
+    if (o->type == OSM_REL_MEMBER_TYPE_NODE)
+        return osm_pbf_write_node(o->obj, W);
+    else if (o->type == OSM_REL_MEMBER_TYPE_WAY)
+        return osm_pbf_write_way(o->obj, W);
+    return osm_pbf_write_relation(o->obj, W);
+}
+
+/*
+ * merge the num inputs (see above) into out as .osm.pbf, block_size and
+ * level as for osm_pbf_write_header(), who for the header. The output is
+ * marked as sorted. Returns 0 on success, -1 on errors
+ */
+int osm_merge(OSM_File **inputs, int num, FILE *out,
+                uint32_t block_size, int level, char *who)
+{
+    struct osm_merge M;
+    struct merge_object pending;
+    OSM_PBF_Writer *W;
+    uint64_t dupes = 0;
+    int *heap, heap_num = 0, started = 0, ret = 0, i, r;
+
+    if (num < 1) {
+        fprintf(stderr, "nothing to merge\n");
+        return -1;
+    }
+    memset(&M, 0, sizeof(M));
+    M.num  = num;
+    M.in   = calloc(num, sizeof(struct merge_input));
+    heap   = malloc(sizeof(int) * num);
+    if (M.in == NULL || heap == NULL) {
+        fprintf(stderr, "failed to malloc merge inputs: %s\n", strerror(errno));
+        free(M.in);
+        free(heap);
+        return -1;
+    }
+    W = osm_pbf_write_header_opt(who, out, NULL, block_size, level, OSM_PBF_SORTED);
+    if (W == NULL) {
+        free(M.in);
+        free(heap);
+        return -1;
+    }
+    pthread_mutex_init(&M.lock, NULL);
+    pthread_cond_init(&M.cond, NULL);
+
+    for (i=0; i<num; i++) {
+        int err;
+        M.in[i].F = inputs[i];
+        M.in[i].n = i;
+        M.in[i].M = &M;
+        err = pthread_create(&M.in[i].thread, NULL, merge_scan, &M.in[i]);
+        if (err != 0) {
+            fprintf(stderr, "failed to create thread %d: %s\n", i, strerror(err));
+            ret = -1;
+            goto done;
+        }
+        started++;
+    }
+
+    for (i=0; i<num; i++) {
+        r = merge_advance(&M.in[i]);
+        if (r < 0) {
+            ret = -1;
+            goto done;
+        }
+        if (r == 0) {
+            M.in[i].last = M.in[i].head.key;
+            heap[heap_num++] = i;
+        }
+    }
+    for (i=heap_num/2 - 1; i>=0; i--)
+        merge_sift_down(&M, heap, heap_num, i);
+
+    pending.type = 0;
+    while (heap_num) {
+        struct merge_input *I = &M.in[ heap[0] ];
+        struct merge_object o = I->head;
+
+        osm_stats_add(OSM_STAT_SEEN(o.type), 1);
+        r = merge_advance(I);
+        if (r < 0) {
+            merge_free_object(&o);
+            ret = -1;
+            break;
+        }
+        if (r > 0)
+            heap[0] = heap[--heap_num];
+        else if (I->head.key < I->last) {
+            fprintf(stderr, "input %d is not sorted: %s %lu after %s %lu\n",
+                        I->n + 1, merge_type_name[I->head.type],
+                        MERGE_ID(I->head.key), merge_type_name[I->last >> 60],
+                        MERGE_ID(I->last));
+            merge_free_object(&I->head);
+            merge_free_object(&o);
+            ret = -1;
+            break;
+        }
+        else
+            I->last = I->head.key;
+        merge_sift_down(&M, heap, heap_num, 0);
+
+        if (pending.type && pending.key == o.key) {
+            osm_trace(OSM_TRACE_OBJECT, "dupe %lu: version %u, have %u",
+                        o.key, o.version, pending.version);
+            dupes++;
+            if (o.version > pending.version) {
+                merge_free_object(&pending);
+                pending = o;
+            }
+            else
+                merge_free_object(&o);
+            continue;
+        }
+        if (pending.type) {
+            if (merge_write(&pending, W) != 0) {
+                merge_free_object(&pending);
+                merge_free_object(&o);
+                ret = -1;
+                break;
+            }
+            merge_free_object(&pending);
+        }
+        pending = o;
+    }
+    if (pending.type) {
+        if (ret == 0 && merge_write(&pending, W) != 0)
+            ret = -1;
+        merge_free_object(&pending);
+    }
+    osm_trace(OSM_TRACE_PASS, "merged %d inputs, %lu duplicates dropped", num, dupes);
+
+  done:
+    /* let the scans end, also after errors */
+    pthread_mutex_lock(&M.lock);
+    M.stop = 1;
+    pthread_cond_broadcast(&M.cond);
+    pthread_mutex_unlock(&M.lock);
+    for (i=0; i<started; i++) {
+        struct merge_input *I = &M.in[i];
+        pthread_join(I->thread, NULL);
+        if (I->ret != 0 && ret == 0) {
+            fprintf(stderr, "failed to read input %d\n", i + 1);
+            ret = -1;
+        }
+        if (I->head.type)
+            merge_free_object(&I->head);
+        if (I->cur != NULL) {
+            /* the objects before the cursor are gone already */
+            for (; I->node < I->cur->nodes->num; I->node++)
+                osm_free_node(I->cur->nodes->data[I->node]);
+            for (; I->way < I->cur->ways->num; I->way++)
+                osm_free_way(I->cur->ways->data[I->way]);
+            for (; I->rel < I->cur->relations->num; I->rel++)
+                osm_free_relation(I->cur->relations->data[I->rel]);
+            merge_free_block(I->cur);
+        }
+        while (I->q_num) {
+            osm_free_data(I->queue[I->q_head]);
+            I->q_head = (I->q_head + 1) % MERGE_QUEUE;
+            I->q_num--;
+        }
+    }
+    if (osm_pbf_write_footer(W) != 0)
+        ret = -1;
+    pthread_mutex_destroy(&M.lock);
+    pthread_cond_destroy(&M.cond);
+    free(M.in);
+    free(heap);
+    return ret;
+}
+
+/* END */
@@ -32,9 +32,7 @@ int osm_node_pos(OSM_Node_List *n, uint64_t id) {
             break;
         } 
     }
-    if (debug)
-        fprintf(stderr, "%s:%d:%s(): id=%lu is at pos %d\n",
-                        __FILE__, __LINE__, __FUNCTION__, id, ret);
+    osm_trace(OSM_TRACE_DETAIL, "id=%lu is at pos %d", id, ret);
     return ret;
 }
 
@@ -46,8 +44,26 @@ int osm_node_cmp(const void *a, const void *b) {
     else                    return  0;
 }
 
+/* sorts (id, node) pairs, so the nodes are not touched in every pass */
 void osm_node_list_sort(OSM_Node_List *n) {
-    qsort(n->data, n->num, sizeof(OSM_Node *), osm_node_cmp);
+    struct osm_sort_pair *p;
+    uint32_t i;
+
+    if (n->num < 2)
+        return;
+    p = malloc(sizeof(struct osm_sort_pair) * n->num);
+    if (p == NULL) {
+        qsort(n->data, n->num, sizeof(OSM_Node *), osm_node_cmp);
+        return;
+    }
+    for (i=0; i<n->num; i++) {
+        p[i].key = n->data[i]->id;
+        p[i].val = (uintptr_t)n->data[i];
+    }
+    osm_sort_pairs(p, n->num, 0);
+    for (i=0; i<n->num; i++)
+        n->data[i] = (OSM_Node *)(uintptr_t)p[i].val;
+    free(p);
 }
 
 /* END */
@@ -13,6 +13,8 @@
 
 #include "osm.h"
 
+int osm_open_warn = 1;     /* warn about .osm.pbf files in unknown order */
+
 static enum OSM_File_Type check_suffix(const char *filename) {
     size_t len;
     char *suffix;
@@ -87,9 +89,40 @@ OSM_File *osm_open(const char *filename, enum OSM_File_Type type) {
         return (OSM_File *)NULL;
     }
     
-    osm_file->type = type;
-    osm_file->file = file;
+    osm_file->type   = type;
+    osm_file->file   = file;
+    osm_file->reader = NULL;
+
+    /* the parsers need nodes, ways, relations in this order */
+    if (osm_open_warn && type == OSM_FTYPE_PBF && osm_pbf_sorted(osm_file) == 0)
+        fprintf(stderr, "warning: '%s' is not marked as sorted by type and id "
+                        "(Sort.Type_then_ID), see osm-sort\n", filename);
+
+    /* without it the file is read with stdio */
+    if (type == OSM_FTYPE_PBF && osm_readahead(osm_file, OSM_READ_WINDOW, 0) != 0
+        && debug)
+        fprintf(stderr, "reading '%s' without read-ahead\n", filename);
     return osm_file;
 }
 
+/* back to the start of the file for the next pass, -1 on errors */
+int osm_rewind(OSM_File *F) {
+    if (fseek(F->file, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "failed to rewind file: %s\n", strerror(errno));
+        return -1;
+    }
+    if (F->reader != NULL && osm_reader_seek(F->reader, 0) != 0) {
+        fprintf(stderr, "failed to rewind the read-ahead\n");
+        return -1;
+    }
+    return 0;
+}
+
+void osm_close(OSM_File *F) {
+    if (F->reader != NULL)
+        osm_reader_free(F->reader);
+    fclose(F->file);
+    free(F);
+}
+
 /* END */
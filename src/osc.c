@@ -0,0 +1,467 @@
+/*
+ * osc.c - OsmChange (.osc) diffs and applying them to a sorted file
+ *
+ * osm_diff_read() parses the <create>, <modify> and <delete> blocks of
+ * an .osc into one id sorted change list per object type. Reading more
+ * diffs into the same OSM_Diff squashes them: for every object the last
+ * change read wins, a create followed by modifies stays a create.
+ *
+ * osm_diff_apply() streams the base file (nodes, ways, relations, each
+ * sorted by id like planet dumps and extracts are) block by block with
+ * osm_scan() and merges it with the change lists: objects not in the
+ * diff are copied, changed objects replaced, deleted objects dropped and
+ * created ones inserted at their place. Only the diff and the current
+ * block are in memory. The result is written as .osm XML or, sorted like
+ * the base, as .osm.pbf.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "osm.h"
+
+enum {
+    diff_nodes,
+    diff_ways,
+    diff_relations,
+    diff_types
+};
+
+static struct osm_change_list *diff_list(OSM_Diff *d, int type) {
+    switch (type) {
+        case diff_nodes:
+            return &d->nodes;
+        case diff_ways:
+            return &d->ways;
+        default:
+            return &d->relations;
+    }
+}
+
+static void diff_free_obj(int type, void *obj) {
+    switch (type) {
+        case diff_nodes:
+            osm_free_node(obj);
+            break;
+        case diff_ways:
+            osm_free_way(obj);
+            break;
+        default:
+            osm_free_relation(obj);
+            break;
+    }
+}
+
+/* to the .osm.pbf writer W if there is one, else as XML to out */
+static int diff_write_obj(int type, void *obj, FILE *out, OSM_PBF_Writer *W) {
+    if (W != NULL) {
+        switch (type) {
+            case diff_nodes:
+                return osm_pbf_write_node(obj, W);
+            case diff_ways:
+                return osm_pbf_write_way(obj, W);
+            default:
+                return osm_pbf_write_relation(obj, W);
+        }
+    }
+    switch (type) {
+        case diff_nodes:
+            osm_xml_write_node(obj, out);
+            break;
+        case diff_ways:
+            osm_xml_write_way(obj, out);
+            break;
+        default:
+            osm_xml_write_relation(obj, out);
+            break;
+    }
+    return 0;
+}
+
+static int diff_add(struct osm_change_list *l, struct osm_change *c) {
+    if (l->num == l->size) {
+        uint32_t size = l->size ? l->size * 2 : 1024;
+        struct osm_change *tmp = realloc(l->data, sizeof(struct osm_change) * size);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to realloc change list: %s\n", strerror(errno));
+            return -1;
+        }
+        l->data = tmp;
+        l->size = size;
+    }
+    l->data[ l->num++ ] = *c;
+    return 0;
+}
+
+/* by id, changes of one object in the order they were read */
+static int diff_cmp(const void *a, const void *b) {
+    const struct osm_change *x = a, *y = b;
+    if (x->id != y->id)
+        return x->id < y->id ? -1 : 1;
+    if (x->seq != y->seq)
+        return x->seq < y->seq ? -1 : 1;
+    return 0;
+}
+
+/* sort and keep the last change of every object */
+static void diff_squash(struct osm_change_list *l, int type) {
+    uint32_t i, n = 0;
+    if (l->num == 0)
+        return;
+    qsort(l->data, l->num, sizeof(struct osm_change), diff_cmp);
+    for (i=0; i<l->num; i++) {
+        struct osm_change *c = &l->data[i];
+        if (n && l->data[n-1].id == c->id) {
+            struct osm_change *prev = &l->data[n-1];
+            if (prev->action == OSM_CHANGE_CREATE && c->action == OSM_CHANGE_MODIFY)
+                c->action = OSM_CHANGE_CREATE;
+            if (prev->obj != NULL)
+                diff_free_obj(type, prev->obj);
+            *prev = *c;
+            continue;
+        }
+        l->data[n++] = *c;
+    }
+    l->num = n;
+}
+
+/*
+ * <node id="..." .../> in a <delete> block, only the id matters. The lines
+ * read after the first one are added to *lineno
+ */
+static int diff_read_delete(FILE *fh, char *line, char *param, int type,
+                            uint64_t *id, int *lineno)
+{
+    char *str, *end, buffer[LINE_SIZE];
+    static char *close[diff_types] = { "</node>", "</way>", "</relation>" };
+
+    str = osm_xml_fetch_param(line, "id", param);
+    if (str == NULL || (*id = strtoull(str, NULL, 10)) == 0)
+        return -1;
+
+    end = line + strcspn(line, "\r\n");
+    while (end > line && (end[-1] == ' ' || end[-1] == '\t'))
+        --end;
+    if (end - line >= 2 && end[-2] == '/' && end[-1] == '>')
+        return 0;
+
+    while (fgets(buffer, LINE_SIZE, fh) != NULL) {
+        ++*lineno;
+        str = buffer;
+        trim_left(str);
+        if (strncmp(str, close[type], strlen(close[type])) == 0)
+            return 0;
+    }
+    return -1;
+}
+
+/*
+ * the lines an .osm parser read after the first one of its object, which
+ * started at pos. The position of fh is kept
+ */
+static int diff_count_lines(FILE *fh, long int pos) {
+    long int end = ftell(fh);
+    int lines = 0, c;
+
+    if (end < 0 || fseek(fh, pos, SEEK_SET) != 0)
+        return 0;
+    for (; pos < end && (c = getc(fh)) != EOF; pos++) {
+        if (c == '\n')
+            lines++;
+    }
+    return lines > 0 ? lines - 1 : 0;
+}
+
+OSM_Diff *osm_diff_new() {
+    OSM_Diff *d = calloc(1, sizeof(OSM_Diff));
+    if (d == NULL)
+        fprintf(stderr, "failed to malloc diff: %s\n", strerror(errno));
+    return d;
+}
+
+int osm_diff_read(OSM_Diff *d, const char *file) {
+    FILE *fh;
+    char *buffer, *param;
+    int lineno = 0, start, action = 0, type, ret = -1;
+    long int pos;
+
+    fh = fopen(file, "r");
+    if (fh == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    buffer = malloc(LINE_SIZE);
+    param  = malloc(LINE_SIZE);
+
+    while (1) {
+        struct osm_change c;
+        char *line;
+
+        pos = ftell(fh);
+        if (fgets(buffer, LINE_SIZE, fh) == NULL)
+            break;
+        start = ++lineno;
+        line = buffer;
+        trim_left(line);
+
+        if (strncmp(line, "<create", 7) == 0) {
+            action = OSM_CHANGE_CREATE;
+            continue;
+        }
+        else if (strncmp(line, "<modify", 7) == 0) {
+            action = OSM_CHANGE_MODIFY;
+            continue;
+        }
+        else if (strncmp(line, "<delete", 7) == 0) {
+            action = OSM_CHANGE_DELETE;
+            continue;
+        }
+        else if (strncmp(line, "</create>", 9) == 0
+              || strncmp(line, "</modify>", 9) == 0
+              || strncmp(line, "</delete>", 9) == 0) {
+            action = 0;
+            continue;
+        }
+        else if (strncmp(line, "<node ", 6) == 0)
+            type = diff_nodes;
+        else if (strncmp(line, "<way ", 5) == 0)
+            type = diff_ways;
+        else if (strncmp(line, "<relation ", 10) == 0)
+            type = diff_relations;
+        else
+            continue;
+
+        if (!action) {
+            fprintf(stderr, "%s:%d: object outside of create/modify/delete\n",
+                            file, lineno);
+            goto done;
+        }
+
+        memset(&c, 0, sizeof(c));
+        c.action = action;
+        c.seq    = d->seq++;
+        if (action == OSM_CHANGE_DELETE) {
+            if (diff_read_delete(fh, line, param, type, &c.id, &lineno) != 0) {
+                fprintf(stderr, "%s:%d: invalid deleted object\n", file, start);
+                goto done;
+            }
+        }
+        else {
+            /* let the .osm parsers read the object from its first line */
+            fseek(fh, pos, SEEK_SET);
+            switch (type) {
+                case diff_nodes: {
+                    OSM_Node *N = osm_xml_get_node(fh, buffer, param);
+                    if (N != NULL) {
+                        c.id  = N->id;
+                        c.obj = N;
+                    }
+                    break;
+                }
+                case diff_ways: {
+                    OSM_Way *W = osm_xml_get_way(fh, buffer, param);
+                    if (W != NULL) {
+                        c.id  = W->id;
+                        c.obj = W;
+                    }
+                    break;
+                }
+                default: {
+                    OSM_Relation *R = osm_xml_get_relation(fh, buffer, param);
+                    if (R != NULL) {
+                        c.id  = R->id;
+                        c.obj = R;
+                    }
+                    break;
+                }
+            }
+            if (c.obj == NULL) {
+                fprintf(stderr, "%s:%d: invalid object\n", file, start);
+                goto done;
+            }
+            lineno += diff_count_lines(fh, pos);
+        }
+        if (diff_add(diff_list(d, type), &c) != 0) {
+            diff_free_obj(type, c.obj);
+            goto done;
+        }
+    }
+    if (ferror(fh)) {
+        fprintf(stderr, "failed to read %s: %s\n", file, strerror(errno));
+        goto done;
+    }
+    ret = 0;
+
+  done:
+    for (type=0; type<diff_types; type++)
+        diff_squash(diff_list(d, type), type);
+    if (debug)
+        fprintf(stderr, "%s:%d:%s(): %s: %u nodes, %u ways, %u relations changed\n",
+                        __FILE__, __LINE__, __FUNCTION__, file,
+                        d->nodes.num, d->ways.num, d->relations.num);
+    free(buffer);
+    free(param);
+    fclose(fh);
+    return ret;
+}
+
+void osm_diff_free(OSM_Diff *d) {
+    int type;
+    uint32_t i;
+    if (d == NULL)
+        return;
+    for (type=0; type<diff_types; type++) {
+        struct osm_change_list *l = diff_list(d, type);
+        for (i=0; i<l->num; i++)
+            if (l->data[i].obj != NULL)
+                diff_free_obj(type, l->data[i].obj);
+        free(l->data);
+    }
+    free(d);
+}
+
+struct diff_merge {
+    OSM_Diff *d;
+    FILE     *out;
+    OSM_PBF_Writer *W;          /* NULL: XML to out */
+    uint32_t  pos[diff_types];  /* next change of each type */
+    uint64_t  last[diff_types]; /* last base id, to check the order */
+    int       type;             /* type of the last base object */
+    uint64_t  copied, replaced, deleted, created;
+};
+
+/* write the created / modified objects of type before id */
+static int diff_flush(struct diff_merge *m, int type, uint64_t id) {
+    struct osm_change_list *l = diff_list(m->d, type);
+    while (m->pos[type] < l->num && l->data[ m->pos[type] ].id < id) {
+        struct osm_change *c = &l->data[ m->pos[type]++ ];
+        if (c->action == OSM_CHANGE_DELETE)
+            continue;
+        if (diff_write_obj(type, c->obj, m->out, m->W) != 0)
+            return -1;
+        m->created += 1;
+    }
+    return 0;
+}
+
+/* returns 1 if the base object is replaced or deleted by the diff, -1 on errors */
+static int diff_merge_obj(struct diff_merge *m, int type, uint64_t id) {
+    struct osm_change_list *l = diff_list(m->d, type);
+    struct osm_change *c;
+
+    if (type < m->type || (type == m->type && id <= m->last[type])) {
+        fprintf(stderr, "base file is not sorted at %s %lu\n",
+                        type == diff_nodes ? "node" : type == diff_ways ? "way" : "relation",
+                        id);
+        return -1;
+    }
+    /* everything of the previous types goes before this object */
+    for (; m->type < type; m->type++) {
+        if (diff_flush(m, m->type, UINT64_MAX) != 0)
+            return -1;
+    }
+    m->last[type] = id;
+
+    if (diff_flush(m, type, id) != 0)
+        return -1;
+    if (m->pos[type] == l->num || l->data[ m->pos[type] ].id != id) {
+        m->copied += 1;
+        return 0;
+    }
+    c = &l->data[ m->pos[type]++ ];
+    if (c->action == OSM_CHANGE_DELETE)
+        m->deleted += 1;
+    else {
+        if (diff_write_obj(type, c->obj, m->out, m->W) != 0)
+            return -1;
+        m->replaced += 1;
+    }
+    return 1;
+}
+
+static int diff_block(OSM_Data *d, void *ctx) {
+    struct diff_merge *m = ctx;
+    uint32_t i;
+    int r;
+
+    for (i=0; i<d->nodes->num; i++) {
+        r = diff_merge_obj(m, diff_nodes, d->nodes->data[i]->id);
+        if (r == 0)
+            r = diff_write_obj(diff_nodes, d->nodes->data[i], m->out, m->W);
+        if (r < 0)
+            return 1;
+    }
+    for (i=0; i<d->ways->num; i++) {
+        r = diff_merge_obj(m, diff_ways, d->ways->data[i]->id);
+        if (r == 0)
+            r = diff_write_obj(diff_ways, d->ways->data[i], m->out, m->W);
+        if (r < 0)
+            return 1;
+    }
+    for (i=0; i<d->relations->num; i++) {
+        r = diff_merge_obj(m, diff_relations, d->relations->data[i]->id);
+        if (r == 0)
+            r = diff_write_obj(diff_relations, d->relations->data[i], m->out, m->W);
+        if (r < 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * apply d to F, write the result to out as OSM_FTYPE_XML or OSM_FTYPE_PBF
+ * (out_type), block_size and level as for osm_pbf_write_header(). Returns
+ * 0 on success, -1 on errors
+ */
+int osm_diff_apply(OSM_File *F, OSM_Diff *d, FILE *out, int out_type,
+                    uint32_t block_size, int level, char *creator)
+{
+    struct diff_merge m;
+    int type, ret = 0;
+
+    memset(&m, 0, sizeof(m));
+    m.d   = d;
+    m.out = out;
+
+    if (out_type == OSM_FTYPE_PBF) {
+        /* the base is checked to be sorted, so is the result */
+        m.W = osm_pbf_write_header_opt(creator, out, NULL, block_size, level,
+                                        OSM_PBF_SORTED);
+        if (m.W == NULL)
+            return -1;
+    }
+    else
+        osm_xml_write_header(creator, out);
+    if (osm_scan(F, OSMDATA_NODE|OSMDATA_WAY|OSMDATA_REL, diff_block, &m) != 0)
+        ret = -1;
+    for (type=diff_nodes; ret == 0 && type<diff_types; type++) {
+        if (diff_flush(&m, type, UINT64_MAX) != 0)
+            ret = -1;
+    }
+    if (m.W != NULL) {
+        if (osm_pbf_write_footer(m.W) != 0)
+            ret = -1;
+    }
+    else
+        osm_xml_write_footer(out);
+    if (ret != 0)
+        return -1;
+
+    if (debug)
+        fprintf(stderr, "%s:%d:%s(): %lu copied, %lu replaced, %lu deleted, %lu created\n",
+                        __FILE__, __LINE__, __FUNCTION__,
+                        m.copied, m.replaced, m.deleted, m.created);
+    if (fflush(out) != 0) {
+        fprintf(stderr, "failed to write output: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* END */
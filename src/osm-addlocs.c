@@ -0,0 +1,212 @@
+/*
+ * osm-addlocs.c - add node locations to the ways of a file
+ *               - example and test for libosm
+ *
+ * Usage: osm-addlocs [-d] [--stats] [-n] [-j THREADS] [-b BLOCK] [-z LEVEL]
+ *                    [-P|-X] [-o FILE] FILE
+ *   -n - keep all nodes, default: only nodes with tags
+ *   -j THREADS - threads for sorting the location index, default: all CPUs
+ *   -b BLOCK - objects per .osm.pbf block, default: 8000
+ *   -z LEVEL - zlib level, default: 6
+ *   -P - write .osm.pbf (default)
+ *   -X - write .osm XML, default: by the suffix of -o FILE
+ *   -o FILE - write to FILE instead of stdout
+ *   -d  - debug
+ *   --stats - print counters, times and peak memory to stderr on exit
+ *
+ * The first pass reads the locations of all nodes into an index, the
+ * second one writes the ways with the locations of their nodes (the
+ * "LocationsOnWays" lat / lon fields in .osm.pbf, lon and lat of the <nd/>
+ * elements in XML) and the relations. Ways of such files can be turned
+ * into geometries without the nodes, so untagged nodes are dropped unless
+ * -n is given.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+
+#include "osm.h"
+
+#define OSMAL_VERSION "0.1"
+
+int debug = 0;
+int all_nodes = 0;
+int threads = 0;
+uint32_t block_size = 8000;
+int level = 6;
+int file_type = OSM_FTYPE_UNKNOWN;
+char *output = NULL;
+char *file;
+
+OSM_PBF_Writer *W = NULL;
+FILE *out;
+uint64_t missing = 0;
+
+int ftype_by_suffix(char *filename) {
+    char *suffix;
+    int len = strlen(filename);
+    if (len < 5)
+        return OSM_FTYPE_UNKNOWN;
+    suffix = filename + len - 4;
+    if (strcmp(suffix, ".osm") == 0)
+        return OSM_FTYPE_XML;
+    else if (strcmp(suffix, ".pbf") == 0)
+        return OSM_FTYPE_PBF;
+    else
+        return OSM_FTYPE_UNKNOWN;
+}
+
+void parse_args(int argc, char **argv) {
+    char c;
+    opterr = 0;
+    while ((c = getopt(argc, argv, "b:dj:no:PXz:")) != -1) {
+        switch (c) {
+            case 'b':
+                block_size = atoi(optarg);
+                break;
+            case 'd':
+                debug = 1;
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'n':
+                all_nodes = 1;
+                break;
+            case 'o':
+                output = strdup(optarg);
+                break;
+            case 'P':
+                file_type = OSM_FTYPE_PBF;
+                break;
+            case 'X':
+                file_type = OSM_FTYPE_XML;
+                break;
+            case 'z':
+                level = atoi(optarg);
+                if (level < 0 || level > 9) {
+                    fprintf(stderr, "invalid zlib level: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            default:
+                fprintf(stderr, "unknown option %c\n", c);
+                exit(1);
+        }
+    }
+    if (argc == optind) {
+        fprintf(stderr, "missing file\n");
+        exit(1);
+    }
+    file = argv[optind];
+}
+
+int write_block(OSM_Data *d, void *ctx) {
+    uint32_t i, k;
+    int ret = 0;
+
+    for (i=0; i<d->nodes->num && ret == 0; i++) {
+        OSM_Node *n = d->nodes->data[i];
+        if (!all_nodes && (n->tags == NULL || n->tags->num == 0))
+            continue;
+        if (W != NULL)
+            ret = osm_pbf_write_node(n, W);
+        else
+            osm_xml_write_node(n, out);
+    }
+    for (i=0; i<d->ways->num && ret == 0; i++) {
+        OSM_Way *w = d->ways->data[i];
+        for (k=0; w->locs != NULL && w->nodes[k]; k++) {
+            if (isnan(w->locs[k].lat))
+                ++missing;
+        }
+        if (W != NULL)
+            ret = osm_pbf_write_way(w, W);
+        else
+            osm_xml_write_way(w, out);
+    }
+    for (i=0; i<d->relations->num && ret == 0; i++) {
+        if (W != NULL)
+            ret = osm_pbf_write_relation(d->relations->data[i], W);
+        else
+            osm_xml_write_relation(d->relations->data[i], out);
+    }
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    OSM_Loc_Index *I;
+    OSM_File *F;
+    int ret = 0;
+
+    osm_stats_args(&argc, argv);
+    parse_args(argc, argv);
+    osm_init();
+
+    F = osm_open(file, ftype_by_suffix(file));
+    if (F == NULL)
+        return 1;
+    I = osm_loc_index_read(F, threads);
+    if (I == NULL)
+        return 1;
+    if (debug)
+        fprintf(stderr, "%s:%d:%s(): %lu node locations\n",
+                        __FILE__, __LINE__, __FUNCTION__, osm_loc_index_count(I));
+
+    if (file_type == OSM_FTYPE_UNKNOWN)
+        file_type = output != NULL ? ftype_by_suffix(output) : OSM_FTYPE_PBF;
+    if (file_type == OSM_FTYPE_UNKNOWN)
+        file_type = OSM_FTYPE_PBF;
+
+    out = stdout;
+    if (output != NULL) {
+        out = fopen(output, "w");
+        if (out == NULL) {
+            fprintf(stderr, "failed to open %s: %s\n", output, strerror(errno));
+            return 1;
+        }
+    }
+    if (file_type == OSM_FTYPE_PBF) {
+        /* the order of the input is kept */
+        uint32_t flags = OSM_PBF_LOCATIONS_ON_WAYS;
+        int sorted = F->type == OSM_FTYPE_PBF ? osm_pbf_sorted(F) : 0;
+        if (sorted == 1)
+            flags |= OSM_PBF_SORTED;
+        else if (sorted == 2)
+            flags |= OSM_PBF_HILBERT;
+        W = osm_pbf_write_header_opt("osm-addlocs v" OSMAL_VERSION, out, NULL,
+                                    block_size, level, flags);
+        if (W == NULL)
+            return 1;
+    }
+    else
+        osm_xml_write_header("osm-addlocs v" OSMAL_VERSION, out);
+
+    if (osm_scan_locations(F, OSMDATA_NODE|OSMDATA_WAY|OSMDATA_REL, I, write_block, NULL) != 0)
+        ret = 1;
+    osm_close(F);
+    osm_loc_index_free(I);
+
+    if (W != NULL) {
+        if (osm_pbf_write_footer(W) != 0)
+            ret = 1;
+    }
+    else
+        osm_xml_write_footer(out);
+    if (out != stdout && fclose(out) != 0) {
+        fprintf(stderr, "failed to write %s: %s\n", output, strerror(errno));
+        ret = 1;
+    }
+    if (missing)
+        fprintf(stderr, "%lu way nodes without location\n", missing);
+    return ret;
+}
+
+/* END */
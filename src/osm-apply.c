@@ -0,0 +1,140 @@
+/*
+ * osm-apply.c - apply .osc diffs to a sorted .osm/.osm.pbf file
+ *             - example and test for libosm
+ *
+ * Usage: osm-apply [-d] [--stats] [-P|-X] [-b BLOCK] [-z LEVEL] [-o OUT]
+ *                  BASE CHANGE.osc [CHANGE.osc ...]
+ *   -d  - debug
+ *   --stats - print counters, times and peak memory to stderr on exit
+ *   -o FILE - write to FILE instead of stdout
+ *   -b BLOCK - objects per .osm.pbf block, default: 8000
+ *   -z LEVEL - zlib level, default: 6
+ *   -P - base file is pbf format
+ *   -X - base file is xml format
+ *
+ * Several diffs are squashed in the order given before the base file is
+ * read once. The result is written as .osm.pbf if the -o FILE ends in
+ * .pbf, else as .osm XML.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "osm.h"
+
+#define OSMA_VERSION "0.1"
+
+int debug = 0;
+char *file;
+char *output = NULL;
+int file_type = OSM_FTYPE_UNKNOWN;
+uint32_t block_size = 8000;
+int level = 6;
+
+int ftype_by_suffix(char *filename) {
+    char *suffix;
+    int len = strlen(filename);
+    if (len < 5)
+        return OSM_FTYPE_UNKNOWN;
+    suffix = filename + len - 4;
+    if (strcmp(suffix, ".osm") == 0)
+        return OSM_FTYPE_XML;
+    else if (strcmp(suffix, ".pbf") == 0)
+        return OSM_FTYPE_PBF;
+    else
+        return OSM_FTYPE_UNKNOWN;
+}
+
+void parse_args(int argc, char **argv) {
+    char c;
+    opterr = 0;
+    while ((c = getopt(argc, argv, "b:do:z:PX")) != -1) {
+        switch (c) {
+            case 'd':
+                debug = 1;
+                break;
+            case 'o':
+                output = strdup(optarg);
+                break;
+            case 'b':
+                block_size = atoi(optarg);
+                break;
+            case 'z':
+                level = atoi(optarg);
+                if (level < 0 || level > 9) {
+                    fprintf(stderr, "invalid zlib level: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'P':
+                file_type = OSM_FTYPE_PBF;
+                break;
+            case 'X':
+                file_type = OSM_FTYPE_XML;
+                break;
+            default:
+                fprintf(stderr, "unknown option %c\n", c);
+                exit(1);
+        }
+    }
+    if (argc - optind < 2) {
+        fprintf(stderr, "Usage: osm-apply [-d] [--stats] [-P|-X] [-b BLOCK] [-z LEVEL] [-o OUT] BASE CHANGE.osc [CHANGE.osc ...]\n");
+        exit(1);
+    }
+    file = argv[optind];
+}
+
+int main(int argc, char **argv) {
+    int i, ret, out_type = OSM_FTYPE_XML;
+    OSM_File *F;
+    OSM_Diff *D;
+    FILE *out = stdout;
+
+    osm_stats_args(&argc, argv);
+    parse_args(argc, argv);
+
+    if (file_type == OSM_FTYPE_UNKNOWN)
+        file_type = ftype_by_suffix(file);
+
+    osm_init();
+
+    D = osm_diff_new();
+    if (D == NULL)
+        return 1;
+    for (i=optind+1; i<argc; i++) {
+        if (osm_diff_read(D, argv[i]) != 0)
+            return 1;
+    }
+
+    F = osm_open(file, file_type);
+    if (F == NULL)
+        return 1;
+
+    if (output != NULL) {
+        if (ftype_by_suffix(output) == OSM_FTYPE_PBF)
+            out_type = OSM_FTYPE_PBF;
+        out = fopen(output, "w");
+        if (out == NULL) {
+            fprintf(stderr, "failed to open %s: %s\n", output, strerror(errno));
+            return 1;
+        }
+    }
+
+    ret = osm_diff_apply(F, D, out, out_type, block_size, level,
+                            "osm-apply v" OSMA_VERSION);
+    osm_close(F);
+    osm_diff_free(D);
+    if (out != stdout && fclose(out) != 0) {
+        fprintf(stderr, "failed to write %s: %s\n", output, strerror(errno));
+        ret = -1;
+    }
+    return ret == 0 ? 0 : 1;
+}
+
+/* END */
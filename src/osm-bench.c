@@ -0,0 +1,691 @@
+/*
+ * osm-bench.c - benchmark the stages of reading and writing OSM data
+ *             - example and test for libosm
+ *
+ * Usage: osm-bench [-d] [--stats] [-r RUNS] [-e EXPR] [-t DIR] [-E DIR] [-s NUM]
+ *                  [-A WINDOW] FILE.osm.pbf
+ *   -A WINDOW - read stage with read-ahead, WINDOW chunks of 1 MB in flight,
+ *          default: 8, 0 reads synchronously with stdio
+ *   -r RUNS - repeat every measurement RUNS times, default: 3
+ *   -e EXPR - filter expression for the filter stage, default: highway
+ *   -t DIR  - directory for the temporary XML and GPX files, default: /tmp
+ *   -E DIR  - also run osmpbf2osm and osm-extract from DIR end to end
+ *   -s NUM  - also sort NUM random ids with qsort() and osm_sort_ids()
+ *   -d  - debug
+ *   --stats - print counters, times and peak memory to stderr on exit
+ *
+ * Every stage is measured on its own, on the data the stage before left
+ * in memory:
+ *   read      - block headers and blobs read from FILE
+ *   inflate   - Blob messages unpacked and zlib inflated
+ *   unpack    - PrimitiveBlock messages unpacked
+ *   convert   - PrimitiveBlocks converted to OSM_Data
+ *   filter    - EXPR evaluated for all objects
+ *   xml-write - all objects written as .osm XML
+ *   xml-parse - that XML file scanned
+ *   gpx-write - all nodes written as GPX waypoints
+ *   area-index - location index of all nodes and lists of all ways and
+ *               relations
+ *   areas     - areas of the closed ways and multipolygon relations on
+ *               all CPUs, run this on a country extract
+ * and with -s NUM (each run copies the unsorted ids first):
+ *   sort-qsort - qsort() with osm_cmp_member()
+ *   sort-radix - osm_sort_ids() on all CPUs
+ *
+ * Output is one tab separated line per stage / tool, lines starting with
+ * '#' are comments:
+ *   stage runs best_s mean_s bytes objects MB/s objects/s allocs alloc_MB maxrss_MB
+ * The rates are from the best run, allocs (calls to malloc(), calloc() and
+ * realloc()) and alloc_MB (bytes requested) from the last run of a stage.
+ * maxrss_MB is only known for the tools, "-" otherwise.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "osm.h"
+
+#define OSMB_VERSION "0.1"
+
+int debug = 0;
+char *file;
+char *expr = "highway";
+char *tmp_dir = "/tmp";
+char *tool_dir = NULL;
+int runs = 3;
+size_t sort_num = 0;
+int window = -1;
+
+/*
+ * count the allocations of the library (and everything else in this
+ * process) by replacing the malloc() family, see "Replacing malloc" in
+ * the glibc manual. The stages run on several threads, so the counters
+ * are atomic.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t num, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+uint64_t num_allocs = 0;
+uint64_t alloc_bytes = 0;
+
+void *malloc(size_t size) {
+    __atomic_fetch_add(&num_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&alloc_bytes, size, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t num, size_t size) {
+    __atomic_fetch_add(&num_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&alloc_bytes, num * size, __ATOMIC_RELAXED);
+    return __libc_calloc(num, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    __atomic_fetch_add(&num_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&alloc_bytes, size, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+/* what the stages leave for the next one */
+struct bench_block {
+    unsigned char *raw;             /* read */
+    uint32_t len;
+    Blob *blob;                     /* inflate */
+    unsigned char *uncompressed;
+    PrimitiveBlock *P;              /* unpack */
+    OSM_Data *data;                 /* convert */
+};
+
+struct bench {
+    struct bench_block *blocks;
+    uint32_t num;
+    uint32_t size;
+    char xml[1024];
+    char gpx[1024];
+    OSM_Filter *filter;
+    OSM_Loc_Index *locs;            /* area-index */
+    OSM_Way_List ways;
+    OSM_Relation_List rels;
+    uint64_t *ids;                  /* -s */
+    uint64_t *sorted;
+    double min_lat, min_lon, max_lat, max_lon;
+};
+
+struct bench_result {
+    double   best;
+    double   total;
+    uint64_t bytes;
+    uint64_t objects;
+    uint64_t allocs;
+    uint64_t alloc_bytes;
+    long     maxrss;    /* kB, -1: unknown */
+};
+
+void parse_args(int argc, char **argv) {
+    char c;
+    opterr = 0;
+    while ((c = getopt(argc, argv, "A:de:E:r:s:t:")) != -1) {
+        switch (c) {
+            case 'A':
+                window = atoi(optarg);
+                if (window < 0) {
+                    fprintf(stderr, "invalid window: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'd':
+                debug = 1;
+                break;
+            case 'e':
+                expr = strdup(optarg);
+                break;
+            case 'E':
+                tool_dir = strdup(optarg);
+                break;
+            case 'r':
+                runs = atoi(optarg);
+                if (runs < 1) {
+                    fprintf(stderr, "invalid number of runs: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 's':
+                sort_num = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                tmp_dir = strdup(optarg);
+                break;
+            default:
+                fprintf(stderr, "unknown option %c\n", c);
+                exit(1);
+        }
+    }
+    if (argc == optind) {
+        fprintf(stderr, "Usage: osm-bench [-d] [--stats] [-r RUNS] [-e EXPR] [-t DIR] [-E DIR] [-s NUM] [-A WINDOW] FILE.osm.pbf\n");
+        exit(1);
+    }
+    file = argv[optind];
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint64_t file_size(const char *name) {
+    struct stat st;
+    if (stat(name, &st) != 0)
+        return 0;
+    return st.st_size;
+}
+
+/* free what the stage (and the ones after it) left */
+void free_read(struct bench *b) {
+    uint32_t i;
+    for (i=0; i<b->num; i++) {
+        free(b->blocks[i].raw);
+        osm_stats_alloc(OSM_MEM_BLOB, -(int64_t)b->blocks[i].len);
+    }
+    b->num = 0;
+}
+
+void free_inflate(struct bench *b) {
+    uint32_t i;
+    for (i=0; i<b->num; i++) {
+        if (b->blocks[i].blob != NULL)
+            osm_pbf_free_blob(b->blocks[i].blob, b->blocks[i].uncompressed);
+        b->blocks[i].blob = NULL;
+    }
+}
+
+void free_unpack(struct bench *b) {
+    uint32_t i;
+    for (i=0; i<b->num; i++) {
+        if (b->blocks[i].P != NULL)
+            osm_pbf_free_primitive(b->blocks[i].P);
+        b->blocks[i].P = NULL;
+    }
+}
+
+void free_convert(struct bench *b) {
+    uint32_t i;
+    for (i=0; i<b->num; i++) {
+        if (b->blocks[i].data != NULL)
+            osm_free_data(b->blocks[i].data);
+        b->blocks[i].data = NULL;
+    }
+}
+
+void free_area_index(struct bench *b) {
+    osm_loc_index_free(b->locs);
+    b->locs = NULL;
+    free(b->ways.data);
+    free(b->rels.data);
+    memset(&b->ways, 0, sizeof(b->ways));
+    memset(&b->rels, 0, sizeof(b->rels));
+}
+
+/* the stages, return 0 on success, add to r->bytes and r->objects */
+int stage_read(struct bench *b, struct bench_result *r) {
+    OSM_File *F = osm_open(file, OSM_FTYPE_PBF);
+    if (F == NULL)
+        return -1;
+    free_read(b);
+    if (window >= 0
+        && osm_readahead(F, window, window ? 0 : OSM_READ_OFF) != 0) {
+        osm_close(F);
+        return -1;
+    }
+    while (1) {
+        struct bench_block *k;
+        struct osm_pbf_raw raw;
+        int ret = osm_pbf_read_raw(F, &raw);
+        if (ret == 0)
+            break;
+        if (ret < 0) {
+            osm_close(F);
+            return -1;
+        }
+        if (b->num == b->size) {
+            b->size   = b->size ? b->size * 2 : 1024;
+            b->blocks = realloc(b->blocks, sizeof(struct bench_block) * b->size);
+        }
+        k = &b->blocks[b->num++];
+        memset(k, 0, sizeof(*k));
+        k->len = raw.len;
+        k->raw = raw.data;
+    }
+    osm_close(F);
+    r->bytes += file_size(file);
+    r->objects += b->num;
+    return 0;
+}
+
+int stage_inflate(struct bench *b, struct bench_result *r) {
+    uint32_t i;
+    free_inflate(b);
+    for (i=0; i<b->num; i++) {
+        struct bench_block *k = &b->blocks[i];
+        k->blob = blob__unpack(NULL, k->len, k->raw);
+        if (k->blob == NULL) {
+            fprintf(stderr, "Error unpacking Blob message\n");
+            return -1;
+        }
+        if (k->blob->has_raw)
+            k->uncompressed = k->blob->raw.data;
+        else
+            k->uncompressed = osm_pbf_uncompress_blob(k->blob);
+        if (k->uncompressed == NULL) {
+            fprintf(stderr, "failed to uncompress Blob\n");
+            return -1;
+        }
+        r->bytes += k->blob->raw_size;
+    }
+    r->objects += b->num;
+    return 0;
+}
+
+int stage_unpack(struct bench *b, struct bench_result *r) {
+    uint32_t i;
+    free_unpack(b);
+    for (i=0; i<b->num; i++) {
+        struct bench_block *k = &b->blocks[i];
+        k->P = osm_pbf_unpack_data(k->blob, k->uncompressed);
+        if (k->P == NULL)
+            return -1;
+        r->bytes += k->blob->raw_size;
+    }
+    r->objects += b->num;
+    return 0;
+}
+
+int stage_convert(struct bench *b, struct bench_result *r) {
+    uint32_t i;
+    free_convert(b);
+    for (i=0; i<b->num; i++) {
+        struct bench_block *k = &b->blocks[i];
+        k->data = osm_new_data(1024);
+        if (k->data == NULL)
+            return -1;
+        osm_pbf_convert(k->P, OSMDATA_NODE|OSMDATA_WAY|OSMDATA_REL, k->data);
+        r->bytes += k->blob->raw_size;
+        r->objects += k->data->nodes->num + k->data->ways->num + k->data->relations->num;
+    }
+    return 0;
+}
+
+int stage_filter(struct bench *b, struct bench_result *r) {
+    uint32_t i, j;
+    uint64_t match = 0;
+    for (i=0; i<b->num; i++) {
+        OSM_Data *d = b->blocks[i].data;
+        for (j=0; j<d->nodes->num; j++)
+            match += osm_filter_node(b->filter, d->nodes->data[j]);
+        for (j=0; j<d->ways->num; j++)
+            match += osm_filter_way(b->filter, d->ways->data[j]);
+        for (j=0; j<d->relations->num; j++)
+            match += osm_filter_relation(b->filter, d->relations->data[j]);
+        r->objects += d->nodes->num + d->ways->num + d->relations->num;
+    }
+    if (debug)
+        fprintf(stderr, "%s:%d:%s(): %lu objects match '%s'\n",
+                        __FILE__, __LINE__, __FUNCTION__, match, expr);
+    return 0;
+}
+
+int stage_xml_write(struct bench *b, struct bench_result *r) {
+    uint32_t i, j;
+    FILE *out = fopen(b->xml, "w");
+    if (out == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", b->xml, strerror(errno));
+        return -1;
+    }
+    osm_xml_write_header("osm-bench v" OSMB_VERSION, out);
+    for (i=0; i<b->num; i++) {
+        OSM_Data *d = b->blocks[i].data;
+        for (j=0; j<d->nodes->num; j++)
+            osm_xml_write_node(d->nodes->data[j], out);
+        for (j=0; j<d->ways->num; j++)
+            osm_xml_write_way(d->ways->data[j], out);
+        for (j=0; j<d->relations->num; j++)
+            osm_xml_write_relation(d->relations->data[j], out);
+        r->objects += d->nodes->num + d->ways->num + d->relations->num;
+    }
+    osm_xml_write_footer(out);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "failed to write %s: %s\n", b->xml, strerror(errno));
+        return -1;
+    }
+    r->bytes += file_size(b->xml);
+    return 0;
+}
+
+int count_block(OSM_Data *d, void *ctx) {
+    uint64_t *num = ctx;
+    *num += d->nodes->num + d->ways->num + d->relations->num;
+    return 0;
+}
+
+int stage_xml_parse(struct bench *b, struct bench_result *r) {
+    OSM_File *F = osm_open(b->xml, OSM_FTYPE_XML);
+    int ret;
+    if (F == NULL)
+        return -1;
+    ret = osm_xml_scan(F, OSMDATA_NODE|OSMDATA_WAY|OSMDATA_REL, count_block, &r->objects);
+    osm_close(F);
+    r->bytes += file_size(b->xml);
+    return ret;
+}
+
+int stage_gpx_write(struct bench *b, struct bench_result *r) {
+    uint32_t i, j;
+    FILE *out = fopen(b->gpx, "w");
+    if (out == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", b->gpx, strerror(errno));
+        return -1;
+    }
+    osm_gpx_write_header("osm-bench v" OSMB_VERSION, out);
+    for (i=0; i<b->num; i++) {
+        OSM_Data *d = b->blocks[i].data;
+        for (j=0; j<d->nodes->num; j++)
+            osm_gpx_write_node(d->nodes->data[j], out, 0);
+        r->objects += d->nodes->num;
+    }
+    osm_gpx_write_footer(out);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "failed to write %s: %s\n", b->gpx, strerror(errno));
+        return -1;
+    }
+    r->bytes += file_size(b->gpx);
+    return 0;
+}
+
+int stage_area_index(struct bench *b, struct bench_result *r) {
+    uint32_t i, j;
+    free_area_index(b);
+    b->locs = osm_loc_index_new();
+    if (b->locs == NULL)
+        return -1;
+    for (i=0; i<b->num; i++) {
+        OSM_Data *d = b->blocks[i].data;
+        b->ways.size += d->ways->num;
+        b->rels.size += d->relations->num;
+    }
+    b->ways.data = malloc(sizeof(OSM_Way *) * (b->ways.size + 1));
+    b->rels.data = malloc(sizeof(OSM_Relation *) * (b->rels.size + 1));
+    if (b->ways.data == NULL || b->rels.data == NULL) {
+        fprintf(stderr, "failed to malloc way and relation lists: %s\n", strerror(errno));
+        return -1;
+    }
+    for (i=0; i<b->num; i++) {
+        OSM_Data *d = b->blocks[i].data;
+        for (j=0; j<d->nodes->num; j++) {
+            OSM_Node *n = d->nodes->data[j];
+            if (osm_loc_index_add(b->locs, n->id, n->lat, n->lon) != 0)
+                return -1;
+        }
+        for (j=0; j<d->ways->num; j++)
+            b->ways.data[ b->ways.num++ ] = d->ways->data[j];
+        for (j=0; j<d->relations->num; j++)
+            b->rels.data[ b->rels.num++ ] = d->relations->data[j];
+        r->objects += d->nodes->num + d->ways->num + d->relations->num;
+    }
+    osm_loc_index_sort(b->locs, 0);
+    return 0;
+}
+
+int stage_areas(struct bench *b, struct bench_result *r) {
+    struct osm_areas *A = osm_areas_build(&b->ways, &b->rels, b->locs, 0);
+    uint32_t i;
+    if (A == NULL)
+        return -1;
+    for (i=0; i<A->num; i++)
+        r->bytes += sizeof(double) * 2 * A->data[i].ring[ A->data[i].num_rings ];
+    r->objects = A->num;
+    if (debug)
+        fprintf(stderr, "%s:%d:%s(): %u areas, %u failed\n",
+                        __FILE__, __LINE__, __FUNCTION__, A->num, A->failed);
+    osm_free_areas(A);
+    return 0;
+}
+
+/* ids up to 2^34, like the node ids of the planet */
+int sort_init(struct bench *b) {
+    uint64_t x = 1;
+    size_t i;
+    b->ids    = malloc(sizeof(uint64_t) * sort_num);
+    b->sorted = malloc(sizeof(uint64_t) * sort_num);
+    if (b->ids == NULL || b->sorted == NULL) {
+        fprintf(stderr, "failed to malloc %lu ids: %s\n", sort_num, strerror(errno));
+        return -1;
+    }
+    for (i=0; i<sort_num; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        b->ids[i] = x & ((1ULL << 34) - 1);
+    }
+    return 0;
+}
+
+int sort_check(struct bench *b) {
+    size_t i;
+    for (i=1; i<sort_num; i++) {
+        if (b->sorted[i-1] > b->sorted[i]) {
+            fprintf(stderr, "ids not sorted at %lu\n", i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int stage_sort_qsort(struct bench *b, struct bench_result *r) {
+    memcpy(b->sorted, b->ids, sizeof(uint64_t) * sort_num);
+    qsort(b->sorted, sort_num, sizeof(uint64_t), osm_cmp_member);
+    r->bytes   = sizeof(uint64_t) * sort_num;
+    r->objects = sort_num;
+    return sort_check(b);
+}
+
+int stage_sort_radix(struct bench *b, struct bench_result *r) {
+    memcpy(b->sorted, b->ids, sizeof(uint64_t) * sort_num);
+    osm_sort_ids(b->sorted, sort_num, 0);
+    r->bytes   = sizeof(uint64_t) * sort_num;
+    r->objects = sort_num;
+    return sort_check(b);
+}
+
+void print_result(const char *stage, struct bench_result *r) {
+    double best = r->best > 0 ? r->best : 1e-9;
+    printf("%s\t%d\t%.6f\t%.6f\t%lu\t%lu\t%.2f\t%.0f\t", stage, runs,
+            r->best, r->total / runs, r->bytes, r->objects,
+            r->bytes / best / 1e6, r->objects / best);
+    if (r->maxrss < 0)
+        printf("%lu\t%.2f\t-\n", r->allocs, r->alloc_bytes / 1e6);
+    else
+        printf("-\t-\t%.2f\n", r->maxrss / 1024.0);
+    fflush(stdout);
+}
+
+/* run a stage RUNS times, the counts of the last run are kept */
+int run_stage(const char *stage, struct bench *b,
+                int (*fn)(struct bench *b, struct bench_result *r))
+{
+    struct bench_result r;
+    int i;
+    memset(&r, 0, sizeof(r));
+    r.maxrss = -1;
+    for (i=0; i<runs; i++) {
+        double start, t;
+        uint64_t allocs = __atomic_load_n(&num_allocs, __ATOMIC_RELAXED);
+        uint64_t bytes  = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED);
+        r.bytes   = 0;
+        r.objects = 0;
+        start = now();
+        if (fn(b, &r) != 0) {
+            fprintf(stderr, "stage %s failed\n", stage);
+            return -1;
+        }
+        t = now() - start;
+        r.allocs      = __atomic_load_n(&num_allocs, __ATOMIC_RELAXED) - allocs;
+        r.alloc_bytes = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED) - bytes;
+        r.total += t;
+        if (i == 0 || t < r.best)
+            r.best = t;
+    }
+    print_result(stage, &r);
+    return 0;
+}
+
+/* run DIR/argv[0] with stdout to /dev/null, RUNS times */
+int run_tool(const char *name, char **argv) {
+    struct bench_result r;
+    char path[1024];
+    int i;
+    memset(&r, 0, sizeof(r));
+    snprintf(path, sizeof(path), "%s/%s", tool_dir, argv[0]);
+    for (i=0; i<runs; i++) {
+        struct rusage ru;
+        double start = now(), t;
+        int status;
+        pid_t pid = fork();
+        if (pid == -1) {
+            fprintf(stderr, "failed to fork: %s\n", strerror(errno));
+            return -1;
+        }
+        if (pid == 0) {
+            int fd = open("/dev/null", O_WRONLY);
+            if (fd != -1)
+                dup2(fd, 1);
+            execv(path, argv);
+            fprintf(stderr, "failed to run %s: %s\n", path, strerror(errno));
+            _exit(127);
+        }
+        if (wait4(pid, &status, 0, &ru) == -1) {
+            fprintf(stderr, "failed to wait for %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        t = now() - start;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "%s failed\n", path);
+            return -1;
+        }
+        r.total += t;
+        if (i == 0 || t < r.best)
+            r.best = t;
+        if (ru.ru_maxrss > r.maxrss)
+            r.maxrss = ru.ru_maxrss;
+    }
+    r.bytes = file_size(file);
+    print_result(name, &r);
+    return 0;
+}
+
+void find_bbox(struct bench *b) {
+    uint32_t i, j;
+    b->min_lat = b->min_lon = 1000;
+    b->max_lat = b->max_lon = -1000;
+    for (i=0; i<b->num; i++) {
+        OSM_Node_List *n = b->blocks[i].data->nodes;
+        for (j=0; j<n->num; j++) {
+            if (n->data[j]->lat < b->min_lat) b->min_lat = n->data[j]->lat;
+            if (n->data[j]->lat > b->max_lat) b->max_lat = n->data[j]->lat;
+            if (n->data[j]->lon < b->min_lon) b->min_lon = n->data[j]->lon;
+            if (n->data[j]->lon > b->max_lon) b->max_lon = n->data[j]->lon;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    struct bench b;
+    time_t t = time(NULL);
+    int ret = 0;
+
+    osm_stats_args(&argc, argv);
+    parse_args(argc, argv);
+    osm_init();
+
+    memset(&b, 0, sizeof(b));
+    snprintf(b.xml, sizeof(b.xml), "%s/osm-bench.%d.osm", tmp_dir, (int)getpid());
+    snprintf(b.gpx, sizeof(b.gpx), "%s/osm-bench.%d.gpx", tmp_dir, (int)getpid());
+    b.filter = osm_filter_compile(expr);
+    if (b.filter == NULL)
+        return 1;
+
+    printf("# osm-bench v" OSMB_VERSION " (libosm v" LIBOSM_VERSION ")\n");
+    printf("# file %s, %lu bytes, %d runs, filter '%s', %s", file, file_size(file),
+            runs, expr, ctime(&t));
+    printf("# stage\truns\tbest_s\tmean_s\tbytes\tobjects\tMB/s\tobjects/s\t"
+           "allocs\talloc_MB\tmaxrss_MB\n");
+
+    if (run_stage("read", &b, stage_read) != 0
+        || run_stage("inflate", &b, stage_inflate) != 0
+        || run_stage("unpack", &b, stage_unpack) != 0
+        || run_stage("convert", &b, stage_convert) != 0
+        || run_stage("filter", &b, stage_filter) != 0
+        || run_stage("xml-write", &b, stage_xml_write) != 0
+        || run_stage("xml-parse", &b, stage_xml_parse) != 0
+        || run_stage("gpx-write", &b, stage_gpx_write) != 0
+        || run_stage("area-index", &b, stage_area_index) != 0
+        || run_stage("areas", &b, stage_areas) != 0)
+        ret = 1;
+
+    if (ret == 0 && sort_num) {
+        if (sort_init(&b) != 0
+            || run_stage("sort-qsort", &b, stage_sort_qsort) != 0
+            || run_stage("sort-radix", &b, stage_sort_radix) != 0)
+            ret = 1;
+    }
+
+    if (ret == 0 && tool_dir != NULL) {
+        char bbox[256];
+        char *pbf2osm[] = { "osmpbf2osm", file, NULL };
+        char *extract[] = { "osm-extract", "-b", bbox, file, NULL };
+
+        /* the middle quarter of the data */
+        find_bbox(&b);
+        snprintf(bbox, sizeof(bbox), "%.7f,%.7f,%.7f,%.7f",
+                b.min_lon + (b.max_lon - b.min_lon) / 4,
+                b.min_lat + (b.max_lat - b.min_lat) / 4,
+                b.max_lon - (b.max_lon - b.min_lon) / 4,
+                b.max_lat - (b.max_lat - b.min_lat) / 4);
+        if (run_tool("e2e:osmpbf2osm", pbf2osm) != 0
+            || run_tool("e2e:osm-extract", extract) != 0)
+            ret = 1;
+    }
+
+    unlink(b.xml);
+    unlink(b.gpx);
+    free_area_index(&b);
+    free_convert(&b);
+    free_unpack(&b);
+    free_inflate(&b);
+    free_read(&b);
+    free(b.blocks);
+    free(b.ids);
+    free(b.sorted);
+    osm_filter_free(b.filter);
+    return ret;
+}
+
+/* END */
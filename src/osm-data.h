@@ -16,11 +16,13 @@ typedef struct _osm_tag_list OSM_Tag_List;
 typedef struct _osm_node   OSM_Node;
 typedef struct _osm_node_list OSM_Node_List;
 typedef struct _osm_way    OSM_Way;
+typedef struct _osm_location OSM_Location;
 typedef struct _osm_way_list OSM_Way_List;
 typedef struct _osm_rel_member OSM_Rel_Member;
 typedef struct _osm_rel_member_list OSM_Rel_Member_List;
 typedef struct _osm_relation OSM_Relation;
 typedef struct _osm_rel_list OSM_Relation_List;
+typedef struct _osm_cset_list OSM_CSet_List;
 typedef struct _osm_data OSM_Data;
 typedef struct _osm_bbox OSM_BBox;
 
@@ -54,6 +56,12 @@ struct _osm_node {
     OSM_Tag_List *tags;
 };
 
+/* lon and lat are NAN if the node is unknown */
+struct _osm_location {
+    double lon;
+    double lat;
+};
+
 struct _osm_way {
     uint64_t     id;
     char        *user;
@@ -63,6 +71,7 @@ struct _osm_way {
     uint64_t     timestamp;
     uint64_t     *nodes;
     OSM_Tag_List *tags;
+    OSM_Location *locs;     /* NULL or one per node, see locations.c */
 };
 
 struct _osm_way_list {
@@ -116,11 +125,29 @@ struct _osm_rel_list {
     OSM_Relation **data;
 };
 
+/* changesets, one array per field, see changeset.c */
+#define OSM_CSET_OPEN 0x01
+#define OSM_CSET_BBOX 0x02
+
+struct _osm_cset_list {
+    uint32_t  size;
+    uint32_t  num;
+    uint64_t *id;
+    uint64_t *created_at;   /* epoch */
+    uint64_t *closed_at;    /* epoch, 0: unknown */
+    uint32_t *uid;
+    uint8_t  *flags;        /* OSM_CSET_* */
+    int32_t  *bbox;         /* left, bottom, right, top in 1e-7 degree */
+    uint32_t *by_uid;       /* positions by uid, created_at */
+    uint32_t *by_time;      /* positions by created_at */
+    int       indexed;      /* sorted by id, by_uid and by_time valid */
+};
+
 struct _osm_data {
     OSM_Node_List     *nodes;
     OSM_Way_List      *ways;
     OSM_Relation_List *relations;
-//    OSM_CSet_List     *changesets;
+    OSM_CSet_List     *changesets; /* only with OSMDATA_CSET, else NULL */
 };
 
 #endif /* _OSM_DATA_H */
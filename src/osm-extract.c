@@ -8,221 +8,227 @@
  */
 
 /* ToDo: usage():
-   "b:dr:w:n:u:t:v:PXG
+   "b:c:dj:p:r:w:n:u:t:v:e:APXG
    -b llon,botlat,rlon,toplat - use bounding box instead of full file
+   -p FILE.poly - use the (Osmosis) polygon instead of full file, may
+          be combined with -b
+   -c CONFIG - batch mode: write all extracts listed in CONFIG in one
+          set of passes, one line per output:
+            FILE [bbox llon,botlat,rlon,toplat] [poly FILE.poly] [filter EXPR]
+   -j NUM - threads for batch mode, default: all CPUs
    -d  - debug
-   -r ID - get relation ID
-   -w ID - get way ID
-   -n ID - get node ID
-   -u USER - fetch objects from user USER
-   -v TAG [-v VAL] - only objects with tag TAG (and value VAL)
+   --stats - print counters, times and peak memory to stderr on exit
+   -r ID - get relation ID (may be given several times)
+   -w ID - get way ID (may be given several times)
+   -n ID - get node ID (may be given several times)
+   -u USER - fetch objects from user USER (several -u are OR'ed)
+   -t TAG [-v VAL [-v VAL]] - only objects with tag TAG (and one of the
+          values VAL), several -t are OR'ed
+   -A - AND the -t options instead of OR'ing them
+   -e EXPR - filter expression, e.g. 'highway=primary|secondary & !access=private'
+          see filter.c for the syntax
    -P - file is pbf format
    -X - file is xml format
    -G - write GPX instead of .osm XML
+
+   The -t, -u and -e selections are AND'ed, objects given by id are
+   added to the result.
 */
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <unistd.h>
 
 #include "osm.h"
 
-#define OSMX_VERSION "0.2"
+#define OSMX_VERSION "0.3"
 
-uint64_t wanted_id = 0;
 int debug = 0;
-int type;
-char *user = NULL, *tag = NULL, *value = NULL;
 char *file;
-int use_rel = 0, use_way = 0, use_node = 0;
 int file_type = OSM_FTYPE_UNKNOWN;
 int write_gpx = 0;
+char *config = NULL;
+int threads = 0;
+int and_tags  = 0;
 OSM_BBox *bbox = NULL;
+OSM_Poly *poly = NULL;
 
-int rel_wanted(OSM_Relation *r) {
-    if (r->id == wanted_id)
-        return 1;
-    return 0;
-}
+/* the parts of the filter expression built from the options */
+char *ids[4] = { NULL, NULL, NULL, NULL }; /* by OSM_REL_MEMBER_TYPE_* */
+char **tags  = NULL; /* -t terms */
+int num_tags = 0;
+char *tag    = NULL; /* current -t term, -v adds to it */
+int tag_values = 0;
+char *users  = NULL;
+char *expr   = NULL;
 
-int way_wanted(OSM_Way *w) {
-    if (w->id == wanted_id)
-        return 1;
-    return 0;
-}
+/* append to a malloc()ed string, *str may be NULL */
+void append(char **str, const char *fmt, ...) {
+    va_list ap;
+    size_t len = *str ? strlen(*str) : 0;
+    int add;
 
-int node_wanted(OSM_Node *n) {
-    if (n->id == wanted_id)
-        return 1;
-    return 0;
-}
+    va_start(ap, fmt);
+    add = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
 
-int user_node(OSM_Node *n) {
-    if (!*n->user)
-        return 0;
-    if (strcmp(user, n->user) == 0) 
-        return 1;
-    return 0;
+    *str = realloc(*str, len + add + 1);
+    if (*str == NULL) {
+        fprintf(stderr, "failed to realloc filter expression\n");
+        exit(1);
+    }
+    va_start(ap, fmt);
+    vsnprintf(*str + len, add + 1, fmt, ap);
+    va_end(ap);
 }
 
-int user_way(OSM_Way *n) {
-    if (!*n->user)
-        return 0;
-    if (strcmp(user, n->user) == 0) 
-        return 1;
-    return 0;
-}
-int user_rel(OSM_Relation *n) {
-    if (!*n->user)
-        return 0;
-    if (strcmp(user, n->user) == 0) 
-        return 1;
-    return 0;
+/* quote a key or value for the filter expression */
+char *quote(const char *src) {
+    char *dst = malloc(strlen(src) * 2 + 3), *d = dst;
+    *d++ = '"';
+    for (; *src; src++) {
+        if (*src == '"' || *src == '\\')
+            *d++ = '\\';
+        *d++ = *src;
+    }
+    *d++ = '"';
+    *d   = '\0';
+    return dst;
 }
 
-int tag_node(OSM_Node *n) {
-    int i;
-    if (n->tags == NULL)
-        return 0;
-    if (tag == NULL)
-        return 1;
-    if (value != NULL) {
-        for (i=0; i<n->tags->num; i++) {
-            char *key = n->tags->data[i].key;
-            char *val = n->tags->data[i].val;
-            if (*key && *val)
-            {
-                if (strcmp(tag, key) == 0 && strcmp(value, val) == 0)
-                    return 1;
-            }
-        }
-    }
-    else {
-        for (i=0; i<n->tags->num; i++) {
-            if (*n->tags->data[i].key) {
-                char *key = n->tags->data[i].key;
-                if (strcmp(tag, key) == 0)
-                    return 1;
-            }
-        }
+void add_id(int type, char *id) {
+    char *end;
+    uint64_t num = strtoull(id, &end, 10);
+    if (*end || !*id) {
+        fprintf(stderr, "invalid id '%s'\n", id);
+        exit(1);
     }
-    return 0;
+    append(&ids[type], "%s%lu", ids[type] ? "|" : "", num);
 }
 
-int tag_way(OSM_Way *n) {
-    int i;
-    if (n->tags == NULL)
-        return 0;
+void finish_tag() {
     if (tag == NULL)
-        return 1;
-    if (value != NULL) {
-        for (i=0; i<n->tags->num; i++) {
-            char *key = n->tags->data[i].key;
-            char *val = n->tags->data[i].val;
-            if (*key && *val)
-            {
-                if (strcmp(tag, key) == 0 && strcmp(value, val) == 0)
-                    return 1;
-            }
-        }
-    }
-    else {
-        for (i=0; i<n->tags->num; i++) {
-            if (*n->tags->data[i].key) {
-                char *key = n->tags->data[i].key;
-                if (strcmp(tag, key) == 0)
-                    return 1;
-            }
-        }
+        return;
+    tags = realloc(tags, sizeof(char *) * (num_tags + 1));
+    if (tags == NULL) {
+        fprintf(stderr, "failed to realloc tag list\n");
+        exit(1);
     }
-    return 0;
+    tags[num_tags++] = tag;
+    tag = NULL;
+    tag_values = 0;
 }
 
-int tag_rel(OSM_Relation *n) {
-    int i;
-    if (n->tags == NULL)
-        return 0;
-    if (tag == NULL)
-        return 1;
-    if (value != NULL) {
-        for (i=0; i<n->tags->num; i++) {
-            char *key = n->tags->data[i].key;
-            char *val = n->tags->data[i].val;
-            if (*key && *val)
-            {
-                if (strcmp(tag, key) == 0 && strcmp(value, val) == 0)
-                    return 1;
-            }
-        }
+/* join the non-NULL parts with op, parenthesized if there is more than one */
+char *join(char **parts, int num, const char *op) {
+    char *res = NULL;
+    int i, used = 0;
+    for (i=0; i<num; i++)
+        used += parts[i] != NULL;
+    for (i=0; i<num; i++) {
+        if (parts[i] == NULL)
+            continue;
+        if (used > 1)
+            append(&res, "%s(%s)", res ? op : "", parts[i]);
+        else
+            append(&res, "%s", parts[i]);
     }
-    else {
-        for (i=0; i<n->tags->num; i++) {
-            if (*n->tags->data[i].key) {
-                char *key = n->tags->data[i].key;
-                if (strcmp(tag, key) == 0)
-                    return 1;
-            }
-        }
+    return res;
+}
+
+char *build_filter() {
+    static const char *type_name[4] = { NULL, "node", "way", "relation" };
+    char *sel[3], *any[4], *res;
+    int t;
+
+    finish_tag();
+    sel[0] = join(tags, num_tags, and_tags ? " & " : " | ");
+    sel[1] = NULL;
+    sel[2] = expr;
+    if (users)
+        append(&sel[1], "@user=%s", users);
+
+    for (t=OSM_REL_MEMBER_TYPE_NODE; t<=OSM_REL_MEMBER_TYPE_RELATION; t++) {
+        any[t-1] = NULL;
+        if (ids[t])
+            append(&any[t-1], "@type=%s & @id=%s", type_name[t], ids[t]);
     }
-    return 0;
+    any[3] = join(sel, 3, " & ");
+
+    res = join(any, 4, " | ");
+    for (t=0; t<4; t++)
+        free(any[t]);
+    free(sel[0]);
+    free(sel[1]);
+    return res;
 }
 
 void parse_args(int argc, char **argv) {
     char c;
     opterr = 0;
-    while ((c = getopt(argc, argv, "b:dr:w:n:u:t:v:PXG")) != -1) {
+    while ((c = getopt(argc, argv, "b:c:dj:p:r:w:n:u:t:v:e:APXG")) != -1) {
         switch (c) {
             case 'b':
-                bbox = malloc(sizeof(OSM_BBox));
-                char *str = optarg, *end;
-                double box[4];
-                int i;
-                for (i=0; i<3; i++) {
-                    end = strchr(str, ',');
-                    if (end == NULL) {
-                        fprintf(stderr, "not enough bbox params\n");
-                        exit(1);
-                    }
-                    *end = '\0';
-                    box[i] = atof(str);
-                    str = end + 1;
-                }
-                if (!*str) {
-                    fprintf(stderr, "not enough bbox params\n");
+                bbox = osm_bbox_parse(optarg);
+                if (bbox == NULL)
                     exit(1);
-                }
-                bbox->left_lon   = box[0];
-                bbox->bottom_lat = box[1];
-                bbox->right_lon  = box[2];
-                bbox->top_lat    = atof(str);
                 if (debug) {
                     fprintf(stderr, "BBOX: llon=%.7f blat=%.7f rlon=%.7f tlat=%.7f\n", bbox->left_lon, bbox->bottom_lat, bbox->right_lon,  bbox->top_lat);
                 }
                 break;
+            case 'p':
+                poly = osm_poly_read(optarg);
+                if (poly == NULL)
+                    exit(1);
+                break;
+            case 'c':
+                config = strdup(optarg);
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
 
             case 'd':
                 debug = 1;
                 break;
             case 'r':
-                wanted_id = atol(optarg);
-                use_rel   = 1;
+                add_id(OSM_REL_MEMBER_TYPE_RELATION, optarg);
                 break;
             case 'w':
-                wanted_id = atol(optarg);
-                use_way   = 1;
+                add_id(OSM_REL_MEMBER_TYPE_WAY, optarg);
                 break;
             case 'n':
-                wanted_id = atol(optarg);
-                use_node  = 1;
+                add_id(OSM_REL_MEMBER_TYPE_NODE, optarg);
+                break;
+            case 'u': {
+                char *q = quote(optarg);
+                append(&users, "%s%s", users ? "|" : "", q);
+                free(q);
+                break;
+            }
+            case 't': {
+                char *q = quote(optarg);
+                finish_tag();
+                append(&tag, "%s", q);
+                free(q);
                 break;
-            case 'u':
-                user = strdup(optarg);
+            }
+            case 'v': {
+                char *q = quote(optarg);
+                if (tag == NULL) {
+                    fprintf(stderr, "-v without -t\n");
+                    exit(1);
+                }
+                append(&tag, "%s%s", tag_values++ ? "|" : "=", q);
+                free(q);
                 break;
-            case 't':
-                tag  = strdup(optarg);
+            }
+            case 'e':
+                append(&expr, "%s(%s)", expr ? " & " : "", optarg);
                 break;
-            case 'v':
-                value = strdup(optarg);
+            case 'A':
+                and_tags = 1;
                 break;
             case 'P':
                 file_type = OSM_FTYPE_PBF;
@@ -263,44 +269,75 @@ int main(int argc, char **argv) {
     int i;
     OSM_File *F;
     OSM_Data *O;
+    OSM_Parse_Options opt;
+    char *filter;
 
+    osm_stats_args(&argc, argv);
     parse_args(argc, argv);
 
     if (file_type == OSM_FTYPE_UNKNOWN)
         file_type = ftype_by_suffix(file);
 
     osm_init();
+    osm_parse_options_init(&opt);
 
-    F = osm_open(file, file_type);
-    if (F == NULL)
-        return 1;
+    if (config != NULL) {
+        OSM_Extract *ex;
+        int num, ret;
+        ex = osm_extract_read_config(config, &num);
+        if (ex == NULL)
+            return 1;
+        F = osm_open(file, file_type);
+        if (F == NULL)
+            return 1;
+        ret = osm_extract(F, ex, num, threads, "osm-extract v" OSMX_VERSION);
+        osm_close(F);
+        osm_extract_free(ex, num);
+        return ret == 0 ? 0 : 1;
+    }
 
-    if (bbox != NULL) {
-        if (tag != NULL) 
-            O = osm_parse(F, OSMDATA_BBOX, bbox, tag_node, tag_way, tag_rel);
-        else if (user != NULL)
-            O = osm_parse(F, OSMDATA_BBOX, bbox, user_node, user_way, user_rel);
-        else
-            O = osm_parse(F, OSMDATA_BBOX, bbox, NULL, NULL, NULL);
+    filter = build_filter();
+    if (filter != NULL) {
+        if (debug)
+            fprintf(stderr, "filter: %s\n", filter);
+        opt.filter = osm_filter_compile(filter);
+        if (opt.filter == NULL)
+            return 1;
     }
-    else if (use_rel)
-        O = osm_parse(F, OSMDATA_REL, NULL, NULL, NULL, rel_wanted);
-    else if (use_way) 
-        O = osm_parse(F, OSMDATA_WAY, NULL, NULL, way_wanted, NULL);
-    else if (use_node) 
-        O = osm_parse(F, OSMDATA_NODE, NULL, node_wanted, NULL, NULL);
-    else if (user != NULL) 
-        O = osm_parse(F, OSMDATA_REL, NULL, user_node, user_way, user_rel);
-    else if (tag != NULL)
-        O = osm_parse(F, OSMDATA_REL, NULL, tag_node, tag_way, tag_rel);    
-    else {
+
+    if (bbox != NULL || poly != NULL) {
+        opt.mode = OSMDATA_BBOX;
+        opt.bbox = bbox;
+        opt.poly = poly;
+    }
+    else if (filter == NULL) {
         fprintf(stderr, "no selection specified\n");
         exit(1);
     }
+    else if (num_tags || users || expr || ids[OSM_REL_MEMBER_TYPE_RELATION])
+        opt.mode = OSMDATA_REL;
+    else if (ids[OSM_REL_MEMBER_TYPE_WAY])
+        opt.mode = OSMDATA_WAY;
+    else
+        opt.mode = OSMDATA_NODE;
+
+    F = osm_open(file, file_type);
+    if (F == NULL)
+        return 1;
+
+    O = osm_parse_opt(F, &opt);
     osm_close(F);
+    osm_filter_free(opt.filter);
+    free(filter);
+    if (O == NULL)
+        return 1;
 
-    if (write_gpx)
-        osm_gpx_write(O, stdout, "osm-extract v" OSMX_VERSION);
+    if (write_gpx) {
+        OSM_GPX_Writer *G = osm_gpx_writer_new(stdout, "osm-extract v" OSMX_VERSION);
+        if (G == NULL || osm_gpx_way_nodes(O, G) != 0 || osm_gpx_write_block(O, G) != 0)
+            return 1;
+        osm_gpx_writer_close(G);
+    }
     else {
         osm_xml_write_header("osm-extract v" OSMX_VERSION, stdout);
         for (i=0; i<O->nodes->num; i++)
@@ -0,0 +1,601 @@
+/*
+ * osm-gen.c - generate synthetic OSM data for tests and benchmarks
+ *           - example and test for libosm
+ *
+ * Usage: osm-gen [-d] [--stats] [-s SEED] [-n NODES] [-w WAYS] [-r RELATIONS]
+ *                [-l MIN,MAX] [-D DEPTH] [-g GAP] [-t TAGS] [-T PERCENT]
+ *                [-b BLOCK] [-c CODEC] [-z LEVEL] [-B BBOX] [-P|-X] [-o FILE]
+ *   -s SEED - random seed, default: 1
+ *   -n NODES, -w WAYS, -r RELATIONS - number of objects,
+ *          default: 100000, 10000, 500
+ *   -l MIN,MAX - nodes per way, default: 2,40
+ *   -D DEPTH - nesting depth of relations, default: 2. The relations are
+ *          split in DEPTH levels, the members of a level are relations
+ *          of the level below, those of the first level nodes and ways
+ *   -g GAP - mean gap between ids, default: 1 (ids 1, 2, 3, ...)
+ *   -t TAGS - maximum number of tags of ways and relations, default: 4
+ *   -T PERCENT - percentage of nodes with tags, default: 5
+ *   -b BLOCK - objects per .osm.pbf block, default: 8000
+ *   -c CODEC - .osm.pbf blob codec, zlib (default) or none
+ *   -z LEVEL - zlib level, default: 6
+ *   -B llon,botlat,rlon,toplat - area of the nodes, default: 8,50,8.5,50.5
+ *   -P - write .osm.pbf (default)
+ *   -X - write .osm XML, default: by the suffix of -o FILE
+ *   -o FILE - write to FILE instead of stdout
+ *   -d  - debug
+ *   --stats - print counters, times and peak memory to stderr on exit
+ *
+ * Nodes are laid out as random walks ("streets"), ways use runs of these
+ * nodes and continue where the last way ended, some are closed (areas).
+ * Keys and values are drawn from weighted tables similar to real data.
+ * Everything comes from a private generator seeded with SEED, so the same
+ * options give the same file byte for byte on every system.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+
+#include "osm.h"
+
+#define OSMG_VERSION "0.1"
+
+#define GEN_EPOCH  1262304000   /* 2010-01-01 */
+#define GEN_YEARS  10
+#define GEN_USERS  500
+#define GEN_STEP   0.0003       /* degree between the nodes of a walk */
+#define GEN_MAX_TAGS 16
+
+int debug = 0;
+uint64_t seed = 1;
+uint64_t num_nodes = 100000;
+uint64_t num_ways = 10000;
+uint64_t num_rels = 500;
+uint32_t min_len = 2, max_len = 40;
+int depth = 2;
+uint32_t gap = 1;
+uint32_t max_tags = 4;
+uint32_t tagged = 5;
+uint32_t block_size = 8000;
+int level = 6;
+int file_type = OSM_FTYPE_UNKNOWN;
+char *output = NULL;
+OSM_BBox area = { 8.0, 50.0, 8.5, 50.5 };
+
+/* splitmix64, the same sequence everywhere (unlike random()) */
+uint64_t rng_state;
+
+uint64_t rng() {
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+uint64_t rng_below(uint64_t n) {
+    return n ? rng() % n : 0;
+}
+
+double rng_double() {
+    return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* weighted tables, the weights are relative */
+struct gen_choice {
+    char    *key;
+    char    *val;
+    uint32_t weight;
+};
+
+struct gen_choice way_features[] = {
+    { "highway",  "residential",  30 },
+    { "highway",  "service",      20 },
+    { "highway",  "track",        10 },
+    { "highway",  "footway",      10 },
+    { "highway",  "unclassified",  6 },
+    { "highway",  "tertiary",      4 },
+    { "highway",  "secondary",     3 },
+    { "highway",  "primary",       2 },
+    { "building", "yes",          60 },
+    { "building", "house",        15 },
+    { "landuse",  "residential",   5 },
+    { "landuse",  "farmland",      4 },
+    { "natural",  "wood",          3 },
+    { "waterway", "stream",        3 },
+    { "barrier",  "fence",         4 },
+    { NULL, NULL, 0 }
+};
+
+struct gen_choice way_extras[] = {
+    { "name",     NULL,            8 },     /* NULL: generated */
+    { "surface",  "asphalt",       5 },
+    { "surface",  "unpaved",       2 },
+    { "oneway",   "yes",           3 },
+    { "maxspeed", "30",            2 },
+    { "maxspeed", "50",            3 },
+    { "lanes",    "2",             2 },
+    { "source",   "survey",        2 },
+    { "addr:housenumber", NULL,    6 },
+    { NULL, NULL, 0 }
+};
+
+struct gen_choice node_features[] = {
+    { "natural",  "tree",         30 },
+    { "highway",  "bus_stop",     10 },
+    { "highway",  "crossing",     15 },
+    { "amenity",  "bench",         8 },
+    { "amenity",  "restaurant",    5 },
+    { "shop",     "bakery",        3 },
+    { "barrier",  "gate",          6 },
+    { "entrance", "yes",          10 },
+    { NULL, NULL, 0 }
+};
+
+struct gen_choice rel_types[] = {
+    { "type", "multipolygon", 50 },
+    { "type", "route",        30 },
+    { "type", "restriction",  10 },
+    { "type", "site",         10 },
+    { NULL, NULL, 0 }
+};
+
+struct gen_choice super_types[] = {
+    { "type", "route_master", 40 },
+    { "type", "boundary",     30 },
+    { "type", "site",         20 },
+    { "type", "collection",   10 },
+    { NULL, NULL, 0 }
+};
+
+struct gen_choice *choose(struct gen_choice *c) {
+    uint32_t total = 0, i, r;
+    for (i=0; c[i].key != NULL; i++)
+        total += c[i].weight;
+    r = rng_below(total);
+    for (i=0; c[i].key != NULL; i++) {
+        if (r < c[i].weight)
+            return &c[i];
+        r -= c[i].weight;
+    }
+    return &c[0];
+}
+
+/* the tags of one object, strings point to the tables or to buf */
+struct gen_tags {
+    OSM_Tag_List list;
+    OSM_Tag  data[GEN_MAX_TAGS];
+    char     buf[GEN_MAX_TAGS][32];
+};
+
+void add_tag(struct gen_tags *t, struct gen_choice *c) {
+    uint32_t i, k = t->list.num;
+    if (k == GEN_MAX_TAGS)
+        return;
+    for (i=0; i<k; i++)
+        if (strcmp(t->data[i].key, c->key) == 0)
+            return;
+    t->data[k].key = c->key;
+    if (c->val != NULL)
+        t->data[k].val = c->val;
+    else {
+        if (strcmp(c->key, "name") == 0)
+            snprintf(t->buf[k], sizeof(t->buf[k]), "Street %u", (uint32_t)rng_below(5000));
+        else
+            snprintf(t->buf[k], sizeof(t->buf[k]), "%u", 1 + (uint32_t)rng_below(200));
+        t->data[k].val = t->buf[k];
+    }
+    t->list.num += 1;
+}
+
+OSM_Tag_List *init_tags(struct gen_tags *t) {
+    t->list.num  = 0;
+    t->list.size = GEN_MAX_TAGS;
+    t->list.data = t->data;
+    return &t->list;
+}
+
+/* meta data */
+struct gen_meta {
+    char     user[32];
+    uint32_t uid;
+    uint32_t version;
+    uint64_t changeset;
+    uint64_t timestamp;
+};
+
+void gen_meta(struct gen_meta *m) {
+    m->uid       = 1 + rng_below(GEN_USERS);
+    m->version   = 1 + rng_below(5);
+    m->timestamp = GEN_EPOCH + rng_below((uint64_t)GEN_YEARS * 365 * 86400);
+    m->changeset = 1 + (m->timestamp - GEN_EPOCH) / 300;
+    snprintf(m->user, sizeof(m->user), "user%u", m->uid);
+}
+
+uint64_t next_id(uint64_t id) {
+    return id + 1 + (gap > 1 ? rng_below(2 * gap - 1) : 0);
+}
+
+/* the writers for the output format */
+OSM_PBF_Writer *W = NULL;
+FILE *out;
+
+int write_node(OSM_Node *n) {
+    if (W != NULL)
+        return osm_pbf_write_node(n, W);
+    osm_xml_write_node(n, out);
+    return 0;
+}
+
+int write_way(OSM_Way *w) {
+    if (W != NULL)
+        return osm_pbf_write_way(w, W);
+    osm_xml_write_way(w, out);
+    return 0;
+}
+
+int write_relation(OSM_Relation *r) {
+    if (W != NULL)
+        return osm_pbf_write_relation(r, W);
+    osm_xml_write_relation(r, out);
+    return 0;
+}
+
+int gen_nodes(uint64_t *ids) {
+    struct gen_tags t;
+    struct gen_meta m;
+    OSM_Node n;
+    uint64_t i, id = 0;
+    double lat = 0, lon = 0, dir = 0;
+
+    for (i=0; i<num_nodes; i++) {
+        /* a new walk every now and then, else a step in about the same direction */
+        if (i == 0 || rng_below(max_len) == 0
+            || lat < area.bottom_lat || lat > area.top_lat
+            || lon < area.left_lon || lon > area.right_lon)
+        {
+            lat = area.bottom_lat + rng_double() * (area.top_lat - area.bottom_lat);
+            lon = area.left_lon + rng_double() * (area.right_lon - area.left_lon);
+            dir = rng_double() * 6.283185307179586;
+        }
+        else {
+            dir += (rng_double() - 0.5) * 0.8;
+            lat += GEN_STEP * sin(dir);
+            lon += GEN_STEP * cos(dir) * 1.5;
+        }
+        id = ids[i] = next_id(id);
+
+        gen_meta(&m);
+        memset(&n, 0, sizeof(n));
+        n.id        = id;
+        n.lat       = lat;
+        n.lon       = lon;
+        n.user      = m.user;
+        n.uid       = m.uid;
+        n.version   = m.version;
+        n.changeset = m.changeset;
+        n.timestamp = m.timestamp;
+        n.tags      = NULL;
+        if (rng_below(100) < tagged) {
+            n.tags = init_tags(&t);
+            add_tag(&t, choose(node_features));
+            if (rng_below(4) == 0)
+                add_tag(&t, &way_extras[0]);
+        }
+        if (write_node(&n) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+int gen_ways(uint64_t *node_ids, uint64_t *ids) {
+    struct gen_tags t;
+    struct gen_meta m;
+    OSM_Way w;
+    uint64_t i, id = 0, cursor = 0;
+    uint64_t *refs = malloc(sizeof(uint64_t) * (max_len + 2));
+
+    if (refs == NULL) {
+        fprintf(stderr, "failed to malloc refs: %s\n", strerror(errno));
+        return -1;
+    }
+    for (i=0; i<num_ways; i++) {
+        struct gen_choice *f = choose(way_features);
+        uint32_t len, k, extra;
+        int closed = strcmp(f->key, "highway") != 0 && strcmp(f->key, "waterway") != 0
+                        && strcmp(f->key, "barrier") != 0;
+
+        /* short ways are more common than long ones */
+        len = min_len + (uint32_t)((max_len - min_len + 1) * rng_double() * rng_double());
+        if (closed && len < 3)
+            len = 3;
+        if (len > num_nodes)
+            len = num_nodes;
+        /* go on where the last way ended, sometimes somewhere else */
+        if (rng_below(4) == 0 || cursor + len > num_nodes)
+            cursor = rng_below(num_nodes - len + 1);
+        for (k=0; k<len; k++)
+            refs[k] = node_ids[cursor + k];
+        if (closed)
+            refs[k++] = refs[0];
+        refs[k] = 0;
+        cursor += len - 1;
+
+        id = ids[i] = next_id(id);
+        gen_meta(&m);
+        memset(&w, 0, sizeof(w));
+        w.id        = id;
+        w.user      = m.user;
+        w.uid       = m.uid;
+        w.version   = m.version;
+        w.changeset = m.changeset;
+        w.timestamp = m.timestamp;
+        w.nodes     = refs;
+        w.tags      = init_tags(&t);
+        add_tag(&t, f);
+        extra = max_tags > 1 ? rng_below(max_tags) : 0;
+        for (k=0; k<extra; k++)
+            add_tag(&t, choose(way_extras));
+        if (write_way(&w) != 0) {
+            free(refs);
+            return -1;
+        }
+    }
+    free(refs);
+    return 0;
+}
+
+int gen_relations(uint64_t *node_ids, uint64_t *way_ids, uint64_t *ids) {
+    struct gen_tags t;
+    struct gen_meta m;
+    OSM_Relation r;
+    OSM_Rel_Member_List ml;
+    OSM_Rel_Member mem[32];
+    uint64_t i, id = 0, per_level = num_rels / depth;
+
+    ml.data = mem;
+    ml.size = 32;
+    for (i=0; i<num_rels; i++) {
+        uint32_t num, k, extra;
+        uint64_t lvl = per_level ? i / per_level : 0;
+        struct gen_choice *type;
+
+        if (lvl > depth - 1)
+            lvl = depth - 1;
+        ml.num = 0;
+        num = 2 + rng_below(9);
+        if (lvl == 0) {
+            type = choose(rel_types);
+            for (k=0; k<num && num_ways; k++) {
+                OSM_Rel_Member *x = &mem[ml.num++];
+                if (strcmp(type->val, "route") == 0 && rng_below(3) == 0 && num_nodes) {
+                    x->type = OSM_REL_MEMBER_TYPE_NODE;
+                    x->ref  = node_ids[rng_below(num_nodes)];
+                    x->role = "stop";
+                }
+                else {
+                    x->type = OSM_REL_MEMBER_TYPE_WAY;
+                    x->ref  = way_ids[rng_below(num_ways)];
+                    if (strcmp(type->val, "multipolygon") == 0)
+                        x->role = k == 0 || rng_below(3) ? "outer" : "inner";
+                    else
+                        x->role = "";
+                }
+            }
+        }
+        else {
+            type = choose(super_types);
+            for (k=0; k<num; k++) {
+                OSM_Rel_Member *x = &mem[ml.num++];
+                x->type = OSM_REL_MEMBER_TYPE_RELATION;
+                x->ref  = ids[(lvl - 1) * per_level + rng_below(per_level)];
+                x->role = "";
+            }
+        }
+
+        id = ids[i] = next_id(id);
+        gen_meta(&m);
+        memset(&r, 0, sizeof(r));
+        r.id        = id;
+        r.user      = m.user;
+        r.uid       = m.uid;
+        r.version   = m.version;
+        r.changeset = m.changeset;
+        r.timestamp = m.timestamp;
+        r.member    = &ml;
+        r.tags      = init_tags(&t);
+        add_tag(&t, type);
+        extra = max_tags > 1 ? rng_below(max_tags) : 0;
+        for (k=0; k<extra; k++)
+            add_tag(&t, &way_extras[0]);
+        if (write_relation(&r) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+int ftype_by_suffix(char *filename) {
+    char *suffix;
+    int len = strlen(filename);
+    if (len < 5)
+        return OSM_FTYPE_UNKNOWN;
+    suffix = filename + len - 4;
+    if (strcmp(suffix, ".osm") == 0)
+        return OSM_FTYPE_XML;
+    else if (strcmp(suffix, ".pbf") == 0)
+        return OSM_FTYPE_PBF;
+    else
+        return OSM_FTYPE_UNKNOWN;
+}
+
+uint64_t number(char *arg) {
+    char *end;
+    uint64_t n = strtoull(arg, &end, 10);
+    if (*end != '\0') {
+        fprintf(stderr, "invalid number: %s\n", arg);
+        exit(1);
+    }
+    return n;
+}
+
+void parse_args(int argc, char **argv) {
+    char c;
+    OSM_BBox *bbox;
+    opterr = 0;
+    while ((c = getopt(argc, argv, "b:B:c:dD:g:l:n:o:Pr:s:t:T:w:Xz:")) != -1) {
+        switch (c) {
+            case 'b':
+                block_size = number(optarg);
+                break;
+            case 'B':
+                bbox = osm_bbox_parse(optarg);
+                if (bbox == NULL)
+                    exit(1);
+                area = *bbox;
+                free(bbox);
+                break;
+            case 'c':
+                if (strcmp(optarg, "none") == 0)
+                    level = 0;
+                else if (strcmp(optarg, "zlib") != 0) {
+                    fprintf(stderr, "unknown codec %s, use zlib or none\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'd':
+                debug = 1;
+                break;
+            case 'D':
+                depth = number(optarg);
+                break;
+            case 'g':
+                gap = number(optarg);
+                break;
+            case 'l':
+                if (sscanf(optarg, "%u,%u", &min_len, &max_len) != 2
+                    || min_len < 2 || max_len < min_len)
+                {
+                    fprintf(stderr, "invalid way length: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'n':
+                num_nodes = number(optarg);
+                break;
+            case 'o':
+                output = strdup(optarg);
+                break;
+            case 'P':
+                file_type = OSM_FTYPE_PBF;
+                break;
+            case 'r':
+                num_rels = number(optarg);
+                break;
+            case 's':
+                seed = number(optarg);
+                break;
+            case 't':
+                max_tags = number(optarg);
+                break;
+            case 'T':
+                tagged = number(optarg);
+                break;
+            case 'w':
+                num_ways = number(optarg);
+                break;
+            case 'X':
+                file_type = OSM_FTYPE_XML;
+                break;
+            case 'z':
+                level = number(optarg);
+                if (level > 9) {
+                    fprintf(stderr, "invalid zlib level: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            default:
+                fprintf(stderr, "unknown option %c\n", c);
+                exit(1);
+        }
+    }
+    if (depth < 1)
+        depth = 1;
+    if (max_tags >= GEN_MAX_TAGS)
+        max_tags = GEN_MAX_TAGS - 1;
+    if (num_nodes < min_len)
+        num_ways = 0;
+    if (num_ways == 0 && num_nodes == 0)
+        num_rels = 0;
+}
+
+int main(int argc, char **argv) {
+    uint64_t *node_ids, *way_ids, *rel_ids;
+    int ret = 0;
+
+    osm_stats_args(&argc, argv);
+    parse_args(argc, argv);
+    osm_init();
+    rng_state = seed;
+
+    if (file_type == OSM_FTYPE_UNKNOWN)
+        file_type = output != NULL ? ftype_by_suffix(output) : OSM_FTYPE_PBF;
+    if (file_type == OSM_FTYPE_UNKNOWN)
+        file_type = OSM_FTYPE_PBF;
+
+    out = stdout;
+    if (output != NULL) {
+        out = fopen(output, "w");
+        if (out == NULL) {
+            fprintf(stderr, "failed to open %s: %s\n", output, strerror(errno));
+            return 1;
+        }
+    }
+
+    node_ids = malloc(sizeof(uint64_t) * (num_nodes + 1));
+    way_ids  = malloc(sizeof(uint64_t) * (num_ways + 1));
+    rel_ids  = malloc(sizeof(uint64_t) * (num_rels + 1));
+    if (node_ids == NULL || way_ids == NULL || rel_ids == NULL) {
+        fprintf(stderr, "failed to malloc ids: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (file_type == OSM_FTYPE_PBF) {
+        W = osm_pbf_write_header_opt("osm-gen v" OSMG_VERSION, out, &area, block_size, level,
+                                    OSM_PBF_SORTED);
+        if (W == NULL)
+            return 1;
+    }
+    else
+        osm_xml_write_header("osm-gen v" OSMG_VERSION, out);
+
+    if (gen_nodes(node_ids) != 0
+        || gen_ways(node_ids, way_ids) != 0
+        || gen_relations(node_ids, way_ids, rel_ids) != 0)
+        ret = 1;
+
+    if (W != NULL) {
+        if (osm_pbf_write_footer(W) != 0)
+            ret = 1;
+    }
+    else
+        osm_xml_write_footer(out);
+    if (out != stdout && fclose(out) != 0) {
+        fprintf(stderr, "failed to write %s: %s\n", output, strerror(errno));
+        ret = 1;
+    }
+    if (debug)
+        fprintf(stderr, "%s:%d:%s(): seed %lu: %lu nodes, %lu ways, %lu relations\n",
+                        __FILE__, __LINE__, __FUNCTION__, seed,
+                        num_nodes, num_ways, num_rels);
+    free(node_ids);
+    free(way_ids);
+    free(rel_ids);
+    return ret;
+}
+
+/* END */
@@ -0,0 +1,135 @@
+/*
+ * osm-merge.c - merge sorted files into one .osm.pbf
+ *             - example and test for libosm
+ *
+ * Usage: osm-merge [-d] [--stats] [-b BLOCK] [-z LEVEL] [-A WINDOW]
+ *                  [-o FILE] FILE ...
+ *   -b BLOCK - objects per .osm.pbf block, default: 8000
+ *   -z LEVEL - zlib level, default: 6
+ *   -A WINDOW - read .osm.pbf inputs ahead, WINDOW chunks of 1 MB each,
+ *          default: 8
+ *   -o FILE - write to FILE instead of stdout
+ *   -d  - debug
+ *   --stats - print counters, times and peak memory to stderr on exit
+ *
+ * The inputs (.osm.pbf or .osm) must be sorted by type and id, e.g.
+ * extracts of the same planet. Objects in more than one input are
+ * written once, the highest version wins, see merge.c.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "osm.h"
+
+#define OSMM_VERSION "0.1"
+
+int debug = 0;
+uint32_t block_size = 8000;
+int level = 6;
+int window = 0;
+char *output = NULL;
+char **files;
+int num_files;
+
+int ftype_by_suffix(char *filename) {
+    char *suffix;
+    int len = strlen(filename);
+    if (len < 5)
+        return OSM_FTYPE_UNKNOWN;
+    suffix = filename + len - 4;
+    if (strcmp(suffix, ".osm") == 0)
+        return OSM_FTYPE_XML;
+    else if (strcmp(suffix, ".pbf") == 0)
+        return OSM_FTYPE_PBF;
+    else
+        return OSM_FTYPE_UNKNOWN;
+}
+
+void parse_args(int argc, char **argv) {
+    char c;
+    opterr = 0;
+    while ((c = getopt(argc, argv, "A:b:do:z:")) != -1) {
+        switch (c) {
+            case 'A':
+                window = atoi(optarg);
+                if (window <= 0) {
+                    fprintf(stderr, "invalid window: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'b':
+                block_size = atoi(optarg);
+                break;
+            case 'd':
+                debug = 1;
+                break;
+            case 'o':
+                output = strdup(optarg);
+                break;
+            case 'z':
+                level = atoi(optarg);
+                if (level < 0 || level > 9) {
+                    fprintf(stderr, "invalid zlib level: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            default:
+                fprintf(stderr, "unknown option %c\n", c);
+                exit(1);
+        }
+    }
+    if (argc == optind) {
+        fprintf(stderr, "missing files\n");
+        exit(1);
+    }
+    files     = argv + optind;
+    num_files = argc - optind;
+}
+
+int main(int argc, char **argv) {
+    OSM_File **F;
+    FILE *out = stdout;
+    int ret = 0, i;
+
+    osm_stats_args(&argc, argv);
+    parse_args(argc, argv);
+    osm_init();
+
+    F = malloc(sizeof(OSM_File *) * num_files);
+    for (i=0; i<num_files; i++) {
+        F[i] = osm_open(files[i], ftype_by_suffix(files[i]));
+        if (F[i] == NULL)
+            return 1;
+        if (window && osm_readahead(F[i], window, 0) != 0)
+            return 1;
+        if (debug)
+            fprintf(stderr, "input %d: %s\n", i + 1, files[i]);
+    }
+    if (output != NULL) {
+        out = fopen(output, "w");
+        if (out == NULL) {
+            fprintf(stderr, "failed to open %s: %s\n", output, strerror(errno));
+            return 1;
+        }
+    }
+    if (osm_merge(F, num_files, out, block_size, level,
+                    "osm-merge v" OSMM_VERSION) != 0)
+        ret = 1;
+    for (i=0; i<num_files; i++)
+        osm_close(F[i]);
+    free(F);
+    if (out != stdout && fclose(out) != 0) {
+        fprintf(stderr, "failed to write %s: %s\n", output, strerror(errno));
+        ret = 1;
+    }
+    return ret;
+}
+
+/* END */
@@ -0,0 +1,130 @@
+/*
+ * osm-reorder.c - write a file in Hilbert curve order
+ *               - example and test for libosm
+ *
+ * Usage: osm-reorder [-d] [--stats] [-l] [-j THREADS] [-b BLOCK] [-z LEVEL]
+ *                    [-o FILE] FILE
+ *   -l - add the node locations to the ways
+ *   -j THREADS - threads for sorting, default: all CPUs
+ *   -b BLOCK - objects per .osm.pbf block, default: 8000
+ *   -z LEVEL - zlib level, default: 6
+ *   -o FILE - write to FILE instead of stdout
+ *   -d  - debug
+ *   --stats - print counters, times and peak memory to stderr on exit
+ *
+ * The output is always .osm.pbf, each block with the bbox of its objects
+ * in the block header, see reorder.c. Bbox extracts of such a file skip
+ * the blocks outside of the bbox in their first pass.
+ *
+ * Memory: the whole input is parsed into memory (unlike osm-sort, which
+ * spills to temporary files), plus a location index of 16 bytes per node.
+ * That is several times the size of the .osm.pbf, so this is for
+ * regional extracts, not the planet. Sort the planet with osm-sort, and
+ * reorder the extracts cut from it.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "osm.h"
+
+#define OSMR_VERSION "0.1"
+
+int debug = 0;
+int threads = 0;
+uint32_t block_size = 8000;
+int level = 6;
+uint32_t flags = 0;
+char *output = NULL;
+char *file;
+
+int ftype_by_suffix(char *filename) {
+    char *suffix;
+    int len = strlen(filename);
+    if (len < 5)
+        return OSM_FTYPE_UNKNOWN;
+    suffix = filename + len - 4;
+    if (strcmp(suffix, ".osm") == 0)
+        return OSM_FTYPE_XML;
+    else if (strcmp(suffix, ".pbf") == 0)
+        return OSM_FTYPE_PBF;
+    else
+        return OSM_FTYPE_UNKNOWN;
+}
+
+void parse_args(int argc, char **argv) {
+    char c;
+    opterr = 0;
+    while ((c = getopt(argc, argv, "b:dj:lo:z:")) != -1) {
+        switch (c) {
+            case 'b':
+                block_size = atoi(optarg);
+                break;
+            case 'd':
+                debug = 1;
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'l':
+                flags |= OSM_PBF_LOCATIONS_ON_WAYS;
+                break;
+            case 'o':
+                output = strdup(optarg);
+                break;
+            case 'z':
+                level = atoi(optarg);
+                if (level < 0 || level > 9) {
+                    fprintf(stderr, "invalid zlib level: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            default:
+                fprintf(stderr, "unknown option %c\n", c);
+                exit(1);
+        }
+    }
+    if (argc == optind) {
+        fprintf(stderr, "missing file\n");
+        exit(1);
+    }
+    file = argv[optind];
+}
+
+int main(int argc, char **argv) {
+    OSM_File *F;
+    FILE *out = stdout;
+    int ret = 0;
+
+    osm_stats_args(&argc, argv);
+    parse_args(argc, argv);
+    osm_init();
+
+    F = osm_open(file, ftype_by_suffix(file));
+    if (F == NULL)
+        return 1;
+    if (output != NULL) {
+        out = fopen(output, "w");
+        if (out == NULL) {
+            fprintf(stderr, "failed to open %s: %s\n", output, strerror(errno));
+            return 1;
+        }
+    }
+    if (osm_reorder(F, out, block_size, level, flags, threads,
+                        "osm-reorder v" OSMR_VERSION) != 0)
+        ret = 1;
+    osm_close(F);
+    if (out != stdout && fclose(out) != 0) {
+        fprintf(stderr, "failed to write %s: %s\n", output, strerror(errno));
+        ret = 1;
+    }
+    return ret;
+}
+
+/* END */
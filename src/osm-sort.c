@@ -0,0 +1,133 @@
+/*
+ * osm-sort.c - sort a file by type and id into .osm.pbf
+ *            - example and test for libosm
+ *
+ * Usage: osm-sort [-d] [--stats] [-m MB] [-j THREADS] [-t DIR] [-b BLOCK]
+ *                 [-z LEVEL] [-o FILE] FILE
+ *   -m MB - memory for the sorted runs, default: 512
+ *   -j THREADS - threads for sorting and merging runs, default: all CPUs
+ *   -t DIR - directory for the runs, default: $TMPDIR or /tmp
+ *   -b BLOCK - objects per .osm.pbf block, default: 8000
+ *   -z LEVEL - zlib level, default: 6
+ *   -o FILE - write to FILE instead of stdout
+ *   -d  - debug
+ *   --stats - print counters, times and peak memory to stderr on exit
+ *
+ * Nodes, then ways, then relations, each by id, as the parsers expect.
+ * The output is marked Sort.Type_then_ID, see extsort.c.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "osm.h"
+
+#define OSMSO_VERSION "0.1"
+
+int debug = 0;
+int threads = 0;
+size_t mem = OSM_SORT_MEM;
+char *tmp_dir = NULL;
+uint32_t block_size = 8000;
+int level = 6;
+char *output = NULL;
+char *file;
+
+int ftype_by_suffix(char *filename) {
+    char *suffix;
+    int len = strlen(filename);
+    if (len < 5)
+        return OSM_FTYPE_UNKNOWN;
+    suffix = filename + len - 4;
+    if (strcmp(suffix, ".osm") == 0)
+        return OSM_FTYPE_XML;
+    else if (strcmp(suffix, ".pbf") == 0)
+        return OSM_FTYPE_PBF;
+    else
+        return OSM_FTYPE_UNKNOWN;
+}
+
+void parse_args(int argc, char **argv) {
+    char c;
+    opterr = 0;
+    while ((c = getopt(argc, argv, "b:dj:m:o:t:z:")) != -1) {
+        switch (c) {
+            case 'b':
+                block_size = atoi(optarg);
+                break;
+            case 'd':
+                debug = 1;
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'm':
+                mem = strtoul(optarg, NULL, 10) * 1024 * 1024;
+                if (mem == 0) {
+                    fprintf(stderr, "invalid memory: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'o':
+                output = strdup(optarg);
+                break;
+            case 't':
+                tmp_dir = strdup(optarg);
+                break;
+            case 'z':
+                level = atoi(optarg);
+                if (level < 0 || level > 9) {
+                    fprintf(stderr, "invalid zlib level: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            default:
+                fprintf(stderr, "unknown option %c\n", c);
+                exit(1);
+        }
+    }
+    if (argc == optind) {
+        fprintf(stderr, "missing file\n");
+        exit(1);
+    }
+    file = argv[optind];
+}
+
+int main(int argc, char **argv) {
+    OSM_File *F;
+    FILE *out = stdout;
+    int ret = 0;
+
+    osm_stats_args(&argc, argv);
+    parse_args(argc, argv);
+    osm_init();
+
+    osm_open_warn = 0;  /* any order is fine here */
+    F = osm_open(file, ftype_by_suffix(file));
+    if (F == NULL)
+        return 1;
+    if (output != NULL) {
+        out = fopen(output, "w");
+        if (out == NULL) {
+            fprintf(stderr, "failed to open %s: %s\n", output, strerror(errno));
+            return 1;
+        }
+    }
+    if (osm_sort_file(F, out, mem, threads, tmp_dir, block_size, level,
+                        "osm-sort v" OSMSO_VERSION) != 0)
+        ret = 1;
+    osm_close(F);
+    if (out != stdout && fclose(out) != 0) {
+        fprintf(stderr, "failed to write %s: %s\n", output, strerror(errno));
+        ret = 1;
+    }
+    return ret;
+}
+
+/* END */
@@ -0,0 +1,286 @@
+/*
+ * osm-store.c - build an object store and look up objects in it
+ *             - example and test for libosm
+ *
+ * Usage: osm-store [-d] [--stats] [-R BACKREFS] -b FILE.osm.pbf STORE
+ *        osm-store [-d] [--stats] [-a CHANGE.osc ...] [-C] [-R BACKREFS [-p]]
+ *                  [-n ID] [-w ID] [-r ID] STORE
+ *   -b FILE - build STORE from FILE
+ *   -R BACKREFS - the reverse index (node -> ways, way -> relations,
+ *          relation -> relations) file, built with -b from FILE too
+ *   -a FILE - apply the .osc diff FILE to STORE (may be given several
+ *          times, the diffs are squashed in the order given)
+ *   -C  - compact STORE
+ *   -n ID, -w ID, -r ID - write node / way / relation ID as .osm XML
+ *          (may be given several times)
+ *   -p  - write the parents of the ids instead: the ways using the
+ *          nodes, the relations with the ways and relations, needs -R
+ *   -d  - debug
+ *   --stats - print counters, times and peak memory to stderr on exit
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "osm.h"
+
+#define OSMS_VERSION "0.1"
+
+int debug = 0;
+char *input = NULL;
+char *store;
+OSM_Diff *diff = NULL;
+int compact = 0;
+char *backrefs = NULL;
+int parents = 0;
+struct osm_members ids[4]; /* by OSM_REL_MEMBER_TYPE_* */
+
+void push_id(int type, uint64_t id) {
+    if (ids[type].num == ids[type].size) {
+        ids[type].size *= 2;
+        ids[type].data  = realloc(ids[type].data, sizeof(uint64_t) * ids[type].size);
+    }
+    ids[type].data[ ids[type].num++ ] = id;
+}
+
+void add_id(int type, char *arg) {
+    uint64_t id = strtoull(arg, NULL, 10);
+    if (id == 0) {
+        fprintf(stderr, "invalid id: %s\n", arg);
+        exit(1);
+    }
+    push_id(type, id);
+}
+
+void parse_args(int argc, char **argv) {
+    char c;
+    int i;
+    for (i=0; i<4; i++) {
+        ids[i].num  = 0;
+        ids[i].size = 16;
+        ids[i].data = malloc(sizeof(uint64_t) * 16);
+    }
+    opterr = 0;
+    while ((c = getopt(argc, argv, "a:b:Cdn:pR:w:r:")) != -1) {
+        switch (c) {
+            case 'a':
+                if (diff == NULL && (diff = osm_diff_new()) == NULL)
+                    exit(1);
+                if (osm_diff_read(diff, optarg) != 0)
+                    exit(1);
+                break;
+            case 'b':
+                input = strdup(optarg);
+                break;
+            case 'C':
+                compact = 1;
+                break;
+            case 'd':
+                debug = 1;
+                break;
+            case 'n':
+                add_id(OSM_REL_MEMBER_TYPE_NODE, optarg);
+                break;
+            case 'p':
+                parents = 1;
+                break;
+            case 'R':
+                backrefs = strdup(optarg);
+                break;
+            case 'w':
+                add_id(OSM_REL_MEMBER_TYPE_WAY, optarg);
+                break;
+            case 'r':
+                add_id(OSM_REL_MEMBER_TYPE_RELATION, optarg);
+                break;
+            default:
+                fprintf(stderr, "unknown option %c\n", c);
+                exit(1);
+        }
+    }
+    if (argc == optind) {
+        fprintf(stderr, "missing store file\n");
+        exit(1);
+    }
+    store = argv[optind];
+    if (parents && backrefs == NULL) {
+        fprintf(stderr, "-p needs -R\n");
+        exit(1);
+    }
+}
+
+/* the strings stay in the store, only the lists are allocated */
+OSM_Tag_List *store_tags(const char *pool, const uint32_t *tags, uint32_t num) {
+    OSM_Tag_List *t;
+    uint32_t i;
+    if (num == 0)
+        return NULL;
+    t = malloc(sizeof(OSM_Tag_List));
+    t->num  = num;
+    t->size = num;
+    t->data = malloc(sizeof(OSM_Tag) * num);
+    for (i=0; i<num; i++) {
+        t->data[i].key = (char *)(pool + tags[2*i]);
+        t->data[i].val = (char *)(pool + tags[2*i + 1]);
+    }
+    return t;
+}
+
+void free_tags(OSM_Tag_List *t) {
+    if (t == NULL)
+        return;
+    free(t->data);
+    free(t);
+}
+
+void write_node(OSM_Store *S, uint64_t id) {
+    struct osm_store_node sn;
+    OSM_Node n;
+    if (!osm_store_get_node(S, id, &sn)) {
+        fprintf(stderr, "node %lu not found\n", id);
+        return;
+    }
+    memset(&n, 0, sizeof(n));
+    n.id      = sn.id;
+    n.lat     = sn.lat;
+    n.lon     = sn.lon;
+    n.version = sn.version;
+    n.user    = "";
+    n.tags    = store_tags(sn.pool, sn.tags, sn.num_tags);
+    osm_xml_write_node(&n, stdout);
+    free_tags(n.tags);
+}
+
+void write_way(OSM_Store *S, uint64_t id) {
+    struct osm_store_way sw;
+    OSM_Way w;
+    if (!osm_store_get_way(S, id, &sw)) {
+        fprintf(stderr, "way %lu not found\n", id);
+        return;
+    }
+    memset(&w, 0, sizeof(w));
+    w.id      = sw.id;
+    w.version = sw.version;
+    w.user    = "";
+    w.nodes   = calloc(sw.num_refs + 1, sizeof(uint64_t));
+    memcpy(w.nodes, sw.refs, sizeof(uint64_t) * sw.num_refs);
+    w.tags    = store_tags(sw.pool, sw.tags, sw.num_tags);
+    osm_xml_write_way(&w, stdout);
+    free_tags(w.tags);
+    free(w.nodes);
+}
+
+void write_relation(OSM_Store *S, uint64_t id) {
+    struct osm_store_relation sr;
+    OSM_Relation r;
+    OSM_Rel_Member_List m;
+    uint32_t i;
+    if (!osm_store_get_relation(S, id, &sr)) {
+        fprintf(stderr, "relation %lu not found\n", id);
+        return;
+    }
+    memset(&r, 0, sizeof(r));
+    r.id      = sr.id;
+    r.version = sr.version;
+    r.user    = "";
+    m.num     = sr.num_members;
+    m.size    = sr.num_members;
+    m.data    = malloc(sizeof(OSM_Rel_Member) * (sr.num_members + 1));
+    for (i=0; i<sr.num_members; i++) {
+        m.data[i].type = sr.members[i].type;
+        m.data[i].ref  = sr.members[i].ref;
+        m.data[i].role = (char *)osm_store_str(&sr, sr.members[i].role);
+    }
+    r.member  = &m;
+    r.tags    = store_tags(sr.pool, sr.tags, sr.num_tags);
+    osm_xml_write_relation(&r, stdout);
+    free_tags(r.tags);
+    free(m.data);
+}
+
+/* replace the ids by those of their parents */
+int find_parents() {
+    OSM_Backrefs *B = osm_backrefs_open(backrefs);
+    struct osm_members old[4];
+    uint64_t num, k;
+    uint32_t i;
+    int type;
+
+    if (B == NULL)
+        return -1;
+    memcpy(old, ids, sizeof(ids));
+    for (type=OSM_REL_MEMBER_TYPE_NODE; type<=OSM_REL_MEMBER_TYPE_RELATION; type++) {
+        ids[type].num  = 0;
+        ids[type].size = 16;
+        ids[type].data = malloc(sizeof(uint64_t) * 16);
+    }
+    for (type=OSM_REL_MEMBER_TYPE_NODE; type<=OSM_REL_MEMBER_TYPE_RELATION; type++) {
+        int parent = type == OSM_REL_MEMBER_TYPE_NODE
+                        ? OSM_REL_MEMBER_TYPE_WAY : OSM_REL_MEMBER_TYPE_RELATION;
+        for (i=0; i<old[type].num; i++) {
+            const uint64_t *p = osm_backrefs_get(B, type, old[type].data[i], &num);
+            for (k=0; k<num; k++)
+                push_id(parent, p[k]);
+        }
+        free(old[type].data);
+    }
+    osm_backrefs_close(B);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    OSM_Store *S;
+    uint32_t i;
+
+    osm_stats_args(&argc, argv);
+    parse_args(argc, argv);
+    osm_init();
+
+    if (input != NULL) {
+        OSM_File *F = osm_open(input, OSM_FTYPE_UNKNOWN);
+        int ret;
+        if (F == NULL)
+            return 1;
+        ret = osm_store_build(F, store);
+        if (ret == 0 && backrefs != NULL)
+            ret = osm_backrefs_build(F, backrefs, 0);
+        osm_close(F);
+        if (ret != 0)
+            return 1;
+    }
+    if (diff != NULL) {
+        int ret = osm_store_update(store, diff);
+        osm_diff_free(diff);
+        if (ret != 0)
+            return 1;
+    }
+    if (compact && osm_store_compact(store) != 0)
+        return 1;
+
+    if (!ids[OSM_REL_MEMBER_TYPE_NODE].num && !ids[OSM_REL_MEMBER_TYPE_WAY].num
+        && !ids[OSM_REL_MEMBER_TYPE_RELATION].num)
+        return 0;
+
+    S = osm_store_open(store);
+    if (S == NULL)
+        return 1;
+    if (parents && find_parents() != 0)
+        return 1;
+    osm_xml_write_header("osm-store v" OSMS_VERSION, stdout);
+    for (i=0; i<ids[OSM_REL_MEMBER_TYPE_NODE].num; i++)
+        write_node(S, ids[OSM_REL_MEMBER_TYPE_NODE].data[i]);
+    for (i=0; i<ids[OSM_REL_MEMBER_TYPE_WAY].num; i++)
+        write_way(S, ids[OSM_REL_MEMBER_TYPE_WAY].data[i]);
+    for (i=0; i<ids[OSM_REL_MEMBER_TYPE_RELATION].num; i++)
+        write_relation(S, ids[OSM_REL_MEMBER_TYPE_RELATION].data[i]);
+    osm_xml_write_footer(stdout);
+    osm_store_close(S);
+    return 0;
+}
+
+/* END */
@@ -0,0 +1,146 @@
+/*
+ * osm-tagstats.c - key and tag statistics of a file
+ *                - example and test for libosm
+ *
+ * Usage: osm-tagstats [-d] [--stats] [-j THREADS] [-k TOP] [-J] [-o FILE]
+ *                     [-A WINDOW] [-D] [-T] FILE
+ *   -A WINDOW - read .osm.pbf files ahead, WINDOW chunks of 1 MB in flight,
+ *          default: 8
+ *   -D  - read ahead with O_DIRECT, past the page cache
+ *   -T  - read ahead with a pread() thread instead of io_uring
+ *   -j THREADS - threads for counting .osm.pbf blocks, default: all CPUs
+ *   -k TOP - number of the most common key=value pairs per type,
+ *          default: 1000
+ *   -J - write JSON instead of CSV
+ *   -o FILE - write to FILE instead of stdout
+ *   -d  - debug
+ *   --stats - print counters, times and peak memory to stderr on exit
+ *
+ * Counts the objects per key and the distinct values of each key (an
+ * estimate for keys with many values) and finds the most common pairs
+ * (with an upper bound and an error), for nodes, ways and relations each,
+ * see tagstats.c.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "osm.h"
+
+#define OSMTS_VERSION "0.1"
+
+int debug = 0;
+int threads = 0;
+uint32_t top = 1000;
+int format = OSM_TAGSTATS_CSV;
+char *output = NULL;
+char *file;
+int window = 0;
+uint32_t read_flags = 0;
+
+int ftype_by_suffix(char *filename) {
+    char *suffix;
+    int len = strlen(filename);
+    if (len < 5)
+        return OSM_FTYPE_UNKNOWN;
+    suffix = filename + len - 4;
+    if (strcmp(suffix, ".osm") == 0)
+        return OSM_FTYPE_XML;
+    else if (strcmp(suffix, ".pbf") == 0)
+        return OSM_FTYPE_PBF;
+    else
+        return OSM_FTYPE_UNKNOWN;
+}
+
+void parse_args(int argc, char **argv) {
+    char c;
+    opterr = 0;
+    while ((c = getopt(argc, argv, "A:dDj:Jk:o:T")) != -1) {
+        switch (c) {
+            case 'A':
+                window = atoi(optarg);
+                if (window <= 0) {
+                    fprintf(stderr, "invalid window: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'd':
+                debug = 1;
+                break;
+            case 'D':
+                read_flags |= OSM_READ_DIRECT;
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'J':
+                format = OSM_TAGSTATS_JSON;
+                break;
+            case 'k':
+                top = strtoul(optarg, NULL, 10);
+                if (top == 0) {
+                    fprintf(stderr, "invalid top: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'o':
+                output = strdup(optarg);
+                break;
+            case 'T':
+                read_flags |= OSM_READ_THREAD;
+                break;
+            default:
+                fprintf(stderr, "unknown option %c\n", c);
+                exit(1);
+        }
+    }
+    if (argc == optind) {
+        fprintf(stderr, "missing file\n");
+        exit(1);
+    }
+    file = argv[optind];
+}
+
+int main(int argc, char **argv) {
+    OSM_File *F;
+    OSM_Tag_Stats *S;
+    FILE *out = stdout;
+    int ret = 0;
+
+    osm_stats_args(&argc, argv);
+    parse_args(argc, argv);
+    osm_init();
+
+    F = osm_open(file, ftype_by_suffix(file));
+    if (F == NULL)
+        return 1;
+    if ((window || read_flags) && osm_readahead(F, window, read_flags) != 0)
+        return 1;
+    S = osm_tagstats(F, top, threads);
+    osm_close(F);
+    if (S == NULL)
+        return 1;
+    if (output != NULL) {
+        out = fopen(output, "w");
+        if (out == NULL) {
+            fprintf(stderr, "failed to open %s: %s\n", output, strerror(errno));
+            return 1;
+        }
+    }
+    if (osm_tagstats_write(S, out, format) != 0)
+        ret = 1;
+    osm_tagstats_free(S);
+    if (out != stdout && fclose(out) != 0) {
+        fprintf(stderr, "failed to write %s: %s\n", output, strerror(errno));
+        ret = 1;
+    }
+    return ret;
+}
+
+/* END */
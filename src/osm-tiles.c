@@ -0,0 +1,125 @@
+/*
+ * osm-tiles.c - cut a file into z/x/y tiles
+ *             - example and test for libosm
+ *
+ * Usage: osm-tiles [-d] [--stats] [-z ZOOM] [-j THREADS] [-m MB] [-P|-X]
+ *                  [-o DIR] FILE
+ *   -z ZOOM - zoom level of the tiles, 0..16, default: 10
+ *   -j THREADS - threads for writing the tiles, default: all CPUs
+ *   -m MB - memory for the tile buffers before they are written to the
+ *          tile files, default: 256
+ *   -P - write .osm.pbf tiles (default)
+ *   -X - write .osm XML tiles
+ *   -o DIR - write DIR/ZOOM/X/Y.osm[.pbf], default: tiles
+ *   -d  - debug
+ *   --stats - print counters, times and peak memory to stderr on exit
+ *
+ * All tiles are cut in one pass over FILE, which must be sorted (nodes,
+ * ways, relations), see tile.c. The ways carry the locations of their
+ * nodes, so the tiles can be rendered without the nodes outside of them.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "osm.h"
+
+#define OSMT_VERSION "0.1"
+
+int debug = 0;
+int zoom = 10;
+int threads = 0;
+uint64_t memory = 256;
+int file_type = OSM_FTYPE_PBF;
+char *dir = "tiles";
+char *file;
+
+int ftype_by_suffix(char *filename) {
+    char *suffix;
+    int len = strlen(filename);
+    if (len < 5)
+        return OSM_FTYPE_UNKNOWN;
+    suffix = filename + len - 4;
+    if (strcmp(suffix, ".osm") == 0)
+        return OSM_FTYPE_XML;
+    else if (strcmp(suffix, ".pbf") == 0)
+        return OSM_FTYPE_PBF;
+    else
+        return OSM_FTYPE_UNKNOWN;
+}
+
+void parse_args(int argc, char **argv) {
+    char c;
+    opterr = 0;
+    while ((c = getopt(argc, argv, "dj:m:o:PXz:")) != -1) {
+        switch (c) {
+            case 'd':
+                debug = 1;
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'm':
+                memory = strtoull(optarg, NULL, 10);
+                if (memory == 0) {
+                    fprintf(stderr, "invalid memory: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'o':
+                dir = strdup(optarg);
+                break;
+            case 'P':
+                file_type = OSM_FTYPE_PBF;
+                break;
+            case 'X':
+                file_type = OSM_FTYPE_XML;
+                break;
+            case 'z':
+                zoom = atoi(optarg);
+                if (zoom < 0 || zoom > OSM_TILE_MAX_ZOOM) {
+                    fprintf(stderr, "invalid zoom: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            default:
+                fprintf(stderr, "unknown option %c\n", c);
+                exit(1);
+        }
+    }
+    if (argc == optind) {
+        fprintf(stderr, "missing file\n");
+        exit(1);
+    }
+    file = argv[optind];
+}
+
+int main(int argc, char **argv) {
+    OSM_File *F;
+    int64_t num;
+
+    osm_stats_args(&argc, argv);
+    parse_args(argc, argv);
+    osm_init();
+
+    F = osm_open(file, ftype_by_suffix(file));
+    if (F == NULL)
+        return 1;
+    num = osm_tile_split(F, zoom, dir, file_type, memory << 20, threads,
+                            "osm-tiles v" OSMT_VERSION);
+    osm_close(F);
+    if (num < 0)
+        return 1;
+    if (debug)
+        fprintf(stderr, "%s:%d:%s(): %ld tiles in %s/%d\n",
+                        __FILE__, __LINE__, __FUNCTION__, num, dir, zoom);
+    return 0;
+}
+
+/* END */
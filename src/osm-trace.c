@@ -0,0 +1,232 @@
+/*
+ * osm-trace.c - decode a libosm trace file to text
+ *             - example and test for libosm
+ *
+ * Usage: osm-trace [-d] [-l LEVEL] TRACE
+ *   -l LEVEL - only events up to LEVEL, default: all
+ *   -d  - debug
+ *
+ * The trace is written by any libosm tool built with make TRACE=N and
+ * run with OSM_TRACE=TRACE in the environment, see trace.c. The events
+ * of all threads are printed in time order as
+ *   SECONDS THREAD FILE:LINE:FUNCTION(): MESSAGE
+ * with SECONDS relative to the first event.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "osm.h"
+
+#define OSM_TRACE_VERSION "0.1"
+
+int debug = 0;
+int max_level = 0;
+char *file;
+
+struct point {
+    uint32_t line;
+    uint32_t level;
+    char *file;
+    char *func;
+    char *fmt;
+};
+
+void usage(char *msg) {
+    if (msg != NULL)
+        fprintf(stderr, "%s\n", msg);
+    fprintf(stderr, "Usage: osm-trace [-d] [-l LEVEL] TRACE\n");
+    exit(1);
+}
+
+void parse_args(int argc, char **argv) {
+    int c;
+    while ((c = getopt(argc, argv, "dhl:V")) != -1) {
+        switch (c) {
+            case 'd':
+                debug = 1;
+                break;
+            case 'l':
+                max_level = atoi(optarg);
+                break;
+            case 'V':
+                printf("osm-trace %s (libosm %s)\n", OSM_TRACE_VERSION, LIBOSM_VERSION);
+                exit(0);
+            case 'h':
+            default:
+                usage(NULL);
+        }
+    }
+    if (optind != argc - 1)
+        usage("need exactly one TRACE file");
+    file = argv[optind];
+}
+
+static char *read_string(FILE *fh) {
+    char buf[LINE_SIZE];
+    int c, i = 0;
+    while ((c = fgetc(fh)) != EOF && c != '\0') {
+        if (i < LINE_SIZE - 1)
+            buf[i++] = c;
+    }
+    if (c == EOF)
+        return NULL;
+    buf[i] = '\0';
+    return strdup(buf);
+}
+
+/*
+ * print fmt with the event arguments, every conversion takes the next
+ * argument: as double for f, e, g and a, as (unsigned) long with an l
+ * modifier, else as int.
+ */
+static void print_event(FILE *out, const char *fmt, struct osm_trace_event *e) {
+    char spec[64];
+    const char *p = fmt;
+    uint32_t arg = 0;
+
+    while (*p) {
+        const char *start;
+        size_t len;
+        int is_long = 0;
+
+        if (*p != '%') {
+            fputc(*p++, out);
+            continue;
+        }
+        if (p[1] == '%') {
+            fputc('%', out);
+            p += 2;
+            continue;
+        }
+        start = p++;
+        while (*p && strchr("-+ #0123456789.", *p))
+            ++p;
+        while (*p && strchr("hlLqjzt", *p)) {
+            if (*p == 'l' || *p == 'j' || *p == 'z' || *p == 't' || *p == 'q')
+                is_long = 1;
+            ++p;
+        }
+        if (*p == '\0')
+            break;
+        len = p - start + 1;
+        if (len >= sizeof(spec)) {
+            fputs("?", out);
+            ++p;
+            continue;
+        }
+        memcpy(spec, start, len);
+        spec[len] = '\0';
+        if (arg >= e->num) {
+            fputs("?", out);
+        }
+        else if (strchr("feEgGaA", *p)) {
+            double d;
+            memcpy(&d, &e->args[arg], sizeof(d));
+            fprintf(out, spec, d);
+        }
+        else if (*p == 's' || *p == 'p') {
+            fprintf(out, "0x%lx", (unsigned long)e->args[arg]);
+        }
+        else if (is_long) {
+            fprintf(out, spec, (long)e->args[arg]);
+        }
+        else {
+            fprintf(out, spec, (int)e->args[arg]);
+        }
+        ++arg;
+        ++p;
+    }
+    fputc('\n', out);
+}
+
+static int cmp_event(const void *a, const void *b) {
+    const struct osm_trace_event *A = a, *B = b;
+    if (A->ns != B->ns)
+        return A->ns > B->ns ? 1 : -1;
+    if (A->thread != B->thread)
+        return A->thread > B->thread ? 1 : -1;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct point *points;
+    struct osm_trace_event *ev = NULL;
+    uint32_t npoints, k;
+    size_t num = 0, size = 0, i;
+    char magic[8];
+    FILE *fh;
+
+    parse_args(argc, argv);
+    osm_init();
+
+    fh = fopen(file, "r");
+    if (fh == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", file, strerror(errno));
+        exit(1);
+    }
+    if (fread(magic, 1, 8, fh) != 8 || memcmp(magic, "OSMTRC01", 8) != 0
+        || fread(&npoints, sizeof(npoints), 1, fh) != 1)
+    {
+        fprintf(stderr, "%s: not a libosm trace file\n", file);
+        exit(1);
+    }
+    points = calloc(npoints + 1, sizeof(struct point));
+    if (points == NULL) {
+        fprintf(stderr, "failed to malloc %u trace points: %s\n", npoints, strerror(errno));
+        exit(1);
+    }
+    for (k=0; k<npoints; k++) {
+        if (fread(&points[k].line, sizeof(uint32_t), 1, fh) != 1
+            || fread(&points[k].level, sizeof(uint32_t), 1, fh) != 1
+            || (points[k].file = read_string(fh)) == NULL
+            || (points[k].func = read_string(fh)) == NULL
+            || (points[k].fmt  = read_string(fh)) == NULL)
+        {
+            fprintf(stderr, "%s: truncated trace point %u\n", file, k);
+            exit(1);
+        }
+    }
+
+    while (1) {
+        if (num == size) {
+            size = size ? size * 2 : 65536;
+            ev = realloc(ev, sizeof(struct osm_trace_event) * size);
+            if (ev == NULL) {
+                fprintf(stderr, "failed to realloc %lu events: %s\n", size, strerror(errno));
+                exit(1);
+            }
+        }
+        if (fread(&ev[num], sizeof(struct osm_trace_event), 1, fh) != 1)
+            break;
+        if (ev[num].point >= npoints) {
+            fprintf(stderr, "%s: event %lu: invalid point %lu\n", file, num, ev[num].point);
+            exit(1);
+        }
+        ++num;
+    }
+    fclose(fh);
+    if (debug)
+        fprintf(stderr, "%s:%d:%s(): %u points, %lu events\n",
+                        __FILE__, __LINE__, __FUNCTION__, npoints, num);
+
+    qsort(ev, num, sizeof(struct osm_trace_event), cmp_event);
+    for (i=0; i<num; i++) {
+        struct point *p = &points[ ev[i].point ];
+        if (max_level && p->level > max_level)
+            continue;
+        printf("%.9f %u %s:%u:%s(): ", (ev[i].ns - ev[0].ns) / 1e9, ev[i].thread,
+                                        p->file, p->line, p->func);
+        print_event(stdout, p->fmt, &ev[i]);
+    }
+    return 0;
+}
+
+/* END */
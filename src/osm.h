@@ -26,12 +26,15 @@
 #define OSMDATA_CSET 0x08
 #define OSMDATA_DUMP 0x10
 #define OSMDATA_BBOX 0x20
+#define OSMDATA_BARE 0x40 /* osm_scan(): nodes without tags and meta data */
 
 #define NANO_DEGREE .000000001
+#define OSM_PBF_NO_LOCATION 2147483647 /* way lat / lon of an unknown node */
 #define MAX_BLOCK_HEADER_SIZE 64*1024
 #define MAX_BLOB_SIZE 32*1024*1024
 
-#define DEBUG_MEM 1
+#define OSM_MAX_THREADS 64
+#define OSM_EARTH_RADIUS 6371008.8
 
 extern int debug;
 
@@ -41,11 +44,52 @@ enum OSM_File_Type {
     OSM_FTYPE_XML
 };
 
+typedef struct _osm_reader OSM_Reader;
+
 typedef struct _osm_file {
     FILE *file;
     enum OSM_File_Type type;
+    OSM_Reader *reader;     /* .osm.pbf read-ahead, see readahead.c */
 } OSM_File;
 
+/* filter.c */
+typedef struct _osm_filter OSM_Filter;
+extern OSM_Filter *osm_filter_compile(const char *expr);
+extern void osm_filter_free(OSM_Filter *f);
+extern void osm_filter_bind(OSM_Filter *f, StringTable *st);
+extern int osm_filter_node(OSM_Filter *f, OSM_Node *n);
+extern int osm_filter_way(OSM_Filter *f, OSM_Way *w);
+extern int osm_filter_relation(OSM_Filter *f, OSM_Relation *r);
+extern int osm_filter_pbf(OSM_Filter *f, int type, uint64_t id,
+                    const uint32_t *keys, const uint32_t *vals, size_t num, int stride,
+                    uint32_t uid, int64_t user_sid);
+
+/* poly.c */
+typedef struct _osm_poly OSM_Poly;
+extern OSM_Poly *osm_poly_read(const char *file);
+extern int osm_poly_contains(OSM_Poly *p, double lat, double lon);
+extern OSM_BBox *osm_poly_bbox(OSM_Poly *p);
+extern void osm_poly_free(OSM_Poly *p);
+
+/* parse options, see parse.c */
+#define OSM_FILTER_THREAD_SAFE 0x01 /* the *_filter_r may run on several threads */
+typedef struct _osm_parse_options {
+    uint32_t  mode;     /* OSMDATA_* */
+    OSM_BBox *bbox;     /* for OSMDATA_BBOX, bbox and / or poly */
+    OSM_Poly *poly;
+    int (*node_filter)(OSM_Node *);
+    int (*way_filter)(OSM_Way *);
+    int (*rel_filter)(OSM_Relation *);
+    OSM_Filter *filter; /* compiled expression, applied to all objects */
+    /* reentrant filters, called with filter_ctx */
+    int (*node_filter_r)(OSM_Node *, void *ctx);
+    int (*way_filter_r)(OSM_Way *, void *ctx);
+    int (*rel_filter_r)(OSM_Relation *, void *ctx);
+    void     *filter_ctx;
+    uint32_t  filter_flags; /* OSM_FILTER_* */
+    int       threads;  /* for OSM_FILTER_THREAD_SAFE, <= 0: all CPUs */
+} OSM_Parse_Options;
+
 /* util.c */
 extern char *osm_relmember_type(int id);
 extern void osm_init();
@@ -59,6 +103,7 @@ extern int osm_cmp_member(const void *a, const void *b);
 extern void osm_sort_member(struct osm_members *m);
 extern void osm_add_members(struct osm_members *m, uint32_t num, uint64_t *list, int sort);
 extern int osm_is_member(struct osm_members *m, uint64_t id);
+extern double osm_distance(double lat1, double lon1, double lat2, double lon2);
 
 
 /* free.c */
@@ -67,6 +112,7 @@ extern void osm_free_node(OSM_Node *n);
 extern void osm_free_way(OSM_Way *w);
 extern void osm_free_way_list(OSM_Way_List *w);
 extern void osm_free_relation(OSM_Relation *r);
+extern void osm_free_data(OSM_Data *d);
 
 /* realloc.c */
 extern void osm_realloc_tag_list(OSM_Tag_List *t);
@@ -88,27 +134,30 @@ extern OSM_Data *osm_xml_parse(OSM_File *F,
               int (*rel_filter)(OSM_Relation *)/*,
               int (*cset_filter)(OSM_Changeset *) */
         );
+extern OSM_Data *osm_xml_parse_opt(OSM_File *F, OSM_Parse_Options *opt);
+extern int osm_xml_scan(OSM_File *F, uint32_t types,
+                    int (*block)(OSM_Data *d, void *ctx), void *ctx);
 
 /* xml-relation.c */
 extern OSM_Relation *osm_xml_get_relation(FILE *file, char *buffer, char *param);
 extern OSM_Relation_List *osm_xml_parse_relations(long int start,
                             FILE *file,
                             int mode,
-                            int(*filter)(OSM_Relation *r),
+                            OSM_Parse_Options *opt,
                             struct osm_members *wanted);
 /* xml-way.c */
 extern OSM_Way *osm_xml_get_way(FILE *file, char *buffer, char *param);
 extern OSM_Way_List *osm_xml_parse_ways(long int start,
                         FILE *file,
                         int mode,
-                        int(*filter)(OSM_Way *w),
+                        OSM_Parse_Options *opt,
                         struct osm_members *wanted);
 /* xml-node.c */
 extern OSM_Node *osm_xml_get_node(FILE *file, char *buffer, char *param);
 extern OSM_Node_List *osm_xml_parse_nodes(long int start,
                                     FILE *file,
                                     int mode,
-                                    int(*filter)(OSM_Node *n),
+                                    OSM_Parse_Options *opt,
                                     struct osm_members *wanted);
 
 /* xml-write.c */
@@ -128,6 +177,10 @@ extern OSM_Data *osm_pbf_parse(OSM_File *F,
               int (*rel_filter)(OSM_Relation *) /*,
               int (*cset_filter)(OSM_Changeset *) */
         );
+extern OSM_Data *osm_pbf_parse_opt(OSM_File *F, OSM_Parse_Options *opt);
+extern int osm_pbf_scan(OSM_File *F, uint32_t types,
+                    int (*block)(OSM_Data *d, void *ctx), void *ctx);
+extern void osm_pbf_convert(PrimitiveBlock *P, uint32_t types, OSM_Data *block);
 
 /* pbf-util.c */
 extern void osm_pbf_timestamp(const long int deltatimestamp, char *timestamp);
@@ -135,10 +188,36 @@ extern unsigned char *osm_pbf_uncompress_blob(Blob *bmsg);
 extern uint32_t osm_pbf_bh_length(OSM_File *F);
 extern void osm_pbf_free_bh(BlockHeader *bh);
 extern BlockHeader *osm_pbf_get_bh(OSM_File *F, uint32_t len);
+extern int osm_pbf_bh_bbox(BlockHeader *bh, OSM_BBox *bbox);
+extern int osm_pbf_skip_blob(OSM_File *F, uint32_t len);
 extern void osm_pbf_free_blob(Blob *B, unsigned char *uncompressed);
 extern Blob *osm_pbf_get_blob(OSM_File *F, uint32_t len, unsigned char **uncompressed);
 extern void osm_pbf_free_primitive(PrimitiveBlock *P);
 extern PrimitiveBlock *osm_pbf_unpack_data(Blob *B, unsigned char *uncompressed);
+extern int osm_pbf_sorted(OSM_File *F);
+/* an OSMData blob as read from the file, see osm_pbf_read_raw() */
+struct osm_pbf_raw {
+    unsigned char *data;
+    uint32_t       len;
+};
+extern int osm_pbf_read_raw(OSM_File *F, struct osm_pbf_raw *r);
+extern PrimitiveBlock *osm_pbf_unpack_raw(struct osm_pbf_raw *r);
+
+/* pbf-write.c */
+typedef struct _osm_pbf_writer OSM_PBF_Writer;
+#define OSM_PBF_LOCATIONS_ON_WAYS 0x01
+#define OSM_PBF_BLOCK_BBOX        0x02  /* bbox of each block in its indexdata */
+#define OSM_PBF_SORTED            0x04  /* the caller writes by type, then id */
+#define OSM_PBF_HILBERT           0x08  /* by type, then Hilbert index (reorder.c) */
+extern OSM_PBF_Writer *osm_pbf_write_header(char *who, FILE *outfh, OSM_BBox *bbox,
+                                    uint32_t block_size, int level);
+extern OSM_PBF_Writer *osm_pbf_write_header_opt(char *who, FILE *outfh, OSM_BBox *bbox,
+                                    uint32_t block_size, int level, uint32_t flags);
+extern int osm_pbf_write_node(OSM_Node *n, OSM_PBF_Writer *W);
+extern int osm_pbf_write_way(OSM_Way *w, OSM_PBF_Writer *W);
+extern int osm_pbf_write_relation(OSM_Relation *r, OSM_PBF_Writer *W);
+extern void osm_pbf_write_extend(OSM_PBF_Writer *W, double lat, double lon);
+extern int osm_pbf_write_footer(OSM_PBF_Writer *W);
 
 /* nodes.c */
 extern int osm_node_pos(OSM_Node_List *n, uint64_t id);
@@ -147,8 +226,14 @@ extern void osm_node_list_sort(OSM_Node_List *n);
 
 /* bbox.c */
 extern OSM_BBox *osm_bbox_from_nodes(OSM_Node_List *n);
+extern OSM_BBox *osm_bbox_parse(const char *str);
+extern int osm_bbox_contains(OSM_BBox *box, double lat, double lon);
+extern int osm_bbox_intersects(OSM_BBox *a, OSM_BBox *b);
 /* open.c */
+extern int osm_open_warn;
 extern OSM_File *osm_open(const char *filename, enum OSM_File_Type type);
+extern int osm_rewind(OSM_File *F);
+extern void osm_close(OSM_File *F);
 /* parse.c */
 extern OSM_Data *osm_parse(OSM_File *F,
               int mode,
@@ -158,18 +243,371 @@ extern OSM_Data *osm_parse(OSM_File *F,
               int (*rel_filter)(OSM_Relation *)/*,
               int (*cset_filter)(OSM_Changeset *) */
         );
+extern void osm_parse_options_init(OSM_Parse_Options *opt);
+extern OSM_Data *osm_parse_opt(OSM_File *F, OSM_Parse_Options *opt);
+extern int osm_parse_has_filter(OSM_Parse_Options *opt, int type);
+extern int osm_parse_in_area(OSM_Parse_Options *opt, double lat, double lon);
+extern int osm_parse_node_ok(OSM_Parse_Options *opt, OSM_Node *n);
+extern int osm_parse_way_ok(OSM_Parse_Options *opt, OSM_Way *w);
+extern int osm_parse_relation_ok(OSM_Parse_Options *opt, OSM_Relation *r);
+extern OSM_Data *osm_new_data(uint32_t size);
+extern int osm_scan(OSM_File *F, uint32_t types,
+                int (*block)(OSM_Data *d, void *ctx), void *ctx);
 
 /* gpx-write.c */
-extern uint64_t *osm_gpx_write_init(OSM_Data *data, uint32_t *num);
+typedef struct _osm_gpx_writer OSM_GPX_Writer;
 extern void osm_gpx_write_header(char *who, FILE *outfh);
 extern void osm_gpx_write_footer(FILE *outfh);
 extern void osm_gpx_write_tags(OSM_Tag_List *t, FILE *outfh);
 extern void osm_gpx_write_node(OSM_Node *n, FILE *outfh, int is_trkpt);
-extern void osm_gpx_write(OSM_Data *data, FILE *outfh, char *creator);
+extern OSM_GPX_Writer *osm_gpx_writer_new(FILE *outfh, char *creator);
+extern int osm_gpx_way_nodes(OSM_Data *d, void *ctx);
+extern int osm_gpx_write_block(OSM_Data *d, void *ctx);
+extern void osm_gpx_writer_close(OSM_GPX_Writer *G);
+extern int osm_gpx_write(OSM_File *F, FILE *outfh, char *creator);
 
-/* shortcuts */
-#define osm_close(f) { fclose(f->file); free(f); }
+/* idset.c */
+typedef struct _osm_id_set OSM_Id_Set;
+typedef struct _osm_id_map OSM_Id_Map;
+extern OSM_Id_Set *osm_idset_new();
+extern int osm_idset_add(OSM_Id_Set *s, uint64_t id);
+extern int osm_idset_has(OSM_Id_Set *s, uint64_t id);
+extern void osm_idset_del(OSM_Id_Set *s, uint64_t id);
+extern uint64_t osm_idset_count(OSM_Id_Set *s);
+extern void osm_idset_free(OSM_Id_Set *s);
+extern OSM_Id_Map *osm_idmap_new(uint64_t expected);
+extern int osm_idmap_put(OSM_Id_Map *m, uint64_t id, void *val);
+extern void *osm_idmap_get(OSM_Id_Map *m, uint64_t id);
+extern uint64_t osm_idmap_count(OSM_Id_Map *m);
+extern void osm_idmap_free(OSM_Id_Map *m);
+
+/* threads.c */
+extern int osm_threads_num(int wanted);
+extern void osm_threads_run(int num, void (*worker)(int id, int num, void *arg), void *arg);
+
+/* dupes.c */
+struct osm_dupe {
+    uint64_t way_a;
+    uint64_t way_b;
+    uint32_t segments;  /* number of shared segments */
+    double   length;    /* length of the shared segments in meters */
+};
+struct osm_dupes {
+    uint32_t num;
+    uint32_t size;
+    struct osm_dupe *data;
+};
+extern struct osm_dupes *osm_find_dupes(OSM_Way_List *ways, OSM_Node_List *nodes, int threads);
+extern void osm_free_dupes(struct osm_dupes *d);
+
+/* extract.c */
+typedef struct _osm_extract {
+    char       *file;   /* output, .osm XML */
+    OSM_BBox   *bbox;   /* NULL: no area restriction */
+    OSM_Poly   *poly;   /* NULL: no polygon */
+    OSM_Filter *filter; /* NULL: all objects */
+} OSM_Extract;
+extern int osm_extract(OSM_File *F, OSM_Extract *ex, int num, int threads, char *creator);
+extern OSM_Extract *osm_extract_read_config(const char *file, int *num);
+extern void osm_extract_free(OSM_Extract *ex, int num);
+
+/* changeset.c */
+extern OSM_CSet_List *osm_cset_new(uint32_t size);
+extern void osm_cset_free(OSM_CSet_List *cs);
+extern int osm_cset_add(OSM_CSet_List *cs, uint64_t id, uint64_t created_at,
+                    uint64_t closed_at, uint32_t uid, int open, OSM_BBox *bbox);
+extern int osm_cset_append(OSM_CSet_List *dst, OSM_CSet_List *src);
+extern int osm_cset_index(OSM_CSet_List *cs);
+extern int64_t osm_cset_find(OSM_CSet_List *cs, uint64_t id);
+extern int64_t osm_cset_query(OSM_CSet_List *cs, uint32_t uid, uint64_t from, uint64_t to,
+                    OSM_BBox *bbox, uint32_t **res);
+extern OSM_CSet_List *osm_cset_read(OSM_File *F);
+
+/* osc.c */
+enum {
+    OSM_CHANGE_CREATE = 1,
+    OSM_CHANGE_MODIFY,
+    OSM_CHANGE_DELETE
+};
+struct osm_change {
+    uint64_t id;
+    uint32_t seq;       /* order read, the last change of an object wins */
+    int      action;    /* OSM_CHANGE_* */
+    void    *obj;       /* OSM_Node, OSM_Way or OSM_Relation, NULL for deletes */
+};
+struct osm_change_list {
+    uint32_t num;
+    uint32_t size;
+    struct osm_change *data;
+};
+typedef struct _osm_diff {
+    struct osm_change_list nodes;   /* sorted by id, one change per object */
+    struct osm_change_list ways;
+    struct osm_change_list relations;
+    uint32_t seq;
+} OSM_Diff;
+extern OSM_Diff *osm_diff_new();
+extern int osm_diff_read(OSM_Diff *d, const char *file);
+extern int osm_diff_apply(OSM_File *F, OSM_Diff *d, FILE *out, int out_type,
+                            uint32_t block_size, int level, char *creator);
+extern void osm_diff_free(OSM_Diff *d);
+
+/* store.c */
+typedef struct _osm_store OSM_Store;
+/*
+ * views into the mapped store, tags are key / value pairs of offsets into
+ * the string pool of the view, see osm_store_str()
+ */
+struct osm_store_node {
+    uint64_t id;
+    double   lat;
+    double   lon;
+    uint32_t version;   /* only for nodes with tags */
+    uint32_t num_tags;
+    const uint32_t *tags;
+    const char *pool;
+};
+struct osm_store_way {
+    uint64_t id;
+    uint32_t version;
+    uint32_t num_refs;
+    const uint64_t *refs;
+    uint32_t num_tags;
+    const uint32_t *tags;
+    const char *pool;
+};
+struct osm_store_member {
+    uint64_t ref;
+    uint32_t role;      /* string offset */
+    uint32_t type;      /* OSM_REL_MEMBER_TYPE_* */
+};
+struct osm_store_relation {
+    uint64_t id;
+    uint32_t version;
+    uint32_t num_members;
+    const struct osm_store_member *members;
+    uint32_t num_tags;
+    const uint32_t *tags;
+    const char *pool;
+};
+extern int osm_store_build(OSM_File *F, const char *file);
+extern OSM_Store *osm_store_open(const char *file);
+extern void osm_store_close(OSM_Store *s);
+extern int osm_store_refresh(OSM_Store *s);
+extern int osm_store_update(const char *file, OSM_Diff *d);
+extern int osm_store_compact(const char *file);
+extern int osm_store_get_node(OSM_Store *s, uint64_t id, struct osm_store_node *n);
+extern int osm_store_get_way(OSM_Store *s, uint64_t id, struct osm_store_way *w);
+extern int osm_store_get_relation(OSM_Store *s, uint64_t id, struct osm_store_relation *r);
+#define osm_store_str(v, off) ((v)->pool + (off))
+
+/* backref.c */
+typedef struct _osm_backrefs OSM_Backrefs;
+extern int osm_backrefs_build(OSM_File *F, const char *file, int threads);
+extern OSM_Backrefs *osm_backrefs_open(const char *file);
+extern void osm_backrefs_close(OSM_Backrefs *B);
+extern const uint64_t *osm_backrefs_get(OSM_Backrefs *B, int type, uint64_t id, uint64_t *num);
+
+/* locations.c */
+typedef struct _osm_loc_index OSM_Loc_Index;
+extern OSM_Loc_Index *osm_loc_index_new();
+extern int osm_loc_index_add(OSM_Loc_Index *I, uint64_t id, double lat, double lon);
+extern void osm_loc_index_sort(OSM_Loc_Index *I, int threads);
+extern OSM_Loc_Index *osm_loc_index_read(OSM_File *F, int threads);
+extern int osm_loc_index_get(OSM_Loc_Index *I, uint64_t id, OSM_Location *loc);
+extern uint64_t osm_loc_index_count(OSM_Loc_Index *I);
+extern void osm_loc_index_free(OSM_Loc_Index *I);
+extern int osm_way_locations(OSM_Loc_Index *I, OSM_Way *w);
+extern int osm_data_locations(OSM_Data *d, OSM_Loc_Index *I);
+extern int osm_scan_locations(OSM_File *F, uint32_t types, OSM_Loc_Index *I,
+                int (*block)(OSM_Data *d, void *ctx), void *ctx);
+
+/* relgraph.c */
+typedef struct _osm_rel_graph OSM_Rel_Graph;
+#define OSM_RELGRAPH_MEMBER(type, ref) (((uint64_t)(type) << 62) | (ref))
+#define OSM_RELGRAPH_TYPE(m) ((int)((m) >> 62))
+#define OSM_RELGRAPH_REF(m) ((m) & ((1ULL << 62) - 1))
+extern OSM_Rel_Graph *osm_relgraph_new();
+extern void osm_relgraph_free(OSM_Rel_Graph *G);
+extern int osm_relgraph_add(OSM_Rel_Graph *G, uint64_t id);
+extern int osm_relgraph_member(OSM_Rel_Graph *G, int type, uint64_t ref);
+extern int osm_relgraph_index(OSM_Rel_Graph *G, int threads);
+extern const uint64_t *osm_relgraph_get(OSM_Rel_Graph *G, uint64_t id, uint32_t *num);
+extern uint32_t osm_relgraph_count(OSM_Rel_Graph *G);
+extern int64_t osm_relgraph_closure(OSM_Rel_Graph *G, struct osm_members *wanted,
+                            struct osm_members *added);
+
+/* tile.c */
+#define OSM_TILE_MAX_ZOOM 16
+extern void osm_tile_xy(double lat, double lon, int zoom, uint32_t *x, uint32_t *y);
+extern void osm_tile_bbox(uint32_t x, uint32_t y, int zoom, OSM_BBox *bbox);
+extern int64_t osm_tile_split(OSM_File *F, int zoom, const char *dir, int file_type,
+                        uint64_t memory, int threads, char *creator);
+
+/* reorder.c */
+extern uint64_t osm_hilbert(double lat, double lon);
+extern int osm_reorder(OSM_File *F, FILE *out, uint32_t block_size, int level, uint32_t flags,
+                    int threads, char *creator);
+
+/* tagstats.c */
+typedef struct _osm_tag_stats OSM_Tag_Stats;
+#define OSM_TAGSTATS_CSV  0
+#define OSM_TAGSTATS_JSON 1
+extern OSM_Tag_Stats *osm_tagstats(OSM_File *F, uint32_t top, int threads);
+extern int osm_tagstats_write(OSM_Tag_Stats *S, FILE *out, int format);
+extern void osm_tagstats_free(OSM_Tag_Stats *S);
+
+/* readahead.c */
+#define OSM_READ_CHUNK  (1024 * 1024)
+#define OSM_READ_WINDOW 8
+#define OSM_READ_DIRECT 0x01    /* O_DIRECT, if the file system allows */
+#define OSM_READ_THREAD 0x02    /* pread() in a thread instead of io_uring */
+#define OSM_READ_OFF    0x04    /* no read-ahead, stdio reads */
+extern int osm_readahead(OSM_File *F, int window, uint32_t flags);
+extern int osm_reader_seek(OSM_Reader *R, off_t off);
+extern ssize_t osm_reader_read(OSM_Reader *R, void *dst, size_t len);
+extern void osm_reader_free(OSM_Reader *R);
+
+/* merge.c */
+extern int osm_merge(OSM_File **inputs, int num, FILE *out,
+                uint32_t block_size, int level, char *who);
+
+/* extsort.c */
+#define OSM_SORT_MEM (512 * 1024 * 1024)
+extern int osm_sort_file(OSM_File *F, FILE *out, size_t mem, int threads,
+                const char *tmp_dir, uint32_t block_size, int level, char *who);
+
+/* area.c */
+struct osm_area {
+    uint64_t  id;           /* of the way or relation */
+    int       type;         /* OSM_REL_MEMBER_TYPE_WAY or _RELATION */
+    OSM_Tag_List *tags;     /* of the way or relation, not copied */
+    uint32_t  num_rings;
+    uint32_t *ring;         /* ring i: points ring[i] .. ring[i+1]-1 */
+    uint8_t  *outer;        /* per ring: 1 outer, 0 inner */
+    double   *coords;       /* lon, lat per point, rings are closed. One
+                               allocation with ring and outer */
+};
+struct osm_areas {
+    uint32_t num;
+    uint32_t failed;        /* candidates without a valid geometry */
+    struct osm_area *data;
+};
+extern struct osm_areas *osm_areas_build(OSM_Way_List *ways, OSM_Relation_List *rels,
+                                    OSM_Loc_Index *index, int threads);
+extern void osm_free_areas(struct osm_areas *A);
 
+/* stats.c */
+enum osm_stat {
+    OSM_STAT_BYTES_READ,
+    OSM_STAT_BLOBS,
+    OSM_STAT_BLOBS_SKIPPED,
+    OSM_STAT_INFLATED,      /* bytes */
+    OSM_STAT_INFLATE_NS,
+    OSM_STAT_DECODE_NS,
+    OSM_STAT_NODES_SEEN,
+    OSM_STAT_WAYS_SEEN,
+    OSM_STAT_RELATIONS_SEEN,
+    OSM_STAT_NODES_FILTERED,
+    OSM_STAT_WAYS_FILTERED,
+    OSM_STAT_RELATIONS_FILTERED,
+    OSM_STAT_NODES_KEPT,
+    OSM_STAT_WAYS_KEPT,
+    OSM_STAT_RELATIONS_KEPT,
+    OSM_STAT_NUM
+};
+/* by OSM_REL_MEMBER_TYPE_* */
+#define OSM_STAT_SEEN(type)     (OSM_STAT_NODES_SEEN + (type) - 1)
+#define OSM_STAT_FILTERED(type) (OSM_STAT_NODES_FILTERED + (type) - 1)
+#define OSM_STAT_KEPT(type)     (OSM_STAT_NODES_KEPT + (type) - 1)
+enum osm_mem {
+    OSM_MEM_BLOB,
+    OSM_MEM_INFLATE,
+    OSM_MEM_MEMBERS,
+    OSM_MEM_LOCATIONS,
+    OSM_MEM_TILES,
+    OSM_MEM_READAHEAD,
+    OSM_MEM_SORT,
+    OSM_MEM_NUM
+};
+struct osm_stats {
+    uint64_t counter[OSM_STAT_NUM];
+    uint64_t mem_peak[OSM_MEM_NUM];
+    uint64_t max_rss;       /* kB */
+};
+extern int osm_stats_on;
+extern void osm_stats_enable(int on);
+extern void osm_stats_count(int counter, uint64_t n);
+extern uint64_t osm_stats_clock();
+extern void osm_stats_mem(int category, int64_t bytes);
+extern void osm_stats_get(struct osm_stats *s);
+extern void osm_stats_reset();
+extern void osm_stats_print(FILE *fh);
+extern void osm_stats_args(int *argc, char **argv);
+#ifdef OSM_NO_STATS
+# define osm_stats_add(c, n) do { } while (0)
+# define osm_stats_alloc(c, n) do { } while (0)
+# define osm_stats_start() 0
+# define osm_stats_stop(c, t) do { (void)(t); } while (0)
+#else
+# define osm_stats_add(c, n) \
+    do { if (osm_stats_on) osm_stats_count((c), (n)); } while (0)
+# define osm_stats_alloc(c, n) \
+    do { if (osm_stats_on) osm_stats_mem((c), (n)); } while (0)
+# define osm_stats_start() (osm_stats_on ? osm_stats_clock() : 0)
+# define osm_stats_stop(c, t) \
+    do { if (osm_stats_on) osm_stats_count((c), osm_stats_clock() - (t)); } while (0)
+#endif
+
+/* trace.c */
+#define OSM_TRACE_PASS   1  /* per pass over the input */
+#define OSM_TRACE_BLOCK  2  /* per block */
+#define OSM_TRACE_OBJECT 3  /* per node, way or relation */
+#define OSM_TRACE_DETAIL 4  /* per tag, lookup, ... */
+#ifndef OSM_TRACE_LEVEL
+# define OSM_TRACE_LEVEL 0
+#endif
+#define OSM_TRACE_ARGS 4
+struct osm_trace_point {
+    const char *file;
+    const char *func;
+    const char *fmt;    /* printf() format, integer and double conversions only */
+    int line;
+    int level;
+};
+struct osm_trace_event {
+    uint64_t ns;
+    uint64_t point;     /* struct osm_trace_point *, in a dump: index */
+    uint32_t thread;
+    uint32_t num;
+    uint64_t args[OSM_TRACE_ARGS];
+};
+extern int osm_trace_on;
+extern void osm_trace_init();
+extern void osm_trace_event(const struct osm_trace_point *p, const uint64_t *args, uint32_t num);
+extern uint64_t osm_trace_dbl(double d);
+extern int osm_trace_dump(const char *file);
+/* osm_trace(OSM_TRACE_OBJECT, "node=%lu at %.7f", id, osm_trace_dbl(lat)); */
+#define osm_trace(level, fmt, ...) \
+    do { \
+        if ((level) <= OSM_TRACE_LEVEL && osm_trace_on) { \
+            static const struct osm_trace_point _tp = \
+                { __FILE__, __FUNCTION__, fmt, __LINE__, level }; \
+            const uint64_t _ta[] = { 0, __VA_ARGS__ }; \
+            osm_trace_event(&_tp, _ta + 1, sizeof(_ta) / sizeof(_ta[0]) - 1); \
+        } \
+    } while (0)
+
+/* sort.c */
+struct osm_sort_pair {
+    uint64_t key;
+    uint64_t val;       /* location, pointer, offset, ... */
+};
+extern void osm_sort_ids(uint64_t *ids, size_t num, int threads);
+extern void osm_sort_pairs(void *pairs, size_t num, int threads);
+extern void osm_sort_pairs_tmp(void *pairs, size_t num, void *tmp, int threads);
+
+/* shortcuts */
 #define trim_left(l) { while (*l && (*l == ' ' || *l == '\t')) ++l; }
 
 #define FETCH_TAG(t, n) { \
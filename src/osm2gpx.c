@@ -15,11 +15,10 @@
 int debug = 0;
 char *name = "osm2gpx";
 
-int skip_rels(OSM_Relation *r) { return 0; }
-
 int main(int argc, char **argv) {
+    osm_stats_args(&argc, argv);
     if (argc == 1 || argv[1][0] == '-') {
-        fprintf(stderr, "%s: Usage: %s file.osm > file.gpx\n",
+        fprintf(stderr, "%s: Usage: %s [--stats] file.osm > file.gpx\n",
                         name, name);
         exit(1);
     }
@@ -32,12 +31,9 @@ int main(int argc, char **argv) {
     if (F == NULL)
         return 1;
 
-    OSM_Data *O = osm_xml_parse(F, OSMDATA_DUMP, NULL, NULL, NULL, skip_rels);
-    if (O == NULL)
+    if (osm_gpx_write(F, stdout, name) != 0)
         return 1;
-
     osm_close(F);
-    osm_gpx_write(O, stdout, name);
     return 0;
 }
 
@@ -32,8 +32,9 @@ int rel2xml(OSM_Relation *r) {
 char *name = "osmpbf2osm";
 
 int main(int argc, char **argv) {
+    osm_stats_args(&argc, argv);
     if (argc == 1 || argv[1][0] == '-') {
-        fprintf(stderr, "%s: Usage: %s file.osm.pbf > file.osm\n",
+        fprintf(stderr, "%s: Usage: %s [--stats] file.osm.pbf > file.osm\n",
                         name, name);
         exit(1);
     }
@@ -1,5 +1,5 @@
 /*
- * parse.c - wrapper for osm_(xml|pbf)_parse()
+ * parse.c - wrapper for osm_(xml|pbf)_parse() and osm_(xml|pbf)_scan()
  *        
  * This file is licenced licenced under the General Public License 3. 
  *
@@ -7,9 +7,117 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 
 #include "osm.h"
 
+/*
+ * the filters return 1 to keep an object. node_filter, way_filter and
+ * rel_filter are called from the parsing thread only. The reentrant
+ * *_filter_r get filter_ctx as second argument; with filter_flags
+ * OSM_FILTER_THREAD_SAFE they are called on opt->threads threads at the
+ * same time, each object once, for the .osm.pbf blocks being unpacked
+ * in parallel (see pbf_prefilter() in pbf.c). They must then only read
+ * ctx, or synchronize their writes themselves.
+ */
+void osm_parse_options_init(OSM_Parse_Options *opt) {
+    opt->mode        = OSMDATA_DUMP;
+    opt->bbox        = NULL;
+    opt->poly        = NULL;
+    opt->node_filter = NULL;
+    opt->way_filter  = NULL;
+    opt->rel_filter  = NULL;
+    opt->filter      = NULL;
+    opt->node_filter_r = NULL;
+    opt->way_filter_r  = NULL;
+    opt->rel_filter_r  = NULL;
+    opt->filter_ctx    = NULL;
+    opt->filter_flags  = 0;
+    opt->threads       = 0;
+}
+
+/* is any filter set for objects of type (OSM_REL_MEMBER_TYPE_*)? */
+int osm_parse_has_filter(OSM_Parse_Options *opt, int type) {
+    if (opt->filter != NULL)
+        return 1;
+    switch (type) {
+        case OSM_REL_MEMBER_TYPE_NODE:
+            return opt->node_filter != NULL || opt->node_filter_r != NULL;
+        case OSM_REL_MEMBER_TYPE_WAY:
+            return opt->way_filter != NULL || opt->way_filter_r != NULL;
+        case OSM_REL_MEMBER_TYPE_RELATION:
+            return opt->rel_filter != NULL || opt->rel_filter_r != NULL;
+    }
+    return 0;
+}
+
+/* is the location in the bbox and the polygon (if set) of OSMDATA_BBOX? */
+int osm_parse_in_area(OSM_Parse_Options *opt, double lat, double lon) {
+    if (opt->bbox != NULL && !osm_bbox_contains(opt->bbox, lat, lon))
+        return 0;
+    return opt->poly == NULL || osm_poly_contains(opt->poly, lat, lon);
+}
+
+/* the osm_parse_*_ok() return 1 if the object passes all filters */
+int osm_parse_node_ok(OSM_Parse_Options *opt, OSM_Node *n) {
+    if (opt->node_filter != NULL && !opt->node_filter(n))
+        return 0;
+    if (opt->node_filter_r != NULL && !opt->node_filter_r(n, opt->filter_ctx))
+        return 0;
+    return opt->filter == NULL || osm_filter_node(opt->filter, n);
+}
+
+int osm_parse_way_ok(OSM_Parse_Options *opt, OSM_Way *w) {
+    if (opt->way_filter != NULL && !opt->way_filter(w))
+        return 0;
+    if (opt->way_filter_r != NULL && !opt->way_filter_r(w, opt->filter_ctx))
+        return 0;
+    return opt->filter == NULL || osm_filter_way(opt->filter, w);
+}
+
+int osm_parse_relation_ok(OSM_Parse_Options *opt, OSM_Relation *r) {
+    if (opt->rel_filter != NULL && !opt->rel_filter(r))
+        return 0;
+    if (opt->rel_filter_r != NULL && !opt->rel_filter_r(r, opt->filter_ctx))
+        return 0;
+    return opt->filter == NULL || osm_filter_relation(opt->filter, r);
+}
+
+OSM_Data *osm_parse_opt(OSM_File *F, OSM_Parse_Options *opt) {
+    OSM_Parse_Options o = *opt;
+
+    if (o.mode & OSMDATA_DUMP)
+        o.mode = OSMDATA_DUMP;
+    else if (o.mode & OSMDATA_REL)
+        o.mode = OSMDATA_REL;
+    else if (o.mode & OSMDATA_WAY)
+        o.mode = OSMDATA_WAY;
+    else if (o.mode & OSMDATA_NODE)
+        o.mode = OSMDATA_NODE;
+    else if (o.mode & OSMDATA_BBOX)
+        o.mode = OSMDATA_BBOX;
+    else
+        o.mode = 0;
+
+    if (F->type == OSM_FTYPE_PBF) {
+        /* changesets are collected on the side, OSMDATA_CSET alone is ok */
+        o.mode |= opt->mode & OSMDATA_CSET;
+        return osm_pbf_parse_opt(F, &o);
+    }
+    else if (F->type == OSM_FTYPE_XML) {
+        if (o.mode == 0) {
+            fprintf(stderr, "changesets are only read from .osm.pbf files\n");
+            return (OSM_Data *)NULL;
+        }
+        return osm_xml_parse_opt(F, &o);
+    }
+
+    fprintf(stderr, "cannot parse unknown file type\n");
+    return (OSM_Data *)NULL;
+}
+
 OSM_Data *osm_parse(OSM_File *F,
               int mode,
               OSM_BBox *bbox,
@@ -19,24 +127,58 @@ OSM_Data *osm_parse(OSM_File *F,
               int (*cset_filter)(OSM_Changeset *) */
         )
 {
-    if (mode & OSMDATA_DUMP)
-        mode = OSMDATA_DUMP;
-    else if (mode & OSMDATA_REL)
-        mode = OSMDATA_REL;
-    else if (mode & OSMDATA_WAY)
-        mode = OSMDATA_WAY;
-    else if (mode & OSMDATA_NODE)
-        mode = OSMDATA_NODE;
-    else if (mode & OSMDATA_BBOX)
-        mode = OSMDATA_BBOX;
+    OSM_Parse_Options opt;
+    osm_parse_options_init(&opt);
+    opt.mode        = mode;
+    opt.bbox        = bbox;
+    opt.node_filter = node_filter;
+    opt.way_filter  = way_filter;
+    opt.rel_filter  = rel_filter;
+    return osm_parse_opt(F, &opt);
+}
+
+/* an empty OSM_Data with room for size objects of each type */
+OSM_Data *osm_new_data(uint32_t size) {
+    OSM_Data *d = malloc(sizeof(OSM_Data));
+    if (d == NULL) {
+        fprintf(stderr, "failed to malloc OSM_Data: %s\n", strerror(errno));
+        return (OSM_Data *)NULL;
+    }
+    if (size < 16)
+        size = 16;
+    d->nodes = malloc(sizeof(OSM_Node_List));
+    d->nodes->num  = 0;
+    d->nodes->size = size;
+    d->nodes->data = malloc(sizeof(OSM_Node *) * size);
+
+    d->ways = malloc(sizeof(OSM_Way_List));
+    d->ways->num  = 0;
+    d->ways->size = size;
+    d->ways->data = malloc(sizeof(OSM_Way *) * size);
 
+    d->relations = malloc(sizeof(OSM_Relation_List));
+    d->relations->num  = 0;
+    d->relations->size = size;
+    d->relations->data = malloc(sizeof(OSM_Relation *) * size);
+
+    d->changesets = NULL;
+    return d;
+}
+
+/*
+ * stream all objects of the wanted types through block() without keeping
+ * them, see osm_pbf_scan()
+ */
+int osm_scan(OSM_File *F, uint32_t types,
+                int (*block)(OSM_Data *d, void *ctx), void *ctx)
+{
     if (F->type == OSM_FTYPE_PBF)
-        return osm_pbf_parse(F, mode, bbox, node_filter, way_filter, rel_filter);
+        return osm_pbf_scan(F, types, block, ctx);
     else if (F->type == OSM_FTYPE_XML)
-        return osm_xml_parse(F, mode, bbox, node_filter, way_filter, rel_filter);
+        return osm_xml_scan(F, types, block, ctx);
 
-    fprintf(stderr, "cannot parse unknown file type\n");
-    return (OSM_Data *)NULL;
+    fprintf(stderr, "cannot scan unknown file type\n");
+    return -1;
 }
 
 /* END */
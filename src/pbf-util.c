@@ -13,6 +13,7 @@
  */
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <stdio.h>
 #include <arpa/inet.h>
 #include <time.h>
@@ -25,9 +26,10 @@
 #include "osm.h"
 
 void osm_pbf_timestamp(const long int deltatimestamp, char *timestamp) {
-    struct tm *ts = gmtime(&deltatimestamp);
+    struct tm tm, *ts = gmtime_r(&deltatimestamp, &tm);
     if (ts == NULL) {
         timestamp[0] = '\0';
+        return;
     }
 
     strftime(timestamp, 21, "%Y-%m-%dT%H:%M:%SZ" , ts);
@@ -38,6 +40,7 @@ unsigned char *osm_pbf_uncompress_blob(Blob *bmsg) {
         int ret;
         unsigned char *uncompressed;
         z_stream strm;
+        uint64_t t = osm_stats_start();
         strm.zalloc = Z_NULL;
         strm.zfree = Z_NULL;
         strm.opaque = Z_NULL;
@@ -65,6 +68,9 @@ unsigned char *osm_pbf_uncompress_blob(Blob *bmsg) {
             fprintf(stderr, "Zlib compression failed\n");
             return NULL;
         }
+        osm_stats_stop(OSM_STAT_INFLATE_NS, t);
+        osm_stats_add(OSM_STAT_INFLATED, bmsg->raw_size);
+        osm_stats_alloc(OSM_MEM_INFLATE, bmsg->raw_size);
         return uncompressed;
     }
     else if (bmsg->has_lzma_data) {
@@ -81,19 +87,28 @@ unsigned char *osm_pbf_uncompress_blob(Blob *bmsg) {
     return NULL;
 }
 
+/*
+ * read len bytes of F to dst, skip them if dst is NULL. Through the
+ * read-ahead of osm_readahead() if there is one, stdio otherwise
+ */
+static size_t pbf_read(OSM_File *F, void *dst, size_t len) {
+    if (F->reader != NULL) {
+        ssize_t r = osm_reader_read(F->reader, dst, len);
+        return r < 0 ? 0 : r;
+    }
+    if (dst == NULL)
+        return fseek(F->file, len, SEEK_CUR) == 0 ? len : 0;
+    return fread(dst, 1, len, F->file);
+}
+
 uint32_t osm_pbf_bh_length(OSM_File *F) {
     uint32_t length;
-    char lenbuf[4];
-    unsigned int i;
-    unsigned char c;
+    size_t got = pbf_read(F, &length, 4);
 
-    for (i=0; i<4 && (c=fgetc(F->file)) != EOF; i++) {
-        lenbuf[i] = c;
-    }
-    // FIXME pbf-util.c:81: warning: dereferencing type-punned pointer
-    //           will break strict-aliasing rules
-    length = ntohl(*((uint32_t *) lenbuf));  // convert the buffer to a value
-    return length;
+    osm_stats_add(OSM_STAT_BYTES_READ, got);
+    if (got != 4) /* EOF */
+        return -1;
+    return ntohl(length);
 }
 
 void osm_pbf_free_bh(BlockHeader *bh) {
@@ -103,29 +118,60 @@ void osm_pbf_free_bh(BlockHeader *bh) {
 BlockHeader *osm_pbf_get_bh(OSM_File *F, uint32_t len) {
     BlockHeader *bh = NULL;
     unsigned char *buffer = NULL;
-    unsigned char c;
-    int i = 0;
+    size_t got;
 
     buffer = (unsigned char *) malloc(len * sizeof(char));
-    // FIXME if (buffer == NULL) ... 
-    for (i = 0; i < len && (c=fgetc(F->file)) != EOF; i++) {
-        buffer[i] = c;
+    if (buffer == NULL) {
+        fprintf(stderr, "failed to malloc BlockHeader: %s\n", strerror(errno));
+        return (BlockHeader *)NULL;
     }
+    got = pbf_read(F, buffer, len);
+    osm_stats_add(OSM_STAT_BYTES_READ, got);
 
-    bh = block_header__unpack(NULL, len, buffer);
+    bh = block_header__unpack(NULL, got, buffer);
     free(buffer);
     if (bh == NULL) {
         fprintf(stderr, "Error unpacking BlockHeader message\n");
-        free(buffer);
         return (BlockHeader *)NULL;
     }
 
     return bh;
 }
 
+/*
+ * the bbox of the objects of the block from the indexdata of the header,
+ * as written with OSM_PBF_BLOCK_BBOX. 0 if there is one, -1 if not
+ */
+int osm_pbf_bh_bbox(BlockHeader *bh, OSM_BBox *bbox) {
+    HeaderBBox *B;
+    if (!bh->has_indexdata || bh->indexdata.len == 0)
+        return -1;
+    B = header_bbox__unpack(NULL, bh->indexdata.len, bh->indexdata.data);
+    if (B == NULL)
+        return -1;
+    bbox->left_lon   = NANO_DEGREE * B->left;
+    bbox->right_lon  = NANO_DEGREE * B->right;
+    bbox->top_lat    = NANO_DEGREE * B->top;
+    bbox->bottom_lat = NANO_DEGREE * B->bottom;
+    header_bbox__free_unpacked(B, &protobuf_c_system_allocator);
+    return 0;
+}
+
+/* skip the blob after the header, instead of osm_pbf_get_blob() */
+int osm_pbf_skip_blob(OSM_File *F, uint32_t len) {
+    if (pbf_read(F, NULL, len) != len) {
+        fprintf(stderr, "failed to skip blob of %u bytes\n", len);
+        return -1;
+    }
+    osm_stats_add(OSM_STAT_BLOBS_SKIPPED, 1);
+    return 0;
+}
+
 void osm_pbf_free_blob(Blob *B, unsigned char *uncompressed) {
-    if (!B->has_raw)
+    if (!B->has_raw) {
         free(uncompressed);
+        osm_stats_alloc(OSM_MEM_INFLATE, -(int64_t)B->raw_size);
+    }
     blob__free_unpacked(B, &protobuf_c_system_allocator);
 }
 
@@ -133,15 +179,20 @@ Blob *osm_pbf_get_blob(OSM_File *F, uint32_t len, unsigned char **uncompressed)
 {
     Blob *B = NULL;
     unsigned char *buffer;
-    unsigned char c;
-    int i = 0;
+    size_t got;
 
     buffer = (unsigned char *) malloc(len * sizeof(char));
-    for (i = 0; i < len && (c=fgetc(F->file)) != EOF; i++) {
-        buffer[i] = c;
+    if (buffer == NULL) {
+        fprintf(stderr, "failed to malloc blob: %s\n", strerror(errno));
+        return (Blob *)NULL;
     }
+    got = pbf_read(F, buffer, len);
+    osm_stats_add(OSM_STAT_BYTES_READ, got);
+    osm_stats_add(OSM_STAT_BLOBS, 1);
+    osm_stats_alloc(OSM_MEM_BLOB, len);
 
-    B = blob__unpack(NULL, len, buffer);
+    B = blob__unpack(NULL, got, buffer);
+    osm_stats_alloc(OSM_MEM_BLOB, -(int64_t)len);
     if (B == NULL) {
         fprintf(stderr, "Error unpacking Blob message\n");
         free(buffer);
@@ -162,13 +213,63 @@ Blob *osm_pbf_get_blob(OSM_File *F, uint32_t len, unsigned char **uncompressed)
     return B;
 }
 
+/*
+ * 1 if the OSMHeader of F announces Sort.Type_then_ID, 2 for
+ * Sort.Type_then_Hilbert (grouped by type, as the parsers need it, but
+ * not by id), 0 for neither, -1 if it cannot be read. F is rewound
+ */
+int osm_pbf_sorted(OSM_File *F) {
+    BlockHeader *bh;
+    Blob *B;
+    HeaderBlock *H;
+    unsigned char *uncompressed;
+    uint32_t len;
+    size_t i;
+    int ret = -1;
+
+    if (osm_rewind(F) != 0)
+        return -1;
+    len = osm_pbf_bh_length(F);
+    if (len == -1 || len == 0 || len > MAX_BLOCK_HEADER_SIZE)
+        goto done;
+    if ((bh = osm_pbf_get_bh(F, len)) == NULL)
+        goto done;
+    len = bh->datasize;
+    if (strcmp(bh->type, "OSMHeader") != 0 || len == 0 || len > MAX_BLOB_SIZE) {
+        osm_pbf_free_bh(bh);
+        goto done;
+    }
+    osm_pbf_free_bh(bh);
+    if ((B = osm_pbf_get_blob(F, len, &uncompressed)) == NULL)
+        goto done;
+    H = header_block__unpack(NULL, B->has_raw ? B->raw.len : B->raw_size, uncompressed);
+    if (H != NULL) {
+        ret = 0;
+        for (i=0; i<H->n_optional_features; i++) {
+            if (strcmp(H->optional_features[i], "Sort.Type_then_ID") == 0)
+                ret = 1;
+            else if (strcmp(H->optional_features[i], "Sort.Type_then_Hilbert") == 0)
+                ret = 2;
+        }
+        header_block__free_unpacked(H, &protobuf_c_system_allocator);
+    }
+    osm_pbf_free_blob(B, uncompressed);
+
+  done:
+    if (osm_rewind(F) != 0)
+        ret = -1;
+    return ret;
+}
+
 void osm_pbf_free_primitive(PrimitiveBlock *P) {
     primitive_block__free_unpacked(P, &protobuf_c_system_allocator);
 }
 
 PrimitiveBlock *osm_pbf_unpack_data(Blob *B, unsigned char *uncompressed) {
+    uint64_t t = osm_stats_start();
     PrimitiveBlock *P = 
             primitive_block__unpack(NULL, B->raw_size, uncompressed);
+    osm_stats_stop(OSM_STAT_DECODE_NS, t);
     if (P == NULL) {
         fprintf(stderr, "Error unpacking PrimitiveBlock message\n");
         return (PrimitiveBlock *)NULL;
@@ -176,3 +277,87 @@ PrimitiveBlock *osm_pbf_unpack_data(Blob *B, unsigned char *uncompressed) {
     return P;
 }
 
+
+/*
+ * read the next OSMData blob of F without unpacking it, so it can be
+ * unpacked by osm_pbf_unpack_raw() in another thread. Other blobs are
+ * skipped. Returns 1 for a blob, 0 at EOF and -1 on errors
+ */
+int osm_pbf_read_raw(OSM_File *F, struct osm_pbf_raw *r) {
+    BlockHeader *bh;
+    uint32_t len;
+    size_t got;
+    int is_data;
+
+    while (1) {
+        len = osm_pbf_bh_length(F);
+        if (len == -1) /* EOF */
+            return 0;
+        if (len <= 0 || len > MAX_BLOCK_HEADER_SIZE) {
+            fprintf(stderr, "Block Header isn't present or exceeds "
+                            "minimum/maximum size: %u\n", len);
+            return -1;
+        }
+        bh = osm_pbf_get_bh(F, len);
+        if (bh == NULL)
+            return -1;
+        len = bh->datasize;
+        is_data = strcmp(bh->type, "OSMData") == 0;
+        osm_pbf_free_bh(bh);
+        if (len <= 0 || len > MAX_BLOB_SIZE) {
+            fprintf(stderr, "Blob isn't present or exceeds "
+                            "minimum/maximum size\n");
+            return -1;
+        }
+        if (!is_data) {
+            if (pbf_read(F, NULL, len) != len) {
+                fprintf(stderr, "failed to skip blob of %u bytes\n", len);
+                return -1;
+            }
+            continue;
+        }
+
+        r->data = malloc(len);
+        if (r->data == NULL) {
+            fprintf(stderr, "failed to malloc blob: %s\n", strerror(errno));
+            return -1;
+        }
+        got = pbf_read(F, r->data, len);
+        osm_stats_add(OSM_STAT_BYTES_READ, got);
+        if (got != len) {
+            fprintf(stderr, "short read of blob: %lu of %u bytes\n", got, len);
+            free(r->data);
+            r->data = NULL;
+            return -1;
+        }
+        osm_stats_add(OSM_STAT_BLOBS, 1);
+        osm_stats_alloc(OSM_MEM_BLOB, len);
+        r->len = len;
+        return 1;
+    }
+}
+
+/* uncompress and unpack a blob from osm_pbf_read_raw(), frees r->data */
+PrimitiveBlock *osm_pbf_unpack_raw(struct osm_pbf_raw *r) {
+    PrimitiveBlock *P;
+    unsigned char *uncompressed;
+    Blob *B = blob__unpack(NULL, r->len, r->data);
+
+    free(r->data);
+    r->data = NULL;
+    osm_stats_alloc(OSM_MEM_BLOB, -(int64_t)r->len);
+    if (B == NULL) {
+        fprintf(stderr, "Error unpacking Blob message\n");
+        return (PrimitiveBlock *)NULL;
+    }
+    if (B->has_raw)
+        uncompressed = (unsigned char *)B->raw.data;
+    else if ((uncompressed = osm_pbf_uncompress_blob(B)) == NULL) {
+        fprintf(stderr, "failed to uncompress Blob\n");
+        blob__free_unpacked(B, &protobuf_c_system_allocator);
+        return (PrimitiveBlock *)NULL;
+    }
+    P = osm_pbf_unpack_data(B, uncompressed);
+    osm_pbf_free_blob(B, uncompressed);
+    return P;
+}
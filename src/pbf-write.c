@@ -0,0 +1,673 @@
+/*
+ * pbf-write.c - .osm.pbf writing
+ *
+ * Objects are collected until block_size objects or an object of another
+ * type is written, then the block is packed as one PrimitiveGroup (nodes
+ * as DenseNodes), zlib compressed (level 0: stored raw) and written. With
+ * the same objects and settings the output is the same byte for byte.
+ *
+ *   W = osm_pbf_write_header("me", stdout, bbox, 8000, 6);
+ *   osm_pbf_write_node(n, W); ...
+ *   osm_pbf_write_footer(W);    (flushes and frees W)
+ *
+ * Ways with locations (w->locs) get them as delta coded lat / lon, set
+ * OSM_PBF_LOCATIONS_ON_WAYS with osm_pbf_write_header_opt() to announce
+ * them in the header.
+ *
+ * With OSM_PBF_BLOCK_BBOX the BlockHeader of each data block carries the
+ * bbox of its objects as packed HeaderBBox in indexdata, so readers can
+ * skip blocks outside of their area without inflating them (see
+ * osm_pbf_bh_bbox()). Nodes and ways with locations extend it when they
+ * are written, other objects with osm_pbf_write_extend() after they are.
+ *
+ * OSM_PBF_SORTED announces Sort.Type_then_ID, nodes before ways before
+ * relations, each by id. Nothing is checked, that is up to the caller
+ * (osm_merge(), osm_sort_file()). OSM_PBF_HILBERT announces the order of
+ * osm_reorder(), Sort.Type_then_Hilbert: by type as well, but each type
+ * along a Hilbert curve. osm_open() warns about files with neither.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <arpa/inet.h>
+
+#include <zlib.h>
+
+#include "osm.h"
+
+#define PBF_GRANULARITY 100     /* nano degrees */
+#define PBF_DATE_GRANULARITY 1000
+
+struct _osm_pbf_writer {
+    FILE     *out;
+    int       level;
+    uint32_t  block_size;
+    int       type;         /* OSM_REL_MEMBER_TYPE_* in the block, 0: empty */
+    uint32_t  num;          /* objects in the block */
+    int       failed;
+    uint32_t  flags;        /* OSM_PBF_* */
+
+    /* bbox of the block in PBF_GRANULARITY units, for OSM_PBF_BLOCK_BBOX */
+    int       has_box;
+    int64_t   box_left;
+    int64_t   box_right;
+    int64_t   box_top;
+    int64_t   box_bottom;
+
+    /* string table of the block, sid 0 is "" */
+    char    **strings;
+    uint32_t  num_strings;
+    uint32_t  size_strings;
+    uint32_t *hash;         /* sid, 0: empty slot */
+    uint32_t  size_hash;
+
+    /* dense nodes, absolute values, delta coded when packed */
+    int64_t  *id;
+    int64_t  *lat;
+    int64_t  *lon;
+    int32_t  *version;
+    int64_t  *timestamp;
+    int64_t  *changeset;
+    int32_t  *uid;
+    int32_t  *user_sid;
+    int32_t  *keys_vals;
+    uint32_t  num_kv;
+    uint32_t  size_kv;
+
+    Way      **ways;
+    Relation **relations;
+};
+
+static uint32_t pbf_write_hash(const char *s) {
+    uint32_t h = 2166136261U;
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static void pbf_write_box(OSM_PBF_Writer *W, int64_t lat, int64_t lon) {
+    if (!W->has_box) {
+        W->box_left = W->box_right = lon;
+        W->box_top  = W->box_bottom = lat;
+        W->has_box  = 1;
+        return;
+    }
+    if (lon < W->box_left)
+        W->box_left = lon;
+    if (lon > W->box_right)
+        W->box_right = lon;
+    if (lat > W->box_top)
+        W->box_top = lat;
+    if (lat < W->box_bottom)
+        W->box_bottom = lat;
+}
+
+static void *pbf_write_grow(OSM_PBF_Writer *W, void *p, size_t elem, uint32_t size) {
+    void *tmp = realloc(p, elem * size);
+    if (tmp == NULL) {
+        fprintf(stderr, "failed to realloc pbf block: %s\n", strerror(errno));
+        W->failed = 1;
+        return p;
+    }
+    return tmp;
+}
+
+/* sid of str in the block's string table */
+static uint32_t pbf_write_string(OSM_PBF_Writer *W, const char *str) {
+    uint32_t h, mask;
+    if (str == NULL || !*str)
+        return 0;
+    if ((W->num_strings + 1) * 2 > W->size_hash) {
+        uint32_t size = W->size_hash ? W->size_hash * 2 : 4096, i;
+        uint32_t *tmp = calloc(size, sizeof(uint32_t));
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to malloc string hash: %s\n", strerror(errno));
+            W->failed = 1;
+            return 0;
+        }
+        for (i=1; i<W->num_strings; i++) {
+            h = pbf_write_hash(W->strings[i]) & (size - 1);
+            while (tmp[h] != 0)
+                h = (h + 1) & (size - 1);
+            tmp[h] = i;
+        }
+        free(W->hash);
+        W->hash      = tmp;
+        W->size_hash = size;
+    }
+    mask = W->size_hash - 1;
+    h = pbf_write_hash(str) & mask;
+    while (W->hash[h] != 0) {
+        if (strcmp(W->strings[W->hash[h]], str) == 0)
+            return W->hash[h];
+        h = (h + 1) & mask;
+    }
+    if (W->num_strings == W->size_strings) {
+        W->size_strings *= 2;
+        W->strings = pbf_write_grow(W, W->strings, sizeof(char *), W->size_strings);
+        if (W->failed)
+            return 0;
+    }
+    W->strings[W->num_strings] = strdup(str);
+    W->hash[h] = W->num_strings;
+    return W->num_strings++;
+}
+
+static Info *pbf_write_info(OSM_PBF_Writer *W, uint32_t version, uint64_t timestamp,
+                            uint64_t changeset, uint32_t uid, const char *user)
+{
+    Info *I = malloc(sizeof(Info)), init = INFO__INIT;
+    if (I == NULL) {
+        W->failed = 1;
+        return NULL;
+    }
+    *I = init;
+    I->has_version   = 1;
+    I->version       = version;
+    I->has_timestamp = 1;
+    I->timestamp     = timestamp / (PBF_DATE_GRANULARITY / 1000);
+    I->has_changeset = 1;
+    I->changeset     = changeset;
+    I->has_uid       = 1;
+    I->uid           = uid;
+    I->has_user_sid  = 1;
+    I->user_sid      = pbf_write_string(W, user);
+    return I;
+}
+
+static void pbf_write_tags(OSM_PBF_Writer *W, OSM_Tag_List *t,
+                            size_t *n_keys, uint32_t **keys, size_t *n_vals, uint32_t **vals)
+{
+    uint32_t i, num = t != NULL ? t->num : 0;
+    *n_keys = *n_vals = num;
+    *keys = malloc(sizeof(uint32_t) * (num + 1));
+    *vals = malloc(sizeof(uint32_t) * (num + 1));
+    if (*keys == NULL || *vals == NULL) {
+        W->failed = 1;
+        *n_keys = *n_vals = 0;
+        return;
+    }
+    for (i=0; i<num; i++) {
+        (*keys)[i] = pbf_write_string(W, t->data[i].key);
+        (*vals)[i] = pbf_write_string(W, t->data[i].val);
+    }
+}
+
+/*
+ * write one fileblock: length, BlockHeader (with index, if not NULL, as
+ * indexdata) and the (compressed) Blob of msg
+ */
+static int pbf_write_blob(OSM_PBF_Writer *W, const char *type, const ProtobufCMessage *msg,
+                            const HeaderBBox *index)
+{
+    Blob blob = BLOB__INIT;
+    BlockHeader bh = BLOCK_HEADER__INIT;
+    uint8_t index_buf[64];
+    size_t raw_size = protobuf_c_message_get_packed_size(msg), len;
+    uint8_t *raw = malloc(raw_size + 1), *zdata = NULL, *buf = NULL;
+    uint32_t netlen;
+    int ret = -1;
+
+    if (raw == NULL)
+        goto done;
+    protobuf_c_message_pack(msg, raw);
+    blob.has_raw_size = 1;
+    blob.raw_size     = raw_size;
+    if (W->level > 0) {
+        uLongf zlen = compressBound(raw_size);
+        zdata = malloc(zlen);
+        if (zdata == NULL || compress2(zdata, &zlen, raw, raw_size, W->level) != Z_OK) {
+            fprintf(stderr, "failed to compress pbf block\n");
+            goto done;
+        }
+        blob.has_zlib_data  = 1;
+        blob.zlib_data.data = zdata;
+        blob.zlib_data.len  = zlen;
+    }
+    else {
+        blob.has_raw  = 1;
+        blob.raw.data = raw;
+        blob.raw.len  = raw_size;
+    }
+    len = blob__get_packed_size(&blob);
+    if (len > MAX_BLOB_SIZE) {
+        fprintf(stderr, "pbf block of %lu bytes exceeds the maximum size, "
+                        "use a smaller block size\n", len);
+        goto done;
+    }
+    buf = malloc(len + 1);
+    if (buf == NULL)
+        goto done;
+    blob__pack(&blob, buf);
+
+    bh.type     = (char *)type;
+    bh.datasize = len;
+    if (index != NULL) {
+        bh.has_indexdata  = 1;
+        bh.indexdata.data = index_buf;
+        bh.indexdata.len  = header_bbox__pack(index, index_buf);
+    }
+    {
+        size_t bh_len = block_header__get_packed_size(&bh);
+        uint8_t bh_buf[MAX_BLOCK_HEADER_SIZE];
+        block_header__pack(&bh, bh_buf);
+        netlen = htonl(bh_len);
+        if (fwrite(&netlen, 4, 1, W->out) != 1
+            || fwrite(bh_buf, 1, bh_len, W->out) != bh_len
+            || fwrite(buf, 1, len, W->out) != len)
+        {
+            fprintf(stderr, "failed to write pbf: %s\n", strerror(errno));
+            goto done;
+        }
+    }
+    ret = 0;
+
+  done:
+    if (ret != 0)
+        W->failed = 1;
+    free(raw);
+    free(zdata);
+    free(buf);
+    return ret;
+}
+
+/* pack and write the collected objects */
+static int pbf_write_flush(OSM_PBF_Writer *W) {
+    PrimitiveBlock P = PRIMITIVE_BLOCK__INIT;
+    PrimitiveGroup G = PRIMITIVE_GROUP__INIT, *groups[1];
+    StringTable S = STRING_TABLE__INIT;
+    DenseNodes D = DENSE_NODES__INIT;
+    DenseInfo DI = DENSE_INFO__INIT;
+    HeaderBBox B = HEADER_BBOX__INIT, *index = NULL;
+    ProtobufCBinaryData *s = NULL;
+    uint32_t i;
+    int ret = 0;
+
+    if (W->num == 0)
+        return W->failed ? -1 : 0;
+
+    s = malloc(sizeof(ProtobufCBinaryData) * W->num_strings);
+    if (s == NULL) {
+        W->failed = 1;
+        return -1;
+    }
+    s[0].data = (uint8_t *)"";
+    s[0].len  = 0;
+    for (i=1; i<W->num_strings; i++) {
+        s[i].data = (uint8_t *)W->strings[i];
+        s[i].len  = strlen(W->strings[i]);
+    }
+    S.n_s = W->num_strings;
+    S.s   = s;
+
+    groups[0] = &G;
+    P.stringtable          = &S;
+    P.n_primitivegroup     = 1;
+    P.primitivegroup       = groups;
+    P.has_granularity      = 1;
+    P.granularity          = PBF_GRANULARITY;
+    P.has_date_granularity = 1;
+    P.date_granularity     = PBF_DATE_GRANULARITY;
+
+    if (W->type == OSM_REL_MEMBER_TYPE_NODE) {
+        /* delta coding, backwards so the absolute values are still there */
+        for (i=W->num-1; i>0; i--) {
+            W->id[i]        -= W->id[i-1];
+            W->lat[i]       -= W->lat[i-1];
+            W->lon[i]       -= W->lon[i-1];
+            W->timestamp[i] -= W->timestamp[i-1];
+            W->changeset[i] -= W->changeset[i-1];
+            W->uid[i]       -= W->uid[i-1];
+            W->user_sid[i]  -= W->user_sid[i-1];
+        }
+        D.n_id        = W->num;
+        D.id          = W->id;
+        D.n_lat       = W->num;
+        D.lat         = W->lat;
+        D.n_lon       = W->num;
+        D.lon         = W->lon;
+        D.n_keys_vals = W->num_kv;
+        D.keys_vals   = W->keys_vals;
+        DI.n_version   = W->num;
+        DI.version     = W->version;
+        DI.n_timestamp = W->num;
+        DI.timestamp   = W->timestamp;
+        DI.n_changeset = W->num;
+        DI.changeset   = W->changeset;
+        DI.n_uid       = W->num;
+        DI.uid         = W->uid;
+        DI.n_user_sid  = W->num;
+        DI.user_sid    = W->user_sid;
+        D.denseinfo = &DI;
+        G.dense     = &D;
+    }
+    else if (W->type == OSM_REL_MEMBER_TYPE_WAY) {
+        G.n_ways = W->num;
+        G.ways   = W->ways;
+    }
+    else {
+        G.n_relations = W->num;
+        G.relations   = W->relations;
+    }
+
+    if ((W->flags & OSM_PBF_BLOCK_BBOX) && W->has_box) {
+        B.left   = W->box_left * PBF_GRANULARITY;
+        B.right  = W->box_right * PBF_GRANULARITY;
+        B.top    = W->box_top * PBF_GRANULARITY;
+        B.bottom = W->box_bottom * PBF_GRANULARITY;
+        index    = &B;
+    }
+    if (!W->failed)
+        ret = pbf_write_blob(W, "OSMData", (ProtobufCMessage *)&P, index);
+    else
+        ret = -1;
+
+    /* reset the block */
+    for (i=0; i<W->num && W->type == OSM_REL_MEMBER_TYPE_WAY; i++) {
+        free(W->ways[i]->keys);
+        free(W->ways[i]->vals);
+        free(W->ways[i]->info);
+        free(W->ways[i]->refs);
+        free(W->ways[i]->lat);
+        free(W->ways[i]->lon);
+        free(W->ways[i]);
+    }
+    for (i=0; i<W->num && W->type == OSM_REL_MEMBER_TYPE_RELATION; i++) {
+        free(W->relations[i]->keys);
+        free(W->relations[i]->vals);
+        free(W->relations[i]->info);
+        free(W->relations[i]->roles_sid);
+        free(W->relations[i]->memids);
+        free(W->relations[i]->types);
+        free(W->relations[i]);
+    }
+    for (i=1; i<W->num_strings; i++)
+        free(W->strings[i]);
+    W->num_strings = 1;
+    if (W->hash != NULL)
+        memset(W->hash, 0, sizeof(uint32_t) * W->size_hash);
+    W->num    = 0;
+    W->num_kv = 0;
+    W->type   = 0;
+    W->has_box = 0;
+    free(s);
+    return ret;
+}
+
+/* start a block of objects of type if needed, 0 if there is room */
+static int pbf_write_start(OSM_PBF_Writer *W, int type) {
+    if ((W->type != type || W->num == W->block_size) && pbf_write_flush(W) != 0)
+        return -1;
+    W->type = type;
+    return W->failed ? -1 : 0;
+}
+
+/*
+ * write the OSMHeader block. bbox may be NULL, block_size is the number
+ * of objects per block, level the zlib level (0: no compression), flags
+ * the OSM_PBF_* optional features
+ */
+OSM_PBF_Writer *osm_pbf_write_header_opt(char *who, FILE *outfh, OSM_BBox *bbox,
+                                    uint32_t block_size, int level, uint32_t flags)
+{
+    OSM_PBF_Writer *W = calloc(1, sizeof(OSM_PBF_Writer));
+    HeaderBlock H = HEADER_BLOCK__INIT;
+    HeaderBBox B = HEADER_BBOX__INIT;
+    char *features[] = { "OsmSchema-V0.6", "DenseNodes" };
+    char *optional[3];
+    char program[256];
+    size_t n = block_size ? block_size : 8000;
+
+    if (W == NULL) {
+        fprintf(stderr, "failed to malloc pbf writer: %s\n", strerror(errno));
+        return (OSM_PBF_Writer *)NULL;
+    }
+    W->out          = outfh;
+    W->level        = level;
+    W->flags        = flags;
+    W->block_size   = n;
+    W->size_strings = 1024;
+    W->strings      = malloc(sizeof(char *) * W->size_strings);
+    W->num_strings  = 1;    /* "" */
+    W->id        = malloc(sizeof(int64_t) * n);
+    W->lat       = malloc(sizeof(int64_t) * n);
+    W->lon       = malloc(sizeof(int64_t) * n);
+    W->version   = malloc(sizeof(int32_t) * n);
+    W->timestamp = malloc(sizeof(int64_t) * n);
+    W->changeset = malloc(sizeof(int64_t) * n);
+    W->uid       = malloc(sizeof(int32_t) * n);
+    W->user_sid  = malloc(sizeof(int32_t) * n);
+    W->ways      = malloc(sizeof(Way *) * n);
+    W->relations = malloc(sizeof(Relation *) * n);
+    W->size_kv   = n * 3;
+    W->keys_vals = malloc(sizeof(int32_t) * W->size_kv);
+    if (W->strings == NULL || W->id == NULL || W->lat == NULL || W->lon == NULL
+        || W->version == NULL || W->timestamp == NULL || W->changeset == NULL
+        || W->uid == NULL || W->user_sid == NULL || W->ways == NULL
+        || W->relations == NULL || W->keys_vals == NULL)
+    {
+        fprintf(stderr, "failed to malloc pbf writer: %s\n", strerror(errno));
+        W->failed = 1;
+        osm_pbf_write_footer(W);
+        return (OSM_PBF_Writer *)NULL;
+    }
+    W->strings[0] = "";
+
+    snprintf(program, sizeof(program), "%s (libosm v" LIBOSM_VERSION ")", who);
+    H.n_required_features = 2;
+    H.required_features   = features;
+    if (flags & OSM_PBF_LOCATIONS_ON_WAYS)
+        optional[ H.n_optional_features++ ] = "LocationsOnWays";
+    if (flags & OSM_PBF_SORTED)
+        optional[ H.n_optional_features++ ] = "Sort.Type_then_ID";
+    else if (flags & OSM_PBF_HILBERT)
+        optional[ H.n_optional_features++ ] = "Sort.Type_then_Hilbert";
+    if (H.n_optional_features)
+        H.optional_features = optional;
+    H.writingprogram      = program;
+    if (bbox != NULL) {
+        B.left   = llround(bbox->left_lon / NANO_DEGREE);
+        B.right  = llround(bbox->right_lon / NANO_DEGREE);
+        B.top    = llround(bbox->top_lat / NANO_DEGREE);
+        B.bottom = llround(bbox->bottom_lat / NANO_DEGREE);
+        H.bbox   = &B;
+    }
+    if (pbf_write_blob(W, "OSMHeader", (ProtobufCMessage *)&H, NULL) != 0) {
+        osm_pbf_write_footer(W);
+        return (OSM_PBF_Writer *)NULL;
+    }
+    return W;
+}
+
+OSM_PBF_Writer *osm_pbf_write_header(char *who, FILE *outfh, OSM_BBox *bbox,
+                                    uint32_t block_size, int level)
+{
+    return osm_pbf_write_header_opt(who, outfh, bbox, block_size, level, 0);
+}
+
+int osm_pbf_write_node(OSM_Node *n, OSM_PBF_Writer *W) {
+    uint32_t i, k, num_tags = n->tags != NULL ? n->tags->num : 0;
+    if (pbf_write_start(W, OSM_REL_MEMBER_TYPE_NODE) != 0)
+        return -1;
+    k = W->num;
+    W->id[k]        = n->id;
+    W->lat[k]       = llround(n->lat / NANO_DEGREE / PBF_GRANULARITY);
+    W->lon[k]       = llround(n->lon / NANO_DEGREE / PBF_GRANULARITY);
+    W->version[k]   = n->version;
+    W->timestamp[k] = n->timestamp / (PBF_DATE_GRANULARITY / 1000);
+    W->changeset[k] = n->changeset;
+    W->uid[k]       = n->uid;
+    W->user_sid[k]  = pbf_write_string(W, n->user);
+    pbf_write_box(W, W->lat[k], W->lon[k]);
+
+    if (W->num_kv + num_tags * 2 + 1 > W->size_kv) {
+        while (W->num_kv + num_tags * 2 + 1 > W->size_kv)
+            W->size_kv *= 2;
+        W->keys_vals = pbf_write_grow(W, W->keys_vals, sizeof(int32_t), W->size_kv);
+        if (W->failed)
+            return -1;
+    }
+    for (i=0; i<num_tags; i++) {
+        W->keys_vals[W->num_kv++] = pbf_write_string(W, n->tags->data[i].key);
+        W->keys_vals[W->num_kv++] = pbf_write_string(W, n->tags->data[i].val);
+    }
+    W->keys_vals[W->num_kv++] = 0;
+    W->num += 1;
+    return W->failed ? -1 : 0;
+}
+
+/* delta coded, unknown locations as OSM_PBF_NO_LOCATION */
+static void pbf_write_locations(OSM_PBF_Writer *W, Way *way, OSM_Location *locs, uint32_t num) {
+    int64_t last_lat = 0, last_lon = 0;
+    uint32_t i;
+
+    way->lat = malloc(sizeof(int64_t) * num);
+    way->lon = malloc(sizeof(int64_t) * num);
+    if (way->lat == NULL || way->lon == NULL) {
+        W->failed = 1;
+        return;
+    }
+    way->n_lat = way->n_lon = num;
+    for (i=0; i<num; i++) {
+        int64_t lat = OSM_PBF_NO_LOCATION, lon = OSM_PBF_NO_LOCATION;
+        if (!isnan(locs[i].lat)) {
+            lat = llround(locs[i].lat / NANO_DEGREE / PBF_GRANULARITY);
+            lon = llround(locs[i].lon / NANO_DEGREE / PBF_GRANULARITY);
+        }
+        if (lat != OSM_PBF_NO_LOCATION)
+            pbf_write_box(W, lat, lon);
+        way->lat[i] = lat - last_lat;
+        way->lon[i] = lon - last_lon;
+        last_lat = lat;
+        last_lon = lon;
+    }
+}
+
+int osm_pbf_write_way(OSM_Way *w, OSM_PBF_Writer *W) {
+    Way *way, init = WAY__INIT;
+    uint32_t num_refs = 0, i;
+    int64_t last = 0;
+
+    if (pbf_write_start(W, OSM_REL_MEMBER_TYPE_WAY) != 0)
+        return -1;
+    while (w->nodes[num_refs])
+        num_refs += 1;
+    way = malloc(sizeof(Way));
+    if (way == NULL) {
+        W->failed = 1;
+        return -1;
+    }
+    *way = init;
+    way->id   = w->id;
+    way->info = pbf_write_info(W, w->version, w->timestamp, w->changeset, w->uid, w->user);
+    pbf_write_tags(W, w->tags, &way->n_keys, &way->keys, &way->n_vals, &way->vals);
+    way->refs = malloc(sizeof(int64_t) * (num_refs + 1));
+    if (way->refs == NULL)
+        W->failed = 1;
+    else {
+        way->n_refs = num_refs;
+        for (i=0; i<num_refs; i++) {
+            way->refs[i] = (int64_t)w->nodes[i] - last;
+            last = w->nodes[i];
+        }
+    }
+    if (w->locs != NULL && num_refs && !W->failed)
+        pbf_write_locations(W, way, w->locs, num_refs);
+    W->ways[W->num++] = way;
+    return W->failed ? -1 : 0;
+}
+
+int osm_pbf_write_relation(OSM_Relation *r, OSM_PBF_Writer *W) {
+    Relation *rel, init = RELATION__INIT;
+    uint32_t num = r->member != NULL ? r->member->num : 0, i;
+    int64_t last = 0;
+
+    if (pbf_write_start(W, OSM_REL_MEMBER_TYPE_RELATION) != 0)
+        return -1;
+    rel = malloc(sizeof(Relation));
+    if (rel == NULL) {
+        W->failed = 1;
+        return -1;
+    }
+    *rel = init;
+    rel->id   = r->id;
+    rel->info = pbf_write_info(W, r->version, r->timestamp, r->changeset, r->uid, r->user);
+    pbf_write_tags(W, r->tags, &rel->n_keys, &rel->keys, &rel->n_vals, &rel->vals);
+    rel->roles_sid = malloc(sizeof(int32_t) * (num + 1));
+    rel->memids    = malloc(sizeof(int64_t) * (num + 1));
+    rel->types     = malloc(sizeof(Relation__MemberType) * (num + 1));
+    if (rel->roles_sid == NULL || rel->memids == NULL || rel->types == NULL)
+        W->failed = 1;
+    else {
+        rel->n_roles_sid = rel->n_memids = rel->n_types = num;
+        for (i=0; i<num; i++) {
+            OSM_Rel_Member *m = &r->member->data[i];
+            rel->roles_sid[i] = pbf_write_string(W, m->role);
+            rel->memids[i]    = (int64_t)m->ref - last;
+            last = m->ref;
+            switch (m->type) {
+                case OSM_REL_MEMBER_TYPE_WAY:
+                    rel->types[i] = RELATION__MEMBER_TYPE__WAY;
+                    break;
+                case OSM_REL_MEMBER_TYPE_RELATION:
+                    rel->types[i] = RELATION__MEMBER_TYPE__RELATION;
+                    break;
+                default:
+                    rel->types[i] = RELATION__MEMBER_TYPE__NODE;
+                    break;
+            }
+        }
+    }
+    W->relations[W->num++] = rel;
+    return W->failed ? -1 : 0;
+}
+
+/*
+ * extend the bbox of the block of the object written last by lat / lon,
+ * e.g. with the locations of the nodes of a way without w->locs
+ */
+void osm_pbf_write_extend(OSM_PBF_Writer *W, double lat, double lon) {
+    if (W->num == 0 || isnan(lat) || isnan(lon))
+        return;
+    pbf_write_box(W, llround(lat / NANO_DEGREE / PBF_GRANULARITY),
+                        llround(lon / NANO_DEGREE / PBF_GRANULARITY));
+}
+
+/* write the last block and free W, returns -1 if anything failed */
+int osm_pbf_write_footer(OSM_PBF_Writer *W) {
+    int ret;
+    uint32_t i;
+    if (W == NULL)
+        return -1;
+    ret = pbf_write_flush(W);
+    if (W->failed || fflush(W->out) != 0)
+        ret = -1;
+    for (i=1; i<W->num_strings; i++)
+        free(W->strings[i]);
+    free(W->strings);
+    free(W->hash);
+    free(W->id);
+    free(W->lat);
+    free(W->lon);
+    free(W->version);
+    free(W->timestamp);
+    free(W->changeset);
+    free(W->uid);
+    free(W->user_sid);
+    free(W->keys_vals);
+    free(W->ways);
+    free(W->relations);
+    free(W);
+    return ret;
+}
+
+/* END */
@@ -23,47 +23,971 @@
 #include "osm.h"
 
 #define LIST_THRESHOLD 0.9
+#define PBF_BATCH      4            /* blocks per thread, see pbf_parse_batch() */
+#define PBF_DROPPED    ((void *)1)  /* rejected by a thread safe filter */
 
-OSM_Data *osm_pbf_parse(OSM_File *F, 
-              uint32_t mode, 
-              OSM_BBox *bbox,
-              int (*node_filter)(OSM_Node *),
-              int (*way_filter)(OSM_Way *),
-              int (*rel_filter)(OSM_Relation *) /*,
-              int (*cset_filter)(OSM_Changeset *) */
-        )
+enum {
+    bbox_no_bbox,
+    bbox_nodes_in_box,
+    bbox_rel_find,
+    bbox_way_find,
+    bbox_nodes_find
+};
+
+/* state of one osm_pbf_parse_opt() run */
+struct pbf_parse {
+    OSM_Parse_Options *opt;
+    uint32_t mode;
+    int csets;      /* OSMDATA_CSET: collect changesets in the first pass */
+    int bbox_state;
+    OSM_Data *data;
+    struct osm_members *mem_nodes;
+    struct osm_members *mem_ways;
+    struct osm_members *mem_rels;   /* relations of kept relations */
+    struct osm_members *bbn;
+    OSM_Rel_Graph *graph;           /* all relations, OSMDATA_REL pass */
+    struct pbf_pre *pre;            /* of the current group, or NULL */
+};
+
+/*
+ * the objects of a PrimitiveGroup which the thread safe filters ran on,
+ * by index (the dense nodes after the nodes): the object if it passed,
+ * PBF_DROPPED if not, NULL if no filter ran. The objects are taken by
+ * pbf_parse_*(), what is left is freed with the block
+ */
+struct pbf_pre {
+    void **nodes;
+    void **ways;
+    void **relations;
+};
+
+/* delta decoding state of a DenseNodes group */
+struct pbf_dense {
+    DenseNodes *D;
+    size_t kv;      /* first keys_vals index of the current node */
+    size_t kv_num;  /* number of tags of the current node */
+    int64_t id;
+    int64_t lat;
+    int64_t lon;
+    int64_t timestamp;
+    int64_t changeset;
+    int64_t uid;
+    int64_t user_sid;
+};
+
+static char *pbf_string(PrimitiveBlock *P, uint32_t sid) {
+    if (sid >= P->stringtable->n_s || P->stringtable->s[sid].len == 0)
+        return "";
+    return strndup((const char *)P->stringtable->s[sid].data,
+                    P->stringtable->s[sid].len);
+}
+
+static OSM_Tag_List *pbf_tags(PrimitiveBlock *P, const uint32_t *keys,
+                                const uint32_t *vals, size_t num, int stride)
+{
+    OSM_Tag_List *tl;
+    size_t x;
+    if (num == 0)
+        return NULL;
+    tl       = malloc(sizeof(OSM_Tag_List));
+    tl->num  = num;
+    tl->size = num;
+    tl->data = malloc(sizeof(OSM_Tag) * num);
+    for (x=0; x<num; x++) {
+        tl->data[x].key = pbf_string(P, keys[x * stride]);
+        tl->data[x].val = pbf_string(P, vals[x * stride]);
+    }
+    return tl;
+}
+
+static void pbf_info(PrimitiveBlock *P, Info *I, uint32_t *version,
+                        uint64_t *changeset, char **user, uint32_t *uid,
+                        uint64_t *timestamp)
 {
+    *version   = (I && I->has_version)   ? I->version   : 0;
+    *changeset = (I && I->has_changeset) ? I->changeset : 0;
+    *uid       = (I && I->has_uid)       ? I->uid       : 0;
+    *timestamp = (I && I->has_timestamp)
+                    ? I->timestamp * (P->date_granularity / 1000) : 0;
+    *user      = (I && I->has_user_sid)
+                    ? pbf_string(P, I->user_sid) : "";
+}
+
+static int64_t pbf_user_sid(Info *I) {
+    return (I && I->has_user_sid) ? (int64_t)I->user_sid : -1;
+}
+
+/* add the deltas of node k and find its tags */
+static void pbf_dense_decode(struct pbf_dense *d, size_t k) {
+    DenseNodes *D = d->D;
+    if (k > 0 && d->kv < D->n_keys_vals)
+        d->kv += d->kv_num * 2 + 1;
+    d->id  += D->id[k];
+    d->lat += D->lat[k];
+    d->lon += D->lon[k];
+    if (D->denseinfo) {
+        DenseInfo *I = D->denseinfo;
+        d->timestamp += I->timestamp[k];
+        d->changeset += I->changeset[k];
+        d->uid       += I->uid[k];
+        d->user_sid  += I->user_sid[k];
+    }
+    d->kv_num = 0;
+    while (d->kv + d->kv_num * 2 + 1 < D->n_keys_vals
+            && D->keys_vals[d->kv + d->kv_num * 2] != 0)
+        d->kv_num += 1;
+}
+
+static OSM_Node *pbf_dense_node(PrimitiveBlock *P, struct pbf_dense *d, size_t k) {
+    DenseNodes *D = d->D;
+    OSM_Node *n = malloc(sizeof(OSM_Node));
+    n->id  = d->id;
+    n->lat = NANO_DEGREE * (P->lat_offset + (d->lat * P->granularity));
+    n->lon = NANO_DEGREE * (P->lon_offset + (d->lon * P->granularity));
+    if (D->denseinfo) {
+        n->version   = D->denseinfo->version[k];
+        n->changeset = d->changeset;
+        n->user      = pbf_string(P, d->user_sid);
+        n->uid       = d->uid;
+        n->timestamp = d->timestamp * (P->date_granularity / 1000);
+    }
+    else {
+        n->version   = 0;
+        n->changeset = 0;
+        n->user      = "";
+        n->uid       = 0;
+        n->timestamp = 0;
+    }
+    n->tags = pbf_tags(P, (uint32_t *)D->keys_vals + d->kv,
+                        (uint32_t *)D->keys_vals + d->kv + 1, d->kv_num, 2);
+    return n;
+}
+
+/* add the changesets of G to *cs, created on first use */
+static void pbf_changesets(PrimitiveBlock *P, PrimitiveGroup *G, OSM_CSet_List **cs) {
+    size_t k;
+    for (k=0; k<G->n_changesets; k++) {
+        ChangeSet *C = G->changesets[k];
+        uint64_t created_at = C->created_at * (P->date_granularity / 1000);
+        uint64_t closed_at  = C->has_closetime_delta
+                    ? created_at + C->closetime_delta * (P->date_granularity / 1000) : 0;
+        OSM_BBox box, *bbox = NULL;
+
+        if (*cs == NULL && (*cs = osm_cset_new(G->n_changesets)) == NULL)
+            return;
+        if (C->bbox != NULL) {
+            box.left_lon   = NANO_DEGREE * C->bbox->left;
+            box.bottom_lat = NANO_DEGREE * C->bbox->bottom;
+            box.right_lon  = NANO_DEGREE * C->bbox->right;
+            box.top_lat    = NANO_DEGREE * C->bbox->top;
+            bbox = &box;
+        }
+        osm_cset_add(*cs, C->id, created_at, closed_at,
+                        (C->info && C->info->has_uid) ? C->info->uid : 0,
+                        C->open, bbox);
+    }
+}
+
+/* just id and location, for osm_scan() with OSMDATA_BARE */
+static OSM_Node *pbf_bare_node(uint64_t id, double lat, double lon) {
+    OSM_Node *n = malloc(sizeof(OSM_Node));
+    n->id        = id;
+    n->lat       = lat;
+    n->lon       = lon;
+    n->user      = "";
+    n->uid       = 0;
+    n->version   = 0;
+    n->changeset = 0;
+    n->timestamp = 0;
+    n->tags      = NULL;
+    return n;
+}
+
+static OSM_Node *pbf_node(PrimitiveBlock *P, Node *node) {
+    OSM_Node *n = malloc(sizeof(OSM_Node));
+    n->id  = node->id;
+    n->lat = NANO_DEGREE * (P->lat_offset + (node->lat * P->granularity));
+    n->lon = NANO_DEGREE * (P->lon_offset + (node->lon * P->granularity));
+    pbf_info(P, node->info, &n->version, &n->changeset, &n->user,
+                &n->uid, &n->timestamp);
+    n->tags = pbf_tags(P, node->keys, node->vals,
+                node->n_keys < node->n_vals ? node->n_keys : node->n_vals, 1);
+    return n;
+}
+
+/* refs are the already decoded node ids */
+static OSM_Way *pbf_way(PrimitiveBlock *P, Way *W, uint64_t *refs) {
+    OSM_Way *way = malloc(sizeof(OSM_Way));
+    way->id = W->id;
+    pbf_info(P, W->info, &way->version, &way->changeset, &way->user,
+                &way->uid, &way->timestamp);
+    way->nodes = malloc(sizeof(uint64_t) * (W->n_refs + 1));
+    if (W->n_refs)
+        memcpy(way->nodes, refs, sizeof(uint64_t) * W->n_refs);
+    way->nodes[W->n_refs] = 0;
+    way->tags = pbf_tags(P, W->keys, W->vals, W->n_keys, 1);
+    way->locs = NULL;
+    /* "LocationsOnWays" files, see osm_way_locations() */
+    if (W->n_refs && W->n_lat == W->n_refs && W->n_lon == W->n_refs) {
+        way->locs = malloc(sizeof(OSM_Location) * W->n_refs);
+        if (way->locs != NULL) {
+            int64_t lat = 0, lon = 0;
+            size_t l;
+            for (l = 0; l < W->n_refs; l++) {
+                lat += W->lat[l];
+                lon += W->lon[l];
+                if (lat == OSM_PBF_NO_LOCATION || lon == OSM_PBF_NO_LOCATION) {
+                    way->locs[l].lat = way->locs[l].lon = NAN;
+                    continue;
+                }
+                way->locs[l].lat = NANO_DEGREE * (P->lat_offset + (lat * P->granularity));
+                way->locs[l].lon = NANO_DEGREE * (P->lon_offset + (lon * P->granularity));
+            }
+        }
+    }
+    return way;
+}
+
+static OSM_Relation *pbf_relation(PrimitiveBlock *P, Relation *R) {
+    OSM_Relation *rel = malloc(sizeof(OSM_Relation));
+    int64_t deltamemids = 0;
+    size_t l;
+
+    rel->id = R->id;
+    pbf_info(P, R->info, &rel->version, &rel->changeset, &rel->user,
+                &rel->uid, &rel->timestamp);
+    rel->member = NULL;
+    if (R->n_memids) {
+        rel->member = malloc(sizeof(OSM_Rel_Member_List));
+        rel->member->num  = R->n_memids;
+        rel->member->size = R->n_memids;
+        rel->member->data = malloc(sizeof(OSM_Rel_Member) * R->n_memids);
+        for (l=0; l<R->n_memids; l++) {
+            deltamemids += R->memids[l];
+            rel->member->data[l].ref = deltamemids;
+            switch (R->types[l]) {
+                case RELATION__MEMBER_TYPE__NODE:
+                    rel->member->data[l].type = OSM_REL_MEMBER_TYPE_NODE;
+                    break;
+                case RELATION__MEMBER_TYPE__WAY:
+                    rel->member->data[l].type = OSM_REL_MEMBER_TYPE_WAY;
+                    break;
+                case RELATION__MEMBER_TYPE__RELATION:
+                    rel->member->data[l].type = OSM_REL_MEMBER_TYPE_RELATION;
+                    break;
+                default:
+                    fprintf(stderr, "unknown relation member type %d\n", R->types[l]);
+                    rel->member->data[l].type = OSM_REL_MEMBER_TYPE_UNKNOWN;
+                    break;
+            }
+            rel->member->data[l].role = pbf_string(P, R->roles_sid[l]);
+        }
+    }
+    rel->tags = pbf_tags(P, R->keys, R->vals, R->n_keys, 1);
+    return rel;
+}
+
+/*
+ * the pbf_want_*() return 0 if the object is not needed in the current
+ * pass, 1 if it is needed anyway (i.e. a member of something we keep) and
+ * 2 if it is needed if it passes the filters
+ */
+static int pbf_want_node(struct pbf_parse *s, uint64_t id, double lat, double lon) {
+    if (s->mode == OSMDATA_BBOX) {
+        if (s->bbox_state == bbox_nodes_in_box) {
+            if (osm_parse_in_area(s->opt, lat, lon)) {
+                uint64_t *mid = malloc(sizeof(uint64_t));
+                *mid = id;
+                osm_add_members(s->bbn, 1, mid, 0);
+                osm_trace(OSM_TRACE_OBJECT, "NODE %lu (%.7f, %.7f) is in bbox",
+                            id, osm_trace_dbl(lon), osm_trace_dbl(lat));
+            }
+            return 0;
+        }
+        if (osm_is_member(s->mem_nodes, id) != -1)
+            return 1;
+        return osm_is_member(s->bbn, id) != -1 ? 2 : 0;
+    }
+    if (s->mode == OSMDATA_NODE) {
+        if (osm_is_member(s->mem_nodes, id) != -1)
+            return 1;
+        return osm_parse_has_filter(s->opt, OSM_REL_MEMBER_TYPE_NODE) ? 2 : 0;
+    }
+    return 2;
+}
+
+static int pbf_want_way(struct pbf_parse *s, uint64_t id, uint64_t *refs, size_t num) {
+    size_t b;
+    if (s->mode == OSMDATA_BBOX) {
+        if (osm_is_member(s->mem_ways, id) != -1)
+            return 1;
+        for (b=0; b<num; b++) {
+            if (osm_is_member(s->bbn, refs[b]) != -1) {
+                osm_trace(OSM_TRACE_OBJECT, "way %lu: member %lu is in bbox", id, refs[b]);
+                return 2;
+            }
+        }
+        return 0;
+    }
+    if (s->mode == OSMDATA_WAY) {
+        if (osm_is_member(s->mem_ways, id) != -1)
+            return 1;
+        return osm_parse_has_filter(s->opt, OSM_REL_MEMBER_TYPE_WAY) ? 2 : 0;
+    }
+    return 2;
+}
+
+static int pbf_want_relation(struct pbf_parse *s, uint64_t id, uint64_t *nref, size_t num_nref) {
+    size_t b;
+    if (s->mode == OSMDATA_WAY && s->mem_rels != NULL)
+        return osm_is_member(s->mem_rels, id) != -1 ? 1 : 0;
+    if (s->mode == OSMDATA_BBOX) {
+        for (b=0; b<num_nref; b++) {
+            if (osm_is_member(s->bbn, nref[b]) != -1)
+                return 2;
+        }
+        return 0;
+    }
+    return 2;
+}
+
+/* the callback filters, the reentrant one only if it did not run yet */
+static int pbf_node_ok(struct pbf_parse *s, OSM_Node *n, int checked) {
+    OSM_Parse_Options *o = s->opt;
+    if (o->node_filter != NULL && !o->node_filter(n))
+        return 0;
+    return checked || o->node_filter_r == NULL || o->node_filter_r(n, o->filter_ctx);
+}
+
+static int pbf_way_ok(struct pbf_parse *s, OSM_Way *w, int checked) {
+    OSM_Parse_Options *o = s->opt;
+    if (o->way_filter != NULL && !o->way_filter(w))
+        return 0;
+    return checked || o->way_filter_r == NULL || o->way_filter_r(w, o->filter_ctx);
+}
+
+static int pbf_relation_ok(struct pbf_parse *s, OSM_Relation *r, int checked) {
+    OSM_Parse_Options *o = s->opt;
+    if (o->rel_filter != NULL && !o->rel_filter(r))
+        return 0;
+    return checked || o->rel_filter_r == NULL || o->rel_filter_r(r, o->filter_ctx);
+}
+
+/* the object the thread safe filters let through, which is taken now */
+static void *pbf_pre_take(void **pre, size_t k) {
+    void *obj;
+    if (pre == NULL)
+        return NULL;
+    obj = pre[k];
+    if (obj != PBF_DROPPED)
+        pre[k] = NULL;
+    return obj;
+}
+
+/* returns 1 if the node was kept, 0 if a filter dropped it */
+static int pbf_keep_node(struct pbf_parse *s, OSM_Node *n, int want, int checked) {
+    if (want == 2 && !pbf_node_ok(s, n, checked)) {
+        osm_free_node(n);
+        return 0;
+    }
+    if (s->mode == OSMDATA_BBOX)
+        osm_trace(OSM_TRACE_OBJECT, "NODE %lu (%.7f, %.7f) is needed",
+                    n->id, osm_trace_dbl(n->lon), osm_trace_dbl(n->lat));
+    osm_realloc_node_list(s->data->nodes);
+    s->data->nodes->data[ s->data->nodes->num ] = n;
+    s->data->nodes->num += 1;
+    return 1;
+}
+
+static void pbf_parse_nodes(struct pbf_parse *s, PrimitiveBlock *P, PrimitiveGroup *G) {
+    OSM_Filter *f = s->opt->filter;
+    size_t k, filtered = 0, kept = 0;
+
+    for (k = 0; k < G->n_nodes; k++) {
+        Node *node = G->nodes[k];
+        double lat = NANO_DEGREE * (P->lat_offset + (node->lat * P->granularity));
+        double lon = NANO_DEGREE * (P->lon_offset + (node->lon * P->granularity));
+        int want = pbf_want_node(s, node->id, lat, lon);
+        if (want == 2 && f != NULL
+            && !osm_filter_pbf(f, OSM_REL_MEMBER_TYPE_NODE, node->id,
+                            node->keys, node->vals,
+                            node->n_keys < node->n_vals ? node->n_keys : node->n_vals, 1,
+                            node->info ? node->info->uid : 0,
+                            pbf_user_sid(node->info))) {
+            want = 0;
+            ++filtered;
+        }
+        if (want) {
+            OSM_Node *n = pbf_pre_take(s->pre ? s->pre->nodes : NULL, k);
+            if (n == PBF_DROPPED)
+                ++filtered;
+            else if (pbf_keep_node(s, n != NULL ? n : pbf_node(P, node), want, n != NULL))
+                ++kept;
+            else
+                ++filtered;
+        }
+    }
+
+    if (G->dense) {
+        struct pbf_dense d;
+        memset(&d, 0, sizeof(d));
+        d.D = G->dense;
+        for (k=0; k<d.D->n_id; k++) {
+            double lat, lon;
+            int want;
+            pbf_dense_decode(&d, k);
+            lat = NANO_DEGREE * (P->lat_offset + (d.lat * P->granularity));
+            lon = NANO_DEGREE * (P->lon_offset + (d.lon * P->granularity));
+            want = pbf_want_node(s, d.id, lat, lon);
+            if (want == 2 && f != NULL
+                && !osm_filter_pbf(f, OSM_REL_MEMBER_TYPE_NODE, d.id,
+                            (uint32_t *)d.D->keys_vals + d.kv,
+                            (uint32_t *)d.D->keys_vals + d.kv + 1, d.kv_num, 2,
+                            d.uid, d.D->denseinfo ? d.user_sid : -1)) {
+                want = 0;
+                ++filtered;
+            }
+            if (want) {
+                OSM_Node *n = pbf_pre_take(s->pre ? s->pre->nodes : NULL, G->n_nodes + k);
+                if (n == PBF_DROPPED)
+                    ++filtered;
+                else if (pbf_keep_node(s, n != NULL ? n : pbf_dense_node(P, &d, k),
+                                        want, n != NULL))
+                    ++kept;
+                else
+                    ++filtered;
+            }
+        }
+    }
+
+    /* the first bbox pass only looks for nodes in the box */
+    if (s->bbox_state != bbox_nodes_in_box)
+        osm_stats_add(OSM_STAT_NODES_SEEN, G->n_nodes + (G->dense ? G->dense->n_id : 0));
+    osm_stats_add(OSM_STAT_NODES_FILTERED, filtered);
+    osm_stats_add(OSM_STAT_NODES_KEPT, kept);
+}
+
+static void pbf_parse_ways(struct pbf_parse *s, PrimitiveBlock *P, PrimitiveGroup *G) {
+    OSM_Filter *f = s->opt->filter;
+    size_t k, l, filtered = 0;
+
+    for (k = 0; k < G->n_ways; k++) {
+        Way *W = G->ways[k];
+        uint64_t *ref = malloc(sizeof(uint64_t) * (W->n_refs + 1));
+        int64_t deltaref = 0;
+        OSM_Way *way;
+        int want, checked;
+
+        for (l = 0; l < W->n_refs; l++) {
+            deltaref += W->refs[l];
+            ref[l] = deltaref;
+        }
+        want = pbf_want_way(s, W->id, ref, W->n_refs);
+        if (want == 2 && f != NULL
+            && !osm_filter_pbf(f, OSM_REL_MEMBER_TYPE_WAY, W->id,
+                            W->keys, W->vals, W->n_keys, 1,
+                            W->info ? W->info->uid : 0, pbf_user_sid(W->info))) {
+            want = 0;
+            ++filtered;
+        }
+        if (!want) {
+            free(ref);
+            continue;
+        }
+
+        way = pbf_pre_take(s->pre ? s->pre->ways : NULL, k);
+        checked = way != NULL;
+        if (way == PBF_DROPPED) {
+            free(ref);
+            ++filtered;
+            continue;
+        }
+        if (way == NULL)
+            way = pbf_way(P, W, ref);
+        if (want == 2 && !pbf_way_ok(s, way, checked)) {
+            osm_free_way(way);
+            free(ref);
+            ++filtered;
+            continue;
+        }
+        if (s->mem_nodes != NULL && W->n_refs)
+            osm_add_members(s->mem_nodes, W->n_refs, ref, 0);
+        else
+            free(ref);
+        osm_trace(OSM_TRACE_OBJECT, "adding % 6d members to way=%lu list", W->n_refs, W->id);
+        osm_realloc_way_list(s->data->ways);
+        s->data->ways->data[ s->data->ways->num ] = way;
+        s->data->ways->num += 1;
+        osm_stats_add(OSM_STAT_WAYS_KEPT, 1);
+    }
+    osm_stats_add(OSM_STAT_WAYS_SEEN, G->n_ways);
+    osm_stats_add(OSM_STAT_WAYS_FILTERED, filtered);
+}
+
+static void pbf_parse_relations(struct pbf_parse *s, PrimitiveBlock *P, PrimitiveGroup *G) {
+    OSM_Filter *f = s->opt->filter;
+    size_t k, l, filtered = 0;
+
+    for (k=0; k<G->n_relations; k++) {
+        Relation *R = G->relations[k];
+        uint64_t *wref = malloc(sizeof(uint64_t) * (R->n_memids + 1));
+        uint64_t *nref = malloc(sizeof(uint64_t) * (R->n_memids + 1));
+        size_t num_wref = 0, num_nref = 0;
+        int64_t deltamemids = 0;
+        OSM_Relation *rel;
+        int want, checked;
+
+        if (s->graph != NULL)
+            osm_relgraph_add(s->graph, R->id);
+        for (l=0; l<R->n_memids; l++) {
+            deltamemids += R->memids[l];
+            if (R->types[l] == RELATION__MEMBER_TYPE__NODE)
+                nref[num_nref++] = deltamemids;
+            else if (R->types[l] == RELATION__MEMBER_TYPE__WAY)
+                wref[num_wref++] = deltamemids;
+            /* relations in relations: see pbf_relation_closure() */
+            if (s->graph != NULL)
+                osm_relgraph_member(s->graph,
+                    R->types[l] == RELATION__MEMBER_TYPE__NODE ? OSM_REL_MEMBER_TYPE_NODE
+                    : R->types[l] == RELATION__MEMBER_TYPE__WAY ? OSM_REL_MEMBER_TYPE_WAY
+                    : OSM_REL_MEMBER_TYPE_RELATION, deltamemids);
+        }
+        want = pbf_want_relation(s, R->id, nref, num_nref);
+        if (want == 2 && f != NULL
+            && !osm_filter_pbf(f, OSM_REL_MEMBER_TYPE_RELATION, R->id,
+                            R->keys, R->vals, R->n_keys, 1,
+                            R->info ? R->info->uid : 0, pbf_user_sid(R->info))) {
+            want = 0;
+            ++filtered;
+        }
+        if (want) {
+            rel = pbf_pre_take(s->pre ? s->pre->relations : NULL, k);
+            checked = rel != NULL;
+            if (rel == PBF_DROPPED) {
+                want = 0;
+                ++filtered;
+            }
+            else {
+                if (rel == NULL)
+                    rel = pbf_relation(P, R);
+                if (want == 2 && !pbf_relation_ok(s, rel, checked)) {
+                    osm_free_relation(rel);
+                    want = 0;
+                    ++filtered;
+                }
+            }
+        }
+        if (!want) {
+            free(wref);
+            free(nref);
+            continue;
+        }
+
+        /* the members of relations of relations are known already */
+        if (want == 2 && s->mem_nodes != NULL && num_nref)
+            osm_add_members(s->mem_nodes, num_nref, nref, 1);
+        else
+            free(nref);
+        if (want == 2 && s->mem_ways != NULL && num_wref)
+            osm_add_members(s->mem_ways, num_wref, wref, 1);
+        else
+            free(wref);
+
+        osm_realloc_rel_list(s->data->relations);
+        s->data->relations->data[ s->data->relations->num ] = rel;
+        s->data->relations->num += 1;
+        osm_stats_add(OSM_STAT_RELATIONS_KEPT, 1);
+    }
+    if (s->mem_rels == NULL)
+        osm_stats_add(OSM_STAT_RELATIONS_SEEN, G->n_relations);
+    osm_stats_add(OSM_STAT_RELATIONS_FILTERED, filtered);
+}
+
+static struct osm_members *pbf_new_members() {
+    struct osm_members *m = malloc(sizeof(struct osm_members));
+    m->data = malloc(sizeof(uint64_t) * 65536);
+    m->num  = 0;
+    m->size = 65536;
+    osm_stats_alloc(OSM_MEM_MEMBERS, sizeof(uint64_t) * m->size);
+    return m;
+}
+
+static void pbf_free_members(struct osm_members *m) {
+    if (m == NULL)
+        return;
+    osm_stats_alloc(OSM_MEM_MEMBERS, -(int64_t)(sizeof(uint64_t) * m->size));
+    free(m->data);
+    free(m);
+}
+
+/*
+ * after the OSMDATA_REL pass: find the relations which are members of the
+ * kept ones at any depth in the relation graph. They are read in the way
+ * pass, their node and way members are added to the wanted ones now.
+ */
+static void pbf_relation_closure(struct pbf_parse *s) {
+    OSM_Relation_List *rl = s->data->relations;
+    struct osm_members *kept;
+    uint64_t *ids, *nref, *wref;
+    uint32_t i, k, num, num_nref = 0, num_wref = 0;
+
+    if (s->graph == NULL)
+        return;
+    kept = pbf_new_members();
+    ids  = malloc(sizeof(uint64_t) * (rl->num + 1));
+    s->mem_rels = pbf_new_members();
+    if (ids == NULL) {
+        fprintf(stderr, "failed to malloc relation ids: %s\n", strerror(errno));
+        goto done;
+    }
+    for (i=0; i<rl->num; i++)
+        ids[i] = rl->data[i]->id;
+    osm_add_members(kept, rl->num, ids, 1);
+    if (osm_relgraph_closure(s->graph, kept, s->mem_rels) <= 0)
+        goto done;
+
+    for (i=0; i<s->mem_rels->num; i++) {
+        const uint64_t *m = osm_relgraph_get(s->graph, s->mem_rels->data[i], &num);
+        for (k=0; k<num; k++) {
+            if (OSM_RELGRAPH_TYPE(m[k]) == OSM_REL_MEMBER_TYPE_NODE)
+                ++num_nref;
+            else if (OSM_RELGRAPH_TYPE(m[k]) == OSM_REL_MEMBER_TYPE_WAY)
+                ++num_wref;
+        }
+    }
+    nref = malloc(sizeof(uint64_t) * (num_nref + 1));
+    wref = malloc(sizeof(uint64_t) * (num_wref + 1));
+    if (nref == NULL || wref == NULL) {
+        fprintf(stderr, "failed to malloc relation members: %s\n", strerror(errno));
+        free(nref);
+        free(wref);
+        goto done;
+    }
+    num_nref = num_wref = 0;
+    for (i=0; i<s->mem_rels->num; i++) {
+        const uint64_t *m = osm_relgraph_get(s->graph, s->mem_rels->data[i], &num);
+        for (k=0; k<num; k++) {
+            if (OSM_RELGRAPH_TYPE(m[k]) == OSM_REL_MEMBER_TYPE_NODE)
+                nref[num_nref++] = OSM_RELGRAPH_REF(m[k]);
+            else if (OSM_RELGRAPH_TYPE(m[k]) == OSM_REL_MEMBER_TYPE_WAY)
+                wref[num_wref++] = OSM_RELGRAPH_REF(m[k]);
+        }
+    }
+    osm_add_members(s->mem_nodes, num_nref, nref, 1);
+    osm_add_members(s->mem_ways, num_wref, wref, 1);
+    osm_trace(OSM_TRACE_PASS, "relations of relations: %u, nodes=%u, ways=%u",
+                s->mem_rels->num, num_nref, num_wref);
+
+  done:
+    osm_trace(OSM_TRACE_PASS, "closure: %u relations, %u relations of relations",
+                osm_relgraph_count(s->graph), s->mem_rels->num);
+    pbf_free_members(kept);
+    osm_relgraph_free(s->graph);
+    s->graph = NULL;
+}
+
+/* the object types parsed in the current pass, OSMDATA_NODE|WAY|REL */
+static uint32_t pbf_pass_types(struct pbf_parse *s) {
+    uint32_t types = 0;
+    if (s->mode & (OSMDATA_DUMP|OSMDATA_NODE)
+        || (s->mode == OSMDATA_BBOX
+            && (s->bbox_state == bbox_nodes_in_box
+                || s->bbox_state == bbox_nodes_find)))
+        types |= OSMDATA_NODE;
+    if (s->mode & (OSMDATA_DUMP|OSMDATA_WAY)
+        || (s->mode == OSMDATA_BBOX && s->bbox_state == bbox_way_find))
+        types |= OSMDATA_WAY;
+    if (s->mode & (OSMDATA_DUMP|OSMDATA_REL)
+        || (s->mode == OSMDATA_BBOX && s->bbox_state == bbox_rel_find)
+        || (s->mode == OSMDATA_WAY && s->mem_rels != NULL && s->mem_rels->num))
+        types |= OSMDATA_REL;
+    return types;
+}
+
+/* pre are the results of the thread safe filters for the groups, or NULL */
+static void pbf_parse_block(struct pbf_parse *s, PrimitiveBlock *P, struct pbf_pre *pre) {
+    uint32_t types = pbf_pass_types(s);
+    unsigned int j;
+
+    if (s->opt->filter != NULL)
+        osm_filter_bind(s->opt->filter, P->stringtable);
+
+    for (j = 0; j < P->n_primitivegroup; j++) {
+        PrimitiveGroup *G = P->primitivegroup[j];
+        s->pre = pre != NULL ? &pre[j] : NULL;
+        if (types & OSMDATA_NODE)
+            pbf_parse_nodes(s, P, G);
+        if (types & OSMDATA_WAY)
+            pbf_parse_ways(s, P, G);
+        if (types & OSMDATA_REL)
+            pbf_parse_relations(s, P, G);
+        if (s->csets)
+            pbf_changesets(P, G, &s->data->changesets);
+    }
+    s->pre = NULL;
+}
+
+/*
+ * run the thread safe filters in this pass? Not in the first bbox pass,
+ * which only collects the nodes in the area.
+ */
+static int pbf_prefilter_on(struct pbf_parse *s) {
+    OSM_Parse_Options *o = s->opt;
+    uint32_t types;
+    if (!(o->filter_flags & OSM_FILTER_THREAD_SAFE) || s->bbox_state == bbox_nodes_in_box)
+        return 0;
+    types = pbf_pass_types(s);
+    return ((types & OSMDATA_NODE) && o->node_filter_r != NULL)
+        || ((types & OSMDATA_WAY)  && o->way_filter_r  != NULL)
+        || ((types & OSMDATA_REL)  && o->rel_filter_r  != NULL);
+}
+
+static void pbf_pre_free(struct pbf_pre *pre, PrimitiveBlock *P) {
+    unsigned int j;
+    size_t k;
+
+    if (pre == NULL)
+        return;
+    for (j = 0; j < P->n_primitivegroup; j++) {
+        PrimitiveGroup *G = P->primitivegroup[j];
+        size_t num_nodes = G->n_nodes + (G->dense ? G->dense->n_id : 0);
+        for (k = 0; pre[j].nodes != NULL && k < num_nodes; k++) {
+            if (pre[j].nodes[k] != NULL && pre[j].nodes[k] != PBF_DROPPED)
+                osm_free_node(pre[j].nodes[k]);
+        }
+        for (k = 0; pre[j].ways != NULL && k < G->n_ways; k++) {
+            if (pre[j].ways[k] != NULL && pre[j].ways[k] != PBF_DROPPED)
+                osm_free_way(pre[j].ways[k]);
+        }
+        for (k = 0; pre[j].relations != NULL && k < G->n_relations; k++) {
+            if (pre[j].relations[k] != NULL && pre[j].relations[k] != PBF_DROPPED)
+                osm_free_relation(pre[j].relations[k]);
+        }
+        free(pre[j].nodes);
+        free(pre[j].ways);
+        free(pre[j].relations);
+    }
+    free(pre);
+}
+
+/*
+ * called on the worker threads: run the thread safe filters on the
+ * objects of P which the pass wants (pbf_want_*() only read the member
+ * lists here). The compiled filter is bound to one block at a time, it
+ * runs later in pbf_parse_*(). NULL if nothing could be allocated, the
+ * filters run in pbf_parse_*() then
+ */
+static struct pbf_pre *pbf_prefilter(struct pbf_parse *s, PrimitiveBlock *P) {
+    OSM_Parse_Options *o = s->opt;
+    uint32_t types = pbf_pass_types(s);
+    struct pbf_pre *pre = calloc(P->n_primitivegroup + 1, sizeof(struct pbf_pre));
+    unsigned int j;
+    size_t k, l;
+
+    if (pre == NULL)
+        return (struct pbf_pre *)NULL;
+    for (j = 0; j < P->n_primitivegroup; j++) {
+        PrimitiveGroup *G = P->primitivegroup[j];
+
+        if ((types & OSMDATA_NODE) && o->node_filter_r != NULL) {
+            size_t num = G->n_nodes + (G->dense ? G->dense->n_id : 0);
+            pre[j].nodes = calloc(num + 1, sizeof(void *));
+            for (k = 0; pre[j].nodes != NULL && k < G->n_nodes; k++) {
+                Node *node = G->nodes[k];
+                OSM_Node *n;
+                if (pbf_want_node(s, node->id,
+                        NANO_DEGREE * (P->lat_offset + (node->lat * P->granularity)),
+                        NANO_DEGREE * (P->lon_offset + (node->lon * P->granularity))) != 2)
+                    continue;
+                n = pbf_node(P, node);
+                if (o->node_filter_r(n, o->filter_ctx))
+                    pre[j].nodes[k] = n;
+                else {
+                    osm_free_node(n);
+                    pre[j].nodes[k] = PBF_DROPPED;
+                }
+            }
+            if (pre[j].nodes != NULL && G->dense) {
+                struct pbf_dense d;
+                memset(&d, 0, sizeof(d));
+                d.D = G->dense;
+                for (k = 0; k < d.D->n_id; k++) {
+                    OSM_Node *n;
+                    pbf_dense_decode(&d, k);
+                    if (pbf_want_node(s, d.id,
+                            NANO_DEGREE * (P->lat_offset + (d.lat * P->granularity)),
+                            NANO_DEGREE * (P->lon_offset + (d.lon * P->granularity))) != 2)
+                        continue;
+                    n = pbf_dense_node(P, &d, k);
+                    if (o->node_filter_r(n, o->filter_ctx))
+                        pre[j].nodes[G->n_nodes + k] = n;
+                    else {
+                        osm_free_node(n);
+                        pre[j].nodes[G->n_nodes + k] = PBF_DROPPED;
+                    }
+                }
+            }
+        }
+
+        if ((types & OSMDATA_WAY) && o->way_filter_r != NULL) {
+            pre[j].ways = calloc(G->n_ways + 1, sizeof(void *));
+            for (k = 0; pre[j].ways != NULL && k < G->n_ways; k++) {
+                Way *W = G->ways[k];
+                uint64_t *ref = malloc(sizeof(uint64_t) * (W->n_refs + 1));
+                int64_t deltaref = 0;
+                OSM_Way *way;
+                if (ref == NULL)
+                    continue;
+                for (l = 0; l < W->n_refs; l++) {
+                    deltaref += W->refs[l];
+                    ref[l] = deltaref;
+                }
+                if (pbf_want_way(s, W->id, ref, W->n_refs) == 2) {
+                    way = pbf_way(P, W, ref);
+                    if (o->way_filter_r(way, o->filter_ctx))
+                        pre[j].ways[k] = way;
+                    else {
+                        osm_free_way(way);
+                        pre[j].ways[k] = PBF_DROPPED;
+                    }
+                }
+                free(ref);
+            }
+        }
+
+        if ((types & OSMDATA_REL) && o->rel_filter_r != NULL) {
+            pre[j].relations = calloc(G->n_relations + 1, sizeof(void *));
+            for (k = 0; pre[j].relations != NULL && k < G->n_relations; k++) {
+                Relation *R = G->relations[k];
+                uint64_t *nref = malloc(sizeof(uint64_t) * (R->n_memids + 1));
+                size_t num_nref = 0;
+                int64_t deltamemids = 0;
+                OSM_Relation *rel;
+                if (nref == NULL)
+                    continue;
+                for (l = 0; l < R->n_memids; l++) {
+                    deltamemids += R->memids[l];
+                    if (R->types[l] == RELATION__MEMBER_TYPE__NODE)
+                        nref[num_nref++] = deltamemids;
+                }
+                if (pbf_want_relation(s, R->id, nref, num_nref) == 2) {
+                    rel = pbf_relation(P, R);
+                    if (o->rel_filter_r(rel, o->filter_ctx))
+                        pre[j].relations[k] = rel;
+                    else {
+                        osm_free_relation(rel);
+                        pre[j].relations[k] = PBF_DROPPED;
+                    }
+                }
+                free(nref);
+            }
+        }
+    }
+    return pre;
+}
+
+/* a batch of blocks, unpacked and filtered by all threads */
+struct pbf_batch {
+    struct pbf_parse *s;
+    struct osm_pbf_raw *raw;
+    PrimitiveBlock **P;
+    struct pbf_pre **pre;
+    uint32_t num;
+    uint32_t next;
+};
+
+static void pbf_batch_worker(int id, int num, void *arg) {
+    struct pbf_batch *b = arg;
+    uint32_t i;
+
+    while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->num) {
+        b->P[i] = osm_pbf_unpack_raw(&b->raw[i]);
+        if (b->P[i] != NULL)
+            b->pre[i] = pbf_prefilter(b->s, b->P[i]);
+    }
+}
+
+/*
+ * with thread safe filters: read the next threads * PBF_BATCH blocks,
+ * unpack and filter them on all threads, then parse them in file order.
+ * Returns 1 if blocks were parsed, 0 at EOF, -1 on errors
+ */
+static int pbf_parse_batch(struct pbf_parse *s, OSM_File *F, int threads) {
+    uint32_t size = threads * PBF_BATCH, i;
+    struct pbf_batch b;
+    int r = 1, ret = 1;
+
+    b.s   = s;
+    b.raw = calloc(size, sizeof(struct osm_pbf_raw));
+    b.P   = calloc(size, sizeof(PrimitiveBlock *));
+    b.pre = calloc(size, sizeof(struct pbf_pre *));
+    if (b.raw == NULL || b.P == NULL || b.pre == NULL) {
+        fprintf(stderr, "failed to malloc block batch: %s\n", strerror(errno));
+        ret = -1;
+        goto done;
+    }
+    for (b.num = 0; b.num < size; b.num++) {
+        r = osm_pbf_read_raw(F, &b.raw[b.num]);
+        if (r <= 0)
+            break;
+    }
+    if (r < 0)
+        ret = -1;
+    else if (b.num == 0)
+        ret = 0;
+    if (b.num == 0)
+        goto done;
+
+    osm_trace(OSM_TRACE_BLOCK, "batch: %u blocks, mode %d", b.num, s->mode);
+    b.next = 0;
+    osm_threads_run(threads, pbf_batch_worker, &b);
+    for (i = 0; i < b.num; i++) {
+        if (b.P[i] == NULL) {
+            ret = -1;
+            continue;
+        }
+        if (ret > 0)
+            pbf_parse_block(s, b.P[i], b.pre[i]);
+        pbf_pre_free(b.pre[i], b.P[i]);
+        osm_pbf_free_primitive(b.P[i]);
+    }
+
+  done:
+    free(b.raw);
+    free(b.P);
+    free(b.pre);
+    return ret;
+}
+
+OSM_Data *osm_pbf_parse_opt(OSM_File *F, OSM_Parse_Options *opt) {
     uint32_t length;
+    int threads = osm_threads_num(opt->threads);
     BlockHeader *bh = NULL;
     Blob      *blob = NULL;
-    struct osm_members *mem_nodes = NULL;
-    struct osm_members *mem_ways  = NULL;
-    struct osm_members *bbn = NULL;
+    struct pbf_parse s;
     enum {
         osm_pbf_initializer,
         osm_pbf_header,
         osm_pbf_data
     } state = osm_pbf_initializer;
 
-    enum {
-        bbox_no_bbox,
-        bbox_nodes_in_box,
-        bbox_rel_find,
-        bbox_way_find,
-        bbox_nodes_find
-    } bbox_state = bbox_no_bbox;
-   
-    if (mode == 0) {
+    memset(&s, 0, sizeof(s));
+    s.opt        = opt;
+    s.mode       = opt->mode & ~OSMDATA_CSET;
+    s.csets      = opt->mode & OSMDATA_CSET;
+    s.bbox_state = bbox_no_bbox;
+
+    if (s.mode == 0 && !s.csets) {
         fprintf(stderr, "mode cannot be 0...\n");
         return (OSM_Data *)NULL;
     }
-    else if (mode == OSMDATA_BBOX) {
-        if (bbox == NULL) {
-            fprintf(stderr, "mode = OSMDATA_BBOX, but bbox is NULL\n");
+    else if (s.mode == OSMDATA_BBOX) {
+        if (opt->bbox == NULL && opt->poly == NULL) {
+            fprintf(stderr, "mode = OSMDATA_BBOX, but bbox and poly are NULL\n");
             return (OSM_Data *)NULL;
         }
         else {
-            bbox_state = bbox_nodes_in_box;
+            s.bbox_state = bbox_nodes_in_box;
         }
     }
 
@@ -86,76 +1010,84 @@ OSM_Data *osm_pbf_parse(OSM_File *F,
     data->relations->num = 0;
     data->relations->size = 65536;
     data->relations->data = malloc(sizeof(OSM_Relation) * 65536);
+    data->changesets = NULL;
+    s.data = data;
 
-    if (mode != OSMDATA_DUMP) {
-        mem_nodes = malloc(sizeof(struct osm_members));
-        mem_nodes->data = malloc(sizeof(uint64_t) * 65536);
-        mem_nodes->num  = 0;
-        mem_nodes->size = 65536;
-        mem_ways = malloc(sizeof(struct osm_members));
-        mem_ways->data = malloc(sizeof(uint64_t) * 65536);
-        mem_ways->num  = 0;
-        mem_ways->size = 65536;
+    if (s.mode != OSMDATA_DUMP) {
+        s.mem_nodes = pbf_new_members();
+        s.mem_ways  = pbf_new_members();
     }
-
-    bbn = malloc(sizeof(struct osm_members));
-    bbn->data = malloc(sizeof(uint64_t) * 65536);    
-    bbn->size = 65536;
-    bbn->num  = 0;
+    if (s.mode == OSMDATA_REL)
+        s.graph = osm_relgraph_new();
+    s.bbn = pbf_new_members();
 
   restart:
     while (1) {
-        length = osm_pbf_bh_length(F);
+        if (pbf_prefilter_on(&s)) {
+            int r = pbf_parse_batch(&s, F, threads);
+            if (r < 0)
+                return (OSM_Data *)NULL;
+            if (r > 0)
+                continue;
+            length = -1; /* EOF */
+        }
+        else
+            length = osm_pbf_bh_length(F);
         if (length <= 0 || length > MAX_BLOCK_HEADER_SIZE) {
             if (length == -1) { /* @EOF */
-                if (mode & (OSMDATA_DUMP|OSMDATA_NODE)) {
+                s.csets = 0;
+                if (s.mode == 0 || s.mode & (OSMDATA_DUMP|OSMDATA_NODE)) {
                     if (debug)
                         fprintf(stderr, "all parsing done.\n");
-                    return data;
+                    goto done;
                 }
 
-                if (mode & (OSMDATA_WAY|OSMDATA_REL)) {
-                    fseek(F->file, 0, SEEK_SET);
-                    osm_sort_member(mem_ways);
-                    osm_sort_member(mem_nodes);
-                    if (mode == OSMDATA_REL) {
+                if (s.mode & (OSMDATA_WAY|OSMDATA_REL)) {
+                    if (osm_rewind(F) != 0)
+                        return (OSM_Data *)NULL;
+                    osm_sort_member(s.mem_ways);
+                    osm_sort_member(s.mem_nodes);
+                    if (s.mode == OSMDATA_REL) {
+                        pbf_relation_closure(&s);
                         if (debug) 
                             fprintf(stderr, "parsing relations done: %u, %u, %u.\n",
-                                             data->relations->num, mem_ways->num, mem_nodes->num);
+                                             data->relations->num, s.mem_ways->num, s.mem_nodes->num);
                         
-                        mode = OSMDATA_WAY;
+                        s.mode = OSMDATA_WAY;
                     }
-                    else if (mode == OSMDATA_WAY) {
+                    else if (s.mode == OSMDATA_WAY) {
                         if (debug) 
                             fprintf(stderr, "parsing ways done: %u, n=%u\n",
-                                            data->ways->num, mem_nodes->num);
-                        mode = OSMDATA_NODE;
+                                            data->ways->num, s.mem_nodes->num);
+                        s.mode = OSMDATA_NODE;
                     }
                     goto restart;
                 }
-                else if (mode == OSMDATA_BBOX) {
-                    fseek(F->file, 0, SEEK_SET);
-                    switch (bbox_state) {
+                else if (s.mode == OSMDATA_BBOX) {
+                    if (osm_rewind(F) != 0)
+                        return (OSM_Data *)NULL;
+                    switch (s.bbox_state) {
                         case bbox_nodes_find:
                             if (debug)
                                 fprintf(stderr, "nodes: %d\n", data->nodes->num);
-                            return data;
+                            goto done;
                             break;
                         case bbox_way_find:
                             if (debug)
-                                fprintf(stderr, "way members: %u\n", mem_ways->num);
-                            bbox_state = bbox_nodes_find;
+                                fprintf(stderr, "way members: %u\n", s.mem_ways->num);
+                            osm_sort_member(s.mem_nodes);
+                            s.bbox_state = bbox_nodes_find;
                             break;            
                         case bbox_rel_find:
                             if (debug)
-                                fprintf(stderr, "rel members: ways=%u, nodes=%u\n", mem_ways->num, mem_nodes->num);
-                            bbox_state = bbox_way_find;
+                                fprintf(stderr, "rel members: ways=%u, nodes=%u\n", s.mem_ways->num, s.mem_nodes->num);
+                            s.bbox_state = bbox_way_find;
                             break;            
                         case bbox_nodes_in_box:
-                            bbox_state = bbox_rel_find;
-                            osm_sort_member(bbn);
+                            s.bbox_state = bbox_rel_find;
+                            osm_sort_member(s.bbn);
                             if (debug)
-                                fprintf(stderr, "Nodes in BBOX: %d\n", bbn->num);
+                                fprintf(stderr, "Nodes in BBOX: %d\n", s.bbn->num);
                             break;
                         default:
                             fprintf(stderr, "mode = OSMDATA_BBOX, but state "
@@ -186,6 +1118,20 @@ OSM_Data *osm_pbf_parse(OSM_File *F,
         else if (strcmp(bh->type, "OSMData") == 0) {
             state = osm_pbf_data;
         }
+        /* the first bbox pass does not need blocks outside of the area */
+        if (state == osm_pbf_data && s.bbox_state == bbox_nodes_in_box) {
+            OSM_BBox index;
+            if (osm_pbf_bh_bbox(bh, &index) == 0
+                && !osm_bbox_intersects(opt->bbox != NULL ? opt->bbox : osm_poly_bbox(opt->poly),
+                                        &index))
+            {
+                osm_trace(OSM_TRACE_BLOCK, "block: outside of the area, skipped");
+                osm_pbf_free_bh(bh);
+                if (osm_pbf_skip_blob(F, length) != 0)
+                    return (OSM_Data *)NULL;
+                continue;
+            }
+        }
         osm_pbf_free_bh(bh);
 
         unsigned char *uncompressed;
@@ -196,561 +1142,182 @@ OSM_Data *osm_pbf_parse(OSM_File *F,
         }
         else if (state == osm_pbf_data) {
             PrimitiveBlock *P = osm_pbf_unpack_data(blob, uncompressed);
-            double lat_offset  = NANO_DEGREE * P->lat_offset;
-            double lon_offset  = NANO_DEGREE * P->lon_offset;
-            double granularity = NANO_DEGREE * P->granularity;
-
-            unsigned int j;
-            for (j = 0; j < P->n_primitivegroup; j++) {
-                /* fprintf(stderr,"\t\t""Nodes: %li""\n"\
-                   "\t\t""Ways: %li""\n"\
-                   "\t\t""Relations: %li""\n",
-                   (P->primitivegroup[j]->dense ?
-                    P->primitivegroup[j]->dense->n_id :
-                           P->primitivegroup[j]->n_nodes),
-                   P->primitivegroup[j]->n_ways,
-                   P->primitivegroup[j]->n_relations); */
-                int k;
-                if (mode & (OSMDATA_DUMP|OSMDATA_NODE) 
-                    || (mode == OSMDATA_BBOX 
-                        && (bbox_state == bbox_nodes_in_box 
-                            || bbox_state == bbox_nodes_find)))
-                {
-                    if (P->primitivegroup[j]->n_nodes > 0) {
-                        for (k = 0; k < P->primitivegroup[j]->n_nodes; k++) {
-                            Node *node = P->primitivegroup[j]->nodes[k];
-
-                            OSM_Node *n = malloc(sizeof(OSM_Node));
-                            n->id = node->id;
-                            n->lat = lat_offset + (node->lat * granularity);
-                            n->lon = lon_offset + (node->lon * granularity);
-                            if (bbox_state == bbox_nodes_in_box) {
-                                if (n->lon    >= bbox->left_lon
-                                    && n->lon <= bbox->right_lon
-                                    && n->lat >= bbox->bottom_lat
-                                    && n->lat <= bbox->top_lat)
-                                {
-                                    uint64_t *mid = malloc(sizeof(uint64_t));
-                                    *mid = n->id;
-                                    osm_add_members(bbn, 1, mid, 0);
-                                    /* 
-                                    osm_realloc_bbox_nodes(bbn);
-                                    bbn->id[ bbn->num ] = n->id;
-                                    bbn->num += 1;
-                                    */
-                                    if (debug) 
-                                        fprintf(stderr, "NODE %lu (%.7f, %.7f) is in bbox\n", n->id, n->lon, n->lat);
-                                    free(n);
-                                    continue;
-                                }
-                            }
-                            if (node->info) {
-                                Info *I = node->info;
-                                if (I->has_version) 
-                                    n->version = I->version;
-                                else n->version = 0;
-                                if (I->has_changeset)
-                                    n->changeset = I->changeset;
-                                else n->changeset = 0;
-
-                                if (I->has_user_sid) {
-                        
-                                    ProtobufCBinaryData user = 
-                                        P->stringtable->s[I->user_sid];
-                                    n->user = strndup((const char *)user.data, user.len);
-                                }
-                                else n->user = strdup("");
-                                if (I->has_uid)
-                                    n->uid = I->uid;
-                                else n->uid = 0;
-                                if (I->has_timestamp) {
-                                    n->timestamp = I->timestamp * (P->date_granularity / 1000);
-                                } else n->timestamp = 0;
-                                
-                            } /* node->has_info */
-                            OSM_Tag_List *tl = NULL;
-                            if (node->n_keys && node->n_vals) {
-                                tl       = malloc(sizeof(OSM_Tag_List));
-                                tl->num  = node->n_keys;
-                                tl->size = node->n_keys;
-                                tl->data = malloc(sizeof(OSM_Tag) * node->n_keys);
-                                int x;
-                                for (x=0; x<node->n_keys; x++) {
-                                    ProtobufCBinaryData key = 
-                                        P->stringtable->s[node->keys[x]];
-                                    ProtobufCBinaryData val = 
-                                        P->stringtable->s[node->vals[x]];
-                                    tl->data[x].key = 
-                                                strndup((const char *)key.data, key.len);
-                                    tl->data[x].val =
-                                                strndup((const char *)val.data, val.len);
-                                }
-                            }
-                            n->tags = tl;
-                            if (mode == OSMDATA_BBOX) {
-                                if (bbox_state == bbox_nodes_find) {
-                                    if (osm_is_member(mem_nodes, n->id) == -1) {
-                                        if (osm_is_member(bbn, n->id) == -1) {
-                                            osm_free_node(n);
-                                            continue;
-                                        }
-                                        else {
-                                            if (node_filter != NULL && !node_filter(n)) {
-                                                osm_free_node(n);
-                                                continue;
-                                            }
-                                        }
-                                    }
- 
-                                    if (debug) 
-                                        fprintf(stderr, "NODE %lu (%.7f, %.7f) is needed\n", n->id, n->lon, n->lat);
-                                        
-                                }
-                            }
-                            else {
-                                if (mode == OSMDATA_NODE && node_filter != NULL) {
-                                    if ((osm_is_member(mem_nodes, n->id) == -1) 
-                                        && 
-                                        !node_filter(n))
-                                        {
-                                            osm_free_node(n);
-                                            continue;
-                                        }
-                                }
-                                else if (mode == OSMDATA_NODE
-                                            &&
-                                         osm_is_member(mem_nodes, n->id) == -1) 
-                                {
-                                        osm_free_node(n);
-                                        continue;
-                                }
-                                else if (node_filter != NULL && !node_filter(n))
-                                {
-                                    osm_free_node(n);
-                                    continue;
-                                }
-                            }
-                            osm_realloc_node_list(data->nodes);
-                            data->nodes->data[ data->nodes->num ] = n;
-                            data->nodes->num += 1;
-                            // osm_pbf_add_node(node_list, n);
-                        }
-                    } /* P->primitivegroup[j]->n_nodes > 0 */
-                    if (P->primitivegroup[j]->dense) {
-                        int l = 0;
-                        unsigned long int deltaid = 0;
-                        long int deltalat = 0;
-                        long int deltalon = 0;
-                        long int deltatimestamp = 0;
-                        long int deltachangeset = 0;
-                        long int deltauid = 0;
-                        long int deltauser_sid = 0;
-                        int k;
-                        DenseNodes *D = P->primitivegroup[j]->dense;
-
-                        for (k=0; k<D->n_id; k++) {
-                            deltaid  += D->id[k];
-                            deltalat += D->lat[k];
-                            deltalon += D->lon[k];
-
-                            OSM_Node *n = malloc(sizeof(OSM_Node));
-                            n->tags = NULL;
-                            n->id  = deltaid;
-                            n->lat = lat_offset + (deltalat * granularity);
-                            n->lon = lon_offset + (deltalon * granularity);
-                            n->user = "";
-                            n->timestamp = 0;
-                            n->version   = 0;
-                            n->uid       = 0;
-                            n->changeset = 0;
-                            if (D->denseinfo) {
-                                DenseInfo *I = D->denseinfo;
-                                deltatimestamp += I->timestamp[k];
-                                deltachangeset += I->changeset[k];
-                                deltauid       += I->uid[k];
-                                deltauser_sid  += I->user_sid[k];
-                                n->version   = I->version[k];
-                                n->changeset = deltachangeset;
-                                n->user = strndup((const char *)P->stringtable->s[deltauser_sid].data, P->stringtable->s[deltauser_sid].len);
-                                n->uid       = deltauid;
-                                n->timestamp = deltatimestamp * (P->date_granularity / 1000);
-                            }
-
-                            OSM_Tag_List *tl = NULL;
-                            if (l < D->n_keys_vals) {
-                                while (D->keys_vals[l] != 0 && l < D->n_keys_vals) {
-                                    if (tl == NULL) {
-                                        tl       = malloc(sizeof(OSM_Tag_List));
-                                        tl->num  = 0;
-                                        tl->size = 16;
-                                        tl->data = malloc(sizeof(OSM_Tag) * 16);
-                                    } 
-                                    else {
-                                        osm_realloc_tag_list(tl);
-                                    }
-                                    int o = D->keys_vals[l];
-                                    int p = D->keys_vals[l+1];
-                                    tl->data[tl->num].key = 
-                                        strndup((const char *)P->stringtable->s[o].data, P->stringtable->s[o].len);
-                                    tl->data[tl->num].val = 
-                                        strndup((const char *)P->stringtable->s[p].data, P->stringtable->s[p].len);
-                                    tl->num += 1;
-                                    l += 2;
-                                }
-                                l += 1;
-                            }
-                            n->tags = tl;
-
-                            if (mode == OSMDATA_BBOX) {
-                                if (bbox_state == bbox_nodes_in_box) {
-                                    if (   n->lat >= bbox->bottom_lat
-                                        && n->lat <= bbox->top_lat
-                                        && n->lon >= bbox->left_lon 
-                                        && n->lon <= bbox->right_lon) 
-                                    {
-
-                                        // if (node_filter == NULL
-                                        //     || node_filter(N))
-                                        {
-                                            uint64_t *mid
-                                                = malloc(sizeof(uint64_t));
-                                            *mid = n->id;
-                                            osm_add_members(bbn, 1, mid, 0);
-                                            if (debug) 
-                                                fprintf(stderr, "NODE %lu (%.7f, %.7f) is in bbox\n", n->id, n->lon, n->lat);
-                                        }
-                                    }
-                                    osm_free_node(n);
-                                    continue;
-                                }
-                                else if (bbox_state == bbox_nodes_find) {
-                                    if (osm_is_member(mem_nodes, n->id) == -1) {
-                                        if (osm_is_member(bbn, n->id) == -1) {
-                                            osm_free_node(n);
-                                            continue;
-                                        }
-                                        else {
-                                            if (node_filter != NULL && !node_filter(n)) {
-                                                osm_free_node(n);
-                                                continue;
-                                            }
-                                        }
-                                    }
-                                    
-                                    if (debug) 
-                                        fprintf(stderr, "NODE %lu (%.7f, %.7f) is needed\n", n->id, n->lon, n->lat);
-                                        
-                                }
-                            }
-                            else {
-                                if (mode == OSMDATA_NODE && node_filter != NULL)
-                                {
-                                    if ((osm_is_member(mem_nodes, n->id) == -1) 
-                                        && 
-                                        !node_filter(n))
-                                    {
-                                        osm_free_node(n);
-                                        continue;
-                                    }
-                                }
-                                else if (mode == OSMDATA_NODE
-                                            &&
-                                         osm_is_member(mem_nodes, n->id) == -1) 
-                                {
-                                        osm_free_node(n);
-                                        continue;
-                                }
-                                else if (node_filter != NULL && !node_filter(n))
-                                {
-                                    osm_free_node(n);
-                                    continue;
-                                }
-                            }
-                            osm_realloc_node_list(data->nodes);
-                            data->nodes->data[ data->nodes->num ] = n;
-                            data->nodes->num += 1;
-                        }
-                    } /* P->primitivegroup[j]->dense */
-                } /* mode == OSMDATA_DUMP || OSMDATA_NODE */
-
-                if (mode & (OSMDATA_DUMP|OSMDATA_WAY) 
-                    || (mode == OSMDATA_BBOX && bbox_state == bbox_way_find)) {
-                    if (P->primitivegroup[j]->n_ways > 0) {
-                        int k = 0;
-                        for (k = 0; k < P->primitivegroup[j]->n_ways; k++) {
-                            Way *W = P->primitivegroup[j]->ways[k];
-
-                            OSM_Way *way = malloc(sizeof(OSM_Way));
-                            uint64_t *ref = NULL;
-                            int l;
-                            way->id = W->id;
-                            if (W->info) {
-                                Info *I = W->info;
-                                if (I->has_version)
-                                    way->version = I->version;
-                                else way->version = 0;
-
-                                if (I->has_changeset)
-                                    way->changeset = I->changeset;
-                                else way->changeset = 0;
-
-                                if (I->has_user_sid) {
-                                    ProtobufCBinaryData user = 
-                                        P->stringtable->s[I->user_sid];
-                                    way->user = strndup((const char *)user.data, user.len);
-                                } else way->user = strdup("");
-
-                                if (I->has_uid)
-                                    way->uid = I->uid;
-                                else 
-                                    way->uid = 0;
-            
-                                if (I->has_timestamp)
-                                    way->timestamp = I->timestamp * (P->date_granularity / 1000);
-                                else way->timestamp = 0;
-                            }
-
-                            if (W->n_refs == 0) {
-                                way->nodes = malloc(sizeof(uint64_t));
-                                way->nodes[0] = 0;
-                            }
-                            else {
-                                ref = malloc(sizeof(uint64_t) * W->n_refs);
-                                long int deltaref = 0;
-                                way->nodes = malloc(sizeof(uint64_t)*(W->n_refs+1));
-                                way->nodes[W->n_refs] = 0;
-                                for (l = 0; l < W->n_refs; l++) {
-                                    deltaref += W->refs[l];
-                                    way->nodes[l] = deltaref;
-                                    ref[l] = deltaref;
-                                }
-                            }
-
-                            OSM_Tag_List *tl = NULL;
-                            if (W->n_keys > 0) {
-                                tl       = malloc(sizeof(OSM_Tag_List));
-                                tl->num  = W->n_keys;
-                                tl->size = W->n_keys;
-                                tl->data = malloc(sizeof(OSM_Tag) * W->n_keys);
-                            }
-                            for (l=0; l<W->n_keys; l++) {
-                                ProtobufCBinaryData key = 
-                                    P->stringtable->s[W->keys[l]];
-                                ProtobufCBinaryData val = 
-                                    P->stringtable->s[W->vals[l]];
-                                tl->data[l].key = 
-                                            strndup((const char *)key.data, key.len);
-                                tl->data[l].val =
-                                            strndup((const char *)val.data, val.len);
-                                // fprintf(stderr, "WAY=%lu, k='%s', v='%s'\n", W->id, tl->data[l].key, tl->data[l].val);
-                            }
-                            way->tags = tl;
-
-                            if (bbox_state == bbox_way_find) {
-                                int b = 0;
-                                int bbox_member = 0;
-                                for (b=0; b<W->n_refs; b++) {
-                                    if (osm_is_member(bbn, ref[b]) != -1) {
-                                        if (way_filter == NULL || way_filter(way)) {
-                                            if (debug) 
-                                                fprintf(stderr, "way %lu: member %lu is in bbox\n",
-                                                                W->id, ref[b]);
-                                            bbox_member = 1;
-                                            break;
-                                        }
-                                    }
-                                }
-                                if (bbox_member == 0 && osm_is_member(mem_ways, W->id) == -1) { 
-                                    osm_free_way(way);
-                                    free(ref);
-                                    continue;
-                                }
-                            }
-                            else {
-                                if (mode == OSMDATA_WAY && way_filter != NULL) {
-                                    if ((osm_is_member(mem_ways, W->id) == -1) 
-                                        && 
-                                        !way_filter(way))
-                                        {
-                                            osm_free_way(way);
-                                            free(ref);
-                                            continue;
-                                        }
-                                }
-                                else if (mode == OSMDATA_WAY
-                                            &&
-                                         osm_is_member(mem_ways, W->id) == -1) 
-                                {
-                                        osm_free_way(way);
-                                        free(ref);
-                                        continue;
-                                }
-                                else if (way_filter != NULL && !way_filter(way))
-                                {
-                                    osm_free_way(way);
-                                    free(ref);
-                                    continue;
-                                }
-                            }
-                            if (W->n_refs) 
-                                osm_add_members(mem_nodes, W->n_refs, ref, 0);
-                            if (debug)
-                                fprintf(stderr, "adding % 6d members to way=%lu list\n", (int)W->n_refs, W->id);
-                            osm_realloc_way_list(data->ways);
-                            data->ways->data[ data->ways->num ] = way;
-                            data->ways->num += 1;
-                        }
-                    } /* P->primitivegroup[j]->n_ways > 0 */
-                } /* mode == OSMDATA_DUMP || OSMDATA_WAY */
-
-                if (mode & (OSMDATA_DUMP|OSMDATA_REL) 
-                    || (mode == OSMDATA_BBOX && bbox_state == bbox_rel_find))
-                {
-                    if (P->primitivegroup[j]->n_relations > 0) {
-                        int k;
-                        for (k=0; k<P->primitivegroup[j]->n_relations; k++) {
-                            Relation *R = P->primitivegroup[j]->relations[k];
-                            OSM_Relation *rel = malloc(sizeof(OSM_Relation));
-                            
-                            rel->id = R->id;
-                            if (R->info) {
-                                Info *I = R->info;
-        
-                                if (I->has_version)
-                                    rel->version = I->version;
-                                else rel->version = 0;
-
-                                if (I->has_changeset)
-                                    rel->changeset = I->changeset;
-                                else rel->changeset = 0;
-
-                                if (I->has_user_sid) {
-                                    ProtobufCBinaryData user = 
-                                        P->stringtable->s[I->user_sid];
-                                    rel->user = strndup((const char *)user.data, user.len);
-                                } else rel->user = strdup("");
-
-                                if (I->has_uid)
-                                    rel->uid = I->uid;
-                                else 
-                                    rel->uid = 0;
-            
-                                if (I->has_timestamp)
-                                    rel->timestamp = I->timestamp * (P->date_granularity / 1000);
-                                else rel->timestamp = 0;
-                            }
-
-                            uint64_t *wref = NULL;
-                            uint64_t *nref = NULL;
-                            int num_wref = 0;
-                            int num_nref = 0;
-                            if (R->n_memids == 0) {
-                                rel->member = NULL;
-                            }
-                            else {
-                                long int deltamemids = 0;
-                                rel->member = malloc(sizeof(OSM_Rel_Member_List)); 
-                                rel->member->num = R->n_memids;
-                                rel->member->size = R->n_memids;
-                                rel->member->data = malloc(sizeof(OSM_Rel_Member) * R->n_memids); 
-                                wref = malloc(sizeof(uint64_t) * R->n_memids);
-                                nref = malloc(sizeof(uint64_t) * R->n_memids);
-                                int l;
-                                for (l=0; l<R->n_memids; l++) {
-                                    ProtobufCBinaryData role = 
-                                        P->stringtable->s[R->roles_sid[l]];
-                                    deltamemids += R->memids[l];
-                                    rel->member->data[l].ref = deltamemids;
-                                    // ref[l] = deltamemids;
-                                    switch (R->types[l]) {
-                                        case RELATION__MEMBER_TYPE__NODE:
-                                            rel->member->data[l].type = OSM_REL_MEMBER_TYPE_NODE;
-                                            nref[num_nref] = deltamemids;
-                                            ++num_nref; 
-                                            break;
-                                        case RELATION__MEMBER_TYPE__WAY:
-                                            rel->member->data[l].type = OSM_REL_MEMBER_TYPE_WAY;
-                                            wref[num_wref] = deltamemids;
-                                            ++num_wref; 
-                                            break;
-                                        case RELATION__MEMBER_TYPE__RELATION:
-                                            rel->member->data[l].type = OSM_REL_MEMBER_TYPE_RELATION;
-                                            // ref[l] = deltamemids; FIXME - relations in relations
-                                            break;
-                                        default:
-                                            fprintf(stderr, "unknown relation member type %d\n", R->types[l]);
-                                            break;
-                                    }
-                                    rel->member->data[l].role = strndup((const char *)role.data, role.len);
-                                }
-                            }
-                            OSM_Tag_List *tl = NULL;
-                            if (R->n_keys != 0) {
-                                tl       = malloc(sizeof(OSM_Tag_List));
-                                tl->num  = R->n_keys;
-                                tl->size = R->n_keys;
-                                tl->data = malloc(sizeof(OSM_Tag) * R->n_keys);
-                                int l;
-                                for (l=0; l<R->n_keys; l++) {
-                                    ProtobufCBinaryData key = 
-                                        P->stringtable->s[R->keys[l]];
-                                    ProtobufCBinaryData val = 
-                                        P->stringtable->s[R->vals[l]];
-                                    tl->data[l].key = 
-                                                strndup((const char *)key.data, key.len);
-                                    tl->data[l].val =
-                                                strndup((const char *)val.data, val.len);
-                                }
-                            }
-                            rel->tags = tl;
-                            
-                            if (bbox_state == bbox_rel_find) {
-                                int b = 0;
-                                int bbox_member = 0;
-                                for (b=0; b<num_nref; b++) {
-                                    if (osm_is_member(bbn, nref[b]) != -1) {
-                                        if (rel_filter == NULL || rel_filter(rel)) {
-                                            if (debug) 
-                                                fprintf(stderr, "rel %lu: member %lu is in bbox\n",
-                                                                    rel->id, nref[b]);
-                                            bbox_member = 1;
-                                            break;
-                                        }
-                                    }
-                                }
-                                if (bbox_member == 0) {
-                                    osm_free_relation(rel);
-                                    free(wref);
-                                    free(nref);
-                                    continue;
-                                }
-                            }
-                            else {
-                                if (rel_filter != NULL) {
-                                    if (!rel_filter(rel)) {
-                                        osm_free_relation(rel);
-                                        free(wref);
-                                        free(nref);
-                                        continue;
-                                    }
-                                }
-                            }
-
-                            if (num_nref)
-                                osm_add_members(mem_nodes, num_nref, nref, 1);
-                            if (num_wref)
-                                osm_add_members(mem_ways, num_wref, wref, 1);
-
-                            osm_realloc_rel_list(data->relations);
-                            data->relations->data[ data->relations->num ] = rel;
-                            data->relations->num += 1;
-                        }
-                    }
-                } /* mode == OSMDATA_DUMP || OSMDATA_REL */
-            } /* for (j = 0; j < P->n_primitivegroup; j++) */ 
+
+            osm_trace(OSM_TRACE_BLOCK, "block: %d bytes, %lu groups, mode %d",
+                        blob->raw_size, P->n_primitivegroup, s.mode);
+            pbf_parse_block(&s, P, NULL);
             osm_pbf_free_primitive(P);
         }
         osm_pbf_free_blob(blob, uncompressed);
     }
+
+  done:
+    pbf_free_members(s.mem_nodes);
+    pbf_free_members(s.mem_ways);
+    pbf_free_members(s.mem_rels);
+    pbf_free_members(s.bbn);
+    osm_relgraph_free(s.graph);
     return data;
 }
+
+OSM_Data *osm_pbf_parse(OSM_File *F, 
+              uint32_t mode, 
+              OSM_BBox *bbox,
+              int (*node_filter)(OSM_Node *),
+              int (*way_filter)(OSM_Way *),
+              int (*rel_filter)(OSM_Relation *) /*,
+              int (*cset_filter)(OSM_Changeset *) */
+        )
+{
+    OSM_Parse_Options opt;
+    osm_parse_options_init(&opt);
+    opt.mode        = mode;
+    opt.bbox        = bbox;
+    opt.node_filter = node_filter;
+    opt.way_filter  = way_filter;
+    opt.rel_filter  = rel_filter;
+    return osm_pbf_parse_opt(F, &opt);
+}
+
+/* add all objects of the wanted types in G to the block */
+static void pbf_scan_group(PrimitiveBlock *P, PrimitiveGroup *G, uint32_t types, OSM_Data *block) {
+    size_t k, l;
+
+    if (types & OSMDATA_NODE) {
+        for (k = 0; k < G->n_nodes; k++) {
+            OSM_Node *n;
+            if (types & OSMDATA_BARE)
+                n = pbf_bare_node(G->nodes[k]->id,
+                    NANO_DEGREE * (P->lat_offset + (G->nodes[k]->lat * P->granularity)),
+                    NANO_DEGREE * (P->lon_offset + (G->nodes[k]->lon * P->granularity)));
+            else
+                n = pbf_node(P, G->nodes[k]);
+            osm_realloc_node_list(block->nodes);
+            block->nodes->data[ block->nodes->num++ ] = n;
+        }
+        if (G->dense) {
+            struct pbf_dense d;
+            memset(&d, 0, sizeof(d));
+            d.D = G->dense;
+            for (k=0; k<d.D->n_id; k++) {
+                OSM_Node *n;
+                pbf_dense_decode(&d, k);
+                if (types & OSMDATA_BARE)
+                    n = pbf_bare_node(d.id,
+                        NANO_DEGREE * (P->lat_offset + (d.lat * P->granularity)),
+                        NANO_DEGREE * (P->lon_offset + (d.lon * P->granularity)));
+                else
+                    n = pbf_dense_node(P, &d, k);
+                osm_realloc_node_list(block->nodes);
+                block->nodes->data[ block->nodes->num++ ] = n;
+            }
+        }
+    }
+
+    if (types & OSMDATA_WAY) {
+        for (k = 0; k < G->n_ways; k++) {
+            Way *W = G->ways[k];
+            uint64_t *ref = malloc(sizeof(uint64_t) * (W->n_refs + 1));
+            int64_t deltaref = 0;
+            for (l = 0; l < W->n_refs; l++) {
+                deltaref += W->refs[l];
+                ref[l] = deltaref;
+            }
+            osm_realloc_way_list(block->ways);
+            block->ways->data[ block->ways->num++ ] = pbf_way(P, W, ref);
+            free(ref);
+        }
+    }
+
+    if (types & OSMDATA_REL) {
+        for (k=0; k<G->n_relations; k++) {
+            osm_realloc_rel_list(block->relations);
+            block->relations->data[ block->relations->num++ ] =
+                pbf_relation(P, G->relations[k]);
+        }
+    }
+
+    if (types & OSMDATA_CSET)
+        pbf_changesets(P, G, &block->changesets);
+
+    /* what the callback keeps is counted there */
+    if (types & OSMDATA_NODE)
+        osm_stats_add(OSM_STAT_NODES_SEEN, G->n_nodes + (G->dense ? G->dense->n_id : 0));
+    if (types & OSMDATA_WAY)
+        osm_stats_add(OSM_STAT_WAYS_SEEN, G->n_ways);
+    if (types & OSMDATA_REL)
+        osm_stats_add(OSM_STAT_RELATIONS_SEEN, G->n_relations);
+}
+
+/* convert the objects of the wanted types in P to block, see below */
+void osm_pbf_convert(PrimitiveBlock *P, uint32_t types, OSM_Data *block) {
+    unsigned int j;
+    for (j = 0; j < P->n_primitivegroup; j++)
+        pbf_scan_group(P, P->primitivegroup[j], types, block);
+}
+
+/*
+ * call block() for every PrimitiveBlock with the objects of the wanted
+ * types (OSMDATA_NODE|OSMDATA_WAY|OSMDATA_REL, OSMDATA_BARE: nodes without
+ * tags and meta data, OSMDATA_CSET: changesets in d->changesets). The
+ * objects are freed after block() returns.
+ */
+int osm_pbf_scan(OSM_File *F, uint32_t types,
+                    int (*block)(OSM_Data *d, void *ctx), void *ctx)
+{
+    uint32_t length;
+    BlockHeader *bh;
+    Blob *blob;
+    int ret = 0;
+
+    if (osm_rewind(F) != 0)
+        return -1;
+    while (ret == 0) {
+        unsigned char *uncompressed;
+        int is_data;
+
+        length = osm_pbf_bh_length(F);
+        if (length == -1) /* EOF */
+            break;
+        if (length <= 0 || length > MAX_BLOCK_HEADER_SIZE) {
+            fprintf(stderr, "Block Header isn't present or exceeds "
+                            "minimum/maximum size: %u\n", length);
+            return -1;
+        }
+
+        bh = osm_pbf_get_bh(F, length);
+        if (bh == NULL)
+            return -1;
+        length = bh->datasize;
+        is_data = strcmp(bh->type, "OSMData") == 0;
+        osm_pbf_free_bh(bh);
+        if (length <= 0 || length > MAX_BLOB_SIZE) {
+            fprintf(stderr, "Blob isn't present or exceeds "
+                            "minimum/maximum size\n");
+            return -1;
+        }
+
+        blob = osm_pbf_get_blob(F, length, &uncompressed);
+        if (blob == NULL)
+            return -1;
+        if (is_data) {
+            PrimitiveBlock *P = osm_pbf_unpack_data(blob, uncompressed);
+            OSM_Data *d;
+            if (P == NULL) {
+                osm_pbf_free_blob(blob, uncompressed);
+                return -1;
+            }
+            d = osm_new_data(1024);
+            osm_pbf_convert(P, types, d);
+            osm_pbf_free_primitive(P);
+            osm_trace(OSM_TRACE_BLOCK, "block: %d bytes, nodes=%u, ways=%u, relations=%u",
+                        blob->raw_size, d->nodes->num, d->ways->num, d->relations->num);
+            if (d->nodes->num || d->ways->num || d->relations->num
+                || (d->changesets != NULL && d->changesets->num))
+                ret = block(d, ctx);
+            osm_free_data(d);
+        }
+        osm_pbf_free_blob(blob, uncompressed);
+    }
+    return ret;
+}
@@ -0,0 +1,331 @@
+/*
+ * poly.c - Osmosis .poly polygons and fast point in polygon tests
+ *
+ * A .poly file is a name line followed by rings; each ring is a name line
+ * (starting with '!' for holes), "lon lat" lines and END, the file ends
+ * with another END. Insideness uses the even-odd rule over all rings, so
+ * holes inside outer rings are excluded.
+ *
+ * The bbox of the polygon is covered by a grid. Cells crossed by an edge
+ * are "boundary" cells, all others are entirely inside or outside and
+ * resolve with one lookup. Points in boundary cells are tested by casting
+ * a ray against the edges that overlap the cell's grid row only.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "osm.h"
+
+#define POLY_GRID_MIN 16
+#define POLY_GRID_MAX 1024
+
+enum {
+    poly_cell_outside,
+    poly_cell_inside,
+    poly_cell_boundary
+};
+
+struct poly_edge {
+    double x1, y1;
+    double x2, y2;
+};
+
+struct _osm_poly {
+    char     *name;
+    OSM_BBox  bbox;
+    uint32_t  num_rings;
+    uint32_t  num_edges;
+    uint32_t  size_edges;
+    struct poly_edge *edges;
+    uint32_t  cols;
+    uint32_t  rows;
+    double    cell_w;
+    double    cell_h;
+    uint8_t  *cells;
+    uint32_t *row_start;    /* edges of row r: row_edges[row_start[r] .. row_start[r+1]] */
+    uint32_t *row_edges;
+};
+
+static int poly_add_edge(OSM_Poly *p, double x1, double y1, double x2, double y2) {
+    if (p->num_edges == p->size_edges) {
+        uint32_t size = p->size_edges ? p->size_edges * 2 : 256;
+        struct poly_edge *tmp = realloc(p->edges, sizeof(struct poly_edge) * size);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to realloc polygon edges: %s\n", strerror(errno));
+            return -1;
+        }
+        p->edges      = tmp;
+        p->size_edges = size;
+    }
+    p->edges[p->num_edges].x1 = x1;
+    p->edges[p->num_edges].y1 = y1;
+    p->edges[p->num_edges].x2 = x2;
+    p->edges[p->num_edges].y2 = y2;
+    p->num_edges += 1;
+    return 0;
+}
+
+static uint32_t poly_col(OSM_Poly *p, double x) {
+    double c = (x - p->bbox.left_lon) / p->cell_w;
+    if (c < 0)
+        return 0;
+    if (c >= p->cols)
+        return p->cols - 1;
+    return (uint32_t)c;
+}
+
+static uint32_t poly_row(OSM_Poly *p, double y) {
+    double r = (y - p->bbox.bottom_lat) / p->cell_h;
+    if (r < 0)
+        return 0;
+    if (r >= p->rows)
+        return p->rows - 1;
+    return (uint32_t)r;
+}
+
+/* even-odd ray cast to the right against the edges of y's row */
+static int poly_ray(OSM_Poly *p, double x, double y) {
+    uint32_t r = poly_row(p, y), i;
+    int inside = 0;
+    for (i=p->row_start[r]; i<p->row_start[r+1]; i++) {
+        struct poly_edge *e = &p->edges[p->row_edges[i]];
+        if ((e->y1 > y) != (e->y2 > y)
+            && x < e->x1 + (y - e->y1) * (e->x2 - e->x1) / (e->y2 - e->y1))
+            inside = !inside;
+    }
+    return inside;
+}
+
+/* mark all cells an edge passes through as boundary */
+static void poly_mark_edge(OSM_Poly *p, struct poly_edge *e) {
+    uint32_t c0 = poly_col(p, e->x1 < e->x2 ? e->x1 : e->x2);
+    uint32_t c1 = poly_col(p, e->x1 < e->x2 ? e->x2 : e->x1);
+    uint32_t c, r, r0, r1;
+
+    for (c=c0; c<=c1; c++) {
+        double ya = e->y1, yb = e->y2;
+        if (e->x1 != e->x2) {
+            double xl = p->bbox.left_lon + c * p->cell_w;
+            double xr = xl + p->cell_w;
+            double lo = e->x1 < e->x2 ? e->x1 : e->x2;
+            double hi = e->x1 < e->x2 ? e->x2 : e->x1;
+            double slope = (e->y2 - e->y1) / (e->x2 - e->x1);
+            if (xl < lo) xl = lo;
+            if (xr > hi) xr = hi;
+            ya = e->y1 + (xl - e->x1) * slope;
+            yb = e->y1 + (xr - e->x1) * slope;
+        }
+        r0 = poly_row(p, ya < yb ? ya : yb);
+        r1 = poly_row(p, ya < yb ? yb : ya);
+        for (r=r0; r<=r1; r++)
+            p->cells[r * p->cols + c] = poly_cell_boundary;
+    }
+}
+
+static int poly_build_grid(OSM_Poly *p) {
+    uint32_t i, r, c, n = POLY_GRID_MIN;
+    uint32_t *fill;
+
+    while (n < POLY_GRID_MAX && n * n < p->num_edges * 16)
+        n *= 2;
+    p->cols   = n;
+    p->rows   = n;
+    p->cell_w = (p->bbox.right_lon - p->bbox.left_lon) / n;
+    p->cell_h = (p->bbox.top_lat - p->bbox.bottom_lat) / n;
+    if (p->cell_w <= 0 || p->cell_h <= 0) {
+        fprintf(stderr, "polygon %s has no area\n", p->name);
+        return -1;
+    }
+
+    p->cells     = calloc((size_t)p->cols * p->rows, 1);
+    p->row_start = calloc(p->rows + 1, sizeof(uint32_t));
+    fill         = calloc(p->rows, sizeof(uint32_t));
+    if (p->cells == NULL || p->row_start == NULL || fill == NULL) {
+        fprintf(stderr, "failed to malloc polygon grid: %s\n", strerror(errno));
+        free(fill);
+        return -1;
+    }
+
+    /* edges per row, as compressed lists */
+    for (i=0; i<p->num_edges; i++) {
+        struct poly_edge *e = &p->edges[i];
+        uint32_t r0 = poly_row(p, e->y1 < e->y2 ? e->y1 : e->y2);
+        uint32_t r1 = poly_row(p, e->y1 < e->y2 ? e->y2 : e->y1);
+        for (r=r0; r<=r1; r++)
+            p->row_start[r+1] += 1;
+    }
+    for (r=0; r<p->rows; r++)
+        p->row_start[r+1] += p->row_start[r];
+    p->row_edges = malloc(sizeof(uint32_t) * (p->row_start[p->rows] + 1));
+    if (p->row_edges == NULL) {
+        fprintf(stderr, "failed to malloc polygon rows: %s\n", strerror(errno));
+        free(fill);
+        return -1;
+    }
+    for (i=0; i<p->num_edges; i++) {
+        struct poly_edge *e = &p->edges[i];
+        uint32_t r0 = poly_row(p, e->y1 < e->y2 ? e->y1 : e->y2);
+        uint32_t r1 = poly_row(p, e->y1 < e->y2 ? e->y2 : e->y1);
+        for (r=r0; r<=r1; r++)
+            p->row_edges[ p->row_start[r] + fill[r]++ ] = i;
+        poly_mark_edge(p, e);
+    }
+    free(fill);
+
+    /* no edge crosses the other cells, their center decides */
+    for (r=0; r<p->rows; r++) {
+        for (c=0; c<p->cols; c++) {
+            uint8_t *cell = &p->cells[r * p->cols + c];
+            if (*cell == poly_cell_boundary)
+                continue;
+            *cell = poly_ray(p, p->bbox.left_lon + (c + 0.5) * p->cell_w,
+                                p->bbox.bottom_lat + (r + 0.5) * p->cell_h)
+                        ? poly_cell_inside : poly_cell_outside;
+        }
+    }
+    return 0;
+}
+
+OSM_Poly *osm_poly_read(const char *file) {
+    FILE *fh;
+    OSM_Poly *p;
+    char line[LINE_SIZE];
+    int lineno = 0, in_ring = 0, ring_points = 0;
+    double first_x = 0, first_y = 0, last_x = 0, last_y = 0;
+
+    fh = fopen(file, "r");
+    if (fh == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", file, strerror(errno));
+        return (OSM_Poly *)NULL;
+    }
+    p = calloc(1, sizeof(OSM_Poly));
+    if (p == NULL) {
+        fprintf(stderr, "failed to malloc polygon: %s\n", strerror(errno));
+        fclose(fh);
+        return (OSM_Poly *)NULL;
+    }
+    p->bbox.left_lon   =  180.0;
+    p->bbox.right_lon  = -180.0;
+    p->bbox.bottom_lat =   90.0;
+    p->bbox.top_lat    =  -90.0;
+
+    while (fgets(line, LINE_SIZE, fh) != NULL) {
+        char *ptr = line;
+        ++lineno;
+        ptr[strcspn(ptr, "\r\n")] = '\0';
+        trim_left(ptr);
+
+        if (p->name == NULL) {
+            p->name = strdup(ptr);
+            continue;
+        }
+        if (!*ptr)
+            continue;
+
+        if (strncmp(ptr, "END", 3) == 0) {
+            if (!in_ring)
+                break; /* end of file */
+            if (ring_points < 3) {
+                fprintf(stderr, "%s:%d: ring with less than 3 points\n", file, lineno);
+                goto fail;
+            }
+            /* close the ring if the file did not */
+            if ((last_x != first_x || last_y != first_y)
+                && poly_add_edge(p, last_x, last_y, first_x, first_y) != 0)
+                goto fail;
+            in_ring = 0;
+            continue;
+        }
+
+        if (!in_ring) {
+            /* ring name, "!" marks holes, the even-odd rule needs no flag */
+            in_ring = 1;
+            ring_points = 0;
+            p->num_rings += 1;
+            continue;
+        }
+        else {
+            double x, y;
+            char *end;
+            x = strtod(ptr, &end);
+            if (end == ptr) {
+                fprintf(stderr, "%s:%d: expected coordinates: %s\n", file, lineno, ptr);
+                goto fail;
+            }
+            ptr = end;
+            y = strtod(ptr, &end);
+            if (end == ptr) {
+                fprintf(stderr, "%s:%d: expected coordinates: %s\n", file, lineno, ptr);
+                goto fail;
+            }
+            if (ring_points == 0) {
+                first_x = x;
+                first_y = y;
+            }
+            else if (poly_add_edge(p, last_x, last_y, x, y) != 0)
+                goto fail;
+            last_x = x;
+            last_y = y;
+            ring_points += 1;
+
+            if (x < p->bbox.left_lon)   p->bbox.left_lon   = x;
+            if (x > p->bbox.right_lon)  p->bbox.right_lon  = x;
+            if (y < p->bbox.bottom_lat) p->bbox.bottom_lat = y;
+            if (y > p->bbox.top_lat)    p->bbox.top_lat    = y;
+        }
+    }
+    if (in_ring || p->num_rings == 0) {
+        fprintf(stderr, "%s: truncated polygon file\n", file);
+        goto fail;
+    }
+    fclose(fh);
+
+    if (poly_build_grid(p) != 0) {
+        osm_poly_free(p);
+        return (OSM_Poly *)NULL;
+    }
+    if (debug)
+        fprintf(stderr, "%s:%d:%s(): %s: %u rings, %u edges, %ux%u grid\n",
+                        __FILE__, __LINE__, __FUNCTION__,
+                        p->name, p->num_rings, p->num_edges, p->cols, p->rows);
+    return p;
+
+  fail:
+    fclose(fh);
+    osm_poly_free(p);
+    return (OSM_Poly *)NULL;
+}
+
+int osm_poly_contains(OSM_Poly *p, double lat, double lon) {
+    uint8_t cell;
+    if (!osm_bbox_contains(&p->bbox, lat, lon))
+        return 0;
+    cell = p->cells[poly_row(p, lat) * p->cols + poly_col(p, lon)];
+    if (cell != poly_cell_boundary)
+        return cell == poly_cell_inside;
+    return poly_ray(p, lon, lat);
+}
+
+OSM_BBox *osm_poly_bbox(OSM_Poly *p) {
+    return &p->bbox;
+}
+
+void osm_poly_free(OSM_Poly *p) {
+    if (p == NULL)
+        return;
+    free(p->name);
+    free(p->edges);
+    free(p->cells);
+    free(p->row_start);
+    free(p->row_edges);
+    free(p);
+}
+
+/* END */
@@ -0,0 +1,523 @@
+/*
+ * readahead.c - asynchronous read-ahead for .osm.pbf files
+ *
+ * The file is read in chunks of OSM_READ_CHUNK bytes at consecutive
+ * offsets, a window of them is always in flight while the parser works
+ * on the blocks before. On Linux the reads are queued to an io_uring,
+ * without liburing, just the two system calls and the mmapped rings.
+ * If that is not available (old kernel, seccomp, ...) or OSM_READ_THREAD
+ * is given, one thread does the pread()s in the same order.
+ *
+ * osm_open() starts it for every .osm.pbf file with OSM_READ_WINDOW
+ * chunks, osm_readahead() replaces that reader with another window or
+ * flags, with OSM_READ_OFF the file is read with stdio again.
+ *
+ * With OSM_READ_DIRECT the file is opened a second time with O_DIRECT,
+ * the buffers are aligned for that. If the file system refuses, the
+ * page cache is used as without the flag.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+# include <linux/io_uring.h>
+#endif
+
+#include "osm.h"
+
+#define READ_ALIGN 4096
+
+enum read_state {
+    READ_FREE,      /* nothing submitted, i.e. past EOF */
+    READ_QUEUED,
+    READ_DONE
+};
+
+struct read_slot {
+    unsigned char *buf;
+    off_t off;
+    ssize_t len;        /* bytes read, -errno on errors */
+    int state;
+    struct iovec iov;
+};
+
+#ifdef __NR_io_uring_setup
+struct read_uring {
+    int fd;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size, sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+};
+#endif
+
+struct _osm_reader {
+    int fd;
+    int own_fd;         /* fd was opened here (O_DIRECT) */
+    off_t size;
+    off_t pos;          /* position of the caller */
+    off_t next;         /* offset of the next chunk to submit */
+    uint32_t window;
+    uint32_t head;      /* slot with the data at pos */
+    struct read_slot *slot;
+    int uring;
+#ifdef __NR_io_uring_setup
+    struct read_uring ring;
+#endif
+    /* thread backend */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t io;        /* next slot for the thread */
+    int stop;
+};
+
+#ifdef __NR_io_uring_setup
+static int uring_init(struct read_uring *u, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0)
+        return -1;
+
+    u->sq_size   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_size   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_size > u->sq_size)
+            u->sq_size = u->cq_size;
+        u->cq_size = u->sq_size;
+    }
+    u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ|PROT_WRITE,
+                        MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        u->cq_ptr = u->sq_ptr;
+    else {
+        u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ|PROT_WRITE,
+                        MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ptr == MAP_FAILED) {
+            munmap(u->sq_ptr, u->sq_size);
+            goto fail;
+        }
+    }
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ|PROT_WRITE,
+                        MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        if (u->cq_ptr != u->sq_ptr)
+            munmap(u->cq_ptr, u->cq_size);
+        munmap(u->sq_ptr, u->sq_size);
+        goto fail;
+    }
+
+    u->sq_head  = (unsigned *)((char *)u->sq_ptr + p.sq_off.head);
+    u->sq_tail  = (unsigned *)((char *)u->sq_ptr + p.sq_off.tail);
+    u->sq_mask  = (unsigned *)((char *)u->sq_ptr + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)((char *)u->sq_ptr + p.sq_off.array);
+    u->cq_head  = (unsigned *)((char *)u->cq_ptr + p.cq_off.head);
+    u->cq_tail  = (unsigned *)((char *)u->cq_ptr + p.cq_off.tail);
+    u->cq_mask  = (unsigned *)((char *)u->cq_ptr + p.cq_off.ring_mask);
+    u->cqes     = (struct io_uring_cqe *)((char *)u->cq_ptr + p.cq_off.cqes);
+    return 0;
+
+  fail:
+    close(u->fd);
+    return -1;
+}
+
+static void uring_free(struct read_uring *u) {
+    munmap(u->sqes, u->sqes_size);
+    if (u->cq_ptr != u->sq_ptr)
+        munmap(u->cq_ptr, u->cq_size);
+    munmap(u->sq_ptr, u->sq_size);
+    close(u->fd);
+}
+
+/* queue a readv of the slot, IORING_OP_READV is there since the first io_uring */
+static int uring_submit(OSM_Reader *R, uint32_t i) {
+    struct read_uring *u = &R->ring;
+    struct io_uring_sqe *sqe;
+    unsigned tail = *u->sq_tail, idx = tail & *u->sq_mask;
+
+    sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = IORING_OP_READV;
+    sqe->fd        = R->fd;
+    sqe->off       = R->slot[i].off;
+    sqe->addr      = (unsigned long)&R->slot[i].iov;
+    sqe->len       = 1;
+    sqe->user_data = i;
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    while (syscall(__NR_io_uring_enter, u->fd, 1, 0, 0, NULL, 0) < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+            continue;
+        fprintf(stderr, "failed to submit read: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* reap completions until slot i is done */
+static int uring_wait(OSM_Reader *R, uint32_t i) {
+    struct read_uring *u = &R->ring;
+
+    while (R->slot[i].state != READ_DONE) {
+        unsigned head = *u->cq_head;
+        unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            if (syscall(__NR_io_uring_enter, u->fd, 0, 1,
+                            IORING_ENTER_GETEVENTS, NULL, 0) < 0
+                && errno != EINTR && errno != EAGAIN)
+            {
+                fprintf(stderr, "failed to wait for read: %s\n", strerror(errno));
+                return -1;
+            }
+            continue;
+        }
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            struct read_slot *s = &R->slot[cqe->user_data];
+            s->len   = cqe->res;
+            s->state = READ_DONE;
+            head++;
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+#endif
+
+/* the thread backend: read the queued slots in order */
+static void *read_thread(void *arg) {
+    OSM_Reader *R = arg;
+
+    pthread_mutex_lock(&R->lock);
+    while (1) {
+        struct read_slot *s = &R->slot[R->io];
+        size_t got = 0;
+        ssize_t r = 0;
+        int err = 0;
+        if (R->stop)
+            break;
+        if (s->state != READ_QUEUED) {
+            pthread_cond_wait(&R->cond, &R->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&R->lock);
+        while (got < s->iov.iov_len) {
+            r = pread(R->fd, s->buf + got, s->iov.iov_len - got, s->off + got);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0)
+                break;
+            got += r;
+        }
+        if (r < 0)
+            err = errno;
+        pthread_mutex_lock(&R->lock);
+        s->len   = err ? -err : (ssize_t)got;
+        s->state = READ_DONE;
+        R->io    = (R->io + 1) % R->window;
+        pthread_cond_broadcast(&R->cond);
+    }
+    pthread_mutex_unlock(&R->lock);
+    return NULL;
+}
+
+/* queue the next chunk into slot i, the slot stays free past EOF */
+static int reader_submit(OSM_Reader *R, uint32_t i) {
+    struct read_slot *s = &R->slot[i];
+
+    if (R->next >= R->size) {
+        s->state = READ_FREE;
+        return 0;
+    }
+    s->off = R->next;
+    s->len = 0;
+    s->iov.iov_base = s->buf;
+    s->iov.iov_len  = OSM_READ_CHUNK;
+    R->next += OSM_READ_CHUNK;
+#ifdef __NR_io_uring_setup
+    if (R->uring) {
+        s->state = READ_QUEUED;
+        return uring_submit(R, i);
+    }
+#endif
+    pthread_mutex_lock(&R->lock);
+    s->state = READ_QUEUED;
+    pthread_cond_broadcast(&R->cond);
+    pthread_mutex_unlock(&R->lock);
+    return 0;
+}
+
+static int reader_wait(OSM_Reader *R, uint32_t i) {
+    struct read_slot *s = &R->slot[i];
+    ssize_t want;
+
+#ifdef __NR_io_uring_setup
+    if (R->uring) {
+        if (uring_wait(R, i) != 0)
+            return -1;
+    }
+    else
+#endif
+    {
+        pthread_mutex_lock(&R->lock);
+        while (s->state == READ_QUEUED)
+            pthread_cond_wait(&R->cond, &R->lock);
+        pthread_mutex_unlock(&R->lock);
+    }
+    if (s->len < 0) {
+        fprintf(stderr, "failed to read: %s\n", strerror(-s->len));
+        return -1;
+    }
+    want = R->size - s->off < OSM_READ_CHUNK ? R->size - s->off : OSM_READ_CHUNK;
+    if (s->len < want) {
+        fprintf(stderr, "short read at %ld: %ld of %ld bytes\n",
+                        (long)s->off, (long)s->len, (long)want);
+        return -1;
+    }
+    return 0;
+}
+
+/* wait for everything in flight, e.g. before the buffers are reused */
+static void reader_drain(OSM_Reader *R) {
+    uint32_t i;
+    for (i=0; i<R->window; i++) {
+        if (R->slot[i].state != READ_QUEUED)
+            continue;
+#ifdef __NR_io_uring_setup
+        if (R->uring) {
+            uring_wait(R, i);
+            continue;
+        }
+#endif
+        pthread_mutex_lock(&R->lock);
+        while (R->slot[i].state == READ_QUEUED)
+            pthread_cond_wait(&R->cond, &R->lock);
+        pthread_mutex_unlock(&R->lock);
+    }
+}
+
+/* continue reading at off, all reads in flight are dropped */
+int osm_reader_seek(OSM_Reader *R, off_t off) {
+    uint32_t i;
+
+    reader_drain(R);
+    if (!R->uring) {
+        pthread_mutex_lock(&R->lock);
+        R->io = 0;
+        pthread_mutex_unlock(&R->lock);
+    }
+    R->pos  = off;
+    R->next = off - off % OSM_READ_CHUNK;
+    R->head = 0;
+    for (i=0; i<R->window; i++) {
+        R->slot[i].state = READ_FREE;
+        if (reader_submit(R, i) != 0)
+            return -1;
+    }
+    osm_trace(OSM_TRACE_PASS, "readahead: seek to %ld", (long)off);
+    return 0;
+}
+
+/*
+ * copy the next len bytes to dst, or skip them with dst == NULL. Returns
+ * the number of bytes, less than len only at EOF, -1 on errors
+ */
+ssize_t osm_reader_read(OSM_Reader *R, void *dst, size_t len) {
+    size_t done = 0;
+
+    /* long skips (blocks outside a bbox) do not read what they skip */
+    if (dst == NULL && R->pos + (off_t)len > R->next) {
+        off_t to = R->pos + len > R->size ? R->size : R->pos + len;
+        done = to - R->pos;
+        if (osm_reader_seek(R, to) != 0)
+            return -1;
+        return done;
+    }
+    while (done < len) {
+        struct read_slot *s = &R->slot[R->head];
+        size_t within, n;
+        if (s->state == READ_FREE)
+            break;
+        if (reader_wait(R, R->head) != 0)
+            return -1;
+        within = R->pos - s->off;
+        if (within >= (size_t)s->len)
+            break; /* EOF inside the last chunk */
+        n = s->len - within;
+        if (n > len - done)
+            n = len - done;
+        if (dst != NULL)
+            memcpy((unsigned char *)dst + done, s->buf + within, n);
+        done   += n;
+        R->pos += n;
+        if (R->pos == s->off + OSM_READ_CHUNK) {
+            if (reader_submit(R, R->head) != 0)
+                return -1;
+            R->head = (R->head + 1) % R->window;
+        }
+    }
+    return done;
+}
+
+void osm_reader_free(OSM_Reader *R) {
+    uint32_t i;
+
+    reader_drain(R);
+#ifdef __NR_io_uring_setup
+    if (R->uring)
+        uring_free(&R->ring);
+    else
+#endif
+    {
+        pthread_mutex_lock(&R->lock);
+        R->stop = 1;
+        pthread_cond_broadcast(&R->cond);
+        pthread_mutex_unlock(&R->lock);
+        pthread_join(R->thread, NULL);
+    }
+    pthread_mutex_destroy(&R->lock);
+    pthread_cond_destroy(&R->cond);
+    for (i=0; i<R->window; i++)
+        free(R->slot[i].buf);
+    osm_stats_alloc(OSM_MEM_READAHEAD, -(int64_t)R->window * OSM_READ_CHUNK);
+    free(R->slot);
+    if (R->own_fd)
+        close(R->fd);
+    free(R);
+}
+
+/* a second descriptor of the same file, bypassing the page cache */
+static int open_direct(int fd) {
+#ifdef O_DIRECT
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    return open(path, O_RDONLY|O_DIRECT);
+#else
+    errno = EINVAL;
+    return -1;
+#endif
+}
+
+/*
+ * read F ahead from its current position, with window chunks of
+ * OSM_READ_CHUNK bytes in flight (0: OSM_READ_WINDOW). The .osm.pbf
+ * functions read through it until osm_close(). XML files are read
+ * with stdio, nothing is done for them. Returns 0 on success, -1 on
+ * errors (F can still be read without read-ahead then)
+ */
+int osm_readahead(OSM_File *F, int window, uint32_t flags) {
+    OSM_Reader *R;
+    struct stat st;
+    uint32_t i;
+
+    if (F->type != OSM_FTYPE_PBF)
+        return 0;
+    if (F->reader != NULL) {
+        /* the caller continues where the old reader was */
+        off_t pos = F->reader->pos;
+        osm_reader_free(F->reader);
+        F->reader = NULL;
+        if (fseeko(F->file, pos, SEEK_SET) != 0) {
+            fprintf(stderr, "failed to seek: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    if (flags & OSM_READ_OFF)
+        return 0;
+    if (window <= 0)
+        window = OSM_READ_WINDOW;
+    if (fstat(fileno(F->file), &st) != 0) {
+        fprintf(stderr, "failed to stat file: %s\n", strerror(errno));
+        return -1;
+    }
+    R = calloc(1, sizeof(OSM_Reader));
+    if (R == NULL) {
+        fprintf(stderr, "failed to malloc reader: %s\n", strerror(errno));
+        return -1;
+    }
+    R->fd     = fileno(F->file);
+    R->size   = st.st_size;
+    R->window = window;
+    if (flags & OSM_READ_DIRECT) {
+        int fd = open_direct(R->fd);
+        if (fd >= 0) {
+            R->fd     = fd;
+            R->own_fd = 1;
+        }
+        else
+            osm_trace(OSM_TRACE_PASS, "readahead: no O_DIRECT, errno %d", errno);
+    }
+    R->slot = calloc(window, sizeof(struct read_slot));
+    if (R->slot == NULL) {
+        fprintf(stderr, "failed to malloc read slots: %s\n", strerror(errno));
+        goto fail;
+    }
+    for (i=0; i<window; i++) {
+        if (posix_memalign((void **)&R->slot[i].buf, READ_ALIGN, OSM_READ_CHUNK) != 0) {
+            fprintf(stderr, "failed to malloc read buffer\n");
+            goto fail;
+        }
+    }
+    osm_stats_alloc(OSM_MEM_READAHEAD, (int64_t)window * OSM_READ_CHUNK);
+    pthread_mutex_init(&R->lock, NULL);
+    pthread_cond_init(&R->cond, NULL);
+
+#ifdef __NR_io_uring_setup
+    if (!(flags & OSM_READ_THREAD) && uring_init(&R->ring, window) == 0)
+        R->uring = 1;
+#endif
+    if (!R->uring && pthread_create(&R->thread, NULL, read_thread, R) != 0) {
+        fprintf(stderr, "failed to start read thread\n");
+        pthread_mutex_destroy(&R->lock);
+        pthread_cond_destroy(&R->cond);
+        osm_stats_alloc(OSM_MEM_READAHEAD, -(int64_t)window * OSM_READ_CHUNK);
+        goto fail;
+    }
+    osm_trace(OSM_TRACE_PASS, "readahead: io_uring=%d, direct=%d, %u x %u bytes",
+                R->uring, R->own_fd, window, OSM_READ_CHUNK);
+    F->reader = R;
+    if (osm_reader_seek(R, ftello(F->file)) != 0) {
+        F->reader = NULL;
+        osm_reader_free(R);
+        return -1;
+    }
+    return 0;
+
+  fail:
+    if (R->slot != NULL) {
+        for (i=0; i<window; i++)
+            free(R->slot[i].buf);
+        free(R->slot);
+    }
+    if (R->own_fd)
+        close(R->fd);
+    free(R);
+    return -1;
+}
+
+/* END */
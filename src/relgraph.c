@@ -0,0 +1,272 @@
+/*
+ * relgraph.c - relation membership graph
+ *
+ * The members of all relations of one pass, in compressed sparse row form:
+ * the relation ids sorted, per relation the offset of its first member,
+ * and the members of all relations in one array, each as the member type
+ * (OSM_REL_MEMBER_TYPE_*) in the top 2 bits and the id below, i.e. 8
+ * bytes per member and 12 per relation. With the graph the relations of
+ * relations (of relations ...) can be found in memory at any depth, see
+ * osm_relgraph_closure(), instead of scanning the file once per level.
+ *
+ *   G = osm_relgraph_new();
+ *   osm_relgraph_add(G, id); osm_relgraph_member(G, type, ref); ...
+ *   osm_relgraph_index(G, 0);
+ *   osm_relgraph_closure(G, wanted, added);
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "osm.h"
+
+struct _osm_rel_graph {
+    uint64_t *ids;
+    uint32_t *start;    /* num + 1 offsets into members */
+    uint32_t  num;
+    uint32_t  size;
+    uint64_t *members;
+    uint32_t  num_members;
+    uint32_t  size_members;
+    int       sorted;
+    int       failed;
+};
+
+OSM_Rel_Graph *osm_relgraph_new() {
+    OSM_Rel_Graph *G = calloc(1, sizeof(OSM_Rel_Graph));
+    if (G == NULL) {
+        fprintf(stderr, "failed to malloc relation graph: %s\n", strerror(errno));
+        return (OSM_Rel_Graph *)NULL;
+    }
+    G->size  = 1024;
+    G->ids   = malloc(sizeof(uint64_t) * G->size);
+    G->start = malloc(sizeof(uint32_t) * (G->size + 1));
+    G->size_members = 16384;
+    G->members = malloc(sizeof(uint64_t) * G->size_members);
+    if (G->ids == NULL || G->start == NULL || G->members == NULL) {
+        fprintf(stderr, "failed to malloc relation graph: %s\n", strerror(errno));
+        osm_relgraph_free(G);
+        return (OSM_Rel_Graph *)NULL;
+    }
+    G->start[0] = 0;
+    G->sorted = 1;
+    osm_stats_alloc(OSM_MEM_MEMBERS, (sizeof(uint64_t) + sizeof(uint32_t)) * G->size
+                                        + sizeof(uint64_t) * G->size_members);
+    return G;
+}
+
+void osm_relgraph_free(OSM_Rel_Graph *G) {
+    if (G == NULL)
+        return;
+    osm_stats_alloc(OSM_MEM_MEMBERS, -(int64_t)((sizeof(uint64_t) + sizeof(uint32_t)) * G->size
+                                        + sizeof(uint64_t) * G->size_members));
+    free(G->ids);
+    free(G->start);
+    free(G->members);
+    free(G);
+}
+
+/* start relation id, its members follow with osm_relgraph_member() */
+int osm_relgraph_add(OSM_Rel_Graph *G, uint64_t id) {
+    if (G->failed)
+        return -1;
+    if (G->num == G->size) {
+        uint32_t size = G->size ? G->size * 2 : 1024;
+        uint64_t *ids = realloc(G->ids, sizeof(uint64_t) * size);
+        uint32_t *start;
+        if (ids == NULL) {
+            fprintf(stderr, "failed to realloc relation graph: %s\n", strerror(errno));
+            G->failed = 1;
+            return -1;
+        }
+        G->ids = ids;
+        start = realloc(G->start, sizeof(uint32_t) * (size + 1));
+        if (start == NULL) {
+            fprintf(stderr, "failed to realloc relation graph: %s\n", strerror(errno));
+            G->failed = 1;
+            return -1;
+        }
+        G->start = start;
+        osm_stats_alloc(OSM_MEM_MEMBERS, (sizeof(uint64_t) + sizeof(uint32_t)) * (size - G->size));
+        G->size = size;
+    }
+    if (G->num && G->ids[G->num - 1] >= id)
+        G->sorted = 0;
+    G->ids[G->num] = id;
+    G->num += 1;
+    G->start[G->num] = G->num_members;
+    return 0;
+}
+
+int osm_relgraph_member(OSM_Rel_Graph *G, int type, uint64_t ref) {
+    if (G->failed || G->num == 0)
+        return -1;
+    if (G->num_members == G->size_members) {
+        uint32_t size = G->size_members ? G->size_members * 2 : 16384;
+        uint64_t *m = realloc(G->members, sizeof(uint64_t) * size);
+        if (m == NULL) {
+            fprintf(stderr, "failed to realloc relation graph members: %s\n", strerror(errno));
+            G->failed = 1;
+            return -1;
+        }
+        osm_stats_alloc(OSM_MEM_MEMBERS, sizeof(uint64_t) * (size - G->size_members));
+        G->members = m;
+        G->size_members = size;
+    }
+    G->members[G->num_members++] = OSM_RELGRAPH_MEMBER(type, ref);
+    G->start[G->num] = G->num_members;
+    return 0;
+}
+
+/*
+ * sort the relations by id (if they were not added in order), must be
+ * called after the last osm_relgraph_add(). Of duplicate ids the last
+ * one is kept.
+ */
+int osm_relgraph_index(OSM_Rel_Graph *G, int threads) {
+    struct osm_sort_pair *p;
+    uint64_t *ids, *members;
+    uint32_t *start, i, k = 0, num = 0;
+
+    if (G->failed)
+        return -1;
+    if (G->sorted)
+        return 0;
+    p = malloc(sizeof(struct osm_sort_pair) * (G->num + 1));
+    ids = malloc(sizeof(uint64_t) * (G->num + 1));
+    start = malloc(sizeof(uint32_t) * (G->num + 1));
+    members = malloc(sizeof(uint64_t) * (G->num_members + 1));
+    if (p == NULL || ids == NULL || start == NULL || members == NULL) {
+        fprintf(stderr, "failed to malloc relation graph index: %s\n", strerror(errno));
+        free(p);
+        free(ids);
+        free(start);
+        free(members);
+        return -1;
+    }
+    for (i=0; i<G->num; i++) {
+        p[i].key = G->ids[i];
+        p[i].val = i;
+    }
+    osm_sort_pairs(p, G->num, threads);
+    start[0] = 0;
+    for (i=0; i<G->num; i++) {
+        uint32_t from = G->start[ p[i].val ], len = G->start[ p[i].val + 1 ] - from;
+        if (i + 1 < G->num && p[i+1].key == p[i].key)
+            continue;       /* stable sort: the next one was added later */
+        ids[k] = p[i].key;
+        memcpy(members + num, G->members + from, sizeof(uint64_t) * len);
+        num += len;
+        start[++k] = num;
+    }
+    free(p);
+    free(G->ids);
+    free(G->start);
+    free(G->members);
+    G->ids     = ids;
+    G->start   = start;
+    G->members = members;
+    osm_stats_alloc(OSM_MEM_MEMBERS, (int64_t)(sizeof(uint64_t) + sizeof(uint32_t)) * ((int64_t)k - G->size)
+                        + (int64_t)sizeof(uint64_t) * ((int64_t)num - G->size_members));
+    G->num = G->size = k;
+    G->num_members = G->size_members = num;
+    G->sorted = 1;
+    return 0;
+}
+
+static int64_t relgraph_pos(OSM_Rel_Graph *G, uint64_t id) {
+    uint32_t lower = 0, upper = G->num;
+    while (lower < upper) {
+        uint32_t pos = (lower + upper) / 2;
+        if (G->ids[pos] < id)
+            lower = pos + 1;
+        else if (G->ids[pos] > id)
+            upper = pos;
+        else
+            return pos;
+    }
+    return -1;
+}
+
+/* the members of relation id (see OSM_RELGRAPH_TYPE() / _REF()), NULL if unknown */
+const uint64_t *osm_relgraph_get(OSM_Rel_Graph *G, uint64_t id, uint32_t *num) {
+    int64_t pos = -1;
+    if (osm_relgraph_index(G, 0) == 0)
+        pos = relgraph_pos(G, id);
+    if (pos < 0) {
+        *num = 0;
+        return NULL;
+    }
+    *num = G->start[pos + 1] - G->start[pos];
+    return G->members + G->start[pos];
+}
+
+uint32_t osm_relgraph_count(OSM_Rel_Graph *G) {
+    return G->num;
+}
+
+/*
+ * all relations which are members of the relations in wanted at any
+ * depth and not in wanted themselves are added to added, each once. Both
+ * must be sorted, added stays sorted. Cycles are fine. Returns the number
+ * of relations added or -1.
+ */
+int64_t osm_relgraph_closure(OSM_Rel_Graph *G, struct osm_members *wanted,
+                            struct osm_members *added)
+{
+    uint32_t *queue, head = 0, tail = 0, i, k;
+    uint64_t *list;
+    uint8_t *seen;
+    int64_t num = 0;
+
+    if (osm_relgraph_index(G, 0) != 0)
+        return -1;
+    seen  = calloc(G->num + 1, 1);
+    queue = malloc(sizeof(uint32_t) * (G->num + 1));
+    list  = malloc(sizeof(uint64_t) * (G->num + 1));
+    if (seen == NULL || queue == NULL || list == NULL) {
+        fprintf(stderr, "failed to malloc relation closure: %s\n", strerror(errno));
+        free(seen);
+        free(queue);
+        free(list);
+        return -1;
+    }
+    for (i=0; i<wanted->num; i++) {
+        int64_t pos = relgraph_pos(G, wanted->data[i]);
+        if (pos >= 0 && !seen[pos]) {
+            seen[pos] = 1;
+            queue[tail++] = pos;
+        }
+    }
+    while (head < tail) {
+        uint32_t r = queue[head++];
+        for (k=G->start[r]; k<G->start[r + 1]; k++) {
+            uint64_t m = G->members[k];
+            int64_t pos;
+            if (OSM_RELGRAPH_TYPE(m) != OSM_REL_MEMBER_TYPE_RELATION)
+                continue;
+            pos = relgraph_pos(G, OSM_RELGRAPH_REF(m));
+            if (pos < 0 || seen[pos])
+                continue;
+            seen[pos] = 1;
+            queue[tail++] = pos;
+            if (osm_is_member(wanted, G->ids[pos]) == -1) {
+                osm_trace(OSM_TRACE_OBJECT, "relation %lu: member of relation %lu",
+                            G->ids[pos], G->ids[r]);
+                list[num++] = G->ids[pos];
+            }
+        }
+    }
+    free(seen);
+    free(queue);
+    osm_add_members(added, num, list, 1);
+    return num;
+}
+
+/* END */
@@ -0,0 +1,260 @@
+/*
+ * reorder.c - write a file in Hilbert curve order
+ *
+ * Objects next to each other in the file are next to each other on the
+ * map, so the blocks cover small areas and a bbox query only needs a few
+ * of them (the blocks are written with OSM_PBF_BLOCK_BBOX, see
+ * pbf-write.c and the first bbox pass in pbf.c), the header announces
+ * Sort.Type_then_Hilbert (OSM_PBF_HILBERT). Each type is sorted by
+ * the Hilbert index of a point:
+ *   - nodes: their location,
+ *   - ways: the centroid of their nodes,
+ *   - relations: the center of the bbox of their node and way members,
+ * objects without any known location go last. The order within one type
+ * and index is the order in the input. The Hilbert index is computed on
+ * the 100 nano degree fixed point coordinates (as in .osm.pbf), lon and
+ * lat as 32 bit unsigned each, giving a 64 bit index.
+ *
+ * The whole input is read into memory (osm_parse() with OSMDATA_DUMP,
+ * there is no spilling like in extsort.c), so the input must fit into
+ * RAM several times over. The sort is the threaded radix sort of sort.c
+ * on (index, position) pairs.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "osm.h"
+
+#define REORDER_SCALE 10000000.0    /* 100 nano degrees */
+#define REORDER_NONE  UINT64_MAX    /* no location */
+
+struct reorder_extent {
+    OSM_BBox box;
+    double   lat;       /* sum, then centroid */
+    double   lon;
+    uint32_t num;       /* locations */
+};
+
+/* the index of lat / lon on a Hilbert curve over the whole world */
+uint64_t osm_hilbert(double lat, double lon) {
+    uint32_t x = (uint32_t)(int64_t)llround((lon + 180.0) * REORDER_SCALE);
+    uint32_t y = (uint32_t)(int64_t)llround((lat + 90.0) * REORDER_SCALE);
+    uint64_t d = 0;
+    uint32_t s, rx, ry, t;
+
+    for (s = 1U << 31; s > 0; s >>= 1) {
+        rx = (x & s) > 0;
+        ry = (y & s) > 0;
+        d += (uint64_t)s * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = ~x;
+                y = ~y;
+            }
+            t = x;
+            x = y;
+            y = t;
+        }
+    }
+    return d;
+}
+
+static void extent_add(struct reorder_extent *e, double lat, double lon) {
+    if (isnan(lat) || isnan(lon))
+        return;
+    if (e->num == 0) {
+        e->box.left_lon = e->box.right_lon = lon;
+        e->box.top_lat  = e->box.bottom_lat = lat;
+    }
+    else {
+        if (lon < e->box.left_lon)
+            e->box.left_lon = lon;
+        if (lon > e->box.right_lon)
+            e->box.right_lon = lon;
+        if (lat > e->box.top_lat)
+            e->box.top_lat = lat;
+        if (lat < e->box.bottom_lat)
+            e->box.bottom_lat = lat;
+    }
+    e->lat += lat;
+    e->lon += lon;
+    e->num += 1;
+}
+
+static void extent_write(struct reorder_extent *e, OSM_PBF_Writer *W) {
+    if (e->num == 0)
+        return;
+    osm_pbf_write_extend(W, e->box.bottom_lat, e->box.left_lon);
+    osm_pbf_write_extend(W, e->box.top_lat, e->box.right_lon);
+}
+
+/* the extents of the ways in way order, their centroid as key in p */
+static struct reorder_extent *reorder_ways(OSM_Way_List *wl, OSM_Loc_Index *I,
+                                            struct osm_sort_pair *p)
+{
+    struct reorder_extent *ext = calloc(wl->num + 1, sizeof(struct reorder_extent));
+    OSM_Location loc;
+    uint32_t i, k;
+
+    if (ext == NULL) {
+        fprintf(stderr, "failed to malloc way extents: %s\n", strerror(errno));
+        return (struct reorder_extent *)NULL;
+    }
+    for (i=0; i<wl->num; i++) {
+        OSM_Way *w = wl->data[i];
+        struct reorder_extent *e = &ext[i];
+        for (k=0; w->nodes[k]; k++) {
+            if (w->locs != NULL)
+                extent_add(e, w->locs[k].lat, w->locs[k].lon);
+            else if (osm_loc_index_get(I, w->nodes[k], &loc) == 0)
+                extent_add(e, loc.lat, loc.lon);
+        }
+        p[i].val = i;
+        p[i].key = REORDER_NONE;
+        if (e->num) {
+            e->lat /= e->num;
+            e->lon /= e->num;
+            p[i].key = osm_hilbert(e->lat, e->lon);
+        }
+    }
+    return ext;
+}
+
+static void reorder_relation(OSM_Relation *r, OSM_Loc_Index *I, OSM_Id_Map *ways,
+                                struct reorder_extent *e)
+{
+    struct reorder_extent *we;
+    OSM_Location loc;
+    uint32_t k;
+
+    for (k=0; r->member != NULL && k<r->member->num; k++) {
+        OSM_Rel_Member *m = &r->member->data[k];
+        if (m->type == OSM_REL_MEMBER_TYPE_NODE) {
+            if (osm_loc_index_get(I, m->ref, &loc) == 0)
+                extent_add(e, loc.lat, loc.lon);
+        }
+        else if (m->type == OSM_REL_MEMBER_TYPE_WAY) {
+            we = osm_idmap_get(ways, m->ref);
+            if (we != NULL && we->num) {
+                extent_add(e, we->box.bottom_lat, we->box.left_lon);
+                extent_add(e, we->box.top_lat, we->box.right_lon);
+            }
+        }
+        /* relations in relations: only by their node and way members */
+    }
+}
+
+/*
+ * read F and write it in Hilbert order as .osm.pbf to out. flags are the
+ * OSM_PBF_* of the writer, OSM_PBF_BLOCK_BBOX is always set. With
+ * OSM_PBF_LOCATIONS_ON_WAYS the ways get the locations of their nodes.
+ * threads <= 0 uses all CPUs. Returns 0 on success.
+ */
+int osm_reorder(OSM_File *F, FILE *out, uint32_t block_size, int level, uint32_t flags,
+                    int threads, char *creator)
+{
+    OSM_Data *D;
+    OSM_Loc_Index *I = NULL;
+    OSM_Id_Map *ways = NULL;
+    OSM_PBF_Writer *W = NULL;
+    struct reorder_extent *ext = NULL, e;
+    struct osm_sort_pair *p = NULL;
+    uint32_t i, num;
+    int ret = -1;
+
+    D = osm_parse(F, OSMDATA_DUMP, NULL, NULL, NULL, NULL);
+    if (D == NULL)
+        return -1;
+    num = D->nodes->num;
+    if (D->ways->num > num)
+        num = D->ways->num;
+    if (D->relations->num > num)
+        num = D->relations->num;
+    p = malloc(sizeof(struct osm_sort_pair) * (num + 1));
+    I = osm_loc_index_new();
+    if (p == NULL || I == NULL) {
+        fprintf(stderr, "failed to malloc reorder index: %s\n", strerror(errno));
+        goto done;
+    }
+
+    W = osm_pbf_write_header_opt(creator, out, NULL, block_size, level,
+                                    flags | OSM_PBF_BLOCK_BBOX | OSM_PBF_HILBERT);
+    if (W == NULL)
+        goto done;
+
+    for (i=0; i<D->nodes->num; i++) {
+        OSM_Node *n = D->nodes->data[i];
+        if (osm_loc_index_add(I, n->id, n->lat, n->lon) != 0)
+            goto done;
+        p[i].key = osm_hilbert(n->lat, n->lon);
+        p[i].val = i;
+    }
+    osm_loc_index_sort(I, threads);
+    osm_sort_pairs(p, D->nodes->num, threads);
+    for (i=0; i<D->nodes->num; i++) {
+        if (osm_pbf_write_node(D->nodes->data[ p[i].val ], W) != 0)
+            goto done;
+    }
+    osm_trace(OSM_TRACE_PASS, "reorder: %u nodes", D->nodes->num);
+
+    ext = reorder_ways(D->ways, I, p);
+    ways = osm_idmap_new(D->ways->num);
+    if (ext == NULL || ways == NULL)
+        goto done;
+    for (i=0; i<D->ways->num; i++) {
+        if (osm_idmap_put(ways, D->ways->data[i]->id, &ext[i]) != 0)
+            goto done;
+    }
+    osm_sort_pairs(p, D->ways->num, threads);
+    for (i=0; i<D->ways->num; i++) {
+        OSM_Way *w = D->ways->data[ p[i].val ];
+        if ((flags & OSM_PBF_LOCATIONS_ON_WAYS) && w->locs == NULL
+            && osm_way_locations(I, w) < 0)
+            goto done;
+        if (osm_pbf_write_way(w, W) != 0)
+            goto done;
+        extent_write(&ext[ p[i].val ], W);
+    }
+    osm_trace(OSM_TRACE_PASS, "reorder: %u ways", D->ways->num);
+
+    for (i=0; i<D->relations->num; i++) {
+        memset(&e, 0, sizeof(e));
+        reorder_relation(D->relations->data[i], I, ways, &e);
+        p[i].val = i;
+        p[i].key = REORDER_NONE;
+        if (e.num)
+            p[i].key = osm_hilbert((e.box.top_lat + e.box.bottom_lat) / 2,
+                                    (e.box.left_lon + e.box.right_lon) / 2);
+    }
+    osm_sort_pairs(p, D->relations->num, threads);
+    for (i=0; i<D->relations->num; i++) {
+        OSM_Relation *r = D->relations->data[ p[i].val ];
+        if (osm_pbf_write_relation(r, W) != 0)
+            goto done;
+        memset(&e, 0, sizeof(e));
+        reorder_relation(r, I, ways, &e);
+        extent_write(&e, W);
+    }
+    osm_trace(OSM_TRACE_PASS, "reorder: %u relations", D->relations->num);
+    ret = 0;
+
+  done:
+    if (W != NULL && osm_pbf_write_footer(W) != 0)
+        ret = -1;
+    osm_idmap_free(ways);
+    free(ext);
+    free(p);
+    osm_loc_index_free(I);
+    osm_free_data(D);
+    return ret;
+}
+
+/* END */
@@ -0,0 +1,191 @@
+/*
+ * sort.c - LSD radix sort for ids and id -> value pairs
+ *
+ * Sorts by the 64 bit id (key) one byte per pass, least significant byte
+ * first, and skips the bytes above the largest key and those that are
+ * the same for all keys, i.e. usually 4 or 5 passes for OSM ids. Each
+ * pass counts the bytes of a slice of the input per thread, then every
+ * thread moves its slice to the offsets it got from the counts, so the
+ * passes are stable. Pairs (the key followed by a value like a location,
+ * a pointer or an offset) are moved as a whole.
+ *
+ * The sort needs a second buffer of the input size. If that cannot be
+ * allocated it falls back to qsort(). osm_sort_pairs_tmp() takes it from
+ * the caller.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "osm.h"
+
+#define SORT_INSERTION 32           /* below: insertion sort */
+#define SORT_THREADED  (1 << 20)    /* from here: use threads */
+
+struct sort_job {
+    uint64_t *src;
+    uint64_t *dst;
+    size_t    num;      /* records */
+    int       width;    /* uint64_t per record, 1 or 2 */
+    int       shift;
+    uint64_t  max[OSM_MAX_THREADS];
+    size_t    count[OSM_MAX_THREADS][256];
+};
+
+#define SORT_SLICE(j, id, n, lo, hi) \
+    { lo = (j)->num * (id) / (n); hi = (j)->num * ((id) + 1) / (n); }
+
+static void sort_insertion(uint64_t *a, size_t num, int width) {
+    size_t i, k;
+    for (i=1; i<num; i++) {
+        uint64_t key = a[i * width], val = width == 2 ? a[i * 2 + 1] : 0;
+        for (k=i; k>0 && a[(k-1) * width] > key; k--) {
+            a[k * width] = a[(k-1) * width];
+            if (width == 2)
+                a[k * 2 + 1] = a[(k-1) * 2 + 1];
+        }
+        a[k * width] = key;
+        if (width == 2)
+            a[k * 2 + 1] = val;
+    }
+}
+
+static void sort_max(int id, int num, void *arg) {
+    struct sort_job *j = arg;
+    size_t i, lo, hi;
+    uint64_t max = 0;
+    SORT_SLICE(j, id, num, lo, hi);
+    for (i=lo; i<hi; i++)
+        max |= j->src[i * j->width];
+    j->max[id] = max;
+}
+
+static void sort_count(int id, int num, void *arg) {
+    struct sort_job *j = arg;
+    size_t *c = j->count[id];
+    size_t i, lo, hi;
+    int shift = j->shift;
+    SORT_SLICE(j, id, num, lo, hi);
+    memset(c, 0, sizeof(j->count[id]));
+    if (j->width == 1) {
+        for (i=lo; i<hi; i++)
+            c[ (j->src[i] >> shift) & 0xff ]++;
+    }
+    else {
+        for (i=lo; i<hi; i++)
+            c[ (j->src[i * 2] >> shift) & 0xff ]++;
+    }
+}
+
+static void sort_move(int id, int num, void *arg) {
+    struct sort_job *j = arg;
+    size_t *off = j->count[id];
+    uint64_t *src = j->src, *dst = j->dst;
+    size_t i, lo, hi;
+    int shift = j->shift;
+    SORT_SLICE(j, id, num, lo, hi);
+    if (j->width == 1) {
+        for (i=lo; i<hi; i++) {
+            uint64_t v = src[i];
+            dst[ off[ (v >> shift) & 0xff ]++ ] = v;
+        }
+    }
+    else {
+        for (i=lo; i<hi; i++) {
+            uint64_t k = src[i * 2];
+            size_t d = off[ (k >> shift) & 0xff ]++;
+            dst[d * 2]     = k;
+            dst[d * 2 + 1] = src[i * 2 + 1];
+        }
+    }
+}
+
+static void sort_radix(uint64_t *a, size_t num, int width, uint64_t *buf, int threads) {
+    struct sort_job *j;
+    uint64_t max = 0, *tmp = buf;
+    int t, b, shift;
+
+    if (num < 2)
+        return;
+    if (num < SORT_INSERTION) {
+        sort_insertion(a, num, width);
+        return;
+    }
+    j = malloc(sizeof(struct sort_job));
+    if (buf == NULL)
+        tmp = malloc(sizeof(uint64_t) * width * num);
+    if (j == NULL || tmp == NULL) {
+        osm_trace(OSM_TRACE_PASS, "sort: no memory for %lu records, using qsort()", num);
+        free(j);
+        if (buf == NULL)
+            free(tmp);
+        /* osm_cmp_member() looks at the key only */
+        qsort(a, num, sizeof(uint64_t) * width, osm_cmp_member);
+        return;
+    }
+    threads = num < SORT_THREADED ? 1 : osm_threads_num(threads);
+    j->src   = a;
+    j->dst   = tmp;
+    j->num   = num;
+    j->width = width;
+
+    osm_threads_run(threads, sort_max, j);
+    for (t=0; t<threads; t++)
+        max |= j->max[t];
+
+    for (shift=0; shift<64 && (max >> shift) != 0; shift+=8) {
+        size_t sum = 0;
+        int skip = 0;
+
+        j->shift = shift;
+        osm_threads_run(threads, sort_count, j);
+        /* offsets: by byte, then by thread to keep the order */
+        for (b=0; b<256 && !skip; b++) {
+            size_t total = 0;
+            for (t=0; t<threads; t++) {
+                size_t c = j->count[t][b];
+                j->count[t][b] = sum;
+                sum   += c;
+                total += c;
+            }
+            if (total == num)
+                skip = 1;
+        }
+        if (skip)
+            continue;
+        osm_threads_run(threads, sort_move, j);
+        j->dst = j->src;
+        j->src = j->src == a ? tmp : a;
+    }
+    if (j->src != a)
+        memcpy(a, j->src, sizeof(uint64_t) * width * num);
+    if (buf == NULL)
+        free(tmp);
+    free(j);
+}
+
+/* sort ids, threads <= 0 uses all CPUs (for large arrays only) */
+void osm_sort_ids(uint64_t *ids, size_t num, int threads) {
+    sort_radix(ids, num, 1, NULL, threads);
+}
+
+/*
+ * sort pairs of uint64_t by the first one (the key), the second one is
+ * moved with its key. pairs is any array of struct { uint64_t id; uint64_t
+ * val; }, e.g. struct osm_sort_pair.
+ */
+void osm_sort_pairs(void *pairs, size_t num, int threads) {
+    sort_radix(pairs, num, 2, NULL, threads);
+}
+
+/* osm_sort_pairs() with tmp (room for num pairs) as the second buffer */
+void osm_sort_pairs_tmp(void *pairs, size_t num, void *tmp, int threads) {
+    sort_radix(pairs, num, 2, tmp, threads);
+}
+
+/* END */
@@ -0,0 +1,227 @@
+/*
+ * stats.c - performance counters, timers and peak memory
+ *
+ * The library counts bytes read, blobs inflated, the time spent inflating
+ * and decoding and the objects seen, filtered and kept with the
+ * osm_stats_add() / osm_stats_start() / osm_stats_stop() macros from osm.h.
+ * They cost a test of osm_stats_on while disabled (and nothing at all if
+ * built with -DOSM_NO_STATS). Counters are kept per thread and summed by
+ * osm_stats_get(), so counting needs no locks. The counters of a thread are
+ * added to those of the exited threads and freed when it exits, the rest
+ * when the report was printed. The current and peak size
+ * of a few large buffer categories are global, they change per block, not
+ * per object.
+ *
+ * Tools call osm_stats_args() first, it removes a --stats argument and
+ * prints the report to stderr on exit.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "osm.h"
+
+struct stats_thread {
+    uint64_t counter[OSM_STAT_NUM];
+    struct stats_thread *next;
+};
+
+int osm_stats_on = 0;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_thread *stats_threads = NULL;
+static __thread struct stats_thread *stats_local = NULL;
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+static uint64_t stats_exited[OSM_STAT_NUM];     /* counters of exited threads */
+static int64_t stats_mem_cur[OSM_MEM_NUM];
+static int64_t stats_mem_peak[OSM_MEM_NUM];
+
+static const char *stats_names[OSM_STAT_NUM] = {
+    "bytes read",
+    "blobs",
+    "blobs skipped",
+    "blob bytes inflated",
+    "inflate time",
+    "decode time",
+    "nodes seen",
+    "ways seen",
+    "relations seen",
+    "nodes filtered",
+    "ways filtered",
+    "relations filtered",
+    "nodes kept",
+    "ways kept",
+    "relations kept"
+};
+
+static const char *stats_mem_names[OSM_MEM_NUM] = {
+    "blobs",
+    "inflated",
+    "member ids",
+    "locations",
+    "tile buffers",
+    "read-ahead",
+    "sort runs"
+};
+
+void osm_stats_enable(int on) {
+    osm_stats_on = on;
+}
+
+/* thread exit: keep the counts, free the counters */
+static void stats_release(void *arg) {
+    struct stats_thread *t = arg, **p;
+    int i;
+    pthread_mutex_lock(&stats_lock);
+    for (p=&stats_threads; *p!=NULL; p=&(*p)->next) {
+        if (*p == t) {
+            *p = t->next;
+            break;
+        }
+    }
+    for (i=0; i<OSM_STAT_NUM; i++)
+        stats_exited[i] += t->counter[i];
+    pthread_mutex_unlock(&stats_lock);
+    free(t);
+}
+
+static void stats_key_init() {
+    pthread_key_create(&stats_key, stats_release);
+}
+
+/* the counters of this thread, registered on first use */
+static struct stats_thread *stats_thread() {
+    struct stats_thread *t = stats_local;
+    if (t != NULL)
+        return t;
+    pthread_once(&stats_key_once, stats_key_init);
+    t = calloc(1, sizeof(struct stats_thread));
+    if (t == NULL)
+        return NULL;
+    pthread_mutex_lock(&stats_lock);
+    t->next = stats_threads;
+    stats_threads = t;
+    pthread_mutex_unlock(&stats_lock);
+    pthread_setspecific(stats_key, t);
+    stats_local = t;
+    return t;
+}
+
+/* only this thread writes its counters, others just read them */
+void osm_stats_count(int counter, uint64_t n) {
+    struct stats_thread *t = stats_thread();
+    if (t == NULL)
+        return;
+    __atomic_store_n(&t->counter[counter],
+            __atomic_load_n(&t->counter[counter], __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/* monotonic nano seconds, for the *_NS counters */
+uint64_t osm_stats_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* bytes allocated (> 0) or freed (< 0) in the category */
+void osm_stats_mem(int category, int64_t bytes) {
+    int64_t cur = __atomic_add_fetch(&stats_mem_cur[category], bytes, __ATOMIC_RELAXED);
+    int64_t peak = __atomic_load_n(&stats_mem_peak[category], __ATOMIC_RELAXED);
+    while (cur > peak
+            && !__atomic_compare_exchange_n(&stats_mem_peak[category], &peak, cur,
+                                        0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* the sum of all threads */
+void osm_stats_get(struct osm_stats *s) {
+    struct stats_thread *t;
+    struct rusage ru;
+    int i;
+
+    memset(s, 0, sizeof(*s));
+    pthread_mutex_lock(&stats_lock);
+    for (i=0; i<OSM_STAT_NUM; i++)
+        s->counter[i] = stats_exited[i];
+    for (t=stats_threads; t!=NULL; t=t->next)
+        for (i=0; i<OSM_STAT_NUM; i++)
+            s->counter[i] += __atomic_load_n(&t->counter[i], __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&stats_lock);
+    for (i=0; i<OSM_MEM_NUM; i++)
+        s->mem_peak[i] = __atomic_load_n(&stats_mem_peak[i], __ATOMIC_RELAXED);
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+        s->max_rss = ru.ru_maxrss;
+}
+
+void osm_stats_reset() {
+    struct stats_thread *t;
+    int i;
+    pthread_mutex_lock(&stats_lock);
+    memset(stats_exited, 0, sizeof(stats_exited));
+    for (t=stats_threads; t!=NULL; t=t->next)
+        for (i=0; i<OSM_STAT_NUM; i++)
+            __atomic_store_n(&t->counter[i], 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&stats_lock);
+    for (i=0; i<OSM_MEM_NUM; i++)
+        __atomic_store_n(&stats_mem_peak[i], stats_mem_cur[i], __ATOMIC_RELAXED);
+}
+
+void osm_stats_print(FILE *fh) {
+    struct osm_stats s;
+    int i;
+
+    osm_stats_get(&s);
+    for (i=0; i<OSM_STAT_NUM; i++) {
+        if (i == OSM_STAT_INFLATE_NS || i == OSM_STAT_DECODE_NS)
+            fprintf(fh, "stats: %-20s %.6f s\n", stats_names[i], s.counter[i] / 1e9);
+        else
+            fprintf(fh, "stats: %-20s %lu\n", stats_names[i], s.counter[i]);
+    }
+    for (i=0; i<OSM_MEM_NUM; i++)
+        fprintf(fh, "stats: peak %-15s %.2f MB\n", stats_mem_names[i], s.mem_peak[i] / 1e6);
+    fprintf(fh, "stats: %-20s %.2f MB\n", "max rss", s.max_rss / 1024.0);
+}
+
+/* print the report, stop counting and free the counters */
+static void stats_atexit() {
+    struct stats_thread *t;
+
+    osm_stats_print(stderr);
+    osm_stats_enable(0);
+    pthread_mutex_lock(&stats_lock);
+    while (stats_threads != NULL) {
+        t = stats_threads;
+        stats_threads = t->next;
+        free(t);
+    }
+    pthread_mutex_unlock(&stats_lock);
+    stats_local = NULL;
+}
+
+/* remove --stats from argv, if it was there: count and report on exit */
+void osm_stats_args(int *argc, char **argv) {
+    int i, k;
+    for (i=1, k=1; i<*argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0) {
+            if (!osm_stats_on)
+                atexit(stats_atexit);
+            osm_stats_enable(1);
+            continue;
+        }
+        argv[k++] = argv[i];
+    }
+    argv[k] = NULL;
+    *argc = k;
+}
+
+/* END */
@@ -0,0 +1,1155 @@
+/*
+ * store.c - on disk object store with O(1) lookups by id, mmap()ed
+ *
+ * osm_store_build() converts a .osm(.pbf) in two scans (max ids, data)
+ * into one file:
+ *
+ *   header      struct store_header, one page
+ *   node_loc    2 x int32 per node id: lat, lon in 1e-7 degree, lat is
+ *               biased by STORE_LAT_BIAS so an all zero entry (i.e. a
+ *               hole in the sparse file) means "no such node"
+ *   way_index   uint64 per way id: file offset of the way, 0: none
+ *   rel_index   uint64 per relation id: offset of the relation, 0: none
+ *   blobs       ways, relations and tags of tagged nodes, 8 byte aligned
+ *   node_tags   {id, offset} of the tagged nodes, sorted by id
+ *   pool        all strings (keys, values, roles), NUL terminated and
+ *               stored once; tags and roles are offsets into it, 0 is ""
+ *
+ * Values are in host byte order. osm_store_open() maps the file read only,
+ * so opening costs no parsing and the lookups just follow offsets. Nodes
+ * with tags need a binary search in node_tags for their tags.
+ *
+ * Updates: osm_store_update() never changes data in place. It appends
+ * the changed objects (copy on write, so ways and relations may grow),
+ * a string pool for them and a new delta table: the {id, offset, pool}
+ * of the changed objects, sorted per type, deletes have offset
+ * STORE_DELETED, and the offset of the previous table. Lookups search
+ * the chain of tables, newest first, before the base arrays. To keep the
+ * chain short, an update merges the newest tables into its own as long
+ * as they are not larger than what it has so far, so each entry is
+ * written O(log(updates)) times and the chain has at most that many
+ * tables. The update is published by storing the offset of the new table
+ * in the header, one aligned 8 byte write after everything it points to
+ * is synced: readers see either the old or the new state, a crash before
+ * the write leaves the old state (the appended rest is cut by the next
+ * update). Readers map STORE_RESERVE bytes beyond the end of the file, so
+ * updates become visible without remapping until the reserve is used up;
+ * a lookup never waits for an update, it uses the last table it can see.
+ *
+ * When the updates have grown to 1 / STORE_COMPACT of the base, the store
+ * is compacted: rebuilt from its current state into FILE.tmp and renamed
+ * over FILE. Open stores keep the old file, osm_store_refresh() switches.
+ * Updates and compactions are serialized with flock().
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "osm.h"
+
+#define STORE_MAGIC      "OSMSTORE"
+#define STORE_VERSION    3
+#define STORE_BYTE_ORDER 0x01020304
+#define STORE_PAGE       4096
+#define STORE_DEGREE     10000000.0
+#define STORE_LAT_BIAS   900000001
+#define STORE_RESERVE    ((uint64_t)1 << 30)
+#define STORE_DELETED    1
+#define STORE_COMPACT    4
+#define STORE_MAX_ID     ((uint64_t)1 << 40)  /* 8 TB (sparse) of node_loc */
+
+enum {
+    store_nodes,
+    store_ways,
+    store_relations,
+    store_types
+};
+
+struct store_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t size;          /* of the complete file */
+    uint64_t max_node;
+    uint64_t max_way;
+    uint64_t max_rel;
+    uint64_t node_loc;      /* offsets of the sections */
+    uint64_t way_index;
+    uint64_t rel_index;
+    uint64_t blobs;
+    uint64_t node_tags;
+    uint64_t num_node_tags;
+    uint64_t pool;
+    uint64_t pool_size;
+    uint64_t base_size;     /* size without updates */
+    uint64_t delta;         /* offset of the struct store_delta, 0: none */
+};
+
+/* blobs, followed by refs / members and 2 x uint32 per tag */
+struct store_node_blob {
+    int32_t  lat;
+    int32_t  lon;
+    uint32_t version;
+    uint32_t num_tags;
+};
+
+struct store_way_blob {
+    uint32_t version;
+    uint32_t num_refs;
+    uint32_t num_tags;
+    uint32_t pad;
+};
+
+struct store_rel_blob {
+    uint32_t version;
+    uint32_t num_members;
+    uint32_t num_tags;
+    uint32_t pad;
+};
+
+struct store_id_off {
+    uint64_t id;
+    uint64_t off;
+};
+
+/* followed by num[store_nodes] node entries, then ways, relations */
+struct store_delta {
+    uint64_t prev;          /* offset of the older table, 0: none */
+    uint64_t num[store_types];
+};
+
+struct store_delta_entry {
+    uint64_t id;
+    uint64_t off;           /* of the blob, STORE_DELETED */
+    uint64_t pool;          /* offset of the string pool of the blob */
+};
+
+struct _osm_store {
+    int       fd;
+    char     *file;
+    size_t    map_size;
+    const uint8_t *map;
+    const struct store_header *hdr;
+    const int32_t  *node_loc;
+    const uint64_t *way_index;
+    const uint64_t *rel_index;
+    const struct store_id_off *node_tags;
+    const char *pool;
+    uint64_t  delta;        /* last delta table inside the mapping */
+};
+
+/* state of osm_store_build() and osm_store_update() */
+struct store_build {
+    const char *file;
+    char     *tmp;
+    int       fd;
+    FILE     *out;
+    uint64_t  pos;          /* offset of the next blob */
+    uint8_t  *map;          /* header and the fixed size sections */
+    size_t    map_size;
+    struct store_header *hdr;
+    int32_t  *node_loc;
+    uint64_t *way_index;
+    uint64_t *rel_index;
+    struct store_id_off *node_tags;
+    uint64_t  num_node_tags;
+    uint64_t  size_node_tags;
+    char     *pool;
+    uint64_t  pool_size;
+    uint64_t  pool_alloc;
+    uint32_t *strings;      /* hash of pool offsets, 0: empty slot */
+    uint64_t  num_strings;
+    uint64_t  size_strings;
+    uint64_t  max_node, max_way, max_rel;
+    int       failed;
+};
+
+static uint64_t store_align(uint64_t off, uint64_t to) {
+    return (off + to - 1) & ~(to - 1);
+}
+
+/*
+ * ids are indexes into node_loc, way_index and rel_index, negative ones
+ * (e.g. from JOSM files) are huge as uint64_t and can not be stored
+ */
+static int store_check_id(const char *type, uint64_t id) {
+    if (id < STORE_MAX_ID)
+        return 0;
+    fprintf(stderr, "%s %ld: id out of range for the store (max %lu)\n",
+                    type, (int64_t)id, STORE_MAX_ID - 1);
+    return -1;
+}
+
+static uint64_t store_hash(const char *s) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static int store_grow_strings(struct store_build *b) {
+    uint64_t size = b->size_strings ? b->size_strings * 2 : 65536, mask = size - 1, i;
+    uint32_t *tmp = calloc(size, sizeof(uint32_t));
+    if (tmp == NULL) {
+        fprintf(stderr, "failed to malloc string hash: %s\n", strerror(errno));
+        return -1;
+    }
+    for (i=0; i<b->size_strings; i++) {
+        uint64_t h;
+        if (b->strings[i] == 0)
+            continue;
+        h = store_hash(b->pool + b->strings[i]) & mask;
+        while (tmp[h] != 0)
+            h = (h + 1) & mask;
+        tmp[h] = b->strings[i];
+    }
+    free(b->strings);
+    b->strings      = tmp;
+    b->size_strings = size;
+    return 0;
+}
+
+static int store_init_pool(struct store_build *b) {
+    b->pool       = malloc(65536);
+    b->pool_alloc = 65536;
+    b->pool_size  = 1;   /* offset 0 is "" */
+    if (b->pool == NULL) {
+        fprintf(stderr, "failed to malloc string pool: %s\n", strerror(errno));
+        return -1;
+    }
+    b->pool[0] = '\0';
+    return 0;
+}
+
+/* pool offset of str, added if it is new */
+static uint32_t store_string(struct store_build *b, const char *str) {
+    uint64_t mask, h, len;
+    if (str == NULL || !*str)
+        return 0;
+    if ((b->num_strings + 1) * 2 > b->size_strings && store_grow_strings(b) != 0) {
+        b->failed = 1;
+        return 0;
+    }
+    mask = b->size_strings - 1;
+    h = store_hash(str) & mask;
+    while (b->strings[h] != 0) {
+        if (strcmp(b->pool + b->strings[h], str) == 0)
+            return b->strings[h];
+        h = (h + 1) & mask;
+    }
+
+    len = strlen(str) + 1;
+    if (b->pool_size + len > UINT32_MAX) {
+        fprintf(stderr, "string pool of the store exceeds 4 GB\n");
+        b->failed = 1;
+        return 0;
+    }
+    if (b->pool_size + len > b->pool_alloc) {
+        uint64_t size = b->pool_alloc;
+        char *tmp;
+        while (size < b->pool_size + len)
+            size *= 2;
+        tmp = realloc(b->pool, size);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to realloc string pool: %s\n", strerror(errno));
+            b->failed = 1;
+            return 0;
+        }
+        b->pool       = tmp;
+        b->pool_alloc = size;
+    }
+    memcpy(b->pool + b->pool_size, str, len);
+    b->strings[h] = b->pool_size;
+    b->num_strings += 1;
+    b->pool_size += len;
+    return b->strings[h];
+}
+
+/* append len bytes to the blobs, returns their offset */
+static uint64_t store_write(struct store_build *b, const void *data, size_t len) {
+    uint64_t off = b->pos;
+    static const char zero[8];
+    size_t pad = store_align(len, 8) - len;
+    if (fwrite(data, 1, len, b->out) != len
+        || (pad && fwrite(zero, 1, pad, b->out) != pad))
+    {
+        fprintf(stderr, "failed to write store: %s\n", strerror(errno));
+        b->failed = 1;
+    }
+    b->pos += len + pad;
+    return off;
+}
+
+/* tags as pairs of pool offsets */
+static uint32_t *store_tags(struct store_build *b, OSM_Tag_List *t, uint32_t *num) {
+    uint32_t i, *tags;
+    *num = t != NULL ? t->num : 0;
+    tags = malloc(sizeof(uint32_t) * 2 * (*num + 1));
+    if (tags == NULL) {
+        fprintf(stderr, "failed to malloc tags: %s\n", strerror(errno));
+        b->failed = 1;
+        return NULL;
+    }
+    for (i=0; i<*num; i++) {
+        tags[2*i]     = store_string(b, t->data[i].key);
+        tags[2*i + 1] = store_string(b, t->data[i].val);
+    }
+    return tags;
+}
+
+/* the same for the tags of a view from another store */
+static uint32_t *store_view_tags(struct store_build *b, const char *pool,
+                                    const uint32_t *view, uint32_t num)
+{
+    uint32_t i, *tags = malloc(sizeof(uint32_t) * 2 * (num + 1));
+    if (tags == NULL) {
+        fprintf(stderr, "failed to malloc tags: %s\n", strerror(errno));
+        b->failed = 1;
+        return NULL;
+    }
+    for (i=0; i<2*num; i++)
+        tags[i] = store_string(b, pool + view[i]);
+    return tags;
+}
+
+static uint64_t store_node_blob(struct store_build *b, double lat, double lon,
+                                uint32_t version, uint32_t *tags, uint32_t num_tags)
+{
+    struct store_node_blob blob;
+    uint64_t off;
+    blob.lat      = (int32_t)lround(lat * STORE_DEGREE);
+    blob.lon      = (int32_t)lround(lon * STORE_DEGREE);
+    blob.version  = version;
+    blob.num_tags = num_tags;
+    off = store_write(b, &blob, sizeof(blob));
+    store_write(b, tags, sizeof(uint32_t) * 2 * num_tags);
+    return off;
+}
+
+static uint64_t store_way_blob(struct store_build *b, uint32_t version,
+                                const uint64_t *refs, uint32_t num_refs,
+                                uint32_t *tags, uint32_t num_tags)
+{
+    struct store_way_blob blob;
+    uint64_t off;
+    memset(&blob, 0, sizeof(blob));
+    blob.version  = version;
+    blob.num_refs = num_refs;
+    blob.num_tags = num_tags;
+    off = store_write(b, &blob, sizeof(blob));
+    store_write(b, refs, sizeof(uint64_t) * num_refs);
+    store_write(b, tags, sizeof(uint32_t) * 2 * num_tags);
+    return off;
+}
+
+static uint64_t store_rel_blob(struct store_build *b, uint32_t version,
+                                struct osm_store_member *mem, uint32_t num_members,
+                                uint32_t *tags, uint32_t num_tags)
+{
+    struct store_rel_blob blob;
+    uint64_t off;
+    memset(&blob, 0, sizeof(blob));
+    blob.version     = version;
+    blob.num_members = num_members;
+    blob.num_tags    = num_tags;
+    off = store_write(b, &blob, sizeof(blob));
+    store_write(b, mem, sizeof(struct osm_store_member) * num_members);
+    store_write(b, tags, sizeof(uint32_t) * 2 * num_tags);
+    return off;
+}
+
+/* blob of an OSM_Node / OSM_Way / OSM_Relation, 0 on error */
+static uint64_t store_osm_node(struct store_build *b, OSM_Node *n) {
+    uint32_t num, *tags = store_tags(b, n->tags, &num);
+    uint64_t off = 0;
+    if (tags != NULL)
+        off = store_node_blob(b, n->lat, n->lon, n->version, tags, num);
+    free(tags);
+    return off;
+}
+
+static uint64_t store_osm_way(struct store_build *b, OSM_Way *w) {
+    uint32_t num, num_refs = 0, *tags = store_tags(b, w->tags, &num);
+    uint64_t off = 0;
+    while (w->nodes[num_refs])
+        num_refs += 1;
+    if (tags != NULL)
+        off = store_way_blob(b, w->version, w->nodes, num_refs, tags, num);
+    free(tags);
+    return off;
+}
+
+static uint64_t store_osm_relation(struct store_build *b, OSM_Relation *r) {
+    uint32_t i, num, num_members = r->member != NULL ? r->member->num : 0;
+    uint32_t *tags = store_tags(b, r->tags, &num);
+    struct osm_store_member *mem = malloc(sizeof(struct osm_store_member) * (num_members + 1));
+    uint64_t off = 0;
+    if (mem == NULL || tags == NULL) {
+        fprintf(stderr, "failed to malloc relation: %s\n", strerror(errno));
+        b->failed = 1;
+        free(mem);
+        free(tags);
+        return 0;
+    }
+    for (i=0; i<num_members; i++) {
+        mem[i].ref  = r->member->data[i].ref;
+        mem[i].role = store_string(b, r->member->data[i].role);
+        mem[i].type = r->member->data[i].type;
+    }
+    off = store_rel_blob(b, r->version, mem, num_members, tags, num);
+    free(mem);
+    free(tags);
+    return off;
+}
+
+/* location and (if any) tags of a node in a new store */
+static void store_put_node(struct store_build *b, uint64_t id, double lat, double lon,
+                            uint32_t version, uint32_t *tags, uint32_t num_tags)
+{
+    if (id > b->max_node)
+        return;
+    b->node_loc[2 * id]     = (int32_t)lround(lat * STORE_DEGREE) + STORE_LAT_BIAS;
+    b->node_loc[2 * id + 1] = (int32_t)lround(lon * STORE_DEGREE);
+    if (num_tags == 0)
+        return;
+
+    if (b->num_node_tags == b->size_node_tags) {
+        uint64_t size = b->size_node_tags ? b->size_node_tags * 2 : 4096;
+        struct store_id_off *tmp = realloc(b->node_tags, sizeof(struct store_id_off) * size);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to realloc node tags: %s\n", strerror(errno));
+            b->failed = 1;
+            return;
+        }
+        b->node_tags      = tmp;
+        b->size_node_tags = size;
+    }
+    b->node_tags[b->num_node_tags].id  = id;
+    b->node_tags[b->num_node_tags].off = store_node_blob(b, lat, lon, version, tags, num_tags);
+    b->num_node_tags += 1;
+}
+
+static int store_max_ids(OSM_Data *d, void *ctx) {
+    struct store_build *b = ctx;
+    uint32_t i;
+    for (i=0; i<d->nodes->num; i++) {
+        if (store_check_id("node", d->nodes->data[i]->id) != 0)
+            return -1;
+        if (d->nodes->data[i]->id > b->max_node)
+            b->max_node = d->nodes->data[i]->id;
+    }
+    for (i=0; i<d->ways->num; i++) {
+        if (store_check_id("way", d->ways->data[i]->id) != 0)
+            return -1;
+        if (d->ways->data[i]->id > b->max_way)
+            b->max_way = d->ways->data[i]->id;
+    }
+    for (i=0; i<d->relations->num; i++) {
+        if (store_check_id("relation", d->relations->data[i]->id) != 0)
+            return -1;
+        if (d->relations->data[i]->id > b->max_rel)
+            b->max_rel = d->relations->data[i]->id;
+    }
+    return 0;
+}
+
+static int store_add_block(OSM_Data *d, void *ctx) {
+    struct store_build *b = ctx;
+    uint32_t i;
+    for (i=0; i<d->nodes->num && !b->failed; i++) {
+        OSM_Node *n = d->nodes->data[i];
+        uint32_t num, *tags = store_tags(b, n->tags, &num);
+        if (tags != NULL)
+            store_put_node(b, n->id, n->lat, n->lon, n->version, tags, num);
+        free(tags);
+    }
+    for (i=0; i<d->ways->num && !b->failed; i++) {
+        OSM_Way *w = d->ways->data[i];
+        if (w->id <= b->max_way)
+            b->way_index[w->id] = store_osm_way(b, w);
+    }
+    for (i=0; i<d->relations->num && !b->failed; i++) {
+        OSM_Relation *r = d->relations->data[i];
+        if (r->id <= b->max_rel)
+            b->rel_index[r->id] = store_osm_relation(b, r);
+    }
+    return b->failed;
+}
+
+/* create FILE.tmp with room for b->max_* and map its fixed size part */
+static int store_begin(struct store_build *b, const char *file) {
+    uint64_t off;
+
+    b->file = file;
+    b->fd   = -1;
+    b->tmp  = malloc(strlen(file) + 5);
+    if (b->tmp == NULL)
+        return -1;
+    sprintf(b->tmp, "%s.tmp", file);
+    b->fd = open(b->tmp, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (b->fd == -1) {
+        fprintf(stderr, "failed to open %s: %s\n", b->tmp, strerror(errno));
+        return -1;
+    }
+
+    /* the fixed size part is mapped, holes stay sparse. With the ids below
+       STORE_MAX_ID the sizes can not overflow, nor the off_t of ftruncate() */
+    if (b->max_node >= STORE_MAX_ID || b->max_way >= STORE_MAX_ID
+        || b->max_rel >= STORE_MAX_ID)
+    {
+        fprintf(stderr, "failed to create %s: max ids %lu/%lu/%lu out of range\n",
+                        b->tmp, b->max_node, b->max_way, b->max_rel);
+        return -1;
+    }
+    off = STORE_PAGE;
+    off = store_align(off + sizeof(int32_t) * 2 * (b->max_node + 1), STORE_PAGE);
+    off = store_align(off + sizeof(uint64_t) * (b->max_way + 1), STORE_PAGE);
+    off = store_align(off + sizeof(uint64_t) * (b->max_rel + 1), STORE_PAGE);
+    b->map_size = off;
+    if (ftruncate(b->fd, b->map_size) != 0) {
+        fprintf(stderr, "failed to resize %s: %s\n", b->tmp, strerror(errno));
+        return -1;
+    }
+    b->map = mmap(NULL, b->map_size, PROT_READ|PROT_WRITE, MAP_SHARED, b->fd, 0);
+    if (b->map == MAP_FAILED) {
+        fprintf(stderr, "failed to mmap %s: %s\n", b->tmp, strerror(errno));
+        b->map = NULL;
+        return -1;
+    }
+    b->hdr = (struct store_header *)b->map;
+    b->hdr->max_node  = b->max_node;
+    b->hdr->max_way   = b->max_way;
+    b->hdr->max_rel   = b->max_rel;
+    b->hdr->node_loc  = STORE_PAGE;
+    b->hdr->way_index = store_align(b->hdr->node_loc
+                            + sizeof(int32_t) * 2 * (b->max_node + 1), STORE_PAGE);
+    b->hdr->rel_index = store_align(b->hdr->way_index
+                            + sizeof(uint64_t) * (b->max_way + 1), STORE_PAGE);
+    b->hdr->blobs     = b->map_size;
+    b->node_loc  = (int32_t *)(b->map + b->hdr->node_loc);
+    b->way_index = (uint64_t *)(b->map + b->hdr->way_index);
+    b->rel_index = (uint64_t *)(b->map + b->hdr->rel_index);
+
+    if (store_init_pool(b) != 0)
+        return -1;
+    b->out = fdopen(dup(b->fd), "w");
+    if (b->out == NULL || fseeko(b->out, b->map_size, SEEK_SET) != 0) {
+        fprintf(stderr, "failed to write %s: %s\n", b->tmp, strerror(errno));
+        return -1;
+    }
+    b->pos = b->map_size;
+    return 0;
+}
+
+/* write node_tags, pool and header, sync and rename FILE.tmp to FILE */
+static int store_finish(struct store_build *b) {
+    osm_sort_pairs(b->node_tags, b->num_node_tags, 0);
+    b->hdr->node_tags     = store_write(b, b->node_tags,
+                                sizeof(struct store_id_off) * b->num_node_tags);
+    b->hdr->num_node_tags = b->num_node_tags;
+    b->hdr->pool          = store_write(b, b->pool, b->pool_size);
+    b->hdr->pool_size     = b->pool_size;
+    b->hdr->size          = b->pos;
+    b->hdr->base_size     = b->pos;
+    b->hdr->delta         = 0;
+    if (b->failed || fflush(b->out) != 0)
+        return -1;
+
+    /* header last: an incomplete file has no magic */
+    b->hdr->version    = STORE_VERSION;
+    b->hdr->byte_order = STORE_BYTE_ORDER;
+    memcpy(b->hdr->magic, STORE_MAGIC, 8);
+    if (msync(b->map, b->map_size, MS_SYNC) != 0 || fsync(b->fd) != 0) {
+        fprintf(stderr, "failed to sync %s: %s\n", b->tmp, strerror(errno));
+        return -1;
+    }
+    if (rename(b->tmp, b->file) != 0) {
+        fprintf(stderr, "failed to rename %s to %s: %s\n", b->tmp, b->file, strerror(errno));
+        return -1;
+    }
+    if (debug)
+        fprintf(stderr, "%s:%d:%s(): %s: max ids %lu/%lu/%lu, %lu tagged nodes, "
+                        "%lu strings, %lu bytes\n",
+                        __FILE__, __LINE__, __FUNCTION__, b->file,
+                        b->max_node, b->max_way, b->max_rel, b->num_node_tags,
+                        b->num_strings, b->pos);
+    return 0;
+}
+
+static void store_cleanup(struct store_build *b, int failed) {
+    if (b->out != NULL)
+        fclose(b->out);
+    if (b->map != NULL)
+        munmap(b->map, b->map_size);
+    if (b->fd != -1)
+        close(b->fd);
+    if (failed && b->tmp != NULL)
+        unlink(b->tmp);
+    free(b->tmp);
+    free(b->node_tags);
+    free(b->pool);
+    free(b->strings);
+}
+
+/*
+ * build the store file from F, written to file.tmp and renamed when
+ * complete, so readers of an older store never see a partial file
+ */
+int osm_store_build(OSM_File *F, const char *file) {
+    struct store_build b;
+    int ret = -1;
+
+    memset(&b, 0, sizeof(b));
+    b.fd = -1;
+    if (osm_scan(F, OSMDATA_NODE|OSMDATA_BARE|OSMDATA_WAY|OSMDATA_REL,
+                    store_max_ids, &b) != 0)
+        return -1;
+
+    if (store_begin(&b, file) == 0
+        && osm_scan(F, OSMDATA_NODE|OSMDATA_WAY|OSMDATA_REL, store_add_block, &b) == 0
+        && !b.failed
+        && store_finish(&b) == 0)
+        ret = 0;
+    store_cleanup(&b, ret != 0);
+    return ret;
+}
+
+static int store_map(OSM_Store *s) {
+    struct stat st;
+    const struct store_header *h;
+
+    s->fd = open(s->file, O_RDONLY);
+    if (s->fd == -1 || fstat(s->fd, &st) != 0) {
+        fprintf(stderr, "failed to open %s: %s\n", s->file, strerror(errno));
+        return -1;
+    }
+    if (st.st_size < STORE_PAGE) {
+        fprintf(stderr, "%s: not an object store\n", s->file);
+        return -1;
+    }
+    /* the reserve makes appended updates visible without a new mapping */
+    s->map_size = st.st_size + STORE_RESERVE;
+    s->map = mmap(NULL, s->map_size, PROT_READ, MAP_SHARED, s->fd, 0);
+    if (s->map == MAP_FAILED) {
+        fprintf(stderr, "failed to mmap %s: %s\n", s->file, strerror(errno));
+        s->map = NULL;
+        return -1;
+    }
+
+    h = s->hdr = (const struct store_header *)s->map;
+    if (memcmp(h->magic, STORE_MAGIC, 8) != 0 || h->byte_order != STORE_BYTE_ORDER) {
+        fprintf(stderr, "%s: not an object store\n", s->file);
+        return -1;
+    }
+    if (h->version != STORE_VERSION) {
+        fprintf(stderr, "%s: unsupported store version %u\n", s->file, h->version);
+        return -1;
+    }
+    if (h->size > (uint64_t)st.st_size || h->pool + h->pool_size > h->size) {
+        fprintf(stderr, "%s: truncated object store\n", s->file);
+        return -1;
+    }
+    s->node_loc  = (const int32_t *)(s->map + h->node_loc);
+    s->way_index = (const uint64_t *)(s->map + h->way_index);
+    s->rel_index = (const uint64_t *)(s->map + h->rel_index);
+    s->node_tags = (const struct store_id_off *)(s->map + h->node_tags);
+    s->pool      = (const char *)(s->map + h->pool);
+    s->delta     = h->delta;
+    return 0;
+}
+
+static void store_unmap(OSM_Store *s) {
+    if (s->map != NULL)
+        munmap((void *)s->map, s->map_size);
+    if (s->fd != -1)
+        close(s->fd);
+    s->map = NULL;
+    s->fd  = -1;
+}
+
+OSM_Store *osm_store_open(const char *file) {
+    OSM_Store *s = calloc(1, sizeof(OSM_Store));
+    if (s == NULL) {
+        fprintf(stderr, "failed to malloc store: %s\n", strerror(errno));
+        return (OSM_Store *)NULL;
+    }
+    s->fd   = -1;
+    s->file = strdup(file);
+    if (s->file == NULL || store_map(s) != 0) {
+        osm_store_close(s);
+        return (OSM_Store *)NULL;
+    }
+    return s;
+}
+
+void osm_store_close(OSM_Store *s) {
+    if (s == NULL)
+        return;
+    store_unmap(s);
+    free(s->file);
+    free(s);
+}
+
+/*
+ * map the store again if it was compacted or the updates outgrew the
+ * reserve. Returns 1 if it was remapped, 0 if not needed, -1 on error.
+ * Must not run concurrently with lookups on the same OSM_Store.
+ */
+int osm_store_refresh(OSM_Store *s) {
+    struct stat st, cur;
+    if (stat(s->file, &st) != 0 || fstat(s->fd, &cur) != 0) {
+        fprintf(stderr, "failed to stat %s: %s\n", s->file, strerror(errno));
+        return -1;
+    }
+    if (st.st_ino == cur.st_ino && st.st_dev == cur.st_dev
+        && __atomic_load_n(&s->hdr->size, __ATOMIC_ACQUIRE) <= s->map_size)
+        return 0;
+    store_unmap(s);
+    return store_map(s) == 0 ? 1 : -1;
+}
+
+/* the current delta table, if it is inside the mapping */
+static const struct store_delta *store_delta(OSM_Store *s) {
+    uint64_t off = __atomic_load_n(&s->hdr->delta, __ATOMIC_ACQUIRE);
+    if (off != s->delta) {
+        const struct store_delta *d = (const struct store_delta *)(s->map + off);
+        if (off + sizeof(struct store_delta) <= s->map_size
+            && off + sizeof(struct store_delta)
+                    + sizeof(struct store_delta_entry)
+                        * (d->num[0] + d->num[1] + d->num[2]) <= s->map_size)
+            __atomic_store_n(&s->delta, off, __ATOMIC_RELAXED);
+        else
+            off = s->delta;
+    }
+    if (off == 0)
+        return NULL;
+    return (const struct store_delta *)(s->map + off);
+}
+
+/* the table before d, it is older, so inside the mapping if d is */
+static const struct store_delta *store_delta_prev(OSM_Store *s, const struct store_delta *d) {
+    if (d->prev == 0)
+        return NULL;
+    return (const struct store_delta *)(s->map + d->prev);
+}
+
+static uint64_t store_delta_num(const struct store_delta *d) {
+    return d->num[store_nodes] + d->num[store_ways] + d->num[store_relations];
+}
+
+static const struct store_delta_entry *store_delta_entries(const struct store_delta *d, int type) {
+    const struct store_delta_entry *e = (const struct store_delta_entry *)(d + 1);
+    int t;
+    for (t=0; t<type; t++)
+        e += d->num[t];
+    return e;
+}
+
+/* the newest delta entry of id, NULL if it was not changed */
+static const struct store_delta_entry *store_changed(OSM_Store *s, int type, uint64_t id) {
+    const struct store_delta *d;
+    const struct store_delta_entry *e;
+
+    for (d=store_delta(s); d!=NULL; d=store_delta_prev(s, d)) {
+        uint64_t lo = 0, hi = d->num[type];
+        e = store_delta_entries(d, type);
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            if (e[mid].id < id)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo < d->num[type] && e[lo].id == id)
+            return &e[lo];
+    }
+    return NULL;
+}
+
+/* the osm_store_get_*() return 1 and fill the view if the object exists */
+int osm_store_get_node(OSM_Store *s, uint64_t id, struct osm_store_node *n) {
+    const struct store_delta_entry *e = store_changed(s, store_nodes, id);
+    const struct store_node_blob *blob = NULL;
+    uint64_t lo = 0, hi = s->hdr->num_node_tags;
+
+    n->id       = id;
+    n->version  = 0;
+    n->num_tags = 0;
+    n->tags     = NULL;
+    n->pool     = s->pool;
+    if (e != NULL) {
+        if (e->off == STORE_DELETED)
+            return 0;
+        blob    = (const struct store_node_blob *)(s->map + e->off);
+        n->pool = (const char *)(s->map + e->pool);
+        n->lat  = blob->lat / STORE_DEGREE;
+        n->lon  = blob->lon / STORE_DEGREE;
+    }
+    else {
+        if (id > s->hdr->max_node || s->node_loc[2 * id] == 0)
+            return 0;
+        n->lat = (s->node_loc[2 * id] - STORE_LAT_BIAS) / STORE_DEGREE;
+        n->lon = s->node_loc[2 * id + 1] / STORE_DEGREE;
+
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            if (s->node_tags[mid].id < id)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo < s->hdr->num_node_tags && s->node_tags[lo].id == id)
+            blob = (const struct store_node_blob *)(s->map + s->node_tags[lo].off);
+    }
+    if (blob != NULL) {
+        n->version  = blob->version;
+        n->num_tags = blob->num_tags;
+        n->tags     = (const uint32_t *)(blob + 1);
+    }
+    return 1;
+}
+
+int osm_store_get_way(OSM_Store *s, uint64_t id, struct osm_store_way *w) {
+    const struct store_delta_entry *e = store_changed(s, store_ways, id);
+    const struct store_way_blob *blob;
+    w->pool = s->pool;
+    if (e != NULL) {
+        if (e->off == STORE_DELETED)
+            return 0;
+        blob    = (const struct store_way_blob *)(s->map + e->off);
+        w->pool = (const char *)(s->map + e->pool);
+    }
+    else {
+        if (id > s->hdr->max_way || s->way_index[id] == 0)
+            return 0;
+        blob = (const struct store_way_blob *)(s->map + s->way_index[id]);
+    }
+    w->id       = id;
+    w->version  = blob->version;
+    w->num_refs = blob->num_refs;
+    w->refs     = (const uint64_t *)(blob + 1);
+    w->num_tags = blob->num_tags;
+    w->tags     = (const uint32_t *)(w->refs + blob->num_refs);
+    return 1;
+}
+
+int osm_store_get_relation(OSM_Store *s, uint64_t id, struct osm_store_relation *r) {
+    const struct store_delta_entry *e = store_changed(s, store_relations, id);
+    const struct store_rel_blob *blob;
+    r->pool = s->pool;
+    if (e != NULL) {
+        if (e->off == STORE_DELETED)
+            return 0;
+        blob    = (const struct store_rel_blob *)(s->map + e->off);
+        r->pool = (const char *)(s->map + e->pool);
+    }
+    else {
+        if (id > s->hdr->max_rel || s->rel_index[id] == 0)
+            return 0;
+        blob = (const struct store_rel_blob *)(s->map + s->rel_index[id]);
+    }
+    r->id          = id;
+    r->version     = blob->version;
+    r->num_members = blob->num_members;
+    r->members     = (const struct osm_store_member *)(blob + 1);
+    r->num_tags    = blob->num_tags;
+    r->tags        = (const uint32_t *)(r->members + blob->num_members);
+    return 1;
+}
+
+/*
+ * open and flock() the store for writing. A compaction may have replaced
+ * the file while we waited for the lock, then the new one is locked.
+ */
+static int store_lock(const char *file) {
+    struct stat st, cur;
+    while (1) {
+        int fd = open(file, O_RDWR);
+        if (fd == -1) {
+            fprintf(stderr, "failed to open %s: %s\n", file, strerror(errno));
+            return -1;
+        }
+        if (flock(fd, LOCK_EX) != 0) {
+            fprintf(stderr, "failed to lock %s: %s\n", file, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        if (stat(file, &st) == 0 && fstat(fd, &cur) == 0
+            && st.st_ino == cur.st_ino && st.st_dev == cur.st_dev)
+            return fd;
+        close(fd);
+    }
+}
+
+/* rebuild the store from its current state, the lock is held */
+static int store_compact(const char *file) {
+    struct store_build b;
+    OSM_Store *s;
+    const struct store_delta *d;
+    uint64_t id;
+    uint32_t i;
+    int ret = -1;
+
+    s = osm_store_open(file);
+    if (s == NULL)
+        return -1;
+    memset(&b, 0, sizeof(b));
+    b.fd       = -1;
+    b.max_node = s->hdr->max_node;
+    b.max_way  = s->hdr->max_way;
+    b.max_rel  = s->hdr->max_rel;
+    for (d=store_delta(s); d!=NULL; d=store_delta_prev(s, d)) {
+        /* the entries are sorted, the last is the largest id */
+        if (d->num[store_nodes] && store_delta_entries(d, store_nodes)[d->num[store_nodes]-1].id > b.max_node)
+            b.max_node = store_delta_entries(d, store_nodes)[d->num[store_nodes]-1].id;
+        if (d->num[store_ways] && store_delta_entries(d, store_ways)[d->num[store_ways]-1].id > b.max_way)
+            b.max_way = store_delta_entries(d, store_ways)[d->num[store_ways]-1].id;
+        if (d->num[store_relations] && store_delta_entries(d, store_relations)[d->num[store_relations]-1].id > b.max_rel)
+            b.max_rel = store_delta_entries(d, store_relations)[d->num[store_relations]-1].id;
+    }
+    if (store_begin(&b, file) != 0)
+        goto done;
+
+    for (id=1; id<=b.max_node && !b.failed; id++) {
+        struct osm_store_node n;
+        uint32_t *tags;
+        if (!osm_store_get_node(s, id, &n))
+            continue;
+        tags = store_view_tags(&b, n.pool, n.tags, n.num_tags);
+        if (tags != NULL)
+            store_put_node(&b, id, n.lat, n.lon, n.version, tags, n.num_tags);
+        free(tags);
+    }
+    for (id=1; id<=b.max_way && !b.failed; id++) {
+        struct osm_store_way w;
+        uint32_t *tags;
+        if (!osm_store_get_way(s, id, &w))
+            continue;
+        tags = store_view_tags(&b, w.pool, w.tags, w.num_tags);
+        if (tags != NULL)
+            b.way_index[id] = store_way_blob(&b, w.version, w.refs, w.num_refs,
+                                                tags, w.num_tags);
+        free(tags);
+    }
+    for (id=1; id<=b.max_rel && !b.failed; id++) {
+        struct osm_store_relation r;
+        struct osm_store_member *mem;
+        uint32_t *tags;
+        if (!osm_store_get_relation(s, id, &r))
+            continue;
+        tags = store_view_tags(&b, r.pool, r.tags, r.num_tags);
+        mem  = malloc(sizeof(struct osm_store_member) * (r.num_members + 1));
+        if (tags != NULL && mem != NULL) {
+            for (i=0; i<r.num_members; i++) {
+                mem[i]      = r.members[i];
+                mem[i].role = store_string(&b, r.pool + r.members[i].role);
+            }
+            b.rel_index[id] = store_rel_blob(&b, r.version, mem, r.num_members,
+                                                tags, r.num_tags);
+        }
+        else
+            b.failed = 1;
+        free(tags);
+        free(mem);
+    }
+    if (!b.failed && store_finish(&b) == 0)
+        ret = 0;
+
+  done:
+    store_cleanup(&b, ret != 0);
+    osm_store_close(s);
+    return ret;
+}
+
+int osm_store_compact(const char *file) {
+    int fd = store_lock(file), ret;
+    if (fd == -1)
+        return -1;
+    ret = store_compact(file);
+    close(fd);
+    return ret;
+}
+
+/* the delta entries of the changes of a type in the diff */
+static struct store_delta_entry *store_changes(struct store_build *b, int type,
+                            struct osm_change_list *l, uint64_t *num)
+{
+    struct store_delta_entry *res;
+    uint64_t j;
+
+    res = malloc(sizeof(struct store_delta_entry) * (l->num + 1));
+    if (res == NULL) {
+        fprintf(stderr, "failed to malloc delta: %s\n", strerror(errno));
+        b->failed = 1;
+        return NULL;
+    }
+    for (j=0; j<l->num && !b->failed; j++) {
+        struct osm_change *c = &l->data[j];
+        if (store_check_id(type == store_nodes ? "node"
+                            : type == store_ways ? "way" : "relation", c->id) != 0) {
+            b->failed = 1;
+            break;
+        }
+        res[j].id   = c->id;
+        res[j].pool = 0;    /* set when the pool is written */
+        if (c->action == OSM_CHANGE_DELETE)
+            res[j].off = STORE_DELETED;
+        else if (type == store_nodes)
+            res[j].off = store_osm_node(b, c->obj);
+        else if (type == store_ways)
+            res[j].off = store_osm_way(b, c->obj);
+        else
+            res[j].off = store_osm_relation(b, c->obj);
+    }
+    *num = j;
+    return res;
+}
+
+/* merge the entries of a type of the older table d into e, e wins */
+static struct store_delta_entry *store_merge(struct store_build *b, int type,
+                            const struct store_delta *d, struct store_delta_entry *e,
+                            uint64_t *num)
+{
+    const struct store_delta_entry *old = store_delta_entries(d, type);
+    struct store_delta_entry *res;
+    uint64_t i = 0, j = 0, n = 0, num_old = d->num[type];
+
+    res = malloc(sizeof(struct store_delta_entry) * (num_old + *num + 1));
+    if (res == NULL) {
+        fprintf(stderr, "failed to malloc delta: %s\n", strerror(errno));
+        b->failed = 1;
+        return e;
+    }
+    while (i < num_old || j < *num) {
+        if (j == *num || (i < num_old && old[i].id < e[j].id)) {
+            res[n++] = old[i++];
+            continue;
+        }
+        if (i < num_old && old[i].id == e[j].id)
+            ++i;    /* replaced by the newer one */
+        res[n++] = e[j++];
+    }
+    free(e);
+    *num = n;
+    return res;
+}
+
+/*
+ * apply the (squashed) diff d to the store, see above. Concurrent readers
+ * keep working, other updates wait.
+ */
+int osm_store_update(const char *file, OSM_Diff *d) {
+    struct store_build b;
+    struct store_header *hdr = NULL;
+    struct store_delta delta;
+    struct store_delta_entry *entries[store_types] = { NULL, NULL, NULL };
+    const struct store_delta *old;
+    OSM_Store *s = NULL;
+    uint64_t pool, off, base_size, size, total;
+    int type, ret = -1, compact = 0, merged = 0;
+
+    memset(&b, 0, sizeof(b));
+    b.fd = store_lock(file);
+    if (b.fd == -1)
+        return -1;
+    s = osm_store_open(file);
+    if (s == NULL)
+        goto done;
+
+    /* cut what a crashed update left behind */
+    if (ftruncate(b.fd, s->hdr->size) != 0
+        || (b.out = fdopen(dup(b.fd), "r+")) == NULL
+        || fseeko(b.out, s->hdr->size, SEEK_SET) != 0)
+    {
+        fprintf(stderr, "failed to write %s: %s\n", file, strerror(errno));
+        goto done;
+    }
+    b.pos = s->hdr->size;
+    if (store_init_pool(&b) != 0)
+        goto done;
+
+    entries[store_nodes]     = store_changes(&b, store_nodes, &d->nodes,
+                                    &delta.num[store_nodes]);
+    entries[store_ways]      = store_changes(&b, store_ways, &d->ways,
+                                    &delta.num[store_ways]);
+    entries[store_relations] = store_changes(&b, store_relations, &d->relations,
+                                    &delta.num[store_relations]);
+    /* take the newest tables over while they are not larger than ours */
+    total = store_delta_num(&delta);
+    for (old=store_delta(s); old!=NULL && !b.failed; old=store_delta_prev(s, old)) {
+        if (store_delta_num(old) > total)
+            break;
+        for (type=0; type<store_types; type++)
+            entries[type] = store_merge(&b, type, old, entries[type], &delta.num[type]);
+        total = store_delta_num(&delta);
+        ++merged;
+    }
+    delta.prev = old != NULL ? (uint64_t)((const uint8_t *)old - s->map) : 0;
+    if (b.failed)
+        goto done;
+    pool = store_write(&b, b.pool, b.pool_size);
+    for (type=0; type<store_types; type++) {
+        uint64_t i;
+        for (i=0; i<delta.num[type]; i++)
+            if (entries[type][i].pool == 0)
+                entries[type][i].pool = pool;
+    }
+    off = store_write(&b, &delta, sizeof(delta));
+    for (type=0; type<store_types; type++)
+        store_write(&b, entries[type], sizeof(struct store_delta_entry) * delta.num[type]);
+    if (b.failed || fflush(b.out) != 0 || fdatasync(b.fd) != 0) {
+        fprintf(stderr, "failed to write %s: %s\n", file, strerror(errno));
+        goto done;
+    }
+
+    /* publish: everything is on disk, now switch the readers */
+    hdr = mmap(NULL, STORE_PAGE, PROT_READ|PROT_WRITE, MAP_SHARED, b.fd, 0);
+    if (hdr == MAP_FAILED) {
+        fprintf(stderr, "failed to mmap %s: %s\n", file, strerror(errno));
+        hdr = NULL;
+        goto done;
+    }
+    __atomic_store_n(&hdr->size, b.pos, __ATOMIC_RELEASE);
+    __atomic_store_n(&hdr->delta, off, __ATOMIC_RELEASE);
+    if (msync(hdr, STORE_PAGE, MS_SYNC) != 0) {
+        fprintf(stderr, "failed to sync %s: %s\n", file, strerror(errno));
+        goto done;
+    }
+    base_size = hdr->base_size;
+    size      = b.pos;
+    compact   = (size - base_size) * STORE_COMPACT > base_size;
+    if (debug)
+        fprintf(stderr, "%s:%d:%s(): %s: %lu/%lu/%lu objects in the new delta table "
+                        "(%d older merged), %lu bytes of updates\n",
+                        __FILE__, __LINE__, __FUNCTION__, file,
+                        delta.num[store_nodes], delta.num[store_ways],
+                        delta.num[store_relations], merged, size - base_size);
+    ret = 0;
+
+  done:
+    if (hdr != NULL)
+        munmap(hdr, STORE_PAGE);
+    osm_store_close(s);
+    for (type=0; type<store_types; type++)
+        free(entries[type]);
+    if (ret == 0 && compact)
+        ret = store_compact(file);
+    store_cleanup(&b, 0);
+    return ret;
+}
+
+/* END */
@@ -0,0 +1,864 @@
+/*
+ * tagstats.c - key and tag statistics per object type
+ *
+ * For nodes, ways and relations each:
+ *   - the number of objects and of objects with tags,
+ *   - per key the number of objects with it and the number of distinct
+ *     values, exact up to TAGSTATS_SPARSE values, above a HyperLogLog
+ *     estimate with TAGSTATS_HLL_SIZE registers (~3% error),
+ *   - the most common key=value pairs, found with Space-Saving counters
+ *     (4 * top per type and thread). The count of a pair is an upper
+ *     bound, count - error a lower bound of the real number. With more
+ *     than one thread the bounds depend on which thread got which block.
+ *
+ * The .osm.pbf blocks are read by the calling thread and unpacked and
+ * counted by all threads, each into its own tables, which are merged at
+ * the end. Keys and values are taken from the string table of a block: a
+ * key string is looked up once per block, not once per tag, values are
+ * only hashed (once per block), their string is copied when they enter
+ * the top list. .osm XML files are counted by the calling thread.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#define _GNU_SOURCE /* strndup */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "osm.h"
+
+#define TAGSTATS_TYPES    3     /* OSM_REL_MEMBER_TYPE_* - 1 */
+#define TAGSTATS_HLL_BITS 10
+#define TAGSTATS_HLL_SIZE (1 << TAGSTATS_HLL_BITS)
+#define TAGSTATS_SPARSE   32    /* exact hashes before the registers are used */
+#define TAGSTATS_SLACK    4     /* counters per top entry */
+#define TAGSTATS_BATCH    4     /* blocks per thread and batch */
+
+static const char *tagstats_types[TAGSTATS_TYPES] = { "node", "way", "relation" };
+
+struct tagstats_hll {
+    uint32_t  num;      /* hashes in sparse */
+    uint64_t *sparse;
+    uint8_t  *reg;      /* NULL while sparse */
+};
+
+struct tagstats_key {
+    char    *key;
+    uint64_t count[TAGSTATS_TYPES];
+    struct tagstats_hll values[TAGSTATS_TYPES];
+};
+
+struct tagstats_entry {
+    uint64_t item;      /* hash of key and value */
+    uint64_t vhash;
+    uint32_t key;       /* index in keys */
+    uint32_t slot;      /* index in slots */
+    char    *val;
+    uint64_t count;
+    uint64_t error;
+    uint64_t floor;     /* merge: sum of the minimums of the parts with it */
+};
+
+/* Space-Saving counters: a min heap by count, found by item in slots */
+struct tagstats_top {
+    uint32_t num;
+    uint32_t size;
+    struct tagstats_entry *heap;
+    uint32_t *slots;    /* heap index + 1, 0: empty */
+    uint32_t  mask;
+};
+
+struct tagstats_part {
+    struct tagstats_key *keys;
+    uint32_t  num_keys;
+    uint32_t  size_keys;
+    uint32_t *hash;     /* key index + 1, 0: empty */
+    uint32_t  mask;
+    struct tagstats_top top[TAGSTATS_TYPES];
+    uint64_t  objects[TAGSTATS_TYPES];
+    uint64_t  tagged[TAGSTATS_TYPES];
+    int64_t  *sid_key;  /* per string table id of the block, -1: unknown */
+    uint64_t *sid_hash; /* 0: unknown */
+    uint32_t  sid_size;
+    int       failed;
+};
+
+struct _osm_tag_stats {
+    struct tagstats_part all;
+    uint32_t top;
+    struct osm_sort_pair *keys[TAGSTATS_TYPES];   /* by count */
+    uint32_t num_keys[TAGSTATS_TYPES];
+    struct osm_sort_pair *tags[TAGSTATS_TYPES];   /* by count, val is the heap index */
+    uint32_t num_tags[TAGSTATS_TYPES];
+};
+
+struct tagstats_job {
+    struct osm_pbf_raw *raw;
+    uint32_t num;
+    uint32_t next;
+    struct tagstats_part *parts;
+};
+
+static uint64_t tagstats_hash(const char *s, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (len--) {
+        h ^= (uint8_t)*s++;
+        h *= 0x100000001b3ULL;
+    }
+    /* the HyperLogLog takes the register from the high bits */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h ? h : 1;
+}
+
+static void hll_set(uint8_t *reg, uint64_t h) {
+    uint32_t j = h >> (64 - TAGSTATS_HLL_BITS);
+    uint8_t rank = __builtin_clzll((h << TAGSTATS_HLL_BITS)
+                                    | (1ULL << (TAGSTATS_HLL_BITS - 1))) + 1;
+    if (rank > reg[j])
+        reg[j] = rank;
+}
+
+static int hll_dense(struct tagstats_hll *H) {
+    uint32_t i;
+    H->reg = calloc(TAGSTATS_HLL_SIZE, 1);
+    if (H->reg == NULL) {
+        fprintf(stderr, "failed to malloc HyperLogLog registers: %s\n", strerror(errno));
+        return -1;
+    }
+    for (i=0; i<H->num; i++)
+        hll_set(H->reg, H->sparse[i]);
+    free(H->sparse);
+    H->sparse = NULL;
+    H->num    = 0;
+    return 0;
+}
+
+static int hll_add(struct tagstats_hll *H, uint64_t h) {
+    uint32_t i;
+    if (H->reg != NULL) {
+        hll_set(H->reg, h);
+        return 0;
+    }
+    for (i=0; i<H->num; i++) {
+        if (H->sparse[i] == h)
+            return 0;
+    }
+    if (H->num == TAGSTATS_SPARSE) {
+        if (hll_dense(H) != 0)
+            return -1;
+        hll_set(H->reg, h);
+        return 0;
+    }
+    if (H->sparse == NULL) {
+        H->sparse = malloc(sizeof(uint64_t) * TAGSTATS_SPARSE);
+        if (H->sparse == NULL) {
+            fprintf(stderr, "failed to malloc value hashes: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    H->sparse[ H->num++ ] = h;
+    return 0;
+}
+
+static int hll_merge(struct tagstats_hll *dst, struct tagstats_hll *src) {
+    uint32_t i;
+    if (src->reg == NULL) {
+        for (i=0; i<src->num; i++) {
+            if (hll_add(dst, src->sparse[i]) != 0)
+                return -1;
+        }
+        return 0;
+    }
+    if (dst->reg == NULL && hll_dense(dst) != 0)
+        return -1;
+    for (i=0; i<TAGSTATS_HLL_SIZE; i++) {
+        if (src->reg[i] > dst->reg[i])
+            dst->reg[i] = src->reg[i];
+    }
+    return 0;
+}
+
+static uint64_t hll_count(struct tagstats_hll *H) {
+    double m = TAGSTATS_HLL_SIZE, sum = 0, e;
+    uint32_t i, zeros = 0;
+    if (H->reg == NULL)
+        return H->num;
+    for (i=0; i<TAGSTATS_HLL_SIZE; i++) {
+        sum += ldexp(1.0, -H->reg[i]);
+        zeros += H->reg[i] == 0;
+    }
+    e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    if (e <= 2.5 * m && zeros)
+        e = m * log(m / zeros);
+    return (uint64_t)llround(e);
+}
+
+static void hll_free(struct tagstats_hll *H) {
+    free(H->sparse);
+    free(H->reg);
+}
+
+static int top_init(struct tagstats_top *t, uint32_t size) {
+    uint32_t slots = 16;
+    while (slots < size * 2)
+        slots *= 2;
+    t->num   = 0;
+    t->size  = size;
+    t->mask  = slots - 1;
+    t->heap  = malloc(sizeof(struct tagstats_entry) * size);
+    t->slots = calloc(slots, sizeof(uint32_t));
+    if (t->heap == NULL || t->slots == NULL) {
+        fprintf(stderr, "failed to malloc top counters: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void top_free(struct tagstats_top *t) {
+    uint32_t i;
+    for (i=0; i<t->num; i++)
+        free(t->heap[i].val);
+    free(t->heap);
+    free(t->slots);
+}
+
+static void top_swap(struct tagstats_top *t, uint32_t a, uint32_t b) {
+    struct tagstats_entry e = t->heap[a];
+    t->heap[a] = t->heap[b];
+    t->heap[b] = e;
+    t->slots[ t->heap[a].slot ] = a + 1;
+    t->slots[ t->heap[b].slot ] = b + 1;
+}
+
+static void top_up(struct tagstats_top *t, uint32_t i) {
+    while (i > 0 && t->heap[(i - 1) / 2].count > t->heap[i].count) {
+        top_swap(t, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void top_down(struct tagstats_top *t, uint32_t i) {
+    uint32_t c;
+    while ((c = 2 * i + 1) < t->num) {
+        if (c + 1 < t->num && t->heap[c + 1].count < t->heap[c].count)
+            c += 1;
+        if (t->heap[i].count <= t->heap[c].count)
+            break;
+        top_swap(t, i, c);
+        i = c;
+    }
+}
+
+/* the slot of item, or the empty one where it would be */
+static uint32_t top_slot(struct tagstats_top *t, uint64_t item) {
+    uint32_t s = item & t->mask;
+    while (t->slots[s] != 0 && t->heap[ t->slots[s] - 1 ].item != item)
+        s = (s + 1) & t->mask;
+    return s;
+}
+
+/* empty slot s, moving the following entries back into the gap */
+static void top_unslot(struct tagstats_top *t, uint32_t s) {
+    uint32_t j = s, home;
+    while (1) {
+        j = (j + 1) & t->mask;
+        if (t->slots[j] == 0)
+            break;
+        home = t->heap[ t->slots[j] - 1 ].item & t->mask;
+        if (s <= j ? (s < home && home <= j) : (s < home || home <= j))
+            continue;
+        t->slots[s] = t->slots[j];
+        t->heap[ t->slots[s] - 1 ].slot = s;
+        s = j;
+    }
+    t->slots[s] = 0;
+}
+
+static struct tagstats_entry *top_insert(struct tagstats_top *t, uint32_t s, uint64_t item,
+                                            uint32_t key, uint64_t vhash, char *val)
+{
+    struct tagstats_entry *e = &t->heap[t->num];
+    e->item  = item;
+    e->vhash = vhash;
+    e->key   = key;
+    e->slot  = s;
+    e->val   = val;
+    e->count = 0;
+    e->error = 0;
+    e->floor = 0;
+    t->slots[s] = ++t->num;
+    return e;
+}
+
+static uint64_t top_item(uint32_t key, uint64_t vhash) {
+    return vhash ^ ((uint64_t)(key + 1) * 0x9e3779b97f4a7c15ULL);
+}
+
+/* count key=val once */
+static int top_add(struct tagstats_top *t, uint32_t key, uint64_t vhash,
+                    const char *val, size_t len)
+{
+    uint64_t item = top_item(key, vhash);
+    uint32_t s = top_slot(t, item);
+    struct tagstats_entry *e;
+    char *v;
+
+    if (t->slots[s] != 0) {
+        e = &t->heap[ t->slots[s] - 1 ];
+        e->count += 1;
+        top_down(t, t->slots[s] - 1);
+        return 0;
+    }
+    v = strndup(val, len);
+    if (v == NULL) {
+        fprintf(stderr, "failed to malloc tag value: %s\n", strerror(errno));
+        return -1;
+    }
+    if (t->num < t->size) {
+        e = top_insert(t, s, item, key, vhash, v);
+        e->count = 1;
+        top_up(t, t->num - 1);
+        return 0;
+    }
+
+    /* the new pair replaces the least counted, inheriting its count */
+    e = &t->heap[0];
+    top_unslot(t, e->slot);
+    free(e->val);
+    e->item  = item;
+    e->vhash = vhash;
+    e->key   = key;
+    e->val   = v;
+    e->error = e->count;
+    e->count += 1;
+    e->slot  = top_slot(t, item);
+    t->slots[e->slot] = 1;
+    top_down(t, 0);
+    return 0;
+}
+
+static int part_init(struct tagstats_part *p, uint32_t top) {
+    int i;
+    memset(p, 0, sizeof(struct tagstats_part));
+    p->mask = 1023;
+    p->hash = calloc(p->mask + 1, sizeof(uint32_t));
+    if (p->hash == NULL) {
+        fprintf(stderr, "failed to malloc key hash: %s\n", strerror(errno));
+        return -1;
+    }
+    for (i=0; i<TAGSTATS_TYPES; i++) {
+        if (top_init(&p->top[i], top) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void part_free(struct tagstats_part *p) {
+    uint32_t i;
+    int t;
+    for (i=0; i<p->num_keys; i++) {
+        free(p->keys[i].key);
+        for (t=0; t<TAGSTATS_TYPES; t++)
+            hll_free(&p->keys[i].values[t]);
+    }
+    for (t=0; t<TAGSTATS_TYPES; t++)
+        top_free(&p->top[t]);
+    free(p->keys);
+    free(p->hash);
+    free(p->sid_key);
+    free(p->sid_hash);
+}
+
+static int part_grow_keys(struct tagstats_part *p) {
+    uint32_t size = (p->mask + 1) * 2, mask = size - 1, i, h;
+    uint32_t *tmp = calloc(size, sizeof(uint32_t));
+    if (tmp == NULL) {
+        fprintf(stderr, "failed to malloc key hash: %s\n", strerror(errno));
+        return -1;
+    }
+    for (i=0; i<p->num_keys; i++) {
+        h = tagstats_hash(p->keys[i].key, strlen(p->keys[i].key)) & mask;
+        while (tmp[h] != 0)
+            h = (h + 1) & mask;
+        tmp[h] = i + 1;
+    }
+    free(p->hash);
+    p->hash = tmp;
+    p->mask = mask;
+    return 0;
+}
+
+/* index of the key, added if it is new, -1 on errors */
+static int64_t part_key(struct tagstats_part *p, const char *key, size_t len) {
+    struct tagstats_key *k;
+    uint32_t h, i;
+
+    if ((p->num_keys + 1) * 2 > p->mask + 1 && part_grow_keys(p) != 0)
+        return -1;
+    h = tagstats_hash(key, len) & p->mask;
+    while ((i = p->hash[h]) != 0) {
+        k = &p->keys[i - 1];
+        if (strncmp(k->key, key, len) == 0 && k->key[len] == '\0')
+            return i - 1;
+        h = (h + 1) & p->mask;
+    }
+    if (p->num_keys == p->size_keys) {
+        uint32_t size = p->size_keys ? p->size_keys * 2 : 1024;
+        k = realloc(p->keys, sizeof(struct tagstats_key) * size);
+        if (k == NULL) {
+            fprintf(stderr, "failed to malloc keys: %s\n", strerror(errno));
+            return -1;
+        }
+        p->keys      = k;
+        p->size_keys = size;
+    }
+    k = &p->keys[p->num_keys];
+    memset(k, 0, sizeof(struct tagstats_key));
+    k->key = strndup(key, len);
+    if (k->key == NULL) {
+        fprintf(stderr, "failed to malloc key: %s\n", strerror(errno));
+        return -1;
+    }
+    p->hash[h] = ++p->num_keys;
+    return p->num_keys - 1;
+}
+
+static void part_tag(struct tagstats_part *p, int type, int64_t key, uint64_t vhash,
+                        const char *val, size_t len)
+{
+    struct tagstats_key *k;
+    if (key < 0) {
+        p->failed = 1;
+        return;
+    }
+    k = &p->keys[key];
+    k->count[type] += 1;
+    if (hll_add(&k->values[type], vhash) != 0
+        || top_add(&p->top[type], key, vhash, val, len) != 0)
+        p->failed = 1;
+}
+
+/* the per block caches for n string table ids */
+static int part_block(struct tagstats_part *p, uint32_t n) {
+    if (n > p->sid_size) {
+        free(p->sid_key);
+        free(p->sid_hash);
+        p->sid_key  = malloc(sizeof(int64_t) * n);
+        p->sid_hash = malloc(sizeof(uint64_t) * n);
+        p->sid_size = n;
+        if (p->sid_key == NULL || p->sid_hash == NULL) {
+            fprintf(stderr, "failed to malloc string table cache: %s\n", strerror(errno));
+            p->sid_size = 0;
+            return -1;
+        }
+    }
+    memset(p->sid_key, 0xff, sizeof(int64_t) * n);
+    memset(p->sid_hash, 0, sizeof(uint64_t) * n);
+    return 0;
+}
+
+static void part_pbf_tag(struct tagstats_part *p, StringTable *st, int type,
+                            uint32_t ksid, uint32_t vsid)
+{
+    ProtobufCBinaryData *k, *v;
+    if (ksid >= st->n_s || vsid >= st->n_s)
+        return;
+    k = &st->s[ksid];
+    v = &st->s[vsid];
+    if (p->sid_key[ksid] < 0)
+        p->sid_key[ksid] = part_key(p, (const char *)k->data, k->len);
+    if (p->sid_hash[vsid] == 0)
+        p->sid_hash[vsid] = tagstats_hash((const char *)v->data, v->len);
+    part_tag(p, type, p->sid_key[ksid], p->sid_hash[vsid], (const char *)v->data, v->len);
+}
+
+static void part_pbf_tags(struct tagstats_part *p, StringTable *st, int type,
+                            size_t n, uint32_t *keys, uint32_t *vals)
+{
+    size_t i;
+    p->objects[type] += 1;
+    if (n)
+        p->tagged[type] += 1;
+    for (i=0; i<n; i++)
+        part_pbf_tag(p, st, type, keys[i], vals[i]);
+}
+
+/* count the objects of a block, by their string table ids */
+static void part_pbf(struct tagstats_part *p, PrimitiveBlock *P) {
+    StringTable *st = P->stringtable;
+    unsigned int j;
+    size_t i, k;
+
+    if (part_block(p, st->n_s) != 0) {
+        p->failed = 1;
+        return;
+    }
+    for (j=0; j<P->n_primitivegroup; j++) {
+        PrimitiveGroup *G = P->primitivegroup[j];
+        if (G->dense) {
+            DenseNodes *D = G->dense;
+            for (i=0, k=0; i<D->n_id; i++) {
+                p->objects[0] += 1;
+                if (k < D->n_keys_vals && D->keys_vals[k] != 0)
+                    p->tagged[0] += 1;
+                while (k + 1 < D->n_keys_vals && D->keys_vals[k] != 0) {
+                    part_pbf_tag(p, st, 0, D->keys_vals[k], D->keys_vals[k + 1]);
+                    k += 2;
+                }
+                k += 1; /* the 0 after the node's tags */
+            }
+        }
+        for (i=0; i<G->n_nodes; i++)
+            part_pbf_tags(p, st, 0, G->nodes[i]->n_keys, G->nodes[i]->keys, G->nodes[i]->vals);
+        for (i=0; i<G->n_ways; i++)
+            part_pbf_tags(p, st, 1, G->ways[i]->n_keys, G->ways[i]->keys, G->ways[i]->vals);
+        for (i=0; i<G->n_relations; i++)
+            part_pbf_tags(p, st, 2, G->relations[i]->n_keys,
+                            G->relations[i]->keys, G->relations[i]->vals);
+    }
+}
+
+static void part_tags(struct tagstats_part *p, int type, OSM_Tag_List *tags) {
+    uint32_t i;
+    p->objects[type] += 1;
+    if (tags == NULL || tags->num == 0)
+        return;
+    p->tagged[type] += 1;
+    for (i=0; i<tags->num; i++) {
+        char *key = tags->data[i].key, *val = tags->data[i].val;
+        if (val == NULL)
+            val = "";
+        part_tag(p, type, part_key(p, key, strlen(key)),
+                    tagstats_hash(val, strlen(val)), val, strlen(val));
+    }
+}
+
+/* osm_scan() callback for XML files */
+static int tagstats_block(OSM_Data *d, void *ctx) {
+    struct tagstats_part *p = ctx;
+    uint32_t i;
+    for (i=0; i<d->nodes->num; i++)
+        part_tags(p, 0, d->nodes->data[i]->tags);
+    for (i=0; i<d->ways->num; i++)
+        part_tags(p, 1, d->ways->data[i]->tags);
+    for (i=0; i<d->relations->num; i++)
+        part_tags(p, 2, d->relations->data[i]->tags);
+    return p->failed ? -1 : 0;
+}
+
+static void tagstats_worker(int id, int num, void *arg) {
+    struct tagstats_job *job = arg;
+    struct tagstats_part *p = &job->parts[id];
+    uint32_t i;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->num) {
+        PrimitiveBlock *P = osm_pbf_unpack_raw(&job->raw[i]);
+        if (P == NULL) {
+            p->failed = 1;
+            continue;
+        }
+        part_pbf(p, P);
+        osm_pbf_free_primitive(P);
+    }
+}
+
+/* count the blocks of F with num threads into parts */
+static int tagstats_pbf(OSM_File *F, struct tagstats_part *parts, int num) {
+    struct tagstats_job job;
+    int ret = 0, r = 1;
+
+    job.parts = parts;
+    job.raw   = malloc(sizeof(struct osm_pbf_raw) * num * TAGSTATS_BATCH);
+    if (job.raw == NULL) {
+        fprintf(stderr, "failed to malloc blob batch: %s\n", strerror(errno));
+        return -1;
+    }
+    if (osm_rewind(F) != 0) {
+        free(job.raw);
+        return -1;
+    }
+    while (r > 0) {
+        for (job.num=0; job.num < num * TAGSTATS_BATCH; job.num++) {
+            r = osm_pbf_read_raw(F, &job.raw[job.num]);
+            if (r <= 0)
+                break;
+        }
+        if (r < 0)
+            ret = -1;
+        if (job.num == 0)
+            break;
+        osm_trace(OSM_TRACE_BLOCK, "tagstats: %u blocks", job.num);
+        job.next = 0;
+        osm_threads_run(num, tagstats_worker, &job);
+    }
+    free(job.raw);
+    return ret;
+}
+
+/* add the counts of p to S->all */
+static int tagstats_merge(OSM_Tag_Stats *S, struct tagstats_part *p) {
+    struct tagstats_part *all = &S->all;
+    uint32_t i, s;
+    int t;
+
+    for (t=0; t<TAGSTATS_TYPES; t++) {
+        all->objects[t] += p->objects[t];
+        all->tagged[t]  += p->tagged[t];
+    }
+    for (i=0; i<p->num_keys; i++) {
+        struct tagstats_key *k = &p->keys[i];
+        int64_t key = part_key(all, k->key, strlen(k->key));
+        if (key < 0)
+            return -1;
+        for (t=0; t<TAGSTATS_TYPES; t++) {
+            all->keys[key].count[t] += k->count[t];
+            if (hll_merge(&all->keys[key].values[t], &k->values[t]) != 0)
+                return -1;
+        }
+    }
+
+    /*
+     * a pair missing in a full part was counted there at most as often
+     * as its least counted pair: floor is the sum of those minimums of
+     * the parts a pair was in, see tagstats_finish()
+     */
+    for (t=0; t<TAGSTATS_TYPES; t++) {
+        struct tagstats_top *top = &p->top[t], *dst = &all->top[t];
+        uint64_t min = top->num == top->size ? top->heap[0].count : 0;
+        for (i=0; i<top->num; i++) {
+            struct tagstats_entry *e = &top->heap[i], *d;
+            uint32_t key = part_key(all, p->keys[e->key].key, strlen(p->keys[e->key].key));
+            uint64_t item = top_item(key, e->vhash);
+            s = top_slot(dst, item);
+            if (dst->slots[s] != 0)
+                d = &dst->heap[ dst->slots[s] - 1 ];
+            else {
+                d = top_insert(dst, s, item, key, e->vhash, e->val);
+                e->val = NULL;
+            }
+            d->count += e->count;
+            d->error += e->error;
+            d->floor += min;
+        }
+    }
+    return 0;
+}
+
+/* sort the keys and pairs of S->all by count */
+static int tagstats_finish(OSM_Tag_Stats *S, uint64_t *mins) {
+    struct tagstats_part *all = &S->all;
+    uint32_t i, n;
+    int t;
+
+    for (t=0; t<TAGSTATS_TYPES; t++) {
+        struct tagstats_top *top = &all->top[t];
+        S->keys[t] = malloc(sizeof(struct osm_sort_pair) * (all->num_keys + 1));
+        S->tags[t] = malloc(sizeof(struct osm_sort_pair) * (top->num + 1));
+        if (S->keys[t] == NULL || S->tags[t] == NULL) {
+            fprintf(stderr, "failed to malloc sorted stats: %s\n", strerror(errno));
+            return -1;
+        }
+        for (i=0, n=0; i<all->num_keys; i++) {
+            if (all->keys[i].count[t] == 0)
+                continue;
+            S->keys[t][n].key = UINT64_MAX - all->keys[i].count[t];
+            S->keys[t][n].val = i;
+            n++;
+        }
+        S->num_keys[t] = n;
+        osm_sort_pairs(S->keys[t], n, 1);
+
+        for (i=0; i<top->num; i++) {
+            struct tagstats_entry *e = &top->heap[i];
+            e->count += mins[t] - e->floor;
+            e->error += mins[t] - e->floor;
+            S->tags[t][i].key = UINT64_MAX - e->count;
+            S->tags[t][i].val = i;
+        }
+        osm_sort_pairs(S->tags[t], top->num, 1);
+        S->num_tags[t] = top->num < S->top ? top->num : S->top;
+    }
+    return 0;
+}
+
+/*
+ * key and tag statistics of F, the top most common key=value pairs per
+ * type. threads <= 0 uses all CPUs. NULL on errors
+ */
+OSM_Tag_Stats *osm_tagstats(OSM_File *F, uint32_t top, int threads) {
+    OSM_Tag_Stats *S = calloc(1, sizeof(OSM_Tag_Stats));
+    struct tagstats_part *parts;
+    uint64_t mins[TAGSTATS_TYPES] = { 0, 0, 0 }, total = 0;
+    int num = F->type == OSM_FTYPE_PBF ? osm_threads_num(threads) : 1;
+    int i, t, ret = 0;
+
+    if (top == 0)
+        top = 1;
+    parts = calloc(num, sizeof(struct tagstats_part));
+    if (S == NULL || parts == NULL) {
+        fprintf(stderr, "failed to malloc tag stats: %s\n", strerror(errno));
+        free(S);
+        free(parts);
+        return (OSM_Tag_Stats *)NULL;
+    }
+    S->top = top;
+    for (i=0; i<num && ret == 0; i++)
+        ret = part_init(&parts[i], top * TAGSTATS_SLACK);
+
+    if (ret == 0) {
+        if (F->type == OSM_FTYPE_PBF)
+            ret = tagstats_pbf(F, parts, num);
+        else
+            ret = osm_scan(F, OSMDATA_NODE|OSMDATA_WAY|OSMDATA_REL, tagstats_block, &parts[0]);
+    }
+    for (i=0; i<num; i++) {
+        if (parts[i].failed)
+            ret = -1;
+        for (t=0; t<TAGSTATS_TYPES; t++)
+            total += parts[i].top[t].num;
+    }
+
+    if (ret == 0)
+        ret = part_init(&S->all, total + 1);
+    for (i=0; i<num; i++) {
+        if (ret == 0)
+            ret = tagstats_merge(S, &parts[i]);
+        for (t=0; t<TAGSTATS_TYPES; t++) {
+            struct tagstats_top *tp = &parts[i].top[t];
+            if (tp->num == tp->size)
+                mins[t] += tp->heap[0].count;
+        }
+        part_free(&parts[i]);
+    }
+    free(parts);
+    if (ret == 0)
+        ret = tagstats_finish(S, mins);
+    if (ret != 0) {
+        osm_tagstats_free(S);
+        return (OSM_Tag_Stats *)NULL;
+    }
+    osm_trace(OSM_TRACE_PASS, "tagstats: %u keys", S->all.num_keys);
+    return S;
+}
+
+void osm_tagstats_free(OSM_Tag_Stats *S) {
+    int t;
+    if (S == NULL)
+        return;
+    for (t=0; t<TAGSTATS_TYPES; t++) {
+        free(S->keys[t]);
+        free(S->tags[t]);
+    }
+    part_free(&S->all);
+    free(S);
+}
+
+static void tagstats_csv_str(const char *s, FILE *out) {
+    if (strpbrk(s, ",\"\r\n") == NULL) {
+        fputs(s, out);
+        return;
+    }
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"')
+            fputc('"', out);
+        fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+static void tagstats_json_str(const char *s, FILE *out) {
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(out, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(out, "\\u%04x", (unsigned char)*s);
+        else
+            fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+static void tagstats_csv(OSM_Tag_Stats *S, FILE *out) {
+    struct tagstats_part *all = &S->all;
+    uint32_t i;
+    int t;
+
+    fprintf(out, "type,key,value,count,error,values\n");
+    for (t=0; t<TAGSTATS_TYPES; t++) {
+        for (i=0; i<S->num_keys[t]; i++) {
+            struct tagstats_key *k = &all->keys[ S->keys[t][i].val ];
+            fprintf(out, "%s,", tagstats_types[t]);
+            tagstats_csv_str(k->key, out);
+            fprintf(out, ",,%lu,,%lu\n", k->count[t], hll_count(&k->values[t]));
+        }
+        for (i=0; i<S->num_tags[t]; i++) {
+            struct tagstats_entry *e = &all->top[t].heap[ S->tags[t][i].val ];
+            fprintf(out, "%s,", tagstats_types[t]);
+            tagstats_csv_str(all->keys[e->key].key, out);
+            fputc(',', out);
+            tagstats_csv_str(e->val, out);
+            fprintf(out, ",%lu,%lu,\n", e->count, e->error);
+        }
+    }
+}
+
+static void tagstats_json(OSM_Tag_Stats *S, FILE *out) {
+    struct tagstats_part *all = &S->all;
+    uint32_t i;
+    int t;
+
+    fprintf(out, "{");
+    for (t=0; t<TAGSTATS_TYPES; t++) {
+        fprintf(out, "%s\n \"%ss\": {\"objects\": %lu, \"tagged\": %lu,\n  \"keys\": [",
+                        t ? "," : "", tagstats_types[t], all->objects[t], all->tagged[t]);
+        for (i=0; i<S->num_keys[t]; i++) {
+            struct tagstats_key *k = &all->keys[ S->keys[t][i].val ];
+            fprintf(out, "%s\n   {\"key\": ", i ? "," : "");
+            tagstats_json_str(k->key, out);
+            fprintf(out, ", \"count\": %lu, \"values\": %lu}",
+                            k->count[t], hll_count(&k->values[t]));
+        }
+        fprintf(out, "\n  ],\n  \"tags\": [");
+        for (i=0; i<S->num_tags[t]; i++) {
+            struct tagstats_entry *e = &all->top[t].heap[ S->tags[t][i].val ];
+            fprintf(out, "%s\n   {\"key\": ", i ? "," : "");
+            tagstats_json_str(all->keys[e->key].key, out);
+            fprintf(out, ", \"value\": ");
+            tagstats_json_str(e->val, out);
+            fprintf(out, ", \"count\": %lu, \"error\": %lu}", e->count, e->error);
+        }
+        fprintf(out, "\n  ]}");
+    }
+    fprintf(out, "\n}\n");
+}
+
+/*
+ * write S as OSM_TAGSTATS_CSV: "type,key,value,count,error,values", one
+ * line per key (empty value, values is the number of distinct values)
+ * and one per pair (with count - error <= real count <= count), or as
+ * OSM_TAGSTATS_JSON. Returns 0 on success
+ */
+int osm_tagstats_write(OSM_Tag_Stats *S, FILE *out, int format) {
+    if (format == OSM_TAGSTATS_JSON)
+        tagstats_json(S, out);
+    else
+        tagstats_csv(S, out);
+    if (ferror(out)) {
+        fprintf(stderr, "failed to write tag stats: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* END */
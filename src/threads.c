@@ -0,0 +1,86 @@
+/*
+ * threads.c - minimal helpers to run a function on several threads
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "osm.h"
+
+struct osm_thread_arg {
+    int id;
+    int num;
+    void (*worker)(int id, int num, void *arg);
+    void *arg;
+};
+
+static void *osm_thread_start(void *p) {
+    struct osm_thread_arg *a = p;
+    a->worker(a->id, a->num, a->arg);
+    return NULL;
+}
+
+/* number of threads to use if the caller did not ask for a specific one */
+int osm_threads_num(int wanted) {
+    long int cpus;
+    if (wanted > 0)
+        return wanted > OSM_MAX_THREADS ? OSM_MAX_THREADS : wanted;
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        return 1;
+    return cpus > OSM_MAX_THREADS ? OSM_MAX_THREADS : (int)cpus;
+}
+
+/*
+ * run worker(id, num, arg) for id = 0 .. num-1, id 0 runs in the calling
+ * thread. Returns when all workers are done. If a thread cannot be
+ * created, its share is run by the calling thread after the others.
+ */
+void osm_threads_run(int num, void (*worker)(int id, int num, void *arg), void *arg) {
+    pthread_t tid[OSM_MAX_THREADS];
+    struct osm_thread_arg targ[OSM_MAX_THREADS];
+    int started[OSM_MAX_THREADS];
+    int i;
+
+    if (num < 1)
+        num = 1;
+    if (num > OSM_MAX_THREADS)
+        num = OSM_MAX_THREADS;
+
+    for (i=0; i<num; i++) {
+        targ[i].id     = i;
+        targ[i].num    = num;
+        targ[i].worker = worker;
+        targ[i].arg    = arg;
+        started[i]     = 0;
+    }
+
+    for (i=1; i<num; i++) {
+        int err = pthread_create(&tid[i], NULL, osm_thread_start, &targ[i]);
+        if (err != 0) {
+            fprintf(stderr, "failed to create thread %d: %s\n", i, strerror(err));
+            continue;
+        }
+        started[i] = 1;
+    }
+
+    worker(0, num, arg);
+
+    for (i=1; i<num; i++) {
+        if (started[i])
+            pthread_join(tid[i], NULL);
+        else
+            worker(i, num, arg);
+    }
+}
+
+/* END */
@@ -0,0 +1,605 @@
+/*
+ * tile.c - cut a file into z/x/y tiles in one pass
+ *
+ * One pass over the input (nodes, then ways, then relations as in every
+ * sorted file) assigns
+ *   - nodes to the tile of their location,
+ *   - ways to every tile one of their nodes is in, written with the
+ *     locations of all their nodes (see locations.c), so a tile does not
+ *     need the nodes outside of it,
+ *   - relations to every tile one of their node or way members is in.
+ * The tiles of the nodes come from a location index, those of the ways
+ * are kept as (way id, tile) pairs, i.e. a compact tile list per way.
+ * The objects of a block are copied to per tile buffers by several
+ * threads, each tile is owned by one thread. When the buffers of all
+ * tiles hold more than the memory limit, they are appended to
+ * DIR/z/x/y.osm and freed. For .osm.pbf output the finished XML tiles are
+ * converted by several threads afterwards, i.e. a second pass over the
+ * tile data, not over the input.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#define _GNU_SOURCE /* open_memstream */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "osm.h"
+
+#define TILE_PBF_BLOCK 8000
+#define TILE_PBF_LEVEL 6
+#define TILE_MAX_LAT   85.0511287798
+
+struct tile {
+    uint32_t x;
+    uint32_t y;
+    uint32_t slot;      /* index in split->tiles */
+    int      spilled;   /* DIR/z/x/y.osm exists */
+    char    *buf;
+    size_t   len;
+    size_t   size;
+};
+
+/* an object of the current block in one tile */
+struct tile_ref {
+    uint32_t slot;
+    uint32_t type;      /* OSM_REL_MEMBER_TYPE_* */
+    uint32_t index;     /* in the node, way or relation list of the block */
+};
+
+struct tile_scratch {
+    FILE  *out;
+    char  *ptr;
+    size_t size;
+};
+
+struct tile_split {
+    int       zoom;
+    const char *dir;
+    char     *creator;
+    int       threads;
+    uint64_t  memory;
+    uint64_t  buffered;     /* bytes in all tile buffers */
+    int       failed;
+    int       last;         /* the final spill, with footer */
+
+    OSM_Loc_Index *locs;
+    struct osm_sort_pair *way_tiles;
+    uint64_t  num_way_tiles;
+    uint64_t  size_way_tiles;
+    int       way_tiles_sorted;
+
+    OSM_Id_Map   *map;      /* (x << zoom | y) + 1 -> struct tile */
+    struct tile **tiles;
+    uint32_t  num_tiles;
+    uint32_t  size_tiles;
+
+    uint32_t *keys;         /* tiles of the current object */
+    uint32_t  num_keys;
+    uint32_t  size_keys;
+
+    struct tile_ref *refs;  /* of the current block */
+    uint32_t  num_refs;
+    uint32_t  size_refs;
+    OSM_Data *block;
+    struct tile_scratch *scratch;
+    uint64_t  skipped;      /* objects without a known location */
+};
+
+/* tile numbers of lat / lon in web mercator, as used by the renderers */
+void osm_tile_xy(double lat, double lon, int zoom, uint32_t *x, uint32_t *y) {
+    double n = (double)(1U << zoom), r, tx, ty;
+
+    if (lat > TILE_MAX_LAT)
+        lat = TILE_MAX_LAT;
+    else if (lat < -TILE_MAX_LAT)
+        lat = -TILE_MAX_LAT;
+    r  = lat * M_PI / 180.0;
+    tx = floor((lon + 180.0) / 360.0 * n);
+    ty = floor((1.0 - asinh(tan(r)) / M_PI) / 2.0 * n);
+    *x = tx < 0 ? 0 : tx >= n ? (uint32_t)n - 1 : (uint32_t)tx;
+    *y = ty < 0 ? 0 : ty >= n ? (uint32_t)n - 1 : (uint32_t)ty;
+}
+
+/* the area of a tile */
+void osm_tile_bbox(uint32_t x, uint32_t y, int zoom, OSM_BBox *bbox) {
+    double n = (double)(1U << zoom);
+    bbox->left_lon   = x / n * 360.0 - 180.0;
+    bbox->right_lon  = (x + 1) / n * 360.0 - 180.0;
+    bbox->top_lat    = atan(sinh(M_PI * (1.0 - 2.0 * y / n))) * 180.0 / M_PI;
+    bbox->bottom_lat = atan(sinh(M_PI * (1.0 - 2.0 * (y + 1) / n))) * 180.0 / M_PI;
+}
+
+static void tile_path(struct tile_split *s, struct tile *t, char *path, size_t len,
+                        const char *suffix)
+{
+    snprintf(path, len, "%s/%d/%u/%u%s", s->dir, s->zoom, t->x, t->y, suffix);
+}
+
+static int tile_mkdir(const char *path) {
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "failed to create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* the tile of key, created if not yet known. NULL on error */
+static struct tile *tile_get(struct tile_split *s, uint32_t key) {
+    struct tile *t = osm_idmap_get(s->map, (uint64_t)key + 1);
+    char path[LINE_SIZE];
+
+    if (t != NULL)
+        return t;
+    if (s->num_tiles == s->size_tiles) {
+        uint32_t size = s->size_tiles ? s->size_tiles * 2 : 256;
+        struct tile **tmp = realloc(s->tiles, sizeof(struct tile *) * size);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to realloc tile list: %s\n", strerror(errno));
+            return (struct tile *)NULL;
+        }
+        s->tiles = tmp;
+        s->size_tiles = size;
+    }
+    t = calloc(1, sizeof(struct tile));
+    if (t == NULL) {
+        fprintf(stderr, "failed to malloc tile: %s\n", strerror(errno));
+        return (struct tile *)NULL;
+    }
+    t->x    = key >> s->zoom;
+    t->y    = key & ((1U << s->zoom) - 1);
+    t->slot = s->num_tiles;
+    if (osm_idmap_put(s->map, (uint64_t)key + 1, t) != 0) {
+        free(t);
+        return (struct tile *)NULL;
+    }
+    s->tiles[s->num_tiles++] = t;
+
+    /* the directories are created here, the files by the writing threads */
+    snprintf(path, sizeof(path), "%s/%d/%u", s->dir, s->zoom, t->x);
+    if (tile_mkdir(path) != 0)
+        return (struct tile *)NULL;
+    return t;
+}
+
+static int tile_add_key(struct tile_split *s, uint32_t key) {
+    uint32_t i;
+
+    for (i=0; i<s->num_keys; i++) {
+        if (s->keys[i] == key)
+            return 0;
+    }
+    if (s->num_keys == s->size_keys) {
+        uint32_t size = s->size_keys ? s->size_keys * 2 : 64;
+        uint32_t *tmp = realloc(s->keys, sizeof(uint32_t) * size);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to realloc tile keys: %s\n", strerror(errno));
+            return -1;
+        }
+        s->keys = tmp;
+        s->size_keys = size;
+    }
+    s->keys[s->num_keys++] = key;
+    return 0;
+}
+
+static int tile_add_location(struct tile_split *s, double lat, double lon) {
+    uint32_t x, y;
+
+    if (isnan(lat) || isnan(lon))
+        return 0;
+    osm_tile_xy(lat, lon, s->zoom, &x, &y);
+    return tile_add_key(s, (x << s->zoom) | y);
+}
+
+/* add the object to all tiles in s->keys */
+static int tile_add_refs(struct tile_split *s, uint32_t type, uint32_t index) {
+    uint32_t i;
+
+    if (s->num_keys == 0) {
+        s->skipped += 1;
+        return 0;
+    }
+    if (s->num_refs + s->num_keys > s->size_refs) {
+        uint32_t size = s->size_refs ? s->size_refs : 16384;
+        struct tile_ref *tmp;
+        while (size < s->num_refs + s->num_keys)
+            size *= 2;
+        tmp = realloc(s->refs, sizeof(struct tile_ref) * size);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to realloc tile refs: %s\n", strerror(errno));
+            return -1;
+        }
+        s->refs = tmp;
+        s->size_refs = size;
+    }
+    for (i=0; i<s->num_keys; i++) {
+        struct tile *t = tile_get(s, s->keys[i]);
+        if (t == NULL)
+            return -1;
+        s->refs[s->num_refs].slot  = t->slot;
+        s->refs[s->num_refs].type  = type;
+        s->refs[s->num_refs].index = index;
+        s->num_refs += 1;
+    }
+    return 0;
+}
+
+static int tile_add_way_tiles(struct tile_split *s, uint64_t id) {
+    uint32_t i;
+
+    if (s->num_way_tiles + s->num_keys > s->size_way_tiles) {
+        uint64_t size = s->size_way_tiles ? s->size_way_tiles : 65536;
+        struct osm_sort_pair *tmp;
+        while (size < s->num_way_tiles + s->num_keys)
+            size *= 2;
+        tmp = realloc(s->way_tiles, sizeof(struct osm_sort_pair) * size);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to realloc way tiles: %s\n", strerror(errno));
+            return -1;
+        }
+        osm_stats_alloc(OSM_MEM_TILES, sizeof(struct osm_sort_pair) * (size - s->size_way_tiles));
+        s->way_tiles = tmp;
+        s->size_way_tiles = size;
+    }
+    if (s->num_way_tiles && s->way_tiles[s->num_way_tiles - 1].key > id)
+        s->way_tiles_sorted = 0;
+    for (i=0; i<s->num_keys; i++) {
+        s->way_tiles[s->num_way_tiles].key = id;
+        s->way_tiles[s->num_way_tiles].val = s->keys[i];
+        s->num_way_tiles += 1;
+    }
+    return 0;
+}
+
+/* add the tiles of way id to s->keys */
+static int tile_way_keys(struct tile_split *s, uint64_t id) {
+    uint64_t lower = 0, upper = s->num_way_tiles;
+
+    if (!s->way_tiles_sorted) {
+        osm_sort_pairs(s->way_tiles, s->num_way_tiles, s->threads);
+        s->way_tiles_sorted = 1;
+    }
+    while (lower < upper) {
+        uint64_t pos = (lower + upper) / 2;
+        if (s->way_tiles[pos].key < id)
+            lower = pos + 1;
+        else
+            upper = pos;
+    }
+    for (; lower < s->num_way_tiles && s->way_tiles[lower].key == id; lower++) {
+        if (tile_add_key(s, s->way_tiles[lower].val) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* which tiles the objects of the block are in, the way locations are set */
+static int tile_assign(struct tile_split *s, OSM_Data *d) {
+    OSM_Location loc;
+    uint32_t i, k;
+
+    s->num_refs = 0;
+    for (i=0; i<d->nodes->num; i++) {
+        OSM_Node *n = d->nodes->data[i];
+        if (osm_loc_index_add(s->locs, n->id, n->lat, n->lon) != 0)
+            return -1;
+        s->num_keys = 0;
+        if (tile_add_location(s, n->lat, n->lon) != 0
+            || tile_add_refs(s, OSM_REL_MEMBER_TYPE_NODE, i) != 0)
+            return -1;
+    }
+    for (i=0; i<d->ways->num; i++) {
+        OSM_Way *w = d->ways->data[i];
+        /* from a file with locations on ways the nodes may be missing */
+        if (w->locs == NULL && osm_way_locations(s->locs, w) < 0)
+            return -1;
+        s->num_keys = 0;
+        for (k=0; w->locs != NULL && w->nodes[k]; k++) {
+            if (tile_add_location(s, w->locs[k].lat, w->locs[k].lon) != 0)
+                return -1;
+        }
+        if (tile_add_way_tiles(s, w->id) != 0
+            || tile_add_refs(s, OSM_REL_MEMBER_TYPE_WAY, i) != 0)
+            return -1;
+    }
+    for (i=0; i<d->relations->num; i++) {
+        OSM_Relation *r = d->relations->data[i];
+        s->num_keys = 0;
+        for (k=0; r->member != NULL && k<r->member->num; k++) {
+            OSM_Rel_Member *m = &r->member->data[k];
+            int ret = 0;
+            if (m->type == OSM_REL_MEMBER_TYPE_NODE) {
+                if (osm_loc_index_get(s->locs, m->ref, &loc) == 0)
+                    ret = tile_add_location(s, loc.lat, loc.lon);
+            }
+            else if (m->type == OSM_REL_MEMBER_TYPE_WAY)
+                ret = tile_way_keys(s, m->ref);
+            /* relations in relations: only by their node and way members */
+            if (ret != 0)
+                return -1;
+        }
+        if (tile_add_refs(s, OSM_REL_MEMBER_TYPE_RELATION, i) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int tile_append(struct tile_split *s, struct tile *t, const char *data, size_t len) {
+    if (t->len + len > t->size) {
+        size_t size = t->size ? t->size : 4096;
+        char *tmp;
+        while (size < t->len + len)
+            size *= 2;
+        tmp = realloc(t->buf, size);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to realloc tile %d/%u/%u: %s\n",
+                            s->zoom, t->x, t->y, strerror(errno));
+            return -1;
+        }
+        osm_stats_alloc(OSM_MEM_TILES, size - t->size);
+        t->buf  = tmp;
+        t->size = size;
+    }
+    memcpy(t->buf + t->len, data, len);
+    t->len += len;
+    __atomic_add_fetch(&s->buffered, len, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* append the buffer of t to its file and free it, with footer if last */
+static int tile_spill(struct tile_split *s, struct tile *t, int last) {
+    char path[LINE_SIZE];
+    FILE *fh;
+    int ret = 0;
+
+    if (t->len == 0 && !last)
+        return 0;
+    tile_path(s, t, path, sizeof(path), ".osm");
+    fh = fopen(path, t->spilled ? "a" : "w");
+    if (fh == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (!t->spilled)
+        osm_xml_write_header(s->creator, fh);
+    t->spilled = 1;
+    if (t->len && fwrite(t->buf, 1, t->len, fh) != t->len)
+        ret = -1;
+    if (last)
+        osm_xml_write_footer(fh);
+    if (fclose(fh) != 0)
+        ret = -1;
+    if (ret != 0)
+        fprintf(stderr, "failed to write %s: %s\n", path, strerror(errno));
+
+    __atomic_sub_fetch(&s->buffered, t->len, __ATOMIC_RELAXED);
+    osm_stats_alloc(OSM_MEM_TILES, -(int64_t)t->size);
+    free(t->buf);
+    t->buf  = NULL;
+    t->len  = 0;
+    t->size = 0;
+    return ret;
+}
+
+/* the object of ref as XML in the scratch buffer of the thread */
+static int tile_render(struct tile_split *s, struct tile_scratch *sc, struct tile_ref *ref) {
+    rewind(sc->out);
+    switch (ref->type) {
+        case OSM_REL_MEMBER_TYPE_NODE:
+            osm_xml_write_node(s->block->nodes->data[ref->index], sc->out);
+            break;
+        case OSM_REL_MEMBER_TYPE_WAY:
+            osm_xml_write_way(s->block->ways->data[ref->index], sc->out);
+            break;
+        case OSM_REL_MEMBER_TYPE_RELATION:
+            osm_xml_write_relation(s->block->relations->data[ref->index], sc->out);
+            break;
+    }
+    if (fflush(sc->out) != 0)
+        return -1;
+    return ftell(sc->out);
+}
+
+static void tile_write_worker(int id, int num, void *arg) {
+    struct tile_split *s = arg;
+    struct tile_scratch *sc = &s->scratch[id];
+    uint32_t i, last_type = 0, last_index = 0;
+    int len = -1;
+
+    for (i=0; i<s->num_refs && !s->failed; i++) {
+        struct tile_ref *ref = &s->refs[i];
+        if (ref->slot % num != (uint32_t)id)
+            continue;
+        if (len < 0 || ref->type != last_type || ref->index != last_index) {
+            len = tile_render(s, sc, ref);
+            if (len < 0) {
+                s->failed = 1;
+                break;
+            }
+            last_type  = ref->type;
+            last_index = ref->index;
+        }
+        if (tile_append(s, s->tiles[ref->slot], sc->ptr, len) != 0)
+            s->failed = 1;
+    }
+}
+
+static void tile_spill_worker(int id, int num, void *arg) {
+    struct tile_split *s = arg;
+    uint32_t i;
+
+    for (i=id; i<s->num_tiles; i+=num) {
+        if (tile_spill(s, s->tiles[i], s->last) != 0)
+            s->failed = 1;
+    }
+}
+
+static int tile_block(OSM_Data *d, void *ctx) {
+    struct tile_split *s = ctx;
+
+    if (tile_assign(s, d) != 0)
+        return -1;
+    s->block = d;
+    osm_threads_run(s->threads, tile_write_worker, s);
+    s->block = NULL;
+    if (!s->failed && s->buffered > s->memory) {
+        osm_trace(OSM_TRACE_PASS, "spilling %lu bytes of %u tiles", s->buffered, s->num_tiles);
+        osm_threads_run(s->threads, tile_spill_worker, s);
+    }
+    return s->failed ? -1 : 0;
+}
+
+static int tile_pbf_block(OSM_Data *d, void *ctx) {
+    OSM_PBF_Writer *W = ctx;
+    uint32_t i;
+    int ret = 0;
+
+    for (i=0; i<d->nodes->num && ret == 0; i++)
+        ret = osm_pbf_write_node(d->nodes->data[i], W);
+    for (i=0; i<d->ways->num && ret == 0; i++)
+        ret = osm_pbf_write_way(d->ways->data[i], W);
+    for (i=0; i<d->relations->num && ret == 0; i++)
+        ret = osm_pbf_write_relation(d->relations->data[i], W);
+    return ret;
+}
+
+/* DIR/z/x/y.osm -> DIR/z/x/y.osm.pbf */
+static int tile_convert(struct tile_split *s, struct tile *t) {
+    char src[LINE_SIZE], dst[LINE_SIZE];
+    OSM_PBF_Writer *W;
+    OSM_BBox bbox;
+    OSM_File *F;
+    FILE *out;
+    int ret = 0;
+
+    tile_path(s, t, src, sizeof(src), ".osm");
+    tile_path(s, t, dst, sizeof(dst), ".osm.pbf");
+    F = osm_open(src, OSM_FTYPE_XML);
+    if (F == NULL)
+        return -1;
+    out = fopen(dst, "w");
+    if (out == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", dst, strerror(errno));
+        osm_close(F);
+        return -1;
+    }
+    osm_tile_bbox(t->x, t->y, s->zoom, &bbox);
+    W = osm_pbf_write_header_opt(s->creator, out, &bbox, TILE_PBF_BLOCK, TILE_PBF_LEVEL,
+                                    OSM_PBF_LOCATIONS_ON_WAYS);
+    if (W == NULL)
+        ret = -1;
+    else if (osm_scan(F, OSMDATA_NODE|OSMDATA_WAY|OSMDATA_REL, tile_pbf_block, W) != 0)
+        ret = -1;
+    if (osm_pbf_write_footer(W) != 0)
+        ret = -1;
+    osm_close(F);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "failed to write %s: %s\n", dst, strerror(errno));
+        ret = -1;
+    }
+    if (ret == 0)
+        unlink(src);
+    return ret;
+}
+
+static void tile_convert_worker(int id, int num, void *arg) {
+    struct tile_split *s = arg;
+    uint32_t i;
+
+    for (i=id; i<s->num_tiles; i+=num) {
+        if (tile_convert(s, s->tiles[i]) != 0)
+            s->failed = 1;
+    }
+}
+
+/*
+ * write all objects of F to DIR/ZOOM/X/Y.osm (file_type OSM_FTYPE_XML) or
+ * .osm.pbf (OSM_FTYPE_PBF), buffering at most about memory bytes (0: 256
+ * MB). threads <= 0 uses all CPUs. Returns the number of tiles or -1.
+ */
+int64_t osm_tile_split(OSM_File *F, int zoom, const char *dir, int file_type,
+                        uint64_t memory, int threads, char *creator)
+{
+    struct tile_split s;
+    char path[LINE_SIZE];
+    int64_t ret = -1;
+    int i;
+
+    if (zoom < 0 || zoom > OSM_TILE_MAX_ZOOM) {
+        fprintf(stderr, "invalid zoom level %d, must be 0..%d\n", zoom, OSM_TILE_MAX_ZOOM);
+        return -1;
+    }
+    memset(&s, 0, sizeof(s));
+    s.zoom    = zoom;
+    s.dir     = dir;
+    s.creator = creator;
+    s.memory  = memory ? memory : (uint64_t)256 << 20;
+    s.threads = osm_threads_num(threads);
+    s.way_tiles_sorted = 1;
+    s.locs    = osm_loc_index_new();
+    s.map     = osm_idmap_new(1024);
+    s.scratch = calloc(s.threads, sizeof(struct tile_scratch));
+    if (s.locs == NULL || s.map == NULL || s.scratch == NULL) {
+        fprintf(stderr, "failed to set up tile split: %s\n", strerror(errno));
+        goto done;
+    }
+    for (i=0; i<s.threads; i++) {
+        s.scratch[i].out = open_memstream(&s.scratch[i].ptr, &s.scratch[i].size);
+        if (s.scratch[i].out == NULL) {
+            fprintf(stderr, "failed to open tile buffer: %s\n", strerror(errno));
+            goto done;
+        }
+    }
+    snprintf(path, sizeof(path), "%s/%d", dir, zoom);
+    if (tile_mkdir(dir) != 0 || tile_mkdir(path) != 0)
+        goto done;
+
+    if (osm_scan(F, OSMDATA_NODE|OSMDATA_WAY|OSMDATA_REL, tile_block, &s) != 0)
+        goto done;
+    s.last = 1;
+    osm_threads_run(s.threads, tile_spill_worker, &s);
+    if (s.failed)
+        goto done;
+    osm_trace(OSM_TRACE_PASS, "%u tiles, %lu objects without location", s.num_tiles, s.skipped);
+
+    if (file_type == OSM_FTYPE_PBF) {
+        osm_threads_run(s.threads, tile_convert_worker, &s);
+        if (s.failed)
+            goto done;
+    }
+    ret = s.num_tiles;
+
+  done:
+    for (i=0; s.scratch != NULL && i<s.threads; i++) {
+        if (s.scratch[i].out != NULL)
+            fclose(s.scratch[i].out);
+        free(s.scratch[i].ptr);
+    }
+    free(s.scratch);
+    for (i=0; (uint32_t)i<s.num_tiles; i++) {
+        if (s.tiles[i]->size)
+            osm_stats_alloc(OSM_MEM_TILES, -(int64_t)s.tiles[i]->size);
+        free(s.tiles[i]->buf);
+        free(s.tiles[i]);
+    }
+    free(s.tiles);
+    free(s.keys);
+    free(s.refs);
+    osm_stats_alloc(OSM_MEM_TILES, -(int64_t)(sizeof(struct osm_sort_pair) * s.size_way_tiles));
+    free(s.way_tiles);
+    if (s.map != NULL)
+        osm_idmap_free(s.map);
+    osm_loc_index_free(s.locs);
+    return ret;
+}
+
+/* END */
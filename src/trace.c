@@ -0,0 +1,260 @@
+/*
+ * trace.c - binary trace events in per thread ring buffers
+ *
+ * The trace points in the library are osm_trace(LEVEL, FMT, ARGS...)
+ * (see osm.h), points above OSM_TRACE_LEVEL (make TRACE=N, default 0)
+ * are not compiled in. Compiled in points cost a test of osm_trace_on
+ * until tracing is enabled by setting OSM_TRACE=FILE in the environment
+ * (read by osm_init()). An enabled point does not format anything, it
+ * stores the time, the address of its static description and up to
+ * OSM_TRACE_ARGS integer arguments (doubles with osm_trace_dbl()) in the
+ * ring buffer of the calling thread. Only the owning thread writes to a
+ * ring, so no locks are needed. The rings keep the last OSM_TRACE_EVENTS
+ * (default 65536) events of each thread and are written to FILE on exit,
+ * osm-trace decodes FILE to text. The ring of a thread which exited is
+ * taken by the next new thread (with a new thread number, the old events
+ * stay until they are overwritten), so the threads of osm_threads_run()
+ * do not add a ring per call.
+ *
+ * File format (host byte order):
+ *   "OSMTRC01"
+ *   uint32_t number of points, per point:
+ *       uint32_t line, uint32_t level, then file, function and format
+ *       as \0 terminated strings
+ *   events until EOF: struct osm_trace_event, point is the index into
+ *       the points above
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "osm.h"
+
+#define TRACE_DEFAULT_EVENTS 65536
+
+struct trace_ring {
+    struct osm_trace_event *ev;
+    uint64_t head;              /* number of events written */
+    uint32_t thread;
+    int unused;                 /* the thread exited */
+    struct trace_ring *next;
+};
+
+int osm_trace_on = 0;
+
+static char *trace_file = NULL;
+static uint64_t trace_events = TRACE_DEFAULT_EVENTS;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *trace_rings = NULL;
+static uint32_t trace_threads = 0;
+static __thread struct trace_ring *trace_local = NULL;
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+
+/* thread exit: the ring can be taken by a new thread */
+static void trace_release(void *arg) {
+    struct trace_ring *r = arg;
+    pthread_mutex_lock(&trace_lock);
+    r->unused = 1;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_key_init() {
+    pthread_key_create(&trace_key, trace_release);
+}
+
+static struct trace_ring *trace_ring() {
+    struct trace_ring *r = trace_local;
+    if (r != NULL)
+        return r;
+    pthread_once(&trace_key_once, trace_key_init);
+    pthread_mutex_lock(&trace_lock);
+    for (r=trace_rings; r!=NULL && !r->unused; r=r->next)
+        ;
+    if (r != NULL) {
+        r->unused = 0;
+        r->thread = trace_threads++;
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    if (r == NULL) {
+        r = calloc(1, sizeof(struct trace_ring));
+        if (r == NULL)
+            return NULL;
+        r->ev = malloc(sizeof(struct osm_trace_event) * trace_events);
+        if (r->ev == NULL) {
+            free(r);
+            return NULL;
+        }
+        pthread_mutex_lock(&trace_lock);
+        r->thread = trace_threads++;
+        r->next = trace_rings;
+        trace_rings = r;
+        pthread_mutex_unlock(&trace_lock);
+    }
+    pthread_setspecific(trace_key, r);
+    trace_local = r;
+    return r;
+}
+
+void osm_trace_event(const struct osm_trace_point *p, const uint64_t *args, uint32_t num) {
+    struct trace_ring *r = trace_ring();
+    struct osm_trace_event *e;
+    struct timespec ts;
+    uint64_t head;
+
+    if (r == NULL)
+        return;
+    if (num > OSM_TRACE_ARGS)
+        num = OSM_TRACE_ARGS;
+    head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    e = &r->ev[ head & (trace_events - 1) ];
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    e->ns     = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    e->point  = (uintptr_t)p;
+    e->thread = r->thread;
+    e->num    = num;
+    memcpy(e->args, args, num * sizeof(uint64_t));
+    /* a reader sees the event complete once head moved past it */
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t osm_trace_dbl(double d) {
+    uint64_t u;
+    memcpy(&u, &d, sizeof(u));
+    return u;
+}
+
+static int trace_cmp_point(const void *a, const void *b) {
+    uint64_t A = *(const uint64_t *)a, B = *(const uint64_t *)b;
+    return A > B ? 1 : (A < B ? -1 : 0);
+}
+
+/* the oldest event still in the ring and the number of events */
+static uint64_t trace_ring_range(struct trace_ring *r, uint64_t *first) {
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    *first = head > trace_events ? head - trace_events : 0;
+    return head - *first;
+}
+
+/* add p to the sorted list of points, if it is not there */
+static int trace_add_point(uint64_t **points, uint32_t *num, uint32_t *size, uint64_t p) {
+    uint32_t lower = 0, upper = *num;
+    while (lower < upper) {
+        uint32_t pos = (lower + upper) / 2;
+        if ((*points)[pos] < p)
+            lower = pos + 1;
+        else if ((*points)[pos] > p)
+            upper = pos;
+        else
+            return 0;
+    }
+    if (*num == *size) {
+        uint64_t *tmp = realloc(*points, sizeof(uint64_t) * (*size ? *size * 2 : 64));
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to realloc trace points: %s\n", strerror(errno));
+            return -1;
+        }
+        *points = tmp;
+        *size = *size ? *size * 2 : 64;
+    }
+    memmove(*points + lower + 1, *points + lower, sizeof(uint64_t) * (*num - lower));
+    (*points)[lower] = p;
+    *num += 1;
+    return 0;
+}
+
+/*
+ * write all rings to file, returns 0 on success. Events of threads still
+ * running may be overwritten while we copy them, call it at the end.
+ */
+int osm_trace_dump(const char *file) {
+    struct trace_ring *r;
+    uint64_t *points = NULL, i, first, num;
+    uint32_t npoints = 0, size = 0, k;
+    FILE *fh;
+
+    pthread_mutex_lock(&trace_lock);
+    for (r=trace_rings; r!=NULL; r=r->next) {
+        num = trace_ring_range(r, &first);
+        for (i=first; i<first+num; i++) {
+            if (trace_add_point(&points, &npoints, &size,
+                                r->ev[ i & (trace_events - 1) ].point) != 0) {
+                pthread_mutex_unlock(&trace_lock);
+                free(points);
+                return -1;
+            }
+        }
+    }
+
+    fh = fopen(file, "w");
+    if (fh == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", file, strerror(errno));
+        pthread_mutex_unlock(&trace_lock);
+        free(points);
+        return -1;
+    }
+    fwrite("OSMTRC01", 1, 8, fh);
+    fwrite(&npoints, sizeof(npoints), 1, fh);
+    for (k=0; k<npoints; k++) {
+        const struct osm_trace_point *p = (const struct osm_trace_point *)(uintptr_t)points[k];
+        uint32_t line = p->line, level = p->level;
+        fwrite(&line, sizeof(line), 1, fh);
+        fwrite(&level, sizeof(level), 1, fh);
+        fwrite(p->file, 1, strlen(p->file) + 1, fh);
+        fwrite(p->func, 1, strlen(p->func) + 1, fh);
+        fwrite(p->fmt, 1, strlen(p->fmt) + 1, fh);
+    }
+    for (r=trace_rings; r!=NULL; r=r->next) {
+        num = trace_ring_range(r, &first);
+        for (i=first; i<first+num; i++) {
+            struct osm_trace_event e = r->ev[ i & (trace_events - 1) ];
+            uint64_t *pos = bsearch(&e.point, points, npoints, sizeof(uint64_t), trace_cmp_point);
+            if (pos == NULL)
+                continue;
+            e.point = pos - points;
+            fwrite(&e, sizeof(e), 1, fh);
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+    free(points);
+    if (fclose(fh) != 0) {
+        fprintf(stderr, "failed to write %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void trace_atexit() {
+    osm_trace_dump(trace_file);
+}
+
+/*
+ * enable tracing if OSM_TRACE=FILE is set, OSM_TRACE_EVENTS=N sets the
+ * ring size (rounded up to a power of 2). Called by osm_init().
+ */
+void osm_trace_init() {
+    char *file = getenv("OSM_TRACE"), *num = getenv("OSM_TRACE_EVENTS");
+    if (file == NULL || *file == '\0' || osm_trace_on)
+        return;
+    if (OSM_TRACE_LEVEL == 0)
+        fprintf(stderr, "OSM_TRACE is set, but libosm was built without trace points\n");
+    if (num != NULL && atol(num) > 0) {
+        trace_events = 1;
+        while (trace_events < (uint64_t)atol(num))
+            trace_events <<= 1;
+    }
+    trace_file = strdup(file);
+    atexit(trace_atexit);
+    osm_trace_on = 1;
+}
+
+/* END */
@@ -20,6 +20,7 @@
 void osm_init() {
     setenv("TZ", "UTC", 1);    
     tzset();
+    osm_trace_init();
 }
 
 char *osm_relmember_type(int id) {
@@ -40,12 +41,16 @@ char *osm_relmember_type(int id) {
     }
 }
 
+/* 
+ * the result is in a static (per thread) buffer, i.e. valid until the
+ * next call.
+ * The worst case "&quot;" needs 6 bytes per input char.
+ */
 char *osm_encode_xml(char *src) {
-    char buffer[LINE_SIZE];
+    static __thread char buffer[LINE_SIZE * 6 + 1];
     char *dest = buffer;
     char *source = src;
-    memset(dest, '\0', LINE_SIZE);
-    while (*source) {
+    while (*source && dest - buffer < LINE_SIZE * 5) {
         switch (*source) {
             case '&':
                 *dest = '&'; dest++;
@@ -81,9 +86,7 @@ char *osm_encode_xml(char *src) {
         source++;     
     }
     *dest = '\0';
-    if (debug)
-        fprintf(stderr, "%s:%d:%s(): SRC='%s', DEST='%s'\n", 
-                         __FILE__, __LINE__, __FUNCTION__, src, buffer);
+    osm_trace(OSM_TRACE_DETAIL, "encoded %ld bytes to %ld", source - src, dest - buffer);
     dest = buffer;
     return dest;
 }
@@ -98,15 +101,36 @@ int osm_cmp_member(const void *a, const void *b) {
 }
 
 void osm_sort_member(struct osm_members *m) {
-    qsort(m->data, m->num, sizeof(uint64_t), osm_cmp_member);
+    osm_sort_ids(m->data, m->num, 0);
 }
 
+/*
+ * add (and free) the num ids in list. With sort the ids in m must be
+ * sorted already, the sorted list is merged into them.
+ */
 void osm_add_members(struct osm_members *m, uint32_t num, uint64_t *list, int sort) {
     uint32_t i = 0;
     while ((float)(m->num + num)/(float)m->size > LIST_THRESHOLD) {
+        osm_stats_alloc(OSM_MEM_MEMBERS, sizeof(uint64_t) * m->size);
         m->size *= 2;
         m->data  = realloc(m->data, sizeof(uint64_t) * m->size);
     }
+    if (sort) {
+        /* merge from the end, nothing is moved twice */
+        uint64_t *dst = m->data + m->num + num;
+        uint32_t k = m->num;
+        osm_sort_ids(list, num, 0);
+        i = num;
+        while (i > 0) {
+            if (k > 0 && m->data[k-1] > list[i-1])
+                *--dst = m->data[--k];
+            else
+                *--dst = list[--i];
+        }
+        m->num += num;
+        free(list);
+        return;
+    }
     uint64_t *ptr = m->data;
     ptr += m->num;
     for (i=0; i<num; i++) {
@@ -114,8 +138,6 @@ void osm_add_members(struct osm_members *m, uint32_t num, uint64_t *list, int so
         ++ptr;
         m->num += 1;
     }
-    if (sort) 
-        qsort(m->data, m->num, sizeof(uint64_t), osm_cmp_member);
     free(list);
 }
 
@@ -139,4 +161,14 @@ int osm_is_member(struct osm_members *m, uint64_t id) {
     return -1;
 }
 
+/* great circle distance in meters */
+double osm_distance(double lat1, double lon1, double lat2, double lon2) {
+    double dlat = (lat2 - lat1) * M_PI / 180.0;
+    double dlon = (lon2 - lon1) * M_PI / 180.0;
+    double h = sin(dlat/2) * sin(dlat/2)
+                + cos(lat1 * M_PI / 180.0) * cos(lat2 * M_PI / 180.0)
+                    * sin(dlon/2) * sin(dlon/2);
+    return 2 * OSM_EARTH_RADIUS * asin(sqrt(h));
+}
+
 /* END */
@@ -22,9 +22,8 @@ OSM_Node *osm_xml_get_node(FILE *file, char *buffer, char *param) {
     if (buffer == NULL) {
         if (!feof(file))
             perror("error reading .osm file");
-        else if (debug)
-                fprintf(stderr, "%s:%d:%s(): EOF\n",
-                            __FILE__, __LINE__, __FUNCTION__);
+        else
+            osm_trace(OSM_TRACE_PASS, "EOF");
 
         return (OSM_Node *)NULL;
     }
@@ -33,17 +32,13 @@ OSM_Node *osm_xml_get_node(FILE *file, char *buffer, char *param) {
     trim_left(line);
 
     if (strncmp(line, "<node ", 5) != 0) {
-        if (debug)
-            fprintf(stderr, "%s:%d:%s(): not a <node line: %s\n",
-                        __FILE__, __LINE__, __FUNCTION__, line);
+        osm_trace(OSM_TRACE_PASS, "not a <node line");
         return (OSM_Node *)NULL;
     }
 
     str = osm_xml_fetch_param(line, "id", param);
     if (str == NULL) {
-        if (debug)
-            fprintf(stderr, "%s:%d:%s(): no node id\n",
-                        __FILE__, __LINE__, __FUNCTION__);
+        osm_trace(OSM_TRACE_OBJECT, "no node id");
         return (OSM_Node *)NULL;
     }
 
@@ -52,17 +47,13 @@ OSM_Node *osm_xml_get_node(FILE *file, char *buffer, char *param) {
     N->id   = atol(str);
     if (N->id == 0) {
         free(N);
-        if (debug)
-            fprintf(stderr, "%s:%d:%s(): no node id: atol() failed\n",
-                        __FILE__, __LINE__, __FUNCTION__);
+        osm_trace(OSM_TRACE_OBJECT, "no node id: atol() failed");
         return (OSM_Node *)NULL;
     }
 
     str = osm_xml_fetch_param(line, "lon", param);
     if (str == NULL) {
-        if (debug)
-            fprintf(stderr, "%s:%d:%s(): node=%lu: no node 'lon='\n",
-                        __FILE__, __LINE__, __FUNCTION__, N->id);
+        osm_trace(OSM_TRACE_OBJECT, "node=%lu: no node 'lon='", N->id);
         free(N);
         return (OSM_Node *)NULL;
     }
@@ -70,9 +61,7 @@ OSM_Node *osm_xml_get_node(FILE *file, char *buffer, char *param) {
 
     str = osm_xml_fetch_param(line, "lat", param);
     if (str == NULL) {
-        if (debug)
-            fprintf(stderr, "%s:%d:%s(): node=%lu: no node 'lat='\n",
-                        __FILE__, __LINE__, __FUNCTION__, N->id);
+        osm_trace(OSM_TRACE_OBJECT, "node=%lu: no node 'lat='", N->id);
         free(N);
         return (OSM_Node *)NULL;
     }
@@ -120,9 +109,7 @@ OSM_Node *osm_xml_get_node(FILE *file, char *buffer, char *param) {
     }
     --str;
     if (*str == '/') {
-        if (debug)
-            fprintf(stderr, "%s:%d:%s(): node=%lu: no tags...\n",
-                        __FILE__, __LINE__, __FUNCTION__, N->id);
+        osm_trace(OSM_TRACE_DETAIL, "node=%lu: no tags...", N->id);
         return N;
     }
 
@@ -131,10 +118,8 @@ OSM_Node *osm_xml_get_node(FILE *file, char *buffer, char *param) {
         if (buffer == NULL) {
             if (!feof(file))
                 perror("error reading .osm file");
-            else 
-                if (debug)
-                    fprintf(stderr, "%s:%d:%s(): node=%lu: EOF\n",
-                                __FILE__, __LINE__, __FUNCTION__, N->id);
+            else
+                osm_trace(OSM_TRACE_OBJECT, "node=%lu: EOF", N->id);
             osm_free_node(N); 
             return (OSM_Node *)NULL;
         }
@@ -159,15 +144,10 @@ OSM_Node *osm_xml_get_node(FILE *file, char *buffer, char *param) {
                 N->tags->data[pos].val = strdup(str);
             N->tags->num += 1;
             */
-            if (debug)
-                fprintf(stderr, "%s:%d:%s(): node=%lu: tag: k=%s, v=%s\n",
-                                __FILE__, __LINE__, __FUNCTION__, N->id,
-                                N->tags->data[pos].key, N->tags->data[pos].val);
+            osm_trace(OSM_TRACE_DETAIL, "node=%lu: tag %d", N->id, pos);
         }
         else if (strncmp(line, "</node>", 6) == 0) {
-            if (debug)
-                fprintf(stderr, "%s:%d:%s(): node=%lu: </node>\n",
-                                __FILE__, __LINE__, __FUNCTION__, N->id);
+            osm_trace(OSM_TRACE_OBJECT, "node=%lu: </node>", N->id);
             return N;
         }
     }
@@ -176,7 +156,7 @@ OSM_Node *osm_xml_get_node(FILE *file, char *buffer, char *param) {
 OSM_Node_List *osm_xml_parse_nodes(long int start,
                                     FILE *file,
                                     int mode,
-                                    int(*filter)(OSM_Node *n),
+                                    OSM_Parse_Options *opt,
                                     struct osm_members *wanted)
 {
     OSM_Node_List *nl = NULL;
@@ -194,26 +174,23 @@ OSM_Node_List *osm_xml_parse_nodes(long int start,
 
 //    N = osm_xml_get_node(file, buffer, param);
     for (N = osm_xml_get_node(file, buffer, param); N != NULL; N = osm_xml_get_node(file, buffer, param)) {
-        if (mode == OSMDATA_NODE && filter != NULL) {
-            if ((osm_is_member(wanted, N->id) == -1) && !filter(N)) {
-                if (debug)
-                    fprintf(stderr, "%s:%d:%s(): node=%lu: not a member and filtered\n",
-                                __FILE__, __LINE__, __FUNCTION__, N->id);
+        osm_stats_add(OSM_STAT_NODES_SEEN, 1);
+        if (mode == OSMDATA_NODE && osm_parse_has_filter(opt, OSM_REL_MEMBER_TYPE_NODE)) {
+            if ((osm_is_member(wanted, N->id) == -1) && !osm_parse_node_ok(opt, N)) {
+                osm_trace(OSM_TRACE_OBJECT, "node=%lu: not a member and filtered", N->id);
+                osm_stats_add(OSM_STAT_NODES_FILTERED, 1);
                 osm_free_node(N);
                 continue; 
             }
         }
         else if (mode == OSMDATA_NODE && osm_is_member(wanted, N->id) == -1) {
-            if (debug)
-                fprintf(stderr, "%s:%d:%s(): node=%lu: not a member\n",
-                            __FILE__, __LINE__, __FUNCTION__, N->id);
+            osm_trace(OSM_TRACE_OBJECT, "node=%lu: not a member", N->id);
             osm_free_node(N);
             continue; 
         }
-        else if (filter != NULL && !filter(N)) {
-            if (debug)
-                fprintf(stderr, "%s:%d:%s(): node=%lu: filtered\n",
-                            __FILE__, __LINE__, __FUNCTION__, N->id);
+        else if (!osm_parse_node_ok(opt, N)) {
+            osm_trace(OSM_TRACE_OBJECT, "node=%lu: filtered", N->id);
+            osm_stats_add(OSM_STAT_NODES_FILTERED, 1);
             osm_free_node(N);
             continue; 
         }
@@ -221,12 +198,12 @@ OSM_Node_List *osm_xml_parse_nodes(long int start,
         nl->data[nl->num] = N;
         nl->num += 1;
     }
+    osm_stats_add(OSM_STAT_NODES_KEPT, nl->num);
+    osm_stats_add(OSM_STAT_BYTES_READ, ftell(file) - start);
 
     free(buffer);
     free(param);
-    if (debug)
-        fprintf(stderr, "%s:%d:%s(): returning %d nodes\n",
-                    __FILE__, __LINE__, __FUNCTION__, nl->num);
+    osm_trace(OSM_TRACE_PASS, "returning %d nodes", nl->num);
     return nl;
 }
 
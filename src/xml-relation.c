@@ -24,8 +24,7 @@ OSM_Relation *osm_xml_get_relation(FILE *file, char *buffer, char *param) {
         if (!feof(file)) {
             perror("error reading .osm file");
         }
-        if (debug)
-            fprintf(stderr, "%s:%d:%s(): EOF\n", __FILE__, __LINE__, __FUNCTION__);
+        osm_trace(OSM_TRACE_PASS, "relations: EOF");
         return (OSM_Relation *)NULL;
     }
 
@@ -33,17 +32,13 @@ OSM_Relation *osm_xml_get_relation(FILE *file, char *buffer, char *param) {
 
     trim_left(line);
     if (strncmp(line, "<relation ", 10) != 0) {
-        if (debug)
-            fprintf(stderr, "%s:%d:%s(): not a <relation line: %s\n", 
-                            __FILE__, __LINE__, __FUNCTION__, line);
+        osm_trace(OSM_TRACE_PASS, "relations: not a <relation line");
         return (OSM_Relation *)NULL;
     }
 
     str = osm_xml_fetch_param(line, "id", param);
     if (str == NULL) {
-        if (debug)
-            fprintf(stderr, "%s:%d:%s(): no ID for relation\n", 
-                            __FILE__, __LINE__, __FUNCTION__);
+        osm_trace(OSM_TRACE_OBJECT, "relation: no id");
         return (OSM_Relation *)NULL;
     }
 
@@ -51,9 +46,7 @@ OSM_Relation *osm_xml_get_relation(FILE *file, char *buffer, char *param) {
     rel->id = atol(str);
     if (rel->id == 0) {
         free(rel);
-        if (debug)
-            fprintf(stderr, "%s:%d:%s(): no ID for relation: atol() failed\n", 
-                            __FILE__, __LINE__, __FUNCTION__);
+        osm_trace(OSM_TRACE_OBJECT, "relation: no id, atol() failed");
         return (OSM_Relation *)NULL;
     }
     rel->member = malloc(sizeof(OSM_Rel_Member_List));
@@ -105,9 +98,7 @@ OSM_Relation *osm_xml_get_relation(FILE *file, char *buffer, char *param) {
                 free(rel);
                 return (OSM_Relation *)NULL;
             }
-            if (debug)
-                fprintf(stderr, "%s:%d:%s(): EOF\n", 
-                                __FILE__, __LINE__, __FUNCTION__);
+            osm_trace(OSM_TRACE_PASS, "relations: EOF");
             break;
         }
         line = buffer;
@@ -141,12 +132,8 @@ OSM_Relation *osm_xml_get_relation(FILE *file, char *buffer, char *param) {
             else
                 rel->member->data[pos].role = strdup(str);
 
-            if (debug)
-                fprintf(stderr, "%s:%d:%s(): rel=%lu, ref=%lu, role=%s type=%d\n", 
-                                __FILE__, __LINE__, __FUNCTION__, 
-                                rel->id, rel->member->data[pos].ref, 
-                                rel->member->data[pos].role,
-                                rel->member->data[pos].type);
+            osm_trace(OSM_TRACE_DETAIL, "relation %lu: member %lu, type %d", rel->id,
+                        rel->member->data[pos].ref, rel->member->data[pos].type);
 
             rel->member->num += 1;
         }
@@ -167,17 +154,11 @@ OSM_Relation *osm_xml_get_relation(FILE *file, char *buffer, char *param) {
             else
                 rel->tags->data[pos].val = strdup(str);
             */
-            if (debug)
-                fprintf(stderr, "%s:%d:%s(): rel=%lu, tag: k=%s, v=%s\n", 
-                                __FILE__, __LINE__, __FUNCTION__, 
-                                rel->id, rel->tags->data[pos].key, 
-                                rel->tags->data[pos].val);
+            osm_trace(OSM_TRACE_DETAIL, "relation %lu: tag %d", rel->id, pos);
             /* rel->tags->num += 1; */
         }
         else if (strncmp(line, "</relation>", 11) == 0) {
-            if (debug)
-                fprintf(stderr, "%s:%d:%s(): rel=%lu, </relation>\n", 
-                                __FILE__, __LINE__, __FUNCTION__, rel->id); 
+            osm_trace(OSM_TRACE_OBJECT, "relation %lu: %d members", rel->id, rel->member->num);
             return rel;
         }
     }
@@ -191,7 +172,7 @@ OSM_Relation *osm_xml_get_relation(FILE *file, char *buffer, char *param) {
 OSM_Relation_List *osm_xml_parse_relations(long int start, 
                             FILE *file, 
                             int mode, 
-                            int(*filter)(OSM_Relation *r),
+                            OSM_Parse_Options *opt,
                             struct osm_members *wanted)
 {
     OSM_Relation_List *rl = NULL;
@@ -211,10 +192,10 @@ OSM_Relation_List *osm_xml_parse_relations(long int start,
          R != NULL;
          R = osm_xml_get_relation(file, buffer, param)) 
     {
-        if (filter != NULL && !filter(R)) {
-            if (debug)
-                fprintf(stderr, "%s:%d:%s(): rel=%lu filtered\n",
-                                __FILE__, __LINE__, __FUNCTION__, R->id); 
+        osm_stats_add(OSM_STAT_RELATIONS_SEEN, 1);
+        if (!osm_parse_relation_ok(opt, R)) {
+            osm_trace(OSM_TRACE_OBJECT, "relation %lu: filtered", R->id);
+            osm_stats_add(OSM_STAT_RELATIONS_FILTERED, 1);
             osm_free_relation(R);
             continue;
         }
@@ -228,18 +209,15 @@ OSM_Relation_List *osm_xml_parse_relations(long int start,
             for (i=0; i<R->member->num; i++) {
                 ref[i] = R->member->data[i].ref;
             }
-            if (debug)
-                fprintf(stderr, "%s:%d:%s(): rel=%lu adding %d members\n",
-                                __FILE__, __LINE__, __FUNCTION__, R->id, i); 
+            osm_trace(OSM_TRACE_OBJECT, "relation %lu: adding %d members", R->id, i);
             osm_add_members(wanted, i, ref, 1);
         }
-        R = osm_xml_get_relation(file, buffer, param);
     }
+    osm_stats_add(OSM_STAT_RELATIONS_KEPT, rl->num);
+    osm_stats_add(OSM_STAT_BYTES_READ, ftell(file) - start);
     free(buffer);
     free(param);
-    if (debug)
-        fprintf(stderr, "%s:%d:%s(): returning %d relations\n",
-                        __FILE__, __LINE__, __FUNCTION__, rl->num); 
+    osm_trace(OSM_TRACE_PASS, "relations: %d kept", rl->num);
     return rl;
 }
 
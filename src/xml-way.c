@@ -12,8 +12,47 @@
 #include <string.h>
 #include <errno.h>
 
+#include <math.h>
+
 #include "osm.h"
 
+/*
+ * <nd ref=".." lon=".." lat=".."/> as written with locations on ways:
+ * store the location of node num, the nodes before without one are NAN
+ */
+static int get_location(OSM_Way *W, char *line, char *param, int num, int *size) {
+    char *str;
+    double lon;
+    int i;
+
+    str = osm_xml_fetch_param(line, "lon", param);
+    if (str == NULL)
+        return 0;
+    lon = atof(str);
+    str = osm_xml_fetch_param(line, "lat", param);
+    if (str == NULL)
+        return 0;
+
+    if (num >= *size) {
+        int size_new = *size ? *size : 2048;
+        OSM_Location *tmp;
+        while (num >= size_new)
+            size_new *= 2;
+        tmp = realloc(W->locs, sizeof(OSM_Location) * size_new);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to realloc way locations: %s\n", strerror(errno));
+            return -1;
+        }
+        for (i=*size; i<size_new; i++)
+            tmp[i].lon = tmp[i].lat = NAN;
+        W->locs = tmp;
+        *size = size_new;
+    }
+    W->locs[num].lon = lon;
+    W->locs[num].lat = atof(str);
+    return 0;
+}
+
 OSM_Way *osm_xml_get_way(FILE *file, char *buffer, char *param) {
     char *line, *str;
     OSM_Way *W = NULL;
@@ -23,9 +62,7 @@ OSM_Way *osm_xml_get_way(FILE *file, char *buffer, char *param) {
         if (!feof(file)) {
             perror("error reading .osm file");
         }
-        if (debug)
-            fprintf(stderr, "%s:%d:%s(): EOF\n",
-                    __FILE__, __LINE__, __FUNCTION__);
+        osm_trace(OSM_TRACE_PASS, "ways: EOF");
 
         return (OSM_Way *)NULL;
     }
@@ -33,17 +70,13 @@ OSM_Way *osm_xml_get_way(FILE *file, char *buffer, char *param) {
     line = buffer;
     trim_left(line);
     if (strncmp(line, "<way ", 5) != 0) {
-        if (debug)
-            fprintf(stderr, "%s:%d:%s(): not a <way line: %s\n",
-                    __FILE__, __LINE__, __FUNCTION__, line);
+        osm_trace(OSM_TRACE_PASS, "ways: not a <way line");
         return (OSM_Way *)NULL;
     }
 
     str = osm_xml_fetch_param(line, "id", param);
     if (str == NULL) {
-        if (debug)
-            fprintf(stderr, "%s:%d:%s(): no ID parameter\n",
-                    __FILE__, __LINE__, __FUNCTION__);
+        osm_trace(OSM_TRACE_OBJECT, "way: no id");
         return (OSM_Way *)NULL;
     }
 
@@ -63,16 +96,16 @@ OSM_Way *osm_xml_get_way(FILE *file, char *buffer, char *param) {
     W->tags->data = malloc(sizeof(OSM_Tag) * 16);
     W->tags->size = 16;
     W->tags->num  = 0;
+    W->locs = NULL;
 
 
     int size_nodes = 2048;
     int num_nodes  = 0;
+    int size_locs  = 0;
     uint64_t *nodes_ptr = W->nodes;
     W->id = atol(str);
     if (W->id == 0) {
-        if (debug)
-            fprintf(stderr, "%s:%d:%s(): no ID parameter: atol() failed\n",
-                    __FILE__, __LINE__, __FUNCTION__);
+        osm_trace(OSM_TRACE_OBJECT, "way: no id, atol() failed");
         free(W->nodes);
         free(W->tags->data);
         free(W->tags);
@@ -115,9 +148,7 @@ OSM_Way *osm_xml_get_way(FILE *file, char *buffer, char *param) {
         if (buffer == NULL) {
             if (!feof(file))
                 perror("error reading .osm file");
-            if (debug)
-                fprintf(stderr, "%s:%d:%s(): EOF\n",
-                        __FILE__, __LINE__, __FUNCTION__);
+            osm_trace(OSM_TRACE_PASS, "ways: EOF");
             osm_free_way(W);
             return (OSM_Way *)NULL;
         }
@@ -136,12 +167,14 @@ OSM_Way *osm_xml_get_way(FILE *file, char *buffer, char *param) {
                 *nodes_ptr = id;
                 ++nodes_ptr;
                 *nodes_ptr = 0;
+                if (get_location(W, line, param, num_nodes, &size_locs) != 0) {
+                    osm_free_way(W);
+                    return (OSM_Way *)NULL;
+                }
                 ++num_nodes;
             }
             else {
-                if (debug)
-                    fprintf(stderr, "%s:%d:%s(): no ref in <nd\n",
-                                __FILE__, __LINE__, __FUNCTION__);
+                osm_trace(OSM_TRACE_DETAIL, "way %lu: no ref in <nd", W->id);
             }
         }
         else if (strncmp(line, "<tag ", 5) == 0) {
@@ -161,17 +194,11 @@ OSM_Way *osm_xml_get_way(FILE *file, char *buffer, char *param) {
             else 
                 W->tags->data[pos].val = strdup(str);
             */
-            if (debug)
-                    fprintf(stderr, "%s:%d:%s(): way=%lu tag: k=%s, v=%s\n",
-                                __FILE__, __LINE__, __FUNCTION__,
-                                W->id, W->tags->data[pos].key,
-                                W->tags->data[pos].val);
+            osm_trace(OSM_TRACE_DETAIL, "way %lu: tag %d", W->id, pos);
             /* W->tags->num += 1; */
         }
         else if (strncmp(line, "</way>", 6) == 0) {
-            if (debug)
-                    fprintf(stderr, "%s:%d:%s(): way=%lu </way>\n",
-                                __FILE__, __LINE__, __FUNCTION__, W->id);
+            osm_trace(OSM_TRACE_OBJECT, "way %lu: %d nodes", W->id, num_nodes);
             // W->nodes = realloc(W->nodes, sizeof(uint64_t) * num_nodes + 1); // truncate
             return W;
         }
@@ -181,7 +208,7 @@ OSM_Way *osm_xml_get_way(FILE *file, char *buffer, char *param) {
 OSM_Way_List *osm_xml_parse_ways(long int start, 
                         FILE *file,
                         int mode,
-                        int(*filter)(OSM_Way *w),
+                        OSM_Parse_Options *opt,
                         struct osm_members *wanted)
 {
     OSM_Way_List *wl = NULL;
@@ -200,26 +227,23 @@ OSM_Way_List *osm_xml_parse_ways(long int start,
     for (W = osm_xml_get_way(file, buffer, param);
         W != NULL;
         W = osm_xml_get_way(file, buffer, param)) {
-        if (mode == OSMDATA_WAY && filter != NULL) {
-            if ((osm_is_member(wanted, W->id) == -1) && !filter(W)) {
-                if (debug)
-                    fprintf(stderr, "%s:%d:%s(): way=%lu filtered and not a member\n",
-                                __FILE__, __LINE__, __FUNCTION__, W->id);
+        osm_stats_add(OSM_STAT_WAYS_SEEN, 1);
+        if (mode == OSMDATA_WAY && osm_parse_has_filter(opt, OSM_REL_MEMBER_TYPE_WAY)) {
+            if ((osm_is_member(wanted, W->id) == -1) && !osm_parse_way_ok(opt, W)) {
+                osm_trace(OSM_TRACE_OBJECT, "way %lu: filtered and not a member", W->id);
+                osm_stats_add(OSM_STAT_WAYS_FILTERED, 1);
                 osm_free_way(W);
                 continue;
             }
         }
         else if (mode == OSMDATA_WAY && osm_is_member(wanted, W->id) == -1) {
-            if (debug)
-                fprintf(stderr, "%s:%d:%s(): way=%lu not a member\n",
-                            __FILE__, __LINE__, __FUNCTION__, W->id);
+            osm_trace(OSM_TRACE_OBJECT, "way %lu: not a member", W->id);
             osm_free_way(W);
             continue;
         }
-        else if (filter != NULL && !filter(W)) {
-            if (debug)
-                fprintf(stderr, "%s:%d:%s(): way=%lu filtered\n",
-                            __FILE__, __LINE__, __FUNCTION__, W->id);
+        else if (!osm_parse_way_ok(opt, W)) {
+            osm_trace(OSM_TRACE_OBJECT, "way %lu: filtered", W->id);
+            osm_stats_add(OSM_STAT_WAYS_FILTERED, 1);
             osm_free_way(W);
             continue;
         }
@@ -238,18 +262,16 @@ OSM_Way_List *osm_xml_parse_ways(long int start,
                 ref[i] = W->nodes[i];
                 ++i;
             }
-            if (debug)
-                fprintf(stderr, "%s:%d:%s(): way=%lu adding %d members\n",
-                            __FILE__, __LINE__, __FUNCTION__, W->id, i);
+            osm_trace(OSM_TRACE_OBJECT, "way %lu: adding %d members", W->id, i);
             osm_add_members(wanted, i, ref, 1);
         }
     }
+    osm_stats_add(OSM_STAT_WAYS_KEPT, wl->num);
+    osm_stats_add(OSM_STAT_BYTES_READ, ftell(file) - start);
 
     free(buffer);
     free(param);
-    if (debug)
-        fprintf(stderr, "%s:%d:%s(): returning %d ways\n",
-                    __FILE__, __LINE__, __FUNCTION__, wl->num);
+    osm_trace(OSM_TRACE_PASS, "ways: %d kept", wl->num);
     return wl;
 }
 
@@ -7,6 +7,7 @@
  */
 
 #include <stdio.h>
+#include <math.h>
 
 #include "osm.h"
 
@@ -79,7 +80,11 @@ void osm_xml_write_way(OSM_Way *w, FILE *outfh) {
         fprintf(outfh, ">\n");
         int i = 0;
         while (w->nodes[i] != 0) {
-            fprintf(outfh, "  <nd ref=\"%li\"/>\n", w->nodes[i]);
+            if (w->locs != NULL && !isnan(w->locs[i].lat))
+                fprintf(outfh, "  <nd ref=\"%li\" lon=\"%.7f\" lat=\"%.7f\"/>\n",
+                        w->nodes[i], w->locs[i].lon, w->locs[i].lat);
+            else
+                fprintf(outfh, "  <nd ref=\"%li\"/>\n", w->nodes[i]);
             ++i;
         }
         if (w->tags != NULL)
@@ -20,8 +20,9 @@
 
 uint64_t osm_timestamp2epoch(char *timestamp) {
     struct tm tm;
+    memset(&tm, 0, sizeof(tm));
     strptime(timestamp, "%Y-%m-%dT%H:%M:%SZ", &tm);
-    time_t ep = mktime(&tm);
+    time_t ep = timegm(&tm);    /* UTC, as written by osm_pbf_timestamp() */
     return (uint64_t)ep;    
 }
 
@@ -116,8 +117,8 @@ static void find_starts(FILE *file, long int *nodes, long int *ways, long int *r
     *ways  = 0;
     *relations = 0;
     while (1) {
-        buffer = fgets(buffer, LINE_SIZE, file);
-        if (buffer == NULL) {
+        if (fgets(buffer, LINE_SIZE, file) == NULL) {
+            free(buffer);
             return;
         }
         line = buffer;
@@ -154,41 +155,185 @@ static void find_starts(FILE *file, long int *nodes, long int *ways, long int *r
     }
 }
 
-OSM_Data *osm_xml_parse(OSM_File *F,
-              int mode,
-              OSM_BBox *bbox,
-              int (*node_filter)(OSM_Node *),
-              int (*way_filter)(OSM_Way *),
-              int (*rel_filter)(OSM_Relation *)/*,
-              int (*cset_filter)(OSM_Changeset *) */
-        )
-{
+static struct osm_members *xml_new_members() {
+    struct osm_members *m = malloc(sizeof(struct osm_members));
+    m->data = malloc(sizeof(uint64_t) * 1024);
+    m->num  = 0;
+    m->size = 1024;
+    osm_stats_alloc(OSM_MEM_MEMBERS, sizeof(uint64_t) * m->size);
+    return m;
+}
+
+static void xml_free_members(struct osm_members *m) {
+    osm_stats_alloc(OSM_MEM_MEMBERS, -(int64_t)(sizeof(uint64_t) * m->size));
+    free(m->data);
+    free(m);
+}
+
+static void xml_add_member(struct osm_members *m, uint64_t id) {
+    uint64_t *ref = malloc(sizeof(uint64_t));
+    *ref = id;
+    osm_add_members(m, 1, ref, 0);
+}
+
+/*
+ * OSMDATA_BBOX, the same selection as from a .osm.pbf: the nodes in the
+ * area (bbox and / or poly), the relations with one of them as member,
+ * the ways with one of them or which are members of these relations and
+ * the nodes of all these. One pass per type and one for the area.
+ */
+static OSM_Data *xml_parse_bbox(OSM_File *F, OSM_Parse_Options *opt) {
+    long int node_start = 0, way_start = 0, rel_start = 0;
+    char *buffer = malloc(LINE_SIZE);
+    char *param  = malloc(LINE_SIZE);
+    struct osm_members *bbn   = xml_new_members();
+    struct osm_members *nodes = xml_new_members();
+    struct osm_members *ways  = xml_new_members();
+    OSM_Data *data = osm_new_data(1024);
+    OSM_Node *N;
+    OSM_Way *W;
+    OSM_Relation *R;
+    int i, k;
+
+    find_starts(F->file, &node_start, &way_start, &rel_start);
+
+    if (node_start) {
+        fseek(F->file, node_start, SEEK_SET);
+        while ((N = osm_xml_get_node(F->file, buffer, param)) != NULL) {
+            if (osm_parse_in_area(opt, N->lat, N->lon))
+                xml_add_member(bbn, N->id);
+            osm_free_node(N);
+        }
+        osm_sort_member(bbn);
+    }
+    osm_trace(OSM_TRACE_PASS, "bbox: %u nodes in the area", bbn->num);
+
+    if (rel_start) {
+        fseek(F->file, rel_start, SEEK_SET);
+        while ((R = osm_xml_get_relation(F->file, buffer, param)) != NULL) {
+            int want = 0;
+            osm_stats_add(OSM_STAT_RELATIONS_SEEN, 1);
+            for (i=0; i<R->member->num && !want; i++)
+                want = R->member->data[i].type == OSM_REL_MEMBER_TYPE_NODE
+                        && osm_is_member(bbn, R->member->data[i].ref) != -1;
+            if (!want || !osm_parse_relation_ok(opt, R)) {
+                if (want)
+                    osm_stats_add(OSM_STAT_RELATIONS_FILTERED, 1);
+                osm_free_relation(R);
+                continue;
+            }
+            for (i=0; i<R->member->num; i++) {
+                if (R->member->data[i].type == OSM_REL_MEMBER_TYPE_NODE)
+                    xml_add_member(nodes, R->member->data[i].ref);
+                else if (R->member->data[i].type == OSM_REL_MEMBER_TYPE_WAY)
+                    xml_add_member(ways, R->member->data[i].ref);
+            }
+            osm_realloc_rel_list(data->relations);
+            data->relations->data[ data->relations->num++ ] = R;
+        }
+        osm_sort_member(ways);
+    }
+
+    if (way_start) {
+        fseek(F->file, way_start, SEEK_SET);
+        while ((W = osm_xml_get_way(F->file, buffer, param)) != NULL) {
+            int want = osm_is_member(ways, W->id) != -1;
+            osm_stats_add(OSM_STAT_WAYS_SEEN, 1);
+            if (!want) {
+                for (k=0; W->nodes[k] && !want; k++)
+                    want = osm_is_member(bbn, W->nodes[k]) != -1;
+                if (want && !osm_parse_way_ok(opt, W)) {
+                    osm_stats_add(OSM_STAT_WAYS_FILTERED, 1);
+                    want = 0;
+                }
+            }
+            if (!want) {
+                osm_free_way(W);
+                continue;
+            }
+            for (k=0; W->nodes[k]; k++)
+                xml_add_member(nodes, W->nodes[k]);
+            osm_realloc_way_list(data->ways);
+            data->ways->data[ data->ways->num++ ] = W;
+        }
+    }
+    osm_sort_member(nodes);
+
+    if (node_start) {
+        fseek(F->file, node_start, SEEK_SET);
+        while ((N = osm_xml_get_node(F->file, buffer, param)) != NULL) {
+            int want = osm_is_member(nodes, N->id) != -1;
+            osm_stats_add(OSM_STAT_NODES_SEEN, 1);
+            if (!want && osm_is_member(bbn, N->id) != -1) {
+                want = osm_parse_node_ok(opt, N);
+                if (!want)
+                    osm_stats_add(OSM_STAT_NODES_FILTERED, 1);
+            }
+            if (!want) {
+                osm_free_node(N);
+                continue;
+            }
+            osm_realloc_node_list(data->nodes);
+            data->nodes->data[ data->nodes->num++ ] = N;
+        }
+    }
+    osm_stats_add(OSM_STAT_NODES_KEPT, data->nodes->num);
+    osm_stats_add(OSM_STAT_WAYS_KEPT, data->ways->num);
+    osm_stats_add(OSM_STAT_RELATIONS_KEPT, data->relations->num);
+    osm_trace(OSM_TRACE_PASS, "bbox: nodes=%u, ways=%u, relations=%u",
+                data->nodes->num, data->ways->num, data->relations->num);
+
+    xml_free_members(bbn);
+    xml_free_members(nodes);
+    xml_free_members(ways);
+    free(buffer);
+    free(param);
+    return data;
+}
+
+OSM_Data *osm_xml_parse_opt(OSM_File *F, OSM_Parse_Options *opt) {
+    int mode = opt->mode;
     struct osm_members *wanted = NULL;
     long int node_start = 0, way_start = 0, rel_start = 0;
     OSM_Data *data = NULL;
 
+    if (mode == OSMDATA_BBOX) {
+        if (opt->bbox == NULL && opt->poly == NULL) {
+            fprintf(stderr, "mode = OSMDATA_BBOX, but bbox and poly are NULL\n");
+            return (OSM_Data *)NULL;
+        }
+        return xml_parse_bbox(F, opt);
+    }
+
     data = malloc(sizeof(OSM_Data));
+    data->changesets = NULL;
 
     if (mode != OSMDATA_DUMP) {
         wanted = malloc(sizeof(struct osm_members));
         wanted->data = malloc(sizeof(uint64_t) * 1024);
         wanted->num = 0;
         wanted->size = 1024;
+        osm_stats_alloc(OSM_MEM_MEMBERS, sizeof(uint64_t) * wanted->size);
     }
     find_starts(F->file, &node_start, &way_start, &rel_start);
     
     data->relations = 
-        osm_xml_parse_relations(rel_start, F->file, mode, rel_filter, wanted);
+        osm_xml_parse_relations(rel_start, F->file, mode, opt, wanted);
 
     if (mode == OSMDATA_REL)
         mode = OSMDATA_WAY;
     data->ways = 
-        osm_xml_parse_ways(way_start, F->file, mode, way_filter, wanted);
+        osm_xml_parse_ways(way_start, F->file, mode, opt, wanted);
 
     if (mode == OSMDATA_WAY)
         mode = OSMDATA_NODE;
     data->nodes = 
-        osm_xml_parse_nodes(node_start, F->file, mode, node_filter, wanted);
+        osm_xml_parse_nodes(node_start, F->file, mode, opt, wanted);
+    if (wanted != NULL) {
+        osm_stats_alloc(OSM_MEM_MEMBERS, -(int64_t)(sizeof(uint64_t) * wanted->size));
+        free(wanted->data);
+        free(wanted);
+    }
 
     if (debug)
         fprintf(stderr, "%s:%d:%s(): nodes=%u, ways=%u, relations=%u\n", 
@@ -207,4 +352,91 @@ OSM_Data *osm_xml_parse(OSM_File *F,
     return data;
 }
 
+OSM_Data *osm_xml_parse(OSM_File *F,
+              int mode,
+              OSM_BBox *bbox,
+              int (*node_filter)(OSM_Node *),
+              int (*way_filter)(OSM_Way *),
+              int (*rel_filter)(OSM_Relation *)/*,
+              int (*cset_filter)(OSM_Changeset *) */
+        )
+{
+    OSM_Parse_Options opt;
+    osm_parse_options_init(&opt);
+    opt.mode        = mode;
+    opt.bbox        = bbox;
+    opt.node_filter = node_filter;
+    opt.way_filter  = way_filter;
+    opt.rel_filter  = rel_filter;
+    return osm_xml_parse_opt(F, &opt);
+}
+
+#define XML_SCAN_BLOCK 8000
+
+/* see osm_pbf_scan(), blocks are XML_SCAN_BLOCK objects */
+int osm_xml_scan(OSM_File *F, uint32_t types,
+                    int (*block)(OSM_Data *d, void *ctx), void *ctx)
+{
+    long int node_start = 0, way_start = 0, rel_start = 0;
+    char *buffer = malloc(LINE_SIZE);
+    char *param  = malloc(LINE_SIZE);
+    OSM_Data *d  = osm_new_data(XML_SCAN_BLOCK);
+    int ret = 0;
+
+    find_starts(F->file, &node_start, &way_start, &rel_start);
+
+    if ((types & OSMDATA_NODE) && node_start) {
+        OSM_Node *N;
+        fseek(F->file, node_start, SEEK_SET);
+        while (ret == 0 && (N = osm_xml_get_node(F->file, buffer, param)) != NULL) {
+            osm_realloc_node_list(d->nodes);
+            d->nodes->data[ d->nodes->num++ ] = N;
+            osm_stats_add(OSM_STAT_NODES_SEEN, 1);
+            if (d->nodes->num == XML_SCAN_BLOCK) {
+                ret = block(d, ctx);
+                osm_free_data(d);
+                d = osm_new_data(XML_SCAN_BLOCK);
+            }
+        }
+        osm_stats_add(OSM_STAT_BYTES_READ, ftell(F->file) - node_start);
+    }
+    if (ret == 0 && (types & OSMDATA_WAY) && way_start) {
+        OSM_Way *W;
+        fseek(F->file, way_start, SEEK_SET);
+        while (ret == 0 && (W = osm_xml_get_way(F->file, buffer, param)) != NULL) {
+            osm_realloc_way_list(d->ways);
+            d->ways->data[ d->ways->num++ ] = W;
+            osm_stats_add(OSM_STAT_WAYS_SEEN, 1);
+            if (d->ways->num == XML_SCAN_BLOCK) {
+                ret = block(d, ctx);
+                osm_free_data(d);
+                d = osm_new_data(XML_SCAN_BLOCK);
+            }
+        }
+        osm_stats_add(OSM_STAT_BYTES_READ, ftell(F->file) - way_start);
+    }
+    if (ret == 0 && (types & OSMDATA_REL) && rel_start) {
+        OSM_Relation *R;
+        fseek(F->file, rel_start, SEEK_SET);
+        while (ret == 0 && (R = osm_xml_get_relation(F->file, buffer, param)) != NULL) {
+            osm_realloc_rel_list(d->relations);
+            d->relations->data[ d->relations->num++ ] = R;
+            osm_stats_add(OSM_STAT_RELATIONS_SEEN, 1);
+            if (d->relations->num == XML_SCAN_BLOCK) {
+                ret = block(d, ctx);
+                osm_free_data(d);
+                d = osm_new_data(XML_SCAN_BLOCK);
+            }
+        }
+        osm_stats_add(OSM_STAT_BYTES_READ, ftell(F->file) - rel_start);
+    }
+    if (ret == 0 && (d->nodes->num || d->ways->num || d->relations->num))
+        ret = block(d, ctx);
+
+    osm_free_data(d);
+    free(buffer);
+    free(param);
+    return ret;
+}
+
 /* END */